@@ -700,7 +700,7 @@ void search_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
     
 done:
     evhttp_add_header(req->output_headers, "content-type", "text/plain");
-    evhttp_send_reply(req, HTTP_OK, "OK", evb);
+    simplehttp_send_reply(req, HTTP_OK, "OK", evb);
     evhttp_clear_headers(&args);
     if (predlist) {
         for (i = 0; i < npredicates; i++) {
@@ -869,6 +869,7 @@ int main(int argc, char **argv)
     simplehttp_set_cb("/printidx*", printidx_cb, NULL);
     simplehttp_set_cb("/dbstats", dbstats_cb, NULL);
     simplehttp_set_cb("/stats", stats_cb, NULL);
+    simplehttp_set_cb_flags("/search*", SIMPLEHTTP_CB_COMPRESS);
     simplehttp_main();
     free_options();
     return 0;
@@ -4,7 +4,6 @@
 #include <time.h>
 #include <simplehttp/queue.h>
 #include <simplehttp/simplehttp.h>
-#include "http-internal.h"
 
 #include <openssl/sha.h>
 #include <openssl/evp.h>
@@ -29,9 +28,11 @@ typedef struct cli {
     time_t connect_time;
     struct evbuffer *buf;
     struct evhttp_request *req;
+    struct simplehttp_stream *stream;
     TAILQ_ENTRY(cli) entries;
 } cli;
 TAILQ_HEAD(, cli) clients;
+struct simplehttp_pool *cli_pool;
 
 uint64_t totalConns = 0;
 uint64_t currentConns = 0;
@@ -62,36 +63,20 @@ char *base64(const unsigned char *input, int length)
 
 int is_slow(struct cli *client)
 {
+    size_t output_buffer_length;
+    char msg[128];
+    
     if (client->kick_client == KICK_CLIENT) {
         return 1;
     }
-    struct evhttp_connection *evcon;
-    unsigned long output_buffer_length;
-    
-    evcon = (struct evhttp_connection *)client->req->evcon;
-    output_buffer_length = evcon->output_buffer ? (unsigned long)EVBUFFER_LENGTH(evcon->output_buffer) : 0;
+    output_buffer_length = simplehttp_stream_pending(client->stream);
     if (output_buffer_length > MAX_PENDING_DATA) {
         kickedClients += 1;
-        fprintf(stdout, "%llu >> kicking client with %lu pending data\n", client->connection_id, output_buffer_length);
+        fprintf(stdout, "%llu >> kicking client with %lu pending data\n", client->connection_id, (unsigned long)output_buffer_length);
         client->kick_client = KICK_CLIENT;
-        // clear the clients output buffer
-        evbuffer_drain(evcon->output_buffer, EVBUFFER_LENGTH(evcon->output_buffer));
-        evbuffer_add_printf(evcon->output_buffer, "ERROR_TOO_SLOW. kicked for having %lu pending bytes\n", output_buffer_length);
-        return 1;
-    }
-    return 0;
-}
-
-int can_kick(struct cli *client)
-{
-    if (client->kick_client == CLIENT_OK) {
-        return 0;
-    }
-    // if the buffer length is back to zero, we can kick now
-    // our error notice has been pushed to the client
-    struct evhttp_connection *evcon;
-    evcon = (struct evhttp_connection *)client->req->evcon;
-    if (EVBUFFER_LENGTH(evcon->output_buffer) == 0) {
+        // the clients output buffer is cleared, it is disconnected once this is out
+        sprintf(msg, "ERROR_TOO_SLOW. kicked for having %lu pending bytes\n", (unsigned long)output_buffer_length);
+        simplehttp_stream_kick(client->stream, msg);
         return 1;
     }
     return 0;
@@ -102,24 +87,19 @@ void clients_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
     struct cli *client;
     struct tm *time_struct;
     char buf[248];
-    unsigned long output_buffer_length;
-    struct evhttp_connection *evcon;
     
     if (TAILQ_EMPTY(&clients)) {
         evbuffer_add_printf(evb, "no /sub connections\n");
     }
     TAILQ_FOREACH(client, &clients, entries) {
-        evcon = (struct evhttp_connection *)client->req->evcon;
-        
         time_struct = gmtime(&client->connect_time);
         strftime(buf, 248, "%Y-%m-%d %H:%M:%S", time_struct);
-        output_buffer_length = (unsigned long)EVBUFFER_LENGTH(evcon->output_buffer);
-        evbuffer_add_printf(evb, "%s:%d connected at %s. output buffer size:%lu state:%d\n",
+        evbuffer_add_printf(evb, "%s:%d connected at %s. output buffer size:%lu kicked:%d\n",
                             client->req->remote_host,
                             client->req->remote_port,
                             buf,
-                            output_buffer_length,
-                            (int)evcon->state);
+                            (unsigned long)simplehttp_stream_pending(client->stream),
+                            (int)client->kick_client);
     }
     
     evhttp_send_reply(req, HTTP_OK, "OK", evb);
@@ -172,19 +152,15 @@ void stats_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
     evhttp_clear_headers(&args);
 }
 
-void on_close(struct evhttp_connection *evcon, void *ctx)
+void on_close(struct simplehttp_stream *stream, int connected, void *ctx)
 {
     struct cli *client = (struct cli *)ctx;
     
-    if (client) {
-        fprintf(stdout, "%llu >> close from  %s:%d\n", client->connection_id, evcon->address, evcon->port);
-        currentConns--;
-        TAILQ_REMOVE(&clients, client, entries);
-        evbuffer_free(client->buf);
-        free(client);
-    } else {
-        fprintf(stdout, "[unknown] >> close from  %s:%d\n", evcon->address, evcon->port);
-    }
+    fprintf(stdout, "%llu >> close from  %s:%d\n", client->connection_id, client->req->remote_host, client->req->remote_port);
+    currentConns--;
+    TAILQ_REMOVE(&clients, client, entries);
+    evbuffer_free(client->buf);
+    simplehttp_pool_put(cli_pool, client);
 }
 
 void pub_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
@@ -212,10 +188,6 @@ void pub_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
                 msgSent++;
                 evbuffer_drain(client->buf, EVBUFFER_LENGTH(client->buf));
                 if (is_slow(client)) {
-                    if (can_kick(client)) {
-                        evhttp_connection_free(client->req->evcon);
-                        continue;
-                    }
                     continue;
                 }
                 if (client->websocket) {
@@ -254,7 +226,7 @@ void pub_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
                     evbuffer_add(client->buf, current_message, message_length);
                     evbuffer_add_printf(client->buf, "\n");
                 }
-                evhttp_send_reply_chunk(client->req, client->buf);
+                simplehttp_stream_send(client->stream, client->buf);
                 i++;
             }
             
@@ -283,7 +255,7 @@ void sub_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
     currentConns++;
     totalConns++;
     evhttp_parse_query(req->uri, &args);
-    client = calloc(1, sizeof(*client));
+    client = simplehttp_pool_calloc(cli_pool);
     client->multipart = get_int_argument(&args, "multipart", 1);
     client->req = req;
     client->connection_id = totalConns;
@@ -352,17 +324,17 @@ void sub_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
                           "application/json");
         evbuffer_add_printf(client->buf, "\r\n");
     }
+    // messages are pushed as they are published, on_close runs when the client goes away
     if (client->websocket) {
-        evhttp_send_reply_start(client->req, 101, "Switching Protocols");
+        client->stream = simplehttp_stream_start(client->req, 101, "Switching Protocols", NULL, on_close, client);
     } else {
-        evhttp_send_reply_start(client->req, HTTP_OK, "OK");
+        client->stream = simplehttp_stream_start(client->req, HTTP_OK, "OK", NULL, on_close, client);
     }
     if (!client->websocket) {
-        evhttp_send_reply_chunk(client->req, client->buf);
+        simplehttp_stream_send(client->stream, client->buf);
     }
     
     TAILQ_INSERT_TAIL(&clients, client, entries);
-    evhttp_connection_set_closecb(req->evcon, on_close, (void *)client);
     evhttp_clear_headers(&args);
 }
 
@@ -383,11 +355,17 @@ int main(int argc, char **argv)
     }
     
     TAILQ_INIT(&clients);
+    cli_pool = simplehttp_pool_new("pubsub_client", sizeof(struct cli));
     simplehttp_init();
     simplehttp_set_cb("/pub*", pub_cb, NULL);
     simplehttp_set_cb("/sub*", sub_cb, NULL);
     simplehttp_set_cb("/stats*", stats_cb, NULL);
     simplehttp_set_cb("/clients", clients_cb, NULL);
+    simplehttp_metric_counter("pubsub_connections", "subscriber connections accepted", &totalConns);
+    simplehttp_metric_gauge("pubsub_current_connections", "subscribers connected", &currentConns);
+    simplehttp_metric_counter("pubsub_kicked_clients", "slow subscribers disconnected", &kickedClients);
+    simplehttp_metric_counter("pubsub_messages_received", "messages published", &msgRecv);
+    simplehttp_metric_counter("pubsub_messages_sent", "messages delivered to subscribers", &msgSent);
     simplehttp_main();
     free_options();
     
@@ -13,7 +13,6 @@
 #include <openssl/buffer.h>
 
 #include "shared.h"
-#include "http-internal.h"
 #include "pcre.h"
 
 
@@ -50,10 +49,12 @@ typedef struct cli {
     time_t connect_time;
     struct evbuffer *buf;
     struct evhttp_request *req;
+    struct simplehttp_stream *stream;
     struct filter fltr;
     TAILQ_ENTRY(cli) entries;
 } cli;
 TAILQ_HEAD(, cli) clients;
+struct simplehttp_pool *cli_pool;
 
 void error_cb(int status_code, void *arg);
 void source_reconnect_cb(int fd, short what, void *ctx);
@@ -65,11 +66,10 @@ int filter_message(char *subject, pcre *filter, struct json_object *json_in);
 int parse_encrypted_fields(char *str);
 int parse_blacklisted_fields(char *str);
 
-int can_kick(struct cli *client);
 int is_slow(struct cli *client);
 void clients_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx);
 void stats_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx);
-void on_close(struct evhttp_connection *evcon, void *ctx);
+void on_close(struct simplehttp_stream *stream, int connected, void *ctx);
 
 static uint64_t totalConns = 0;
 static uint64_t currentConns = 0;
@@ -232,10 +232,6 @@ void process_message_cb(char *source, void *arg)
         // A: it just clears any old cruft from the clients buffer
         evbuffer_drain(client->buf, EVBUFFER_LENGTH(client->buf));
         if (is_slow(client)) {
-            if (can_kick(client)) {
-                evhttp_connection_free(client->req->evcon);
-                continue;
-            }
             continue;
         }
         // filter
@@ -276,7 +272,7 @@ void process_message_cb(char *source, void *arg)
             /* new line terminated */
             evbuffer_add_printf(client->buf, "%s\n", json_out);
         }
-        evhttp_send_reply_chunk(client->req, client->buf);
+        simplehttp_stream_send(client->stream, client->buf);
         i++;
     }
     json_object_put(json_in);
@@ -284,36 +280,20 @@ void process_message_cb(char *source, void *arg)
 
 int is_slow(struct cli *client)
 {
+    size_t output_buffer_length;
+    char msg[128];
+    
     if (client->kick_client == KICK_CLIENT) {
         return 1;
     }
-    struct evhttp_connection *evcon;
-    unsigned long output_buffer_length;
-    
-    evcon = (struct evhttp_connection *)client->req->evcon;
-    output_buffer_length = (unsigned long)EVBUFFER_LENGTH(evcon->output_buffer);
+    output_buffer_length = simplehttp_stream_pending(client->stream);
     if (output_buffer_length > MAX_PENDING_DATA) {
         kickedClients += 1;
-        fprintf(stdout, "%llu >> kicking client with %lu pending data\n", client->connection_id, output_buffer_length);
+        fprintf(stdout, "%llu >> kicking client with %lu pending data\n", client->connection_id, (unsigned long)output_buffer_length);
         client->kick_client = KICK_CLIENT;
-        // clear the clients output buffer
-        evbuffer_drain(evcon->output_buffer, EVBUFFER_LENGTH(evcon->output_buffer));
-        evbuffer_add_printf(evcon->output_buffer, "ERROR_TOO_SLOW. kicked for having %lu pending bytes\n", output_buffer_length);
-        return 1;
-    }
-    return 0;
-}
-
-int can_kick(struct cli *client)
-{
-    if (client->kick_client == CLIENT_OK) {
-        return 0;
-    }
-    // if the buffer length is back to zero, we can kick now
-    // our error notice has been pushed to the client
-    struct evhttp_connection *evcon;
-    evcon = (struct evhttp_connection *)client->req->evcon;
-    if (EVBUFFER_LENGTH(evcon->output_buffer) == 0) {
+        // the clients output buffer is cleared, it is disconnected once this is out
+        sprintf(msg, "ERROR_TOO_SLOW. kicked for having %lu pending bytes\n", (unsigned long)output_buffer_length);
+        simplehttp_stream_kick(client->stream, msg);
         return 1;
     }
     return 0;
@@ -324,24 +304,19 @@ void clients_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
     struct cli *client;
     struct tm *time_struct;
     char buf[248];
-    unsigned long output_buffer_length;
-    struct evhttp_connection *evcon;
     
     if (TAILQ_EMPTY(&clients)) {
         evbuffer_add_printf(evb, "no /sub connections\n");
     }
     TAILQ_FOREACH(client, &clients, entries) {
-        evcon = (struct evhttp_connection *)client->req->evcon;
-        
         time_struct = gmtime(&client->connect_time);
         strftime(buf, 248, "%Y-%m-%d %H:%M:%S", time_struct);
-        output_buffer_length = (unsigned long)EVBUFFER_LENGTH(evcon->output_buffer);
-        evbuffer_add_printf(evb, "%s:%d connected at %s. output buffer size:%lu state:%d\n",
+        evbuffer_add_printf(evb, "%s:%d connected at %s. output buffer size:%lu kicked:%d\n",
                             client->req->remote_host,
                             client->req->remote_port,
                             buf,
-                            output_buffer_length,
-                            (int)evcon->state);
+                            (unsigned long)simplehttp_stream_pending(client->stream),
+                            (int)client->kick_client);
     }
     
     evhttp_send_reply(req, HTTP_OK, "OK", evb);
@@ -390,28 +365,24 @@ void stats_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
 }
 
 
-void on_close(struct evhttp_connection *evcon, void *ctx)
+void on_close(struct simplehttp_stream *stream, int connected, void *ctx)
 {
     struct cli *client = (struct cli *)ctx;
     
-    if (client) {
-        fprintf(stdout, "%llu >> close from  %s:%d\n", client->connection_id, evcon->address, evcon->port);
-        currentConns--;
-        TAILQ_REMOVE(&clients, client, entries);
-        evbuffer_free(client->buf);
-        if (client->fltr.subject) {
-            free(client->fltr.subject);
-        }
-        if (client->fltr.pattern) {
-            free(client->fltr.pattern);
-        }
-        if (client->fltr.re) {
-            pcre_free(client->fltr.re);
-        }
-        free(client);
-    } else {
-        fprintf(stdout, "[unknown] >> close from  %s:%d\n", evcon->address, evcon->port);
+    fprintf(stdout, "%llu >> close from  %s:%d\n", client->connection_id, client->req->remote_host, client->req->remote_port);
+    currentConns--;
+    TAILQ_REMOVE(&clients, client, entries);
+    evbuffer_free(client->buf);
+    if (client->fltr.subject) {
+        free(client->fltr.subject);
+    }
+    if (client->fltr.pattern) {
+        free(client->fltr.pattern);
+    }
+    if (client->fltr.re) {
+        pcre_free(client->fltr.re);
     }
+    simplehttp_pool_put(cli_pool, client);
 }
 
 void sub_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
@@ -432,7 +403,7 @@ void sub_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
     totalConns++;
     evhttp_parse_query(req->uri, &args);
     
-    client = calloc(1, sizeof(*client));
+    client = simplehttp_pool_calloc(cli_pool);
     client->multipart = 0;
     client->req = req;
     client->connection_id = totalConns;
@@ -502,17 +473,17 @@ void sub_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
         evbuffer_add_printf(client->buf, "\r\n");
     }
     
+    // messages are pushed as they arrive, on_close runs when the client goes away
     if (client->websocket) {
-        evhttp_send_reply_start(client->req, 101, "Switching Protocols");
+        client->stream = simplehttp_stream_start(client->req, 101, "Switching Protocols", NULL, on_close, client);
     } else {
-        evhttp_send_reply_start(client->req, HTTP_OK, "OK");
+        client->stream = simplehttp_stream_start(client->req, HTTP_OK, "OK", NULL, on_close, client);
     }
     if (!client->websocket) {
-        evhttp_send_reply_chunk(client->req, client->buf);
+        simplehttp_stream_send(client->stream, client->buf);
     }
     
     TAILQ_INSERT_TAIL(&clients, client, entries);
-    evhttp_connection_set_closecb(req->evcon, on_close, (void *)client);
     evhttp_clear_headers(&args);
 }
 
@@ -627,6 +598,7 @@ int main(int argc, char **argv)
     }
     
     TAILQ_INIT(&clients);
+    cli_pool = simplehttp_pool_new("pubsub_filtered_client", sizeof(struct cli));
     simplehttp_init();
     simplehttp_set_cb("/sub*", sub_cb, NULL);
     simplehttp_set_cb("/stats*", stats_cb, NULL);
@@ -0,0 +1,77 @@
+#include <stdlib.h>
+#include <string.h>
+#include "simplehttp.h"
+#include "admission.h"
+#include "request.h"
+
+/*
+ * load shedding on queueing delay, in the style of CoDel. a request's delay is
+ * how long ago its last bytes arrived when it is dispatched (the kernel keeps
+ * that per TCP connection), which covers waiting in the accept backlog and
+ * behind other work on the loop. each worker tracks the smallest delay seen
+ * over --admission-interval-ms. if even that one exceeded
+ * --admission-target-ms the worker has a standing queue and, for the next
+ * interval, turns away requests that already waited too long with a 503 and
+ * Retry-After rather than making them wait longer still for a reply the
+ * client may have given up on. short bursts that drain within an interval
+ * are never shed.
+ *
+ * requests on unix sockets have no delay to go on and are always admitted.
+ */
+
+#define ADMISSION_RETRY_AFTER "1"
+
+int simplehttp_admission_target_ms = 0;
+int simplehttp_admission_interval_ms = 100;
+uint64_t simplehttp_requests_shed = 0;
+
+struct admission_state {
+    simplehttp_ts interval_start;
+    int started;
+    uint64_t min_delay_ms;
+    int overloaded;
+};
+
+static __thread struct admission_state admission;
+
+/*
+ * 1 to serve req, 0 to shed it. SIMPLEHTTP_PRIORITY_HIGH requests count
+ * towards the delay but are never shed, SIMPLEHTTP_PRIORITY_LOW ones go once
+ * they waited longer than the target and everything else at twice that
+ */
+int simplehttp_admit(struct evhttp_request *req, int priority, simplehttp_ts now)
+{
+    uint64_t delay_ms, target_ms = simplehttp_admission_target_ms;
+    uint64_t interval_usec = (uint64_t)simplehttp_admission_interval_ms * 1000;
+    uint64_t elapsed = 0;
+    
+    if (simplehttp_admission_target_ms <= 0 || !simplehttp_request_delay_ms(req, &delay_ms)) {
+        return 1;
+    }
+    
+    if (admission.started) {
+        elapsed = simplehttp_ts_diff(admission.interval_start, now);
+    }
+    if (!admission.started || elapsed >= interval_usec) {
+        // the interval that just ended had a standing queue, unless we were idle since
+        admission.overloaded = admission.started && elapsed < 2 * interval_usec && admission.min_delay_ms > target_ms;
+        admission.interval_start = now;
+        admission.started = 1;
+        admission.min_delay_ms = delay_ms;
+    } else if (delay_ms < admission.min_delay_ms) {
+        admission.min_delay_ms = delay_ms;
+    }
+    
+    if (!admission.overloaded || priority == SIMPLEHTTP_PRIORITY_HIGH) {
+        return 1;
+    }
+    
+    return delay_ms <= (priority == SIMPLEHTTP_PRIORITY_LOW ? target_ms : 2 * target_ms);
+}
+
+void simplehttp_admission_reject(struct evhttp_request *req, struct evbuffer *evb)
+{
+    __sync_fetch_and_add(&simplehttp_requests_shed, 1);
+    evhttp_add_header(req->output_headers, "Retry-After", ADMISSION_RETRY_AFTER);
+    evhttp_send_reply(req, HTTP_SERVUNAVAIL, "Service Unavailable", evb);
+}
@@ -0,0 +1,13 @@
+#ifndef _ADMISSION_H
+#define _ADMISSION_H
+
+#include "simplehttp.h"
+
+extern int simplehttp_admission_target_ms;
+extern int simplehttp_admission_interval_ms;
+extern uint64_t simplehttp_requests_shed;
+
+int simplehttp_admit(struct evhttp_request *req, int priority, simplehttp_ts now);
+void simplehttp_admission_reject(struct evhttp_request *req, struct evbuffer *evb);
+
+#endif
@@ -8,24 +8,109 @@
 // this is set as a parameter to init_async_connection_pool()
 static int request_logging = 0;
 
-TAILQ_HEAD(, Connection) connection_pool;
+static struct Connection *connection_pool = NULL;
+static int default_min_connections = 0;
+static int default_max_connections = ASYNC_PER_HOST_CONNECTION_LIMIT;
+
+// every request and callback group is pooled, they come and go at request rate
+static struct simplehttp_pool *callback_pool = NULL;
+static struct simplehttp_pool *callback_group_pool = NULL;
 
 void init_async_connection_pool(int enable_request_logging)
 {
     request_logging = enable_request_logging;
-    TAILQ_INIT(&connection_pool);
 }
 
-void free_async_connection_pool()
+void set_async_connection_pool_limits(int min, int max)
+{
+    default_max_connections = max > 0 ? max : 1;
+    default_min_connections = min < default_max_connections ? min : default_max_connections;
+}
+
+static void reap_idle_connections(int fd, short what, void *arg);
+
+static struct Connection *get_host(const char *address, int port)
 {
-    int i;
     struct Connection *conn;
+    char key[512];
+    
+    snprintf(key, sizeof(key), "%s:%d", address, port);
+    HASH_FIND_STR(connection_pool, key, conn);
+    if (conn) {
+        return conn;
+    }
+    
+    conn = calloc(1, sizeof(struct Connection));
+    conn->key = strdup(key);
+    conn->address = strdup(address);
+    conn->port = port;
+    conn->min = default_min_connections;
+    conn->max = default_max_connections;
+    TAILQ_INIT(&conn->idle);
+    TAILQ_INIT(&conn->busy);
+    TAILQ_INIT(&conn->pending);
+    evtimer_set(&conn->reap_ev, reap_idle_connections, conn);
+    HASH_ADD_KEYPTR(hh, connection_pool, conn->key, strlen(conn->key), conn);
     
-    while ((conn = TAILQ_FIRST(&connection_pool))) {
-        TAILQ_REMOVE(&connection_pool, conn, next);
-        for (i = 0; i < ASYNC_PER_HOST_CONNECTION_LIMIT; i++) {
-            evhttp_connection_free(conn->evcon[i]);
+    return conn;
+}
+
+void set_async_host_connection_limits(const char *address, int port, int min, int max)
+{
+    struct Connection *conn = get_host(address, port);
+    
+    conn->max = max > 0 ? max : 1;
+    conn->min = min < conn->max ? min : conn->max;
+}
+
+static void free_pooled_connection(struct AsyncConnection *aconn)
+{
+    aconn->conn->count--;
+    evhttp_connection_free(aconn->evcon);
+    free(aconn);
+}
+
+// unlinks callback from its group and frees it, the group finishes once its last callback is gone
+static void release_callback(struct AsyncCallback *callback)
+{
+    struct AsyncCallbackGroup *callback_group = callback->callback_group;
+    
+    if (callback_group) {
+        TAILQ_REMOVE(&callback_group->callback_list, callback, entries);
+    }
+    free_async_callback(callback);
+    if (callback_group) {
+        free_async_callback_group(callback_group);
+    }
+}
+
+void free_async_connection_pool()
+{
+    struct Connection *conn, *tmp;
+    struct AsyncConnection *aconn;
+    struct AsyncCallback *callback;
+    
+    HASH_ITER(hh, connection_pool, conn, tmp) {
+        HASH_DEL(connection_pool, conn);
+        evtimer_del(&conn->reap_ev);
+        while ((aconn = TAILQ_FIRST(&conn->idle))) {
+            TAILQ_REMOVE(&conn->idle, aconn, entries);
+            free_pooled_connection(aconn);
+        }
+        while ((aconn = TAILQ_FIRST(&conn->busy))) {
+            TAILQ_REMOVE(&conn->busy, aconn, entries);
+            free_pooled_connection(aconn);
+        }
+        // never sent, they get NULL like a request that got no valid response
+        while ((callback = TAILQ_FIRST(&conn->pending))) {
+            TAILQ_REMOVE(&conn->pending, callback, pending_entries);
+            evhttp_request_free(callback->request);
+            if (callback->cb) {
+                callback->cb(NULL, callback->cb_arg);
+            }
+            release_callback(callback);
         }
+        free(conn->key);
         free(conn->address);
         free(conn);
     }
@@ -38,6 +123,7 @@ static void async_simplehttp_log(struct evhttp_request *req, struct AsyncCallbac
     uint64_t req_time;
     char host_buf[256];
     char id_buf[256];
+    char detail_buf[64];
     
     simplehttp_ts_get(&end_ts);
     req_time = simplehttp_ts_diff(callback->start_ts, end_ts);
@@ -45,33 +131,141 @@ static void async_simplehttp_log(struct evhttp_request *req, struct AsyncCallbac
     if (request_logging) {
         sprintf(host_buf, "%s:%d", callback->conn->address, callback->conn->port);
         sprintf(id_buf, "%"PRIu64":%"PRIu64, callback_group ? callback_group->id : 0, callback->id);
-        simplehttp_log(host_buf, req, req_time, id_buf, 0);
+        sprintf(detail_buf, " queued %.3fms connect %.3fms", callback->queue_time / 1000.0, callback->connect_time / 1000.0);
+        simplehttp_log_detail(host_buf, req, req_time, id_buf, 0, detail_buf);
     }
 }
 
-struct evhttp_connection *get_connection(const char *address, int port, struct Connection **store_conn)
+/*
+ * an idle connection (most recently used first), else a new one while the
+ * host is under max. NULL when the request has to wait.
+ */
+static struct AsyncConnection *acquire_connection(struct Connection *conn, int *is_new)
 {
-    struct Connection *conn;
-    int i;
+    struct AsyncConnection *aconn;
+    
+    *is_new = 0;
+    if ((aconn = TAILQ_FIRST(&conn->idle))) {
+        TAILQ_REMOVE(&conn->idle, aconn, entries);
+    } else if (conn->count < conn->max) {
+        aconn = malloc(sizeof(struct AsyncConnection));
+        aconn->conn = conn;
+        aconn->evcon = evhttp_connection_new(conn->address, conn->port);
+        evhttp_connection_set_retries(aconn->evcon, 0);
+        conn->count++;
+        *is_new = 1;
+    } else {
+        return NULL;
+    }
+    TAILQ_INSERT_TAIL(&conn->busy, aconn, entries);
     
-    TAILQ_FOREACH(conn, &connection_pool, next) {
-        if ((strcmp(conn->address, address) == 0) && (conn->port == port)) {
-            *store_conn = conn;
-            return conn->evcon[conn->next_evcon++ % ASYNC_PER_HOST_CONNECTION_LIMIT];
+    return aconn;
+}
+
+/*
+ * closes idle connections beyond the host's min once they've been idle for
+ * ASYNC_IDLE_TIMEOUT, and rearms for when the next one is due. this runs from
+ * the host's timer so a host that stops getting requests still lets go of them.
+ */
+static void reap_idle_connections(int fd, short what, void *arg)
+{
+    struct Connection *conn = (struct Connection *)arg;
+    struct AsyncConnection *oldest;
+    struct timeval tv = {0, 0};
+    time_t now = time(NULL);
+    
+    // the least recently used connections collect at the tail
+    while (conn->count > conn->min && (oldest = TAILQ_LAST(&conn->idle, AsyncConnectionList))) {
+        if (now - oldest->idle_since < ASYNC_IDLE_TIMEOUT) {
+            tv.tv_sec = oldest->idle_since + ASYNC_IDLE_TIMEOUT - now;
+            evtimer_add(&conn->reap_ev, &tv);
+            return;
         }
+        TAILQ_REMOVE(&conn->idle, oldest, entries);
+        free_pooled_connection(oldest);
     }
-    conn = malloc(sizeof(struct Connection));
-    conn->address = strdup(address);
-    conn->port = port;
-    conn->next_evcon = 0;
-    for (i = 0; i < ASYNC_PER_HOST_CONNECTION_LIMIT; i++) {
-        conn->evcon[i] = evhttp_connection_new(address, port);
-        evhttp_connection_set_retries(conn->evcon[i], 0);
+}
+
+static void release_connection(struct AsyncConnection *aconn)
+{
+    struct Connection *conn = aconn->conn;
+    struct timeval tv = {ASYNC_IDLE_TIMEOUT, 0};
+    
+    TAILQ_REMOVE(&conn->busy, aconn, entries);
+    aconn->idle_since = time(NULL);
+    TAILQ_INSERT_HEAD(&conn->idle, aconn, entries);
+    
+    if (conn->count > conn->min && !evtimer_pending(&conn->reap_ev, NULL)) {
+        evtimer_add(&conn->reap_ev, &tv);
     }
-    TAILQ_INSERT_TAIL(&connection_pool, conn, next);
-    *store_conn = conn;
+}
+
+// returns 0 if evhttp refused the request, the callback has then already run
+static int dispatch_async_request(struct AsyncCallback *callback, struct AsyncConnection *aconn, int is_new)
+{
+    simplehttp_ts start_ts, end_ts;
+    int rc;
+    
+    callback->aconn = aconn;
+    callback->evcon = aconn->evcon;
+    
+    AS_DEBUG("calling evhttp_make_request to %s (%p)\n", callback->path, callback->request);
+    
+    // a new connection resolves and starts connecting inside evhttp_make_request
+    simplehttp_ts_get(&start_ts);
+    rc = evhttp_make_request(callback->evcon, callback->request, callback->request_method, callback->path);
+    if (is_new) {
+        simplehttp_ts_get(&end_ts);
+        callback->connect_time = simplehttp_ts_diff(start_ts, end_ts);
+    }
+    
+    if (rc == -1) {
+        AS_DEBUG("*** request failed for source %s:%d%s ***\n", callback->conn->address, callback->conn->port, callback->path);
+        
+        async_simplehttp_log(callback->request, callback);
+        
+        // run this callback
+        if (callback->cb) {
+            // TODO: should this be passed NULL since this didn't actually execute?
+            callback->cb(callback->request, callback->cb_arg);
+        }
+        
+        // the request is still queued on the evcon, both go
+        release_callback(callback);
+        TAILQ_REMOVE(&aconn->conn->busy, aconn, entries);
+        free_pooled_connection(aconn);
+        
+        return 0;
+    }
+    
+    return 1;
+}
+
+// hands queued requests to connections as they free up
+static void dispatch_pending(struct Connection *conn)
+{
+    struct AsyncCallback *callback;
+    struct AsyncConnection *aconn;
+    simplehttp_ts now_ts;
+    int is_new;
+    
+    while ((callback = TAILQ_FIRST(&conn->pending))) {
+        if (!(aconn = acquire_connection(conn, &is_new))) {
+            return;
+        }
+        TAILQ_REMOVE(&conn->pending, callback, pending_entries);
+        simplehttp_ts_get(&now_ts);
+        callback->queue_time = simplehttp_ts_diff(callback->start_ts, now_ts);
+        dispatch_async_request(callback, aconn, is_new);
+    }
+}
+
+// the original request was answered with a 503 at its route's deadline
+static void callback_group_timeout(struct evhttp_request *req, void *arg)
+{
+    struct AsyncCallbackGroup *callback_group = (struct AsyncCallbackGroup *)arg;
     
-    return conn->evcon[conn->next_evcon % ASYNC_PER_HOST_CONNECTION_LIMIT];
+    callback_group->original_request = NULL;
 }
 
 struct AsyncCallbackGroup *new_async_callback_group(struct evhttp_request *req,
@@ -80,7 +274,10 @@ struct AsyncCallbackGroup *new_async_callback_group(struct evhttp_request *req,
 {
     struct AsyncCallbackGroup *callback_group = NULL;
     
-    callback_group = malloc(sizeof(*callback_group));
+    if (!callback_group_pool) {
+        callback_group_pool = simplehttp_pool_new("async_callback_group", sizeof(*callback_group));
+    }
+    callback_group = simplehttp_pool_get(callback_group_pool);
     callback_group->count = 0;
     callback_group->id = simplehttp_request_id(req);
     callback_group->original_request = req;
@@ -89,17 +286,22 @@ struct AsyncCallbackGroup *new_async_callback_group(struct evhttp_request *req,
     callback_group->finished_cb_arg = finished_cb_arg;
     TAILQ_INIT(&callback_group->callback_list);
     
+    simplehttp_async_set_timeout_cb(req, callback_group_timeout, callback_group);
+    
     return callback_group;
 }
 
 void free_async_callback_group(struct AsyncCallbackGroup *callback_group)
 {
     if (TAILQ_EMPTY(&callback_group->callback_list)) {
+        if (callback_group->original_request) {
+            simplehttp_async_set_timeout_cb(callback_group->original_request, NULL, NULL);
+        }
         if (callback_group->finished_cb) {
             callback_group->finished_cb(callback_group->original_request, callback_group->finished_cb_arg);
         }
         evbuffer_free(callback_group->evb);
-        free(callback_group);
+        simplehttp_pool_put(callback_group_pool, callback_group);
     }
 }
 
@@ -115,21 +317,32 @@ struct AsyncCallback *new_async_request_with_body(int request_method, const char
     static uint64_t counter = 0;
     // create new connection to endpoint
     struct AsyncCallback *callback = NULL;
+    struct AsyncConnection *aconn;
     struct RequestHeader *header;
     simplehttp_ts start_ts;
+    int is_new;
     
     simplehttp_ts_get(&start_ts);
     
-    callback = malloc(sizeof(*callback));
+    if (!callback_pool) {
+        callback_pool = simplehttp_pool_new("async_callback", sizeof(*callback));
+    }
+    callback = simplehttp_pool_get(callback_pool);
     callback->start_ts = start_ts;
     callback->id = counter++;
     callback->callback_group = NULL;
     callback->cb = cb;
     callback->cb_arg = cb_arg;
+    callback->aconn = NULL;
+    callback->evcon = NULL;
+    callback->request_method = request_method;
+    callback->path = strdup(path);
+    callback->queue_time = 0;
+    callback->connect_time = 0;
     
     AS_DEBUG("new_async_callback to %s:%d (%p)\n", address, port, callback);
     
-    callback->evcon = get_connection(address, port, &callback->conn);
+    callback->conn = get_host(address, port);
     
     callback->request = evhttp_request_new(finish_async_request, callback);
     evhttp_add_header(callback->request->output_headers, "Host", address);
@@ -144,22 +357,13 @@ struct AsyncCallback *new_async_request_with_body(int request_method, const char
         evbuffer_add(callback->request->output_buffer, body, strlen(body));
     }
     
-    AS_DEBUG("calling evhttp_make_request to %s (%p)\n", path, callback->request);
+    if (!(aconn = acquire_connection(callback->conn, &is_new))) {
+        AS_DEBUG("all connections to %s:%d busy, queueing (%p)\n", address, port, callback);
+        TAILQ_INSERT_TAIL(&callback->conn->pending, callback, pending_entries);
+        return callback;
+    }
     
-    if (evhttp_make_request(callback->evcon, callback->request, request_method, path) == -1) {
-        AS_DEBUG("*** request failed for source %s:%d%s ***\n", address, port, path);
-        
-        async_simplehttp_log(callback->request, callback);
-        
-        // run this callback
-        if (callback->cb) {
-            // TODO: should this be passed NULL since this didn't actually execute?
-            callback->cb(callback->request, callback->cb_arg);
-        }
-        
-        // free the callback object
-        free_async_callback(callback);
-        
+    if (!dispatch_async_request(callback, aconn, is_new)) {
         return NULL;
     }
     
@@ -184,13 +388,14 @@ int new_async_callback(struct AsyncCallbackGroup *callback_group, const char *ad
 void free_async_callback(struct AsyncCallback *callback)
 {
     AS_DEBUG("free_async_callback (%p)\n", callback);
-    free(callback);
+    free(callback->path);
+    simplehttp_pool_put(callback_pool, callback);
 }
 
 void finish_async_request(struct evhttp_request *req, void *cb_arg)
 {
     struct AsyncCallback *callback = (struct AsyncCallback *)cb_arg;
-    struct AsyncCallbackGroup *callback_group = callback->callback_group;
+    struct Connection *conn = callback->conn;
     
     // NOTE: there's an edge case where req is NULL when libevent receives an invalid response
     // async_simplehttp_log handles this for us
@@ -212,16 +417,11 @@ void finish_async_request(struct evhttp_request *req, void *cb_arg)
         callback->cb(req, callback->cb_arg);
     }
     
-    if (callback_group) {
-        // remove from the list of callbacks
-        TAILQ_REMOVE(&callback_group->callback_list, callback, entries);
-    }
+    release_connection(callback->aconn);
     
-    // free this object
-    free_async_callback(callback);
+    // the group may finish here, so before a queued request of it fails to go out and finishes it as well
+    release_callback(callback);
     
-    if (callback_group) {
-        // re-check if this callback_group needs to be freed
-        free_async_callback_group(callback_group);
-    }
+    // the connection takes the next queued request, if any
+    dispatch_pending(conn);
 }
@@ -3,6 +3,7 @@
 
 #include <queue.h>
 #include <simplehttp.h>
+#include "uthash.h"
 
 #ifdef ASYNC_DEBUG
 #define AS_DEBUG(...) fprintf(stdout, __VA_ARGS__)
@@ -10,23 +11,33 @@
 #define AS_DEBUG(...) do {;} while (0)
 #endif
 
+// default max connections per host, see set_async_connection_pool_limits()
 #define ASYNC_PER_HOST_CONNECTION_LIMIT 10
+// idle connections beyond a host's min are closed after this long, by the host's reap timer
+#define ASYNC_IDLE_TIMEOUT 30
 
 struct AsyncCallbackGroup;
 struct AsyncCallback;
+struct AsyncConnection;
 struct Connection;
 
 /* handling for callbacks */
 struct AsyncCallback {
     simplehttp_ts start_ts;
     struct Connection *conn;
+    struct AsyncConnection *aconn;
     struct evhttp_connection *evcon;
     struct evhttp_request *request;
+    int request_method;
+    char *path;
+    uint64_t queue_time;
+    uint64_t connect_time;
     uint64_t id;
     void (*cb)(struct evhttp_request *req, void *);
     void *cb_arg;
     struct AsyncCallbackGroup *callback_group;
     TAILQ_ENTRY(AsyncCallback) entries;
+    TAILQ_ENTRY(AsyncCallback) pending_entries;
 };
 
 struct AsyncCallbackGroup {
@@ -40,16 +51,32 @@ struct AsyncCallbackGroup {
     TAILQ_HEAD(, AsyncCallback) callback_list;
 };
 
+/* a pooled connection, on its host's idle list or busy with one request */
+struct AsyncConnection {
+    struct evhttp_connection *evcon;
+    struct Connection *conn;
+    time_t idle_since;
+    TAILQ_ENTRY(AsyncConnection) entries;
+};
+
+/* per host pool, hashed by "address:port". callbacks wait on pending
+    while all max connections are busy. reap_ev is armed while idle
+    connections beyond min are waiting out ASYNC_IDLE_TIMEOUT */
 struct Connection {
-    struct evhttp_connection *evcon[ASYNC_PER_HOST_CONNECTION_LIMIT];
-    uint64_t next_evcon;
+    char *key;
     char *address;
     int port;
-    TAILQ_ENTRY(Connection) next;
+    int min;
+    int max;
+    int count;
+    TAILQ_HEAD(AsyncConnectionList, AsyncConnection) idle;
+    struct AsyncConnectionList busy;
+    TAILQ_HEAD(, AsyncCallback) pending;
+    struct event reap_ev;
+    UT_hash_handle hh;
 };
 
 void finish_async_request(struct evhttp_request *req, void *cb_arg);
-struct evhttp_connection *get_connection(const char *address, int port, struct Connection **store_conn);
 void free_async_callback(struct AsyncCallback *callback);
 
 #endif
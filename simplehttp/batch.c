@@ -0,0 +1,499 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <err.h>
+#include "queue.h"
+#include "simplehttp.h"
+#include "http-internal.h"
+#include "request.h"
+#include "worker.h"
+#include "batch.h"
+
+/*
+ * /batch answers many GETs in one round trip. the sub-requests are uris, one
+ * per line of the body, a json array of strings or repeated uri arguments:
+ *
+ *   curl -d $'/get?key=a\n/get?key=b' localhost:8080/batch
+ *   curl -d '["/get?key=a", "/get?key=b"]' localhost:8080/batch?format=txt
+ *
+ * each one goes through the route table like a request off the wire, with its
+ * own id, log line, timeout and per-route stats. its callback replies with
+ * evhttp_send_reply() as usual: the request sits on a stand-in connection that
+ * nothing reads, and the reply is taken out of the stand-in's output buffer.
+ * the stand-in's write event is on a pipe nobody writes to, so evhttp never
+ * gets to flush it. async callbacks reply whenever they are done, /batch
+ * replies once the last of them has.
+ *
+ * the reply has every sub-request's status and body in order, as json
+ * {"responses": [{"uri": "/get?key=a", "status": 200, "body": "..."}, ...]}
+ * or as txt, a "<status> <length> <uri>" line then the body and a newline.
+ * a sub-request that starts a streaming reply is cut off with a 501.
+ */
+
+struct simplehttp_batch;
+
+struct batch_sub {
+    struct simplehttp_batch *batch;
+    struct evhttp_connection *evcon;
+    struct evhttp_request *req;
+    char *uri;
+    int replied;
+    int code;
+    struct evbuffer *body;
+};
+
+struct simplehttp_batch {
+    struct evhttp_request *req;
+    int format;
+    int count;
+    int collected;
+    int dispatching;
+    int scheduled;
+    struct event ev;
+    struct evbuffer *evb;
+    struct batch_sub subs[];
+};
+
+int simplehttp_batch_max_requests = 100;
+
+// stand-in connections wait to write on dups of the read end
+static int batch_pipe[2] = {-1, -1};
+static pthread_mutex_t batch_pipe_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int batch_stand_in_fd()
+{
+    pthread_mutex_lock(&batch_pipe_lock);
+    if (batch_pipe[0] == -1 && pipe(batch_pipe) == -1) {
+        err(1, "pipe() failed");
+    }
+    pthread_mutex_unlock(&batch_pipe_lock);
+    
+    return dup(batch_pipe[0]);
+}
+
+static void batch_collect_cb(int fd, short what, void *arg);
+
+// evhttp wrote (the start of) sub's reply, it is taken once evhttp_send_reply() has returned
+static void batch_output_cb(struct evbuffer *buffer, size_t old_len, size_t new_len, void *arg)
+{
+    struct batch_sub *sub = (struct batch_sub *)arg;
+    struct simplehttp_batch *batch = sub->batch;
+    struct timeval tv = {0, 0};
+    
+    if (sub->replied) {
+        return;
+    }
+    sub->replied = 1;
+    if (!batch->dispatching && !batch->scheduled) {
+        evtimer_add(&batch->ev, &tv);
+        batch->scheduled = 1;
+    }
+}
+
+static void batch_sub_open(struct simplehttp_batch *batch, struct batch_sub *sub, const char *uri)
+{
+    struct evhttp_connection *evcon;
+    struct evhttp_request *req;
+    
+    // no timeout (0), evhttp would fail the connection when its write timed out
+    evcon = calloc(1, sizeof(*evcon));
+    evcon->fd = batch_stand_in_fd();
+    evcon->input_buffer = evbuffer_new();
+    evcon->output_buffer = evbuffer_new();
+    evcon->flags = EVHTTP_CON_INCOMING;
+    // connected, so that evhttp_connection_free() ends a stream started on it
+    evcon->state = EVCON_IDLE;
+    evcon->base = simplehttp_worker_self()->base;
+    TAILQ_INIT(&evcon->requests);
+    evbuffer_setcb(evcon->output_buffer, batch_output_cb, sub);
+    
+    req = evhttp_request_new(NULL, NULL);
+    req->evcon = evcon;
+    req->flags |= EVHTTP_REQ_OWN_CONNECTION;
+    req->kind = EVHTTP_REQUEST;
+    req->type = EVHTTP_REQ_GET;
+    req->major = 1;
+    req->minor = 1;
+    req->uri = strdup(uri);
+    req->remote_host = strdup(batch->req->remote_host);
+    req->remote_port = batch->req->remote_port;
+    TAILQ_INSERT_TAIL(&evcon->requests, req, next);
+    
+    sub->batch = batch;
+    sub->evcon = evcon;
+    sub->req = req;
+    sub->uri = strdup(uri);
+}
+
+// takes the reply off the stand-in connection, which goes away along with the request
+static void batch_sub_close(struct batch_sub *sub)
+{
+    struct evbuffer *output = sub->evcon->output_buffer;
+    u_char *end;
+    
+    evbuffer_setcb(output, NULL, NULL);
+    sub->body = evbuffer_new();
+    if (sub->req->chunked) {
+        sub->code = 501;
+        evbuffer_add_printf(sub->body, "streaming replies are not supported in /batch\n");
+    } else {
+        sub->code = sub->req->response_code;
+        if ((end = evbuffer_find(output, (u_char *)"\r\n\r\n", 4))) {
+            evbuffer_drain(output, end + 4 - EVBUFFER_DATA(output));
+            evbuffer_add_buffer(sub->body, output);
+        }
+    }
+    
+    // an async callback that has not finished its request yet is done with it now
+    simplehttp_async_finish(sub->req);
+    evhttp_connection_free(sub->evcon);
+    sub->evcon = NULL;
+    sub->req = NULL;
+}
+
+static void batch_collect(struct simplehttp_batch *batch)
+{
+    struct batch_sub *sub;
+    int i;
+    
+    for (i = 0; i < batch->count; i++) {
+        sub = &batch->subs[i];
+        if (sub->replied && !sub->body) {
+            batch_sub_close(sub);
+            batch->collected++;
+        }
+    }
+}
+
+static void batch_add_json_str(struct evbuffer *evb, const char *value, size_t len)
+{
+    const char *p;
+    
+    evbuffer_add(evb, "\"", 1);
+    for (p = value; p < value + len; p++) {
+        if (*p == '"' || *p == '\\') {
+            evbuffer_add_printf(evb, "\\%c", *p);
+        } else if ((unsigned char)*p < 0x20) {
+            evbuffer_add_printf(evb, "\\u%04x", *p);
+        } else {
+            evbuffer_add(evb, p, 1);
+        }
+    }
+    evbuffer_add(evb, "\"", 1);
+}
+
+static void batch_reply(struct simplehttp_batch *batch)
+{
+    struct evbuffer *evb = batch->evb;
+    struct batch_sub *sub;
+    int i;
+    
+    if (batch->format == json_format) {
+        evbuffer_add_printf(evb, "{\"responses\": [");
+    }
+    for (i = 0; i < batch->count; i++) {
+        sub = &batch->subs[i];
+        if (batch->format == txt_format) {
+            evbuffer_add_printf(evb, "%d %lu %s\n", sub->code, (unsigned long)EVBUFFER_LENGTH(sub->body), sub->uri);
+            evbuffer_add_buffer(evb, sub->body);
+            evbuffer_add(evb, "\n", 1);
+        } else {
+            evbuffer_add_printf(evb, "%s{\"uri\": ", i ? ", " : "");
+            batch_add_json_str(evb, sub->uri, strlen(sub->uri));
+            evbuffer_add_printf(evb, ", \"status\": %d, \"body\": ", sub->code);
+            batch_add_json_str(evb, (const char *)EVBUFFER_DATA(sub->body), EVBUFFER_LENGTH(sub->body));
+            evbuffer_add(evb, "}", 1);
+        }
+    }
+    if (batch->format == json_format) {
+        evbuffer_add_printf(evb, "]}\n");
+    }
+    simplehttp_send_reply(batch->req, HTTP_OK, "OK", evb);
+}
+
+static void batch_free(struct simplehttp_batch *batch)
+{
+    int i;
+    
+    if (batch->scheduled) {
+        evtimer_del(&batch->ev);
+    }
+    for (i = 0; i < batch->count; i++) {
+        if (batch->subs[i].body) {
+            evbuffer_free(batch->subs[i].body);
+        }
+        free(batch->subs[i].uri);
+    }
+    evbuffer_free(batch->evb);
+    free(batch);
+}
+
+static void batch_collect_cb(int fd, short what, void *arg)
+{
+    struct simplehttp_batch *batch = (struct simplehttp_batch *)arg;
+    
+    batch->scheduled = 0;
+    batch_collect(batch);
+    if (batch->collected < batch->count) {
+        return;
+    }
+    
+    // the batch request itself is gone if it timed out
+    if (batch->req) {
+        batch_reply(batch);
+        simplehttp_async_finish(batch->req);
+    }
+    batch_free(batch);
+}
+
+// --timeout on /batch, req is answered with a 503 and the sub-requests are left to finish
+static void batch_timeout_cb(struct evhttp_request *req, void *arg)
+{
+    struct simplehttp_batch *batch = (struct simplehttp_batch *)arg;
+    
+    batch->req = NULL;
+}
+
+static char *batch_skip_space(char *p)
+{
+    while (isspace((unsigned char)*p)) {
+        p++;
+    }
+    return p;
+}
+
+// \uXXXX as utf-8, out never gets ahead of the escape it replaces
+static int batch_unescape_u(const char *p, char **out)
+{
+    char hex[5];
+    unsigned int c;
+    int i;
+    
+    for (i = 0; i < 4; i++) {
+        if (!isxdigit((unsigned char)p[i])) {
+            return 0;
+        }
+        hex[i] = p[i];
+    }
+    hex[4] = '\0';
+    c = strtoul(hex, NULL, 16);
+    if (c < 0x80) {
+        *(*out)++ = c;
+    } else if (c < 0x800) {
+        *(*out)++ = 0xc0 | (c >> 6);
+        *(*out)++ = 0x80 | (c & 0x3f);
+    } else {
+        *(*out)++ = 0xe0 | (c >> 12);
+        *(*out)++ = 0x80 | ((c >> 6) & 0x3f);
+        *(*out)++ = 0x80 | (c & 0x3f);
+    }
+    return 1;
+}
+
+/*
+ * a json array of strings, decoded in place. returns how many there are (stopping
+ * at max) or -1 if p is not such an array
+ */
+static int batch_parse_json(char *p, char **uris, int max)
+{
+    char *out;
+    int count = 0;
+    
+    p = batch_skip_space(p + 1);
+    if (*p == ']') {
+        return *batch_skip_space(p + 1) ? -1 : 0;
+    }
+    while (count < max) {
+        if (*p++ != '"') {
+            return -1;
+        }
+        uris[count++] = out = p;
+        while (*p != '"') {
+            if (*p == '\0') {
+                return -1;
+            }
+            if (*p != '\\') {
+                *out++ = *p++;
+                continue;
+            }
+            switch (*++p) {
+                case '"':
+                case '\\':
+                case '/':
+                    *out++ = *p;
+                    break;
+                case 'n':
+                    *out++ = '\n';
+                    break;
+                case 't':
+                    *out++ = '\t';
+                    break;
+                case 'r':
+                    *out++ = '\r';
+                    break;
+                case 'u':
+                    if (!batch_unescape_u(p + 1, &out)) {
+                        return -1;
+                    }
+                    p += 4;
+                    break;
+                default:
+                    return -1;
+            }
+            p++;
+        }
+        p++;
+        *out = '\0';
+        p = batch_skip_space(p);
+        if (*p == ']') {
+            return *batch_skip_space(p + 1) ? -1 : count;
+        }
+        if (*p != ',') {
+            return -1;
+        }
+        p = batch_skip_space(p + 1);
+    }
+    
+    return count;
+}
+
+// one uri per line, blank lines are skipped
+static int batch_parse_lines(char *p, char **uris, int max)
+{
+    char *next, *end;
+    int count = 0;
+    
+    for (; p && count < max; p = next) {
+        if ((next = strchr(p, '\n'))) {
+            *next++ = '\0';
+        }
+        p = batch_skip_space(p);
+        end = p + strlen(p);
+        while (end > p && isspace((unsigned char)end[-1])) {
+            *--end = '\0';
+        }
+        if (*p) {
+            uris[count++] = p;
+        }
+    }
+    
+    return count;
+}
+
+// a path and query, nothing that would break the log or the txt reply
+static int batch_valid_uri(const char *uri)
+{
+    const char *p;
+    
+    if (uri[0] != '/') {
+        return 0;
+    }
+    for (p = uri; *p; p++) {
+        if ((unsigned char)*p <= 0x20 || *p == 0x7f) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void simplehttp_batch_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
+{
+    struct simplehttp_args *args = simplehttp_args(req);
+    struct simplehttp_batch *batch;
+    struct simplehttp_request *s_req;
+    struct evbuffer *sub_evb;
+    char error[128] = "";
+    char **uris;
+    char *body = NULL;
+    size_t len;
+    int max = simplehttp_batch_max_requests;
+    int count = 0;
+    int i;
+    
+    // one more than allowed, to tell when there are too many
+    uris = malloc((max + 1) * sizeof(*uris));
+    if ((len = EVBUFFER_LENGTH(req->input_buffer))) {
+        body = malloc(len + 1);
+        memcpy(body, EVBUFFER_DATA(req->input_buffer), len);
+        body[len] = '\0';
+        if (*batch_skip_space(body) == '[') {
+            count = batch_parse_json(batch_skip_space(body), uris, max + 1);
+        } else {
+            count = batch_parse_lines(body, uris, max + 1);
+        }
+    } else {
+        for (i = 0; i < args->count && count <= max; i++) {
+            if (strcmp(args->list[i].key, "uri") == 0) {
+                uris[count++] = (char *)args->list[i].value;
+            }
+        }
+    }
+    
+    if (count == -1) {
+        sprintf(error, "could not parse the list of sub-requests");
+    } else if (count == 0) {
+        sprintf(error, "no sub-requests");
+    } else if (count > max) {
+        sprintf(error, "more than %d sub-requests", max);
+    }
+    for (i = 0; !error[0] && i < count; i++) {
+        if (!batch_valid_uri(uris[i])) {
+            sprintf(error, "sub-requests must be a path and query");
+        }
+    }
+    if (error[0]) {
+        evbuffer_add_printf(evb, "%s\n", error);
+        evhttp_send_reply(req, HTTP_BADREQUEST, "Bad Request", evb);
+        free(body);
+        free(uris);
+        return;
+    }
+    
+    batch = calloc(1, sizeof(*batch) + count * sizeof(struct batch_sub));
+    batch->req = req;
+    batch->format = simplehttp_arg_format(args);
+    batch->count = count;
+    batch->evb = evbuffer_new();
+    evtimer_set(&batch->ev, batch_collect_cb, batch);
+    event_base_set(simplehttp_worker_self()->base, &batch->ev);
+    
+    // callbacks that reply right away are collected below, not through the timer
+    sub_evb = evbuffer_new();
+    batch->dispatching = 1;
+    for (i = 0; i < count; i++) {
+        batch_sub_open(batch, &batch->subs[i], uris[i]);
+        simplehttp_dispatch_sub_request(req, batch->subs[i].req, sub_evb);
+        if (EVBUFFER_LENGTH(sub_evb)) {
+            evbuffer_drain(sub_evb, EVBUFFER_LENGTH(sub_evb));
+        }
+    }
+    batch->dispatching = 0;
+    evbuffer_free(sub_evb);
+    free(body);
+    free(uris);
+    
+    batch_collect(batch);
+    if (batch->collected == count) {
+        batch_reply(batch);
+        batch_free(batch);
+        return;
+    }
+    
+    // the rest reply later
+    if ((s_req = simplehttp_request_get(req))) {
+        s_req->async = 1;
+    }
+    simplehttp_async_set_timeout_cb(req, batch_timeout_cb, batch);
+}
+
+void simplehttp_batch_free()
+{
+    if (batch_pipe[0] != -1) {
+        close(batch_pipe[0]);
+        close(batch_pipe[1]);
+        batch_pipe[0] = batch_pipe[1] = -1;
+    }
+}
@@ -0,0 +1,13 @@
+#ifndef _BATCH_H
+#define _BATCH_H
+
+#include "simplehttp.h"
+
+extern int simplehttp_batch_max_requests;
+
+void simplehttp_batch_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx);
+void simplehttp_batch_free();
+// in simplehttp.c
+void simplehttp_dispatch_sub_request(struct evhttp_request *batch_req, struct evhttp_request *req, struct evbuffer *evb);
+
+#endif
@@ -0,0 +1,792 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
+#include "queue.h"
+#include "simplehttp.h"
+#include "options.h"
+#include "histogram.h"
+
+/*
+ * load generator for simplehttp services. requests come from a scenario file
+ * (see scenarios/) and are sent either closed loop (--concurrency requests in
+ * flight) or at a fixed --rate. with a fixed rate latency is measured from
+ * when a request was due, not when it was sent, so a stalled server is not
+ * hidden by the generator backing off. due requests are sent from a 1ms
+ * timer, so this includes up to a timer tick of lag on the generator side.
+ *
+ * by default requests go through the async_simplehttp keep-alive connection
+ * pool, sized to --connections. --pipeline writes them back to back on
+ * --connections raw sockets without waiting for responses. --unix connects
+ * those raw sockets to a unix socket listener (--listen=unix:PATH) instead.
+ *
+ *   ./bench_http --scenario=scenarios/simplequeue.txt --port=8080 --duration=10
+ *
+ * scenario lines are "<weight> <GET|POST> <path> [body]" with %d in the
+ * path or body replaced by a per line sequence number modulo --keys, and
+ * "subscribe <path> <count>" to hold open streaming subscribers (pubsub).
+ */
+
+#define MAX_LINES 64
+#define SCHEDULE_SIZE 1024
+#define MAX_REQUEST_SIZE 8192
+#define DRAIN_SECS 5
+
+struct scenario_line {
+    int weight;
+    int method;
+    char *path;
+    char *body;
+    uint64_t seq;
+    uint64_t count;
+    uint64_t errors;
+    struct simplehttp_histogram latency;
+};
+
+struct bench_request {
+    simplehttp_ts start_ts;
+    uint64_t lag;
+    struct scenario_line *line;
+    TAILQ_ENTRY(bench_request) entries;
+};
+
+enum parse_state {
+    PARSE_HEADERS,
+    PARSE_BODY,
+    PARSE_CHUNK_SIZE,
+    PARSE_CHUNK_DATA,
+    PARSE_TRAILER
+};
+
+struct pipeline_conn {
+    int fd;
+    struct bufferevent *bev;
+    int state;
+    int status;
+    size_t body_left;
+    TAILQ_HEAD(, bench_request) inflight;
+};
+
+struct subscriber {
+    struct evhttp_connection *evcon;
+};
+
+static struct scenario_line lines[MAX_LINES];
+static int line_count = 0;
+static struct scenario_line *schedule[SCHEDULE_SIZE];
+static int schedule_len = 0;
+
+static char *address;
+static int port;
+static char *unix_path;
+static int concurrency;
+static int rate;
+static int duration;
+static uint64_t max_requests;
+static int keys;
+static int pipeline;
+
+static struct pipeline_conn *conns = NULL;
+static int conn_count = 0;
+static struct subscriber *subscribers = NULL;
+static int subscriber_count = 0;
+static char *subscribe_path = NULL;
+
+static int running = 1;
+static uint64_t issued = 0;
+static uint64_t outstanding = 0;
+static uint64_t completed = 0;
+static uint64_t errors = 0;
+static uint64_t sub_messages = 0;
+static uint64_t sub_bytes = 0;
+static uint64_t sub_disconnects = 0;
+static simplehttp_ts bench_start_ts;
+static simplehttp_ts bench_end_ts;
+static struct simplehttp_histogram total_latency;
+static struct event rate_ev;
+static struct event stop_ev;
+static struct event int_ev;
+
+static void issue_request(uint64_t lag);
+
+static int parse_method(const char *method)
+{
+    if (strcasecmp(method, "GET") == 0) {
+        return EVHTTP_REQ_GET;
+    }
+    if (strcasecmp(method, "POST") == 0) {
+        return EVHTTP_REQ_POST;
+    }
+    return -1;
+}
+
+static int load_scenario(const char *filename)
+{
+    FILE *fp;
+    char buf[4096];
+    char *p, *fields[4];
+    int current[MAX_LINES] = {0};
+    int lineno = 0, n, i, j;
+    struct scenario_line *line;
+    
+    if ((fp = fopen(filename, "r")) == NULL) {
+        fprintf(stderr, "could not open scenario %s\n", filename);
+        return 0;
+    }
+    
+    while (fgets(buf, sizeof(buf), fp)) {
+        lineno++;
+        buf[strcspn(buf, "\r\n")] = '\0';
+        p = buf + strspn(buf, " \t");
+        if (*p == '\0' || *p == '#') {
+            continue;
+        }
+        
+        // the body is everything after the path, spaces included
+        n = 0;
+        while (*p && n < 4) {
+            fields[n++] = p;
+            if (n == 4) {
+                break;
+            }
+            p += strcspn(p, " \t");
+            if (*p) {
+                *p++ = '\0';
+                p += strspn(p, " \t");
+            }
+        }
+        
+        if (strcmp(fields[0], "subscribe") == 0) {
+            if (n < 3) {
+                fprintf(stderr, "%s:%d: expected subscribe <path> <count>\n", filename, lineno);
+                fclose(fp);
+                return 0;
+            }
+            free(subscribe_path);
+            subscribe_path = strdup(fields[1]);
+            subscriber_count = atoi(fields[2]);
+            continue;
+        }
+        
+        if (n < 3 || atoi(fields[0]) <= 0 || parse_method(fields[1]) == -1 || line_count == MAX_LINES) {
+            fprintf(stderr, "%s:%d: expected <weight> <GET|POST> <path> [body]\n", filename, lineno);
+            fclose(fp);
+            return 0;
+        }
+        line = &lines[line_count++];
+        line->weight = atoi(fields[0]);
+        line->method = parse_method(fields[1]);
+        line->path = strdup(fields[2]);
+        line->body = n == 4 ? strdup(fields[3]) : NULL;
+    }
+    fclose(fp);
+    
+    if (!line_count) {
+        fprintf(stderr, "%s: no requests\n", filename);
+        return 0;
+    }
+    
+    for (n = 0, i = 0; i < line_count; i++) {
+        n += lines[i].weight;
+    }
+    if (n > SCHEDULE_SIZE) {
+        fprintf(stderr, "%s: weights add up to more than %d\n", filename, SCHEDULE_SIZE);
+        return 0;
+    }
+    
+    // smooth weighted round robin, so the mix holds over short runs too
+    for (schedule_len = 0; schedule_len < n; schedule_len++) {
+        for (i = 0, j = 0; i < line_count; i++) {
+            current[i] += lines[i].weight;
+            if (current[i] > current[j]) {
+                j = i;
+            }
+        }
+        current[j] -= n;
+        schedule[schedule_len] = &lines[j];
+    }
+    
+    return 1;
+}
+
+// copies template into buf replacing %d with n
+static int expand(char *buf, size_t len, const char *template, uint64_t n)
+{
+    const char *p;
+    size_t used = 0;
+    int w;
+    
+    for (p = template; *p; p++) {
+        if (p[0] == '%' && p[1] == 'd') {
+            w = snprintf(buf + used, len - used, "%"PRIu64, n);
+            if (w < 0 || (size_t)w >= len - used) {
+                return -1;
+            }
+            used += w;
+            p++;
+        } else {
+            if (used + 1 >= len) {
+                return -1;
+            }
+            buf[used++] = *p;
+        }
+    }
+    buf[used] = '\0';
+    
+    return used;
+}
+
+static void stop_bench()
+{
+    struct timeval drain_tv = {DRAIN_SECS, 0};
+    int i;
+    
+    if (running) {
+        running = 0;
+        simplehttp_ts_get(&bench_end_ts);
+        // give up on requests the service never answers
+        event_loopexit(&drain_tv);
+    }
+    if (outstanding == 0) {
+        for (i = 0; i < subscriber_count; i++) {
+            if (subscribers[i].evcon) {
+                evhttp_connection_free(subscribers[i].evcon);
+                subscribers[i].evcon = NULL;
+            }
+        }
+        event_loopexit(NULL);
+    }
+}
+
+// reissue is 0 when a request failed before it was sent, so a dead server
+// does not have us spinning
+static void request_done(struct bench_request *r, int status, int reissue)
+{
+    simplehttp_ts end_ts;
+    uint64_t req_time;
+    
+    simplehttp_ts_get(&end_ts);
+    req_time = simplehttp_ts_diff(r->start_ts, end_ts) + r->lag;
+    
+    simplehttp_histogram_record(&r->line->latency, req_time);
+    simplehttp_histogram_record(&total_latency, req_time);
+    r->line->count++;
+    completed++;
+    if (status < 200 || status >= 300) {
+        r->line->errors++;
+        errors++;
+    }
+    free(r);
+    outstanding--;
+    
+    if (running && max_requests && completed >= max_requests) {
+        stop_bench();
+    }
+    if (!running) {
+        stop_bench();
+        return;
+    }
+    if (!rate && reissue) {
+        issue_request(0);
+    } else if (!rate && outstanding == 0) {
+        stop_bench();
+    }
+}
+
+static void keepalive_cb(struct evhttp_request *req, void *arg)
+{
+    request_done((struct bench_request *)arg, req ? req->response_code : 0, 1);
+}
+
+static int pipeline_connect(struct pipeline_conn *conn);
+
+static void pipeline_fail(struct pipeline_conn *conn)
+{
+    struct bench_request *r;
+    
+    while ((r = TAILQ_FIRST(&conn->inflight))) {
+        TAILQ_REMOVE(&conn->inflight, r, entries);
+        request_done(r, 0, 0);
+    }
+}
+
+static void pipeline_complete(struct pipeline_conn *conn)
+{
+    struct bench_request *r;
+    
+    conn->state = PARSE_HEADERS;
+    if ((r = TAILQ_FIRST(&conn->inflight))) {
+        TAILQ_REMOVE(&conn->inflight, r, entries);
+        request_done(r, conn->status, 1);
+    }
+}
+
+// a body (or chunk) is consumed as it arrives, returns 1 once it is complete
+static int pipeline_drain_body(struct pipeline_conn *conn, struct evbuffer *input)
+{
+    size_t len = EVBUFFER_LENGTH(input);
+    
+    if (len >= conn->body_left) {
+        evbuffer_drain(input, conn->body_left);
+        conn->body_left = 0;
+        return 1;
+    }
+    evbuffer_drain(input, len);
+    conn->body_left -= len;
+    return 0;
+}
+
+static void pipeline_parse_headers(struct pipeline_conn *conn, char *data, size_t len)
+{
+    char *line, *end, *next;
+    
+    conn->status = 0;
+    conn->body_left = 0;
+    conn->state = PARSE_BODY;
+    
+    end = data + len;
+    if (len > 12 && strncmp(data, "HTTP/1.", 7) == 0) {
+        conn->status = atoi(data + 9);
+    }
+    for (line = data; line < end; line = next + 2) {
+        if ((next = strstr(line, "\r\n")) == NULL || next >= end) {
+            break;
+        }
+        if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            conn->body_left = strtoul(line + 15, NULL, 10);
+        } else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0 && strstr(line, "chunked") < next) {
+            conn->state = PARSE_CHUNK_SIZE;
+        }
+    }
+}
+
+static void pipeline_readcb(struct bufferevent *bev, void *arg)
+{
+    struct pipeline_conn *conn = (struct pipeline_conn *)arg;
+    struct evbuffer *input = EVBUFFER_INPUT(bev);
+    u_char *p;
+    size_t len;
+    
+    while (EVBUFFER_LENGTH(input)) {
+        switch (conn->state) {
+            case PARSE_HEADERS:
+                if ((p = evbuffer_find(input, (u_char *)"\r\n\r\n", 4)) == NULL) {
+                    return;
+                }
+                len = (p - EVBUFFER_DATA(input)) + 4;
+                *(p + 2) = '\0';
+                pipeline_parse_headers(conn, (char *)EVBUFFER_DATA(input), len - 2);
+                evbuffer_drain(input, len);
+                if (conn->state == PARSE_BODY && conn->body_left == 0) {
+                    pipeline_complete(conn);
+                }
+                break;
+            case PARSE_BODY:
+                if (pipeline_drain_body(conn, input)) {
+                    pipeline_complete(conn);
+                }
+                break;
+            case PARSE_CHUNK_SIZE:
+                if ((p = evbuffer_find(input, (u_char *)"\r\n", 2)) == NULL) {
+                    return;
+                }
+                *p = '\0';
+                conn->body_left = strtoul((char *)EVBUFFER_DATA(input), NULL, 16);
+                evbuffer_drain(input, (p - EVBUFFER_DATA(input)) + 2);
+                if (conn->body_left == 0) {
+                    conn->state = PARSE_TRAILER;
+                } else {
+                    conn->body_left += 2;
+                    conn->state = PARSE_CHUNK_DATA;
+                }
+                break;
+            case PARSE_CHUNK_DATA:
+                if (pipeline_drain_body(conn, input)) {
+                    conn->state = PARSE_CHUNK_SIZE;
+                }
+                break;
+            case PARSE_TRAILER:
+                if ((p = evbuffer_find(input, (u_char *)"\r\n", 2)) == NULL) {
+                    return;
+                }
+                len = p - EVBUFFER_DATA(input);
+                evbuffer_drain(input, len + 2);
+                if (len == 0) {
+                    pipeline_complete(conn);
+                }
+                break;
+        }
+    }
+}
+
+static void pipeline_errorcb(struct bufferevent *bev, short what, void *arg)
+{
+    struct pipeline_conn *conn = (struct pipeline_conn *)arg;
+    
+    bufferevent_free(conn->bev);
+    close(conn->fd);
+    conn->bev = NULL;
+    conn->fd = -1;
+    pipeline_fail(conn);
+    
+    if (running && !pipeline_connect(conn)) {
+        fprintf(stderr, "could not reconnect to %s:%d\n", address, port);
+    }
+}
+
+static int unix_connect()
+{
+    struct sockaddr_un addr;
+    int fd;
+    
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, unix_path, sizeof(addr.sun_path) - 1);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    
+    return fd;
+}
+
+static int tcp_connect()
+{
+    struct addrinfo hints, *res, *ai;
+    char port_buf[16];
+    int fd = -1, on = 1;
+    
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    sprintf(port_buf, "%d", port);
+    if (getaddrinfo(address, port_buf, &hints, &res) != 0) {
+        return -1;
+    }
+    for (ai = res; ai; ai = ai->ai_next) {
+        if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) == -1) {
+            continue;
+        }
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd != -1) {
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+    
+    return fd;
+}
+
+static int pipeline_connect(struct pipeline_conn *conn)
+{
+    int fd;
+    
+    if ((fd = unix_path ? unix_connect() : tcp_connect()) == -1) {
+        return 0;
+    }
+    
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    conn->fd = fd;
+    conn->state = PARSE_HEADERS;
+    conn->bev = bufferevent_new(fd, pipeline_readcb, NULL, pipeline_errorcb, conn);
+    bufferevent_enable(conn->bev, EV_READ | EV_WRITE);
+    
+    return 1;
+}
+
+static void pipeline_send(struct bench_request *r, const char *path, const char *body, int body_len)
+{
+    static uint64_t next_conn = 0;
+    struct pipeline_conn *conn = &conns[next_conn++ % conn_count];
+    char buf[MAX_REQUEST_SIZE];
+    int len;
+    
+    if (conn->fd == -1) {
+        request_done(r, 0, 0);
+        return;
+    }
+    
+    if (r->line->method == EVHTTP_REQ_POST) {
+        len = snprintf(buf, sizeof(buf), "POST %s HTTP/1.1\r\nHost: %s\r\nContent-Length: %d\r\n\r\n%s",
+                       path, address, body_len, body ? body : "");
+    } else {
+        len = snprintf(buf, sizeof(buf), "GET %s HTTP/1.1\r\nHost: %s\r\n\r\n", path, address);
+    }
+    if (len < 0 || len >= sizeof(buf)) {
+        request_done(r, 0, 0);
+        return;
+    }
+    
+    TAILQ_INSERT_TAIL(&conn->inflight, r, entries);
+    bufferevent_write(conn->bev, buf, len);
+}
+
+static void issue_request(uint64_t lag)
+{
+    struct scenario_line *line;
+    struct bench_request *r;
+    char path[MAX_REQUEST_SIZE / 2];
+    char body[MAX_REQUEST_SIZE / 2];
+    int body_len = 0;
+    uint64_t n;
+    
+    if (!running || (max_requests && issued >= max_requests)) {
+        return;
+    }
+    
+    line = schedule[issued++ % schedule_len];
+    n = keys ? line->seq++ % keys : line->seq++;
+    
+    r = malloc(sizeof(*r));
+    r->line = line;
+    r->lag = lag;
+    simplehttp_ts_get(&r->start_ts);
+    outstanding++;
+    
+    if (expand(path, sizeof(path), line->path, n) == -1
+            || (line->body && (body_len = expand(body, sizeof(body), line->body, n)) == -1)) {
+        request_done(r, 0, 0);
+        return;
+    }
+    
+    if (pipeline) {
+        pipeline_send(r, path, line->body ? body : NULL, body_len);
+    } else {
+        // on failure keepalive_cb has already run
+        new_async_request_with_body(line->method, address, port, path, NULL,
+                                    line->body ? body : NULL, keepalive_cb, r);
+    }
+}
+
+// issues every request that has come due since the last tick
+static void rate_cb(int fd, short what, void *arg)
+{
+    struct timeval tv = {0, 1000};
+    simplehttp_ts now_ts;
+    uint64_t elapsed, due, due_at;
+    
+    if (!running) {
+        return;
+    }
+    
+    simplehttp_ts_get(&now_ts);
+    elapsed = simplehttp_ts_diff(bench_start_ts, now_ts);
+    due = (elapsed * rate) / 1000000;
+    while (running && issued < due && (!max_requests || issued < max_requests)) {
+        due_at = (issued * 1000000) / rate;
+        issue_request(elapsed > due_at ? elapsed - due_at : 0);
+    }
+    
+    evtimer_add(&rate_ev, &tv);
+}
+
+static void stop_cb(int fd, short what, void *arg)
+{
+    stop_bench();
+}
+
+static void sub_chunk_cb(struct evhttp_request *req, void *arg)
+{
+    sub_messages++;
+    sub_bytes += EVBUFFER_LENGTH(req->input_buffer);
+    evbuffer_drain(req->input_buffer, EVBUFFER_LENGTH(req->input_buffer));
+}
+
+static void sub_done_cb(struct evhttp_request *req, void *arg)
+{
+    if (running) {
+        sub_disconnects++;
+    }
+}
+
+static void start_subscribers()
+{
+    struct evhttp_request *req;
+    int i;
+    
+    subscribers = calloc(subscriber_count, sizeof(struct subscriber));
+    for (i = 0; i < subscriber_count; i++) {
+        subscribers[i].evcon = evhttp_connection_new(address, port);
+        req = evhttp_request_new(sub_done_cb, &subscribers[i]);
+        evhttp_request_set_chunked_cb(req, sub_chunk_cb);
+        evhttp_add_header(req->output_headers, "Host", address);
+        evhttp_make_request(subscribers[i].evcon, req, EVHTTP_REQ_GET, subscribe_path);
+    }
+}
+
+static void print_latency(struct simplehttp_histogram *h)
+{
+    double percent = 50.0, step = 25.0;
+    uint64_t value;
+    
+    fprintf(stdout, "latency (ms): mean %.3f  p50 %.3f  p90 %.3f  p99 %.3f  p99.9 %.3f  max %.3f\n",
+            h->count ? (h->sum / (double)h->count) / 1000.0 : 0,
+            simplehttp_histogram_percentile(h, 50) / 1000.0,
+            simplehttp_histogram_percentile(h, 90) / 1000.0,
+            simplehttp_histogram_percentile(h, 99) / 1000.0,
+            simplehttp_histogram_percentile(h, 99.9) / 1000.0,
+            h->max / 1000.0);
+    
+    // percentile spectrum in the same shape as HdrHistogram's output
+    fprintf(stdout, "\n%12s %14s %12s %14s\n", "value(ms)", "percentile", "total_count", "1/(1-p)");
+    while (1) {
+        value = simplehttp_histogram_percentile(h, percent);
+        fprintf(stdout, "%12.3f %14.6f %12"PRIu64" %14.2f\n", value / 1000.0, percent / 100.0,
+                simplehttp_histogram_count_below(h, value), 100.0 / (100.0 - percent));
+        if (100.0 / (100.0 - percent) >= h->count) {
+            break;
+        }
+        percent += step;
+        step /= 2;
+    }
+    fprintf(stdout, "%12.3f %14.6f %12"PRIu64"\n\n", h->max / 1000.0, 1.0, h->count);
+}
+
+static void print_report()
+{
+    struct scenario_line *line;
+    double secs;
+    int i;
+    
+    secs = simplehttp_ts_diff(bench_start_ts, bench_end_ts) / 1000000.0;
+    
+    fprintf(stdout, "%s:%d %s, %s\n", address, port,
+            pipeline ? "pipelined" : "keep-alive", rate ? "fixed rate" : "closed loop");
+    fprintf(stdout, "requests: %"PRIu64"  errors: %"PRIu64"  duration: %.3fs  throughput: %.1f req/s\n",
+            completed, errors, secs, secs > 0 ? completed / secs : 0);
+    if (subscriber_count) {
+        fprintf(stdout, "subscribers: %d  disconnected: %"PRIu64"  messages received: %"PRIu64"  bytes: %"PRIu64"\n",
+                subscriber_count, sub_disconnects, sub_messages, sub_bytes);
+    }
+    print_latency(&total_latency);
+    
+    fprintf(stdout, "%8s %8s %10s %10s %10s  %s\n", "count", "errors", "p50(ms)", "p99(ms)", "max(ms)", "request");
+    for (i = 0; i < line_count; i++) {
+        line = &lines[i];
+        fprintf(stdout, "%8"PRIu64" %8"PRIu64" %10.3f %10.3f %10.3f  %s %s\n", line->count, line->errors,
+                simplehttp_histogram_percentile(&line->latency, 50) / 1000.0,
+                simplehttp_histogram_percentile(&line->latency, 99) / 1000.0,
+                line->latency.max / 1000.0,
+                line->method == EVHTTP_REQ_POST ? "POST" : "GET", line->path);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    struct timeval tv = {0, 0};
+    int i;
+    
+    option_define_str("scenario", OPT_REQUIRED, NULL, NULL, NULL, "scenario file of requests to send");
+    option_define_str("address", OPT_OPTIONAL, "127.0.0.1", &address, NULL, "address of the service");
+    option_define_int("port", OPT_OPTIONAL, 8080, &port, NULL, "port of the service");
+    option_define_str("unix", OPT_OPTIONAL, NULL, &unix_path, NULL, "unix socket of the service (implies --pipeline)");
+    option_define_int("duration", OPT_OPTIONAL, 10, &duration, NULL, "seconds to run for");
+    option_define_int("requests", OPT_OPTIONAL, 0, NULL, NULL, "stop after this many requests (0 for no limit)");
+    option_define_int("concurrency", OPT_OPTIONAL, 16, &concurrency, NULL, "requests in flight when running closed loop");
+    option_define_int("rate", OPT_OPTIONAL, 0, &rate, NULL, "requests per second (0 to run closed loop)");
+    option_define_bool("pipeline", OPT_OPTIONAL, 0, &pipeline, NULL, "pipeline requests on raw connections instead of the keep-alive pool");
+    option_define_int("connections", OPT_OPTIONAL, 10, &conn_count, NULL, "connections to the service");
+    option_define_int("keys", OPT_OPTIONAL, 100000, &keys, NULL, "%d in a scenario wraps at this many keys (0 for no limit)");
+    
+    if (!option_parse_command_line(argc, argv)) {
+        return 1;
+    }
+    max_requests = option_get_int("requests");
+    
+    if (!load_scenario(option_get_str("scenario"))) {
+        return 1;
+    }
+    
+    signal(SIGPIPE, SIG_IGN);
+    event_init();
+    init_async_connection_pool(0);
+    
+    // ^C stops early and still reports
+    signal_set(&int_ev, SIGINT, stop_cb, NULL);
+    signal_add(&int_ev, NULL);
+    
+    if (conn_count < 1) {
+        conn_count = 1;
+    }
+    // the keep-alive pool only speaks tcp
+    if (unix_path) {
+        pipeline = 1;
+    }
+    set_async_connection_pool_limits(conn_count, conn_count);
+    if (pipeline) {
+        conns = calloc(conn_count, sizeof(struct pipeline_conn));
+        for (i = 0; i < conn_count; i++) {
+            TAILQ_INIT(&conns[i].inflight);
+            if (!pipeline_connect(&conns[i])) {
+                fprintf(stderr, "could not connect to %s:%d\n", address, port);
+                return 1;
+            }
+        }
+    }
+    if (subscriber_count && subscribe_path) {
+        start_subscribers();
+    }
+    
+    simplehttp_ts_get(&bench_start_ts);
+    
+    if (duration > 0) {
+        tv.tv_sec = duration;
+        evtimer_set(&stop_ev, stop_cb, NULL);
+        evtimer_add(&stop_ev, &tv);
+    }
+    if (rate > 0) {
+        evtimer_set(&rate_ev, rate_cb, NULL);
+        rate_cb(0, 0, NULL);
+    } else {
+        for (i = 0; i < concurrency; i++) {
+            issue_request(0);
+        }
+    }
+    
+    event_dispatch();
+    
+    print_report();
+    
+    if (rate > 0) {
+        evtimer_del(&rate_ev);
+    }
+    if (duration > 0) {
+        evtimer_del(&stop_ev);
+    }
+    signal_del(&int_ev);
+    for (i = 0; i < conn_count && conns; i++) {
+        if (conns[i].bev) {
+            bufferevent_free(conns[i].bev);
+            close(conns[i].fd);
+        }
+    }
+    free(conns);
+    free(subscribers);
+    free_async_connection_pool();
+    for (i = 0; i < line_count; i++) {
+        free(lines[i].path);
+        free(lines[i].body);
+    }
+    free(subscribe_path);
+    free(unix_path);
+    free_options();
+    
+    return errors ? 2 : 0;
+}
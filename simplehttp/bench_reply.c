@@ -0,0 +1,207 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "simplehttp.h"
+
+/*
+ * counts heap allocations and time per request for the same reply sent three
+ * ways over a keep-alive connection:
+ *
+ *   /alloc   a fresh evbuffer per request and "%s" formatting (the old path)
+ *   /printf  "%s" formatting into the pooled callback evbuffer
+ *   /bytes   simplehttp_reply_bytes()
+ *
+ *   ./bench_reply [--port=8085] [--requests=100000] [--size=128]
+ *
+ * malloc() and friends are wrapped with the glibc __libc_* entry points, the
+ * client thread does no allocations of its own while counting.
+ */
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static volatile int counting = 0;
+static uint64_t alloc_count = 0;
+static char *payload;
+static size_t payload_len;
+
+void *malloc(size_t size)
+{
+    if (counting) {
+        __sync_fetch_and_add(&alloc_count, 1);
+    }
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    if (counting) {
+        __sync_fetch_and_add(&alloc_count, 1);
+    }
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    if (counting) {
+        __sync_fetch_and_add(&alloc_count, 1);
+    }
+    return __libc_realloc(ptr, size);
+}
+
+static void alloc_cb(struct evhttp_request *req, struct evbuffer *unused, void *ctx)
+{
+    struct evbuffer *evb = evbuffer_new();
+    
+    evbuffer_add_printf(evb, "%s", payload);
+    evhttp_send_reply(req, HTTP_OK, "OK", evb);
+    evbuffer_free(evb);
+}
+
+static void printf_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
+{
+    evbuffer_add_printf(evb, "%s", payload);
+    evhttp_send_reply(req, HTTP_OK, "OK", evb);
+}
+
+static void bytes_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
+{
+    simplehttp_reply_bytes(req, HTTP_OK, "OK", payload, payload_len);
+}
+
+static void exit_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
+{
+    evhttp_send_reply(req, HTTP_OK, "OK", evb);
+    event_loopbreak();
+}
+
+// reads one response, returns 0 on a closed connection or a missing Content-Length
+static int read_response(int fd, char *buf, size_t size)
+{
+    size_t have = 0, want = 0;
+    ssize_t n;
+    char *end, *cl;
+    
+    for (;;) {
+        if ((n = read(fd, buf + have, size - have - 1)) <= 0) {
+            return 0;
+        }
+        have += n;
+        buf[have] = '\0';
+        if (!want && (end = strstr(buf, "\r\n\r\n"))) {
+            if (!(cl = strstr(buf, "Content-Length: "))) {
+                return 0;
+            }
+            want = (end - buf) + 4 + strtoul(cl + 16, NULL, 10);
+        }
+        if (want && have >= want) {
+            return 1;
+        }
+    }
+}
+
+static void run(int fd, const char *path, int requests)
+{
+    char request[128], buf[65536];
+    simplehttp_ts start_ts, end_ts;
+    uint64_t allocs;
+    int len, i;
+    
+    len = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: localhost\r\n\r\n", path);
+    
+    // warm up buffers and the Date cache
+    for (i = 0; i < 1000; i++) {
+        write(fd, request, len);
+        read_response(fd, buf, sizeof(buf));
+    }
+    
+    alloc_count = 0;
+    counting = 1;
+    simplehttp_ts_get(&start_ts);
+    for (i = 0; i < requests; i++) {
+        if (write(fd, request, len) != len || !read_response(fd, buf, sizeof(buf))) {
+            fprintf(stderr, "%s: request failed\n", path);
+            exit(1);
+        }
+    }
+    simplehttp_ts_get(&end_ts);
+    counting = 0;
+    allocs = alloc_count;
+    
+    printf("%-8s %8.2f allocs/req %8.2f usec/req\n", path,
+           (double)allocs / requests, (double)simplehttp_ts_diff(start_ts, end_ts) / requests);
+}
+
+static void *client(void *arg)
+{
+    struct sockaddr_in sin;
+    int fd, on = 1;
+    int requests = option_get_int("requests");
+    
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(option_get_int("port"));
+    sin.sin_addr.s_addr = inet_addr("127.0.0.1");
+    
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if (connect(fd, (struct sockaddr *)&sin, sizeof(sin)) != 0) {
+        perror("connect");
+        exit(1);
+    }
+    
+    printf("%d requests, %zu byte replies\n", requests, payload_len);
+    run(fd, "/alloc", requests);
+    run(fd, "/printf", requests);
+    run(fd, "/bytes", requests);
+    
+    // the loop stops before the /exit reply goes out, don't wait for it
+    write(fd, "GET /exit HTTP/1.1\r\n\r\n", 22);
+    close(fd);
+    
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    pthread_t thread;
+    
+    define_simplehttp_options();
+    option_define_int("requests", OPT_OPTIONAL, 100000, NULL, NULL, "requests per reply path");
+    option_define_int("size", OPT_OPTIONAL, 128, NULL, NULL, "reply body size");
+    if (!option_parse_command_line(argc, argv)) {
+        return 1;
+    }
+    
+    payload_len = option_get_int("size");
+    payload = malloc(payload_len + 1);
+    memset(payload, 'x', payload_len);
+    payload[payload_len] = '\0';
+    
+    simplehttp_init();
+    simplehttp_set_cb("/alloc*", alloc_cb, NULL);
+    simplehttp_set_cb("/printf*", printf_cb, NULL);
+    simplehttp_set_cb("/bytes*", bytes_cb, NULL);
+    simplehttp_set_cb("/exit*", exit_cb, NULL);
+    if (!simplehttp_listen()) {
+        return 1;
+    }
+    
+    pthread_create(&thread, NULL, client, NULL);
+    simplehttp_run();
+    pthread_join(thread, NULL);
+    
+    simplehttp_free();
+    free_options();
+    free(payload);
+    
+    return 0;
+}
@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fnmatch.h>
+#include "simplehttp.h"
+#include "route.h"
+
+/*
+ * compares per request dispatch cost of the compiled route table against the
+ * old linear fnmatch() scan over the registered callbacks.
+ *
+ *   ./bench_route [iterations]
+ */
+
+#define MAX_ROUTES 100
+
+static int linear_match(char **patterns, int n, const char *uri)
+{
+    int i;
+    
+    for (i = 0; i < n; i++) {
+        if (fnmatch(patterns[i], uri, FNM_NOESCAPE) == 0) {
+            return i;
+        }
+    }
+    
+    return -1;
+}
+
+static double bench_linear(char **patterns, int n, const char *uri, int iterations)
+{
+    simplehttp_ts start_ts, end_ts;
+    volatile int found = 0;
+    int i;
+    
+    simplehttp_ts_get(&start_ts);
+    for (i = 0; i < iterations; i++) {
+        found += linear_match(patterns, n, uri);
+    }
+    simplehttp_ts_get(&end_ts);
+    
+    return simplehttp_ts_diff(start_ts, end_ts) * 1000.0 / iterations;
+}
+
+static double bench_table(struct simplehttp_route_table *rt, const char *uri, int iterations)
+{
+    simplehttp_ts start_ts, end_ts;
+    volatile int found = 0;
+    int i;
+    
+    simplehttp_ts_get(&start_ts);
+    for (i = 0; i < iterations; i++) {
+        found += simplehttp_route_table_match(rt, uri);
+    }
+    simplehttp_ts_get(&end_ts);
+    
+    return simplehttp_ts_diff(start_ts, end_ts) * 1000.0 / iterations;
+}
+
+int main(int argc, char **argv)
+{
+    int sizes[] = {1, 5, 10, 20, 50, 100};
+    char *patterns[MAX_ROUTES];
+    char first_uri[64], last_uri[64];
+    const char *miss_uri = "/not_a_route?key=abc";
+    struct simplehttp_route_table *rt;
+    int iterations = 200000;
+    int i, s, n;
+    
+    if (argc > 1) {
+        iterations = atoi(argv[1]);
+    }
+    
+    for (i = 0; i < MAX_ROUTES; i++) {
+        patterns[i] = malloc(32);
+        sprintf(patterns[i], "/route_%03d*", i);
+    }
+    
+    fprintf(stdout, "%6s %-6s %12s %12s\n", "routes", "hit", "fnmatch ns", "table ns");
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        n = sizes[s];
+        rt = simplehttp_route_table_new();
+        for (i = 0; i < n; i++) {
+            simplehttp_route_table_add(rt, patterns[i], i);
+        }
+        sprintf(first_uri, "/route_000?key=abc");
+        sprintf(last_uri, "/route_%03d?key=abc", n - 1);
+        
+        if (simplehttp_route_table_match(rt, last_uri) != linear_match(patterns, n, last_uri)) {
+            fprintf(stderr, "ERROR: route table and fnmatch disagree for %s\n", last_uri);
+            return 1;
+        }
+        
+        fprintf(stdout, "%6d %-6s %12.1f %12.1f\n", n, "first",
+                bench_linear(patterns, n, first_uri, iterations), bench_table(rt, first_uri, iterations));
+        fprintf(stdout, "%6d %-6s %12.1f %12.1f\n", n, "last",
+                bench_linear(patterns, n, last_uri, iterations), bench_table(rt, last_uri, iterations));
+        fprintf(stdout, "%6d %-6s %12.1f %12.1f\n", n, "miss",
+                bench_linear(patterns, n, miss_uri, iterations), bench_table(rt, miss_uri, iterations));
+        simplehttp_route_table_free(rt);
+    }
+    
+    for (i = 0; i < MAX_ROUTES; i++) {
+        free(patterns[i]);
+    }
+    
+    return 0;
+}
@@ -0,0 +1,170 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "simplehttp.h"
+#include "compress.h"
+#include "profile.h"
+
+/*
+ * gzip/deflate for replies on routes flagged SIMPLEHTTP_CB_COMPRESS. a
+ * non-chunked reply is compressed in one go, so a thread needs a single
+ * deflate state for all of its connections; streams hold one for as long as
+ * they run. states go back on a per-thread free list and are reset, not
+ * reallocated, for the next reply.
+ */
+
+#define DEFLATE_FREE_MAX 16
+#define DEFLATE_OUT_CHUNK 16384
+
+int simplehttp_compress_level = 6;
+int simplehttp_compress_min_bytes = 1024;
+uint64_t simplehttp_compress_replies = 0;
+uint64_t simplehttp_compress_bytes_in = 0;
+uint64_t simplehttp_compress_bytes_out = 0;
+uint64_t simplehttp_compress_usec = 0;
+
+static __thread struct simplehttp_deflate *deflate_free = NULL;
+static __thread int deflate_free_count = 0;
+
+// the q value of one Accept-Encoding entry, 1 when there is none
+static int encoding_accepted(const char *params, const char *end)
+{
+    const char *q;
+    
+    for (q = params; q < end - 1; q++) {
+        if ((q[0] == 'q' || q[0] == 'Q') && q[1] == '=') {
+            return strtod(q + 2, NULL) > 0;
+        }
+    }
+    
+    return 1;
+}
+
+// the best encoding the client takes, gzip over deflate
+int simplehttp_compress_negotiate(struct evhttp_request *req)
+{
+    const char *header, *p, *end, *name_end;
+    int encoding = SIMPLEHTTP_ENCODING_NONE;
+    size_t len;
+    
+    if (simplehttp_compress_level <= 0 || req->type == EVHTTP_REQ_HEAD) {
+        return SIMPLEHTTP_ENCODING_NONE;
+    }
+    if (!(header = evhttp_find_header(req->input_headers, "Accept-Encoding"))) {
+        return SIMPLEHTTP_ENCODING_NONE;
+    }
+    
+    for (p = header; *p; p = *end ? end + 1 : end) {
+        while (*p == ' ' || *p == '\t') {
+            p++;
+        }
+        if (!(end = strchr(p, ','))) {
+            end = p + strlen(p);
+        }
+        for (name_end = p; name_end < end && *name_end != ';' && *name_end != ' '; name_end++);
+        len = name_end - p;
+        if (!encoding_accepted(name_end, end)) {
+            continue;
+        }
+        if ((len == 4 && strncasecmp(p, "gzip", 4) == 0) || (len == 6 && strncasecmp(p, "x-gzip", 6) == 0)) {
+            return SIMPLEHTTP_ENCODING_GZIP;
+        }
+        if (len == 7 && strncasecmp(p, "deflate", 7) == 0) {
+            encoding = SIMPLEHTTP_ENCODING_DEFLATE;
+        }
+    }
+    
+    return encoding;
+}
+
+void simplehttp_compress_headers(struct evhttp_request *req, int encoding)
+{
+    evhttp_add_header(req->output_headers, "Content-Encoding",
+                      encoding == SIMPLEHTTP_ENCODING_GZIP ? "gzip" : "deflate");
+}
+
+struct simplehttp_deflate *simplehttp_deflate_get(int encoding)
+{
+    struct simplehttp_deflate *d;
+    // 16 more window bits asks zlib for a gzip header and trailer
+    int window_bits = encoding == SIMPLEHTTP_ENCODING_GZIP ? 15 + 16 : 15;
+    
+    if ((d = deflate_free)) {
+        deflate_free = d->next;
+        deflate_free_count--;
+        // --compress-level may have changed through /config since it was set up
+        if (d->encoding == encoding && d->level == simplehttp_compress_level) {
+            deflateReset(&d->zs);
+            return d;
+        }
+        deflateEnd(&d->zs);
+    } else {
+        d = malloc(sizeof(*d));
+    }
+    
+    memset(&d->zs, 0, sizeof(d->zs));
+    if (deflateInit2(&d->zs, simplehttp_compress_level, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        free(d);
+        return NULL;
+    }
+    d->encoding = encoding;
+    d->level = simplehttp_compress_level;
+    
+    return d;
+}
+
+void simplehttp_deflate_put(struct simplehttp_deflate *d)
+{
+    if (deflate_free_count >= DEFLATE_FREE_MAX) {
+        deflateEnd(&d->zs);
+        free(d);
+        return;
+    }
+    d->next = deflate_free;
+    deflate_free = d;
+    deflate_free_count++;
+}
+
+/*
+ * compress len bytes onto out. flush is Z_NO_FLUSH, Z_SYNC_FLUSH (everything
+ * so far can be decoded by the client) or Z_FINISH (the end of the reply)
+ */
+int simplehttp_deflate_add(struct simplehttp_deflate *d, const void *data, size_t len, struct evbuffer *out, int flush)
+{
+    unsigned char chunk[DEFLATE_OUT_CHUNK];
+    uint64_t start_usec = simplehttp_thread_cpu_usec();
+    size_t out_bytes = 0;
+    int rc;
+    
+    d->zs.next_in = (unsigned char *)data;
+    d->zs.avail_in = len;
+    do {
+        d->zs.next_out = chunk;
+        d->zs.avail_out = sizeof(chunk);
+        rc = deflate(&d->zs, flush);
+        if (rc == Z_STREAM_ERROR) {
+            return 0;
+        }
+        evbuffer_add(out, chunk, sizeof(chunk) - d->zs.avail_out);
+        out_bytes += sizeof(chunk) - d->zs.avail_out;
+    } while (d->zs.avail_out == 0);
+    
+    __sync_fetch_and_add(&simplehttp_compress_bytes_in, len);
+    __sync_fetch_and_add(&simplehttp_compress_bytes_out, out_bytes);
+    __sync_fetch_and_add(&simplehttp_compress_usec, simplehttp_thread_cpu_usec() - start_usec);
+    
+    return 1;
+}
+
+// states cached by the calling thread
+void simplehttp_compress_free()
+{
+    struct simplehttp_deflate *d;
+    
+    while ((d = deflate_free)) {
+        deflate_free = d->next;
+        deflateEnd(&d->zs);
+        free(d);
+    }
+    deflate_free_count = 0;
+}
@@ -0,0 +1,33 @@
+#ifndef _COMPRESS_H
+#define _COMPRESS_H
+
+#include <zlib.h>
+#include "simplehttp.h"
+
+#define SIMPLEHTTP_ENCODING_NONE 0
+#define SIMPLEHTTP_ENCODING_DEFLATE 1
+#define SIMPLEHTTP_ENCODING_GZIP 2
+
+// deflate state, kept on a per-thread free list and reset between replies
+struct simplehttp_deflate {
+    z_stream zs;
+    int encoding;
+    int level;
+    struct simplehttp_deflate *next;
+};
+
+extern int simplehttp_compress_level;
+extern int simplehttp_compress_min_bytes;
+extern uint64_t simplehttp_compress_replies;
+extern uint64_t simplehttp_compress_bytes_in;
+extern uint64_t simplehttp_compress_bytes_out;
+extern uint64_t simplehttp_compress_usec;
+
+int simplehttp_compress_negotiate(struct evhttp_request *req);
+void simplehttp_compress_headers(struct evhttp_request *req, int encoding);
+struct simplehttp_deflate *simplehttp_deflate_get(int encoding);
+void simplehttp_deflate_put(struct simplehttp_deflate *d);
+int simplehttp_deflate_add(struct simplehttp_deflate *d, const void *data, size_t len, struct evbuffer *out, int flush);
+void simplehttp_compress_free();
+
+#endif
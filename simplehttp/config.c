@@ -0,0 +1,83 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "simplehttp.h"
+
+/*
+ * the built-in /config route lists the options a service made changeable with
+ * option_set_runtime() and their current values. arguments change them,
+ * /config?slow_request_ms=100&compress_level=1, in order and stopping at the
+ * first one that is refused. there is no authentication, so the route is
+ * only registered with --enable-config. it is not thread safe, so with
+ * --workers no other callback is running while an option changes.
+ */
+
+struct config_list {
+    struct evbuffer *evb;
+    int format;
+    int count;
+};
+
+static void config_add_json_str(struct evbuffer *evb, const char *value)
+{
+    const char *p;
+    
+    evbuffer_add(evb, "\"", 1);
+    for (p = value; *p; p++) {
+        if (*p == '"' || *p == '\\') {
+            evbuffer_add_printf(evb, "\\%c", *p);
+        } else if ((unsigned char)*p < 0x20) {
+            evbuffer_add_printf(evb, "\\u%04x", *p);
+        } else {
+            evbuffer_add(evb, p, 1);
+        }
+    }
+    evbuffer_add(evb, "\"", 1);
+}
+
+static void config_add_option(const char *option_name, const char *value, int is_str, void *arg)
+{
+    struct config_list *list = (struct config_list *)arg;
+    
+    if (list->format == txt_format) {
+        evbuffer_add_printf(list->evb, "%s %s\n", option_name, value);
+    } else {
+        evbuffer_add_printf(list->evb, "%s\"%s\": ", list->count ? ", " : "", option_name);
+        if (is_str) {
+            config_add_json_str(list->evb, value);
+        } else {
+            evbuffer_add_printf(list->evb, "%s", value);
+        }
+    }
+    list->count++;
+}
+
+void simplehttp_config_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
+{
+    struct simplehttp_args *args = simplehttp_args(req);
+    struct config_list list = {evb, simplehttp_arg_format(args), 0};
+    struct simplehttp_arg *arg;
+    int i, ret;
+    
+    for (i = 0; i < args->count; i++) {
+        arg = &args->list[i];
+        if (strcmp(arg->key, "format") == 0) {
+            continue;
+        }
+        if ((ret = option_set(arg->key, arg->value)) != 1) {
+            evbuffer_add_printf(evb, ret == 0 ? "invalid value for %s\n" : "%s can not be changed at runtime\n", arg->key);
+            evhttp_send_reply(req, HTTP_BADREQUEST, "Bad Request", evb);
+            return;
+        }
+        fprintf(stdout, "/config set %s to %s\n", arg->key, arg->value);
+    }
+    
+    if (list.format == json_format) {
+        evbuffer_add(evb, "{", 1);
+    }
+    option_foreach_runtime(config_add_option, &list);
+    if (list.format == json_format) {
+        evbuffer_add(evb, "}\n", 2);
+    }
+    evhttp_send_reply(req, HTTP_OK, "OK", evb);
+}
@@ -0,0 +1,115 @@
+#include <string.h>
+#include <math.h>
+#include "histogram.h"
+
+#define HISTOGRAM_SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_HALF_COUNT (1 << (HISTOGRAM_SUB_BITS - 1))
+
+static int histogram_index(uint64_t value)
+{
+    int shift;
+    
+    if (value < HISTOGRAM_SUB_COUNT) {
+        return (int)value;
+    }
+    if (value >= (1ULL << HISTOGRAM_MAX_BITS)) {
+        value = (1ULL << HISTOGRAM_MAX_BITS) - 1;
+    }
+    
+    // position of the highest set bit, less the bits kept as the sub bucket
+    shift = (63 - __builtin_clzll(value)) - (HISTOGRAM_SUB_BITS - 1);
+    
+    return (shift * HISTOGRAM_HALF_COUNT) + (int)(value >> shift);
+}
+
+// the highest value that lands in bucket index
+static uint64_t histogram_value(int index)
+{
+    int shift;
+    uint64_t sub;
+    
+    if (index < HISTOGRAM_SUB_COUNT) {
+        return index;
+    }
+    
+    shift = (index / HISTOGRAM_HALF_COUNT) - 1;
+    sub = (index % HISTOGRAM_HALF_COUNT) + HISTOGRAM_HALF_COUNT;
+    
+    return ((sub + 1) << shift) - 1;
+}
+
+void simplehttp_histogram_reset(struct simplehttp_histogram *h)
+{
+    memset(h, 0, sizeof(*h));
+}
+
+void simplehttp_histogram_record(struct simplehttp_histogram *h, uint64_t value)
+{
+    h->buckets[histogram_index(value)]++;
+    h->count++;
+    h->sum += value;
+    if (value > h->max) {
+        h->max = value;
+    }
+}
+
+void simplehttp_histogram_merge(struct simplehttp_histogram *dst, struct simplehttp_histogram *src)
+{
+    int i;
+    
+    if (!src->count) {
+        return;
+    }
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        dst->buckets[i] += src->buckets[i];
+    }
+    dst->count += src->count;
+    dst->sum += src->sum;
+    if (src->max > dst->max) {
+        dst->max = src->max;
+    }
+}
+
+uint64_t simplehttp_histogram_percentile(struct simplehttp_histogram *h, double percent)
+{
+    uint64_t target, seen = 0, value;
+    int i;
+    
+    if (!h->count) {
+        return 0;
+    }
+    
+    target = (uint64_t)ceil((percent / 100.0) * h->count);
+    if (target < 1) {
+        target = 1;
+    }
+    
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= target) {
+            value = histogram_value(i);
+            return value < h->max ? value : h->max;
+        }
+    }
+    
+    return h->max;
+}
+
+// number of recorded values whose bucket lies entirely at or below value
+uint64_t simplehttp_histogram_count_below(struct simplehttp_histogram *h, uint64_t value)
+{
+    uint64_t seen = 0;
+    int i;
+    
+    for (i = 0; i < HISTOGRAM_BUCKETS && histogram_value(i) <= value; i++) {
+        seen += h->buckets[i];
+    }
+    
+    return seen;
+}
+
+// the top of the sub bucket value lands in, counting below it leaves nothing out
+uint64_t simplehttp_histogram_bucket_top(uint64_t value)
+{
+    return histogram_value(histogram_index(value));
+}
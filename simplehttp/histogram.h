@@ -0,0 +1,34 @@
+#ifndef _HISTOGRAM_H
+#define _HISTOGRAM_H
+
+#include <stdint.h>
+
+/*
+ * log-linear histogram of usec values. every power of two is split into
+ * 16 linear sub buckets (32 below 32usec). a recorded value is reported as the
+ * top of its sub bucket, at most 1/16th (6.25%) above it. values are capped at
+ * 2^36 usec (~19 hours).
+ *
+ * recording is O(1) and touches no shared state; histograms with the same
+ * layout merge by adding buckets.
+ */
+
+#define HISTOGRAM_SUB_BITS 5
+#define HISTOGRAM_MAX_BITS 36
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) * (1 << (HISTOGRAM_SUB_BITS - 1)) + (1 << (HISTOGRAM_SUB_BITS - 1)))
+
+struct simplehttp_histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+};
+
+void simplehttp_histogram_reset(struct simplehttp_histogram *h);
+void simplehttp_histogram_record(struct simplehttp_histogram *h, uint64_t value);
+void simplehttp_histogram_merge(struct simplehttp_histogram *dst, struct simplehttp_histogram *src);
+uint64_t simplehttp_histogram_percentile(struct simplehttp_histogram *h, double percent);
+uint64_t simplehttp_histogram_count_below(struct simplehttp_histogram *h, uint64_t value);
+uint64_t simplehttp_histogram_bucket_top(uint64_t value);
+
+#endif
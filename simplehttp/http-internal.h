@@ -1,7 +1,9 @@
 /* 
 NOTE: this is included copyied from libevent-1.4.13 with the addition
-of a definition for socklen_t so that we can give statistics on the 
-client connection outgoing buffer size
+of a definition for socklen_t. stream.c uses it to watch a connection's
+outgoing buffer, request.c for a connection's socket (to tell whether a
+parked client is still there) and to time a reply's write, worker.c to move connections between workers and batch.c to set
+up stand-in connections; keep it out of services and installed headers
 */
 
 /*
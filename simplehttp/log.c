@@ -3,8 +3,42 @@
 #include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/uio.h>
 #include "simplehttp.h"
 
+/*
+ * request log lines are appended to a ring buffer and written out by a
+ * background thread in batches, so a slow log file or pipe never blocks the
+ * event loop. lines that do not fit in the ring are dropped and counted.
+ * without simplehttp_log_init() (or with a 0 byte buffer) lines are written
+ * straight to the log fd.
+ */
+
+#define LOG_FLUSH_MSEC 100
+
+uint64_t simplehttp_log_dropped = 0;
+
+static int log_fd = STDOUT_FILENO;
+static char *log_ring = NULL;
+static size_t log_size = 0;
+static uint64_t log_head = 0;
+static uint64_t log_tail = 0;
+static int log_running = 0;
+static pthread_t log_thread;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
+
+// strftime() only runs once a second per thread
+static __thread time_t log_ts_sec = 0;
+static __thread char log_ts_buf[32];
+
+static const char *log_post_error = "<ERROR req->input_buffer=NULL>";
+
 const char *simplehttp_method(struct evhttp_request *req)
 {
     const char *method;
@@ -27,21 +61,206 @@ const char *simplehttp_method(struct evhttp_request *req)
     return method;
 }
 
-void simplehttp_log(const char *host, struct evhttp_request *req, uint64_t req_time, const char *id, int display_post)
+static const char *log_timestamp()
 {
     // NOTE: this is localtime not gmtime
     time_t now;
-    struct tm *tm_now;
-    char datetime_buf[64];
+    struct tm tm_now;
+    
+    time(&now);
+    if (now != log_ts_sec) {
+        localtime_r(&now, &tm_now);
+        strftime(log_ts_buf, sizeof(log_ts_buf), "%y%m%d %H:%M:%S", &tm_now);
+        log_ts_sec = now;
+    }
+    
+    return log_ts_buf;
+}
+
+static void log_writev(struct iovec *iov, int iovcnt)
+{
+    ssize_t n;
+    
+    while (iovcnt) {
+        n = writev(log_fd, iov, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        while (iovcnt && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+// copy a whole line into the ring or drop it
+static void log_append(struct iovec *iov, int iovcnt)
+{
+    size_t len = 0, pos, chunk;
+    int i;
+    
+    for (i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+    
+    pthread_mutex_lock(&log_lock);
+    if (len > log_size - (log_head - log_tail)) {
+        simplehttp_log_dropped++;
+        pthread_mutex_unlock(&log_lock);
+        return;
+    }
+    for (i = 0; i < iovcnt; i++) {
+        pos = log_head % log_size;
+        chunk = iov[i].iov_len;
+        if (chunk > log_size - pos) {
+            chunk = log_size - pos;
+        }
+        memcpy(log_ring + pos, iov[i].iov_base, chunk);
+        memcpy(log_ring, (char *)iov[i].iov_base + chunk, iov[i].iov_len - chunk);
+        log_head += iov[i].iov_len;
+    }
+    // wake the writer early once the ring is half full
+    if ((log_head - log_tail) > log_size / 2) {
+        pthread_cond_signal(&log_cond);
+    }
+    pthread_mutex_unlock(&log_lock);
+}
+
+static void *log_writer(void *arg)
+{
+    struct timespec deadline;
+    struct iovec iov[2];
+    uint64_t start, end;
+    size_t pos;
+    int running = 1, iovcnt;
+    
+    while (running) {
+        pthread_mutex_lock(&log_lock);
+        if (log_running && (log_head - log_tail) <= log_size / 2) {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += LOG_FLUSH_MSEC * 1000000;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&log_cond, &log_lock, &deadline);
+        }
+        running = log_running;
+        start = log_tail;
+        end = log_head;
+        pthread_mutex_unlock(&log_lock);
+        
+        if (start == end) {
+            continue;
+        }
+        
+        // everything between tail and head is written with a single writev
+        pos = start % log_size;
+        iov[0].iov_base = log_ring + pos;
+        iov[0].iov_len = end - start;
+        iovcnt = 1;
+        if (iov[0].iov_len > log_size - pos) {
+            iov[0].iov_len = log_size - pos;
+            iov[1].iov_base = log_ring;
+            iov[1].iov_len = (end - start) - iov[0].iov_len;
+            iovcnt = 2;
+        }
+        log_writev(iov, iovcnt);
+        
+        pthread_mutex_lock(&log_lock);
+        log_tail = end;
+        // more may have been appended while stopping
+        if (!running && log_head != log_tail) {
+            running = 1;
+        }
+        pthread_mutex_unlock(&log_lock);
+    }
+    
+    return NULL;
+}
+
+/*
+ * path is the log file (appended to), NULL or "-" for stdout. buffer_size is
+ * the ring size in bytes, 0 writes each line synchronously.
+ */
+int simplehttp_log_init(const char *path, size_t buffer_size)
+{
+    sigset_t all, old;
+    int fd = STDOUT_FILENO;
+    
+    if (path && strcmp(path, "-") != 0) {
+        if ((fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0644)) == -1) {
+            return 0;
+        }
+    }
+    log_fd = fd;
+    
+    if (buffer_size == 0) {
+        return 1;
+    }
+    
+    // lines written with printf before now must come first
+    fflush(stdout);
+    
+    log_ring = malloc(buffer_size);
+    log_size = buffer_size;
+    log_head = log_tail = 0;
+    log_running = 1;
+    
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    pthread_create(&log_thread, NULL, log_writer, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    
+    return 1;
+}
+
+// flushes anything still buffered
+void simplehttp_log_close()
+{
+    if (log_ring) {
+        pthread_mutex_lock(&log_lock);
+        log_running = 0;
+        pthread_cond_signal(&log_cond);
+        pthread_mutex_unlock(&log_lock);
+        pthread_join(log_thread, NULL);
+        
+        free(log_ring);
+        log_ring = NULL;
+        log_size = 0;
+    }
+    if (log_fd != STDOUT_FILENO) {
+        close(log_fd);
+        log_fd = STDOUT_FILENO;
+    }
+}
+
+void simplehttp_log(const char *host, struct evhttp_request *req, uint64_t req_time, const char *id, int display_post)
+{
+    simplehttp_log_detail(host, req, req_time, id, display_post, NULL);
+}
+
+// detail is appended after the request time
+void simplehttp_log_detail(const char *host, struct evhttp_request *req, uint64_t req_time, const char *id, int display_post, const char *detail)
+{
+    struct iovec iov[8];
+    char prefix_buf[256];
+    char suffix_buf[64];
     char code;
     const char *method;
     char *uri;
     int response_code;
     int type;
-    
-    time(&now);
-    tm_now = localtime(&now);
-    strftime(datetime_buf, 64, "%y%m%d %H:%M:%S", tm_now);
+    int iovcnt = 0;
+    int i;
     
     if (req) {
         if (req->response_code >= 500 && req->response_code < 600) {
@@ -63,16 +282,47 @@ void simplehttp_log(const char *host, struct evhttp_request *req, uint64_t req_t
         type = -1;
     }
     
-    fprintf(stdout, "[%c %s %s] %d %s %s%s", code, datetime_buf, id, response_code, method, host, uri);
+    // host, uri and post body are not copied until they go into the ring
+    iov[iovcnt].iov_base = prefix_buf;
+    iov[iovcnt++].iov_len = snprintf(prefix_buf, sizeof(prefix_buf), "[%c %s %s] %d %s ",
+                                     code, log_timestamp(), id, response_code, method);
+    if (iov[0].iov_len >= sizeof(prefix_buf)) {
+        iov[0].iov_len = sizeof(prefix_buf) - 1;
+    }
+    iov[iovcnt].iov_base = (char *)host;
+    iov[iovcnt++].iov_len = strlen(host);
+    iov[iovcnt].iov_base = uri;
+    iov[iovcnt++].iov_len = strlen(uri);
     
     if (display_post && (type == EVHTTP_REQ_POST)) {
         if (req->input_buffer == NULL || EVBUFFER_DATA(req->input_buffer) == NULL) {
-            fprintf(stdout, "<ERROR req->input_buffer=%p, EVBUFFER_DATA=%p>", req->input_buffer, /* must be */ NULL);
+            iov[iovcnt].iov_base = (char *)log_post_error;
+            iov[iovcnt++].iov_len = strlen(log_post_error);
         } else {
-            fprintf(stdout, "?");
-            fwrite(EVBUFFER_DATA(req->input_buffer), EVBUFFER_LENGTH(req->input_buffer), 1, stdout);
+            iov[iovcnt].iov_base = "?";
+            iov[iovcnt++].iov_len = 1;
+            iov[iovcnt].iov_base = EVBUFFER_DATA(req->input_buffer);
+            iov[iovcnt++].iov_len = EVBUFFER_LENGTH(req->input_buffer);
         }
     }
     
-    fprintf(stdout, " %.3fms\n", req_time / 1000.0);
+    iov[iovcnt].iov_base = suffix_buf;
+    iov[iovcnt++].iov_len = snprintf(suffix_buf, sizeof(suffix_buf), " %.3fms", req_time / 1000.0);
+    if (detail) {
+        iov[iovcnt].iov_base = (char *)detail;
+        iov[iovcnt++].iov_len = strlen(detail);
+    }
+    iov[iovcnt].iov_base = "\n";
+    iov[iovcnt++].iov_len = 1;
+    
+    if (log_ring) {
+        log_append(iov, iovcnt);
+    } else if (log_fd == STDOUT_FILENO) {
+        // keep ordering with everything else printed to stdout
+        for (i = 0; i < iovcnt; i++) {
+            fwrite(iov[i].iov_base, iov[i].iov_len, 1, stdout);
+        }
+    } else {
+        log_writev(iov, iovcnt);
+    }
 }
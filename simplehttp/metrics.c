@@ -0,0 +1,302 @@
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include "queue.h"
+#include "simplehttp.h"
+#include "stat.h"
+#include "worker.h"
+
+/*
+ * registry rendered by the built-in /metrics route in OpenMetrics text format.
+ * values are read in place at scrape time and formatted straight into the
+ * response buffer without printf or temporary allocations.
+ */
+
+enum metric_type {
+    METRIC_COUNTER = 1,
+    METRIC_GAUGE = 2,
+    METRIC_HISTOGRAM = 3,
+};
+
+struct simplehttp_metric {
+    char *name;
+    char *help;
+    int type;
+    uint64_t *value;
+    uint64_t (*cb)(void *);
+    void *ctx;
+    struct simplehttp_histogram *histogram;
+    TAILQ_ENTRY(simplehttp_metric) entries;
+};
+static TAILQ_HEAD(, simplehttp_metric) metrics = TAILQ_HEAD_INITIALIZER(metrics);
+// pools register on first use, on any worker, while another may be scraping
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// histogram bucket bounds in usec. each is exported as the top of the sub bucket
+// it falls in (100usec as le="0.000103"), a bound inside a sub bucket would
+// leave out the samples in it at or below the bound
+static const uint64_t bucket_usecs[] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+    100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000
+};
+#define METRIC_BUCKETS (sizeof(bucket_usecs) / sizeof(bucket_usecs[0]))
+
+extern int callback_count;
+
+static struct simplehttp_metric *metric_new(const char *name, const char *help, int type)
+{
+    struct simplehttp_metric *metric;
+    
+    metric = calloc(1, sizeof(*metric));
+    metric->name = strdup(name);
+    metric->help = strdup(help ? help : "");
+    metric->type = type;
+    
+    return metric;
+}
+
+// only once it is filled in, a scrape can see it from here on
+static void metric_register(struct simplehttp_metric *metric)
+{
+    pthread_mutex_lock(&metrics_lock);
+    TAILQ_INSERT_TAIL(&metrics, metric, entries);
+    pthread_mutex_unlock(&metrics_lock);
+}
+
+void simplehttp_metric_counter(const char *name, const char *help, uint64_t *value)
+{
+    struct simplehttp_metric *metric;
+    
+    metric = metric_new(name, help, METRIC_COUNTER);
+    metric->value = value;
+    metric_register(metric);
+}
+
+void simplehttp_metric_gauge(const char *name, const char *help, uint64_t *value)
+{
+    struct simplehttp_metric *metric;
+    
+    metric = metric_new(name, help, METRIC_GAUGE);
+    metric->value = value;
+    metric_register(metric);
+}
+
+void simplehttp_metric_gauge_cb(const char *name, const char *help, uint64_t (*cb)(void *), void *ctx)
+{
+    struct simplehttp_metric *metric;
+    
+    metric = metric_new(name, help, METRIC_GAUGE);
+    metric->cb = cb;
+    metric->ctx = ctx;
+    metric_register(metric);
+}
+
+struct simplehttp_histogram *simplehttp_metric_histogram(const char *name, const char *help)
+{
+    struct simplehttp_metric *metric;
+    
+    metric = metric_new(name, help, METRIC_HISTOGRAM);
+    metric->histogram = calloc(1, sizeof(struct simplehttp_histogram));
+    metric_register(metric);
+    
+    return metric->histogram;
+}
+
+void simplehttp_metrics_free()
+{
+    struct simplehttp_metric *metric;
+    
+    pthread_mutex_lock(&metrics_lock);
+    while ((metric = TAILQ_FIRST(&metrics))) {
+        TAILQ_REMOVE(&metrics, metric, entries);
+        free(metric->name);
+        free(metric->help);
+        free(metric->histogram);
+        free(metric);
+    }
+    pthread_mutex_unlock(&metrics_lock);
+}
+
+static void metric_add_str(struct evbuffer *evb, const char *str)
+{
+    evbuffer_add(evb, str, strlen(str));
+}
+
+static void metric_add_u64(struct evbuffer *evb, uint64_t value)
+{
+    char buf[24];
+    char *p = buf + sizeof(buf);
+    
+    do {
+        *--p = '0' + (value % 10);
+        value /= 10;
+    } while (value);
+    
+    evbuffer_add(evb, p, (buf + sizeof(buf)) - p);
+}
+
+// usec as decimal seconds into buf (32 bytes), trailing zeros are kept. returns the length
+static int metric_format_seconds(char *buf, uint64_t usec)
+{
+    char tmp[24];
+    char *p = tmp + sizeof(tmp);
+    uint64_t secs = usec / 1000000;
+    uint64_t frac = usec % 1000000;
+    int len, i;
+    
+    do {
+        *--p = '0' + (secs % 10);
+        secs /= 10;
+    } while (secs);
+    len = (tmp + sizeof(tmp)) - p;
+    memcpy(buf, p, len);
+    buf[len++] = '.';
+    for (i = 5; i >= 0; i--) {
+        buf[len + i] = '0' + (frac % 10);
+        frac /= 10;
+    }
+    len += 6;
+    buf[len] = '\0';
+    
+    return len;
+}
+
+static void metric_add_seconds(struct evbuffer *evb, uint64_t usec)
+{
+    char buf[32];
+    
+    evbuffer_add(evb, buf, metric_format_seconds(buf, usec));
+}
+
+static void metric_add_label_value(struct evbuffer *evb, const char *value)
+{
+    const char *p;
+    
+    for (p = value; *p; p++) {
+        switch (*p) {
+            case '\\':
+                evbuffer_add(evb, "\\\\", 2);
+                break;
+            case '"':
+                evbuffer_add(evb, "\\\"", 2);
+                break;
+            case '\n':
+                evbuffer_add(evb, "\\n", 2);
+                break;
+            default:
+                evbuffer_add(evb, p, 1);
+                break;
+        }
+    }
+}
+
+static void metric_add_header(struct evbuffer *evb, const char *name, const char *type, const char *help)
+{
+    metric_add_str(evb, "# TYPE ");
+    metric_add_str(evb, name);
+    metric_add_str(evb, " ");
+    metric_add_str(evb, type);
+    metric_add_str(evb, "\n");
+    if (help && *help) {
+        metric_add_str(evb, "# HELP ");
+        metric_add_str(evb, name);
+        metric_add_str(evb, " ");
+        metric_add_str(evb, help);
+        metric_add_str(evb, "\n");
+    }
+}
+
+static void metric_add_sample(struct evbuffer *evb, const char *name, const char *suffix,
+                              const char *route, const char *le, uint64_t value, int as_seconds)
+{
+    metric_add_str(evb, name);
+    metric_add_str(evb, suffix);
+    if (route || le) {
+        metric_add_str(evb, "{");
+        if (route) {
+            metric_add_str(evb, "route=\"");
+            metric_add_label_value(evb, route);
+            metric_add_str(evb, le ? "\"," : "\"");
+        }
+        if (le) {
+            metric_add_str(evb, "le=\"");
+            metric_add_str(evb, le);
+            metric_add_str(evb, "\"");
+        }
+        metric_add_str(evb, "}");
+    }
+    metric_add_str(evb, " ");
+    if (as_seconds) {
+        metric_add_seconds(evb, value);
+    } else {
+        metric_add_u64(evb, value);
+    }
+    metric_add_str(evb, "\n");
+}
+
+static void metric_add_histogram(struct evbuffer *evb, const char *name, const char *route,
+                                 struct simplehttp_histogram *h)
+{
+    char le[32];
+    uint64_t top;
+    int i;
+    
+    for (i = 0; i < METRIC_BUCKETS; i++) {
+        top = simplehttp_histogram_bucket_top(bucket_usecs[i]);
+        metric_format_seconds(le, top);
+        metric_add_sample(evb, name, "_bucket", route, le, simplehttp_histogram_count_below(h, top), 0);
+    }
+    metric_add_sample(evb, name, "_bucket", route, "+Inf", h->count, 0);
+    metric_add_sample(evb, name, "_count", route, NULL, h->count, 0);
+    metric_add_sample(evb, name, "_sum", route, NULL, h->sum, 1);
+}
+
+void simplehttp_metrics_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
+{
+    struct simplehttp_metric *metric;
+    struct simplehttp_histogram merged;
+    char **labels;
+    uint64_t requests = 0;
+    int i;
+    
+    pthread_mutex_lock(&metrics_lock);
+    TAILQ_FOREACH(metric, &metrics, entries) {
+        switch (metric->type) {
+            case METRIC_COUNTER:
+                metric_add_header(evb, metric->name, "counter", metric->help);
+                metric_add_sample(evb, metric->name, "_total", NULL, NULL, *metric->value, 0);
+                break;
+            case METRIC_GAUGE:
+                metric_add_header(evb, metric->name, "gauge", metric->help);
+                metric_add_sample(evb, metric->name, "", NULL, NULL,
+                                  metric->cb ? metric->cb(metric->ctx) : *metric->value, 0);
+                break;
+            case METRIC_HISTOGRAM:
+                metric_add_header(evb, metric->name, "histogram", metric->help);
+                metric_add_histogram(evb, metric->name, NULL, metric->histogram);
+                break;
+        }
+    }
+    pthread_mutex_unlock(&metrics_lock);
+    
+    for (i = 0; i < simplehttp_worker_count; i++) {
+        requests += simplehttp_workers[i].request_count;
+    }
+    metric_add_header(evb, "simplehttp_requests", "counter", "requests received");
+    metric_add_sample(evb, "simplehttp_requests", "_total", NULL, NULL, requests, 0);
+    
+    metric_add_header(evb, "simplehttp_request_duration_seconds", "histogram", "request time by route");
+    labels = simplehttp_callback_names();
+    for (i = 0; i < callback_count; i++) {
+        simplehttp_stats_totals(i, &merged);
+        metric_add_histogram(evb, "simplehttp_request_duration_seconds", labels[i], &merged);
+        free(labels[i]);
+    }
+    free(labels);
+    
+    metric_add_str(evb, "# EOF\n");
+    
+    evhttp_add_header(req->output_headers, "Content-Type", "application/openmetrics-text; version=1.0.0; charset=utf-8");
+    evhttp_send_reply(req, HTTP_OK, "OK", evb);
+}
@@ -33,15 +33,132 @@ struct Option {
     int(*cb_int)(int value);
     int(*cb_str)(char *value);
     int(*cb_char)(char value);
+    // what we last stored in *dest_str, retired if still there when it changes
+    char *dest_str_value;
+    
+    // changeable with option_set(), cb_change runs after each change
+    int runtime;
+    void(*cb_change)(const char *option_name, void *arg);
+    void *change_arg;
+    char *runtime_str;
     
     char *help;
     UT_hash_handle hh;
 };
 
+// strings replaced by option_set(), callers may still hold them until free_options()
+struct option_retired {
+    char *value;
+    struct option_retired *next;
+};
+
 struct Option *option_list = NULL;
 char *option_process_name = NULL;
+static struct option_retired *option_retired = NULL;
+// the command line before parsing rewrites it, argv[0] made absolute
+static char **option_argv = NULL;
 
 int format_option_name(char *option_name);
+
+static void option_retire(char *value)
+{
+    struct option_retired *retired;
+    
+    if (value) {
+        retired = malloc(sizeof(*retired));
+        retired->value = value;
+        retired->next = option_retired;
+        option_retired = retired;
+    }
+}
+
+static void option_store_str(struct Option *option, const char *value)
+{
+    if (*(option->dest_str) && *(option->dest_str) == option->dest_str_value) {
+        option_retire(*(option->dest_str));
+    }
+    *(option->dest_str) = value ? strdup(value) : NULL;
+    option->dest_str_value = *(option->dest_str);
+}
+
+/*
+parse value for option the same way from the command line and option_set(), run
+the option's cb and store it in dest
+
+@return 1 when value was accepted. 0 when not
+*/
+static int option_apply(struct Option *option, char *value)
+{
+    char *end;
+    long value_long;
+    
+    switch (option->option_type) {
+        case OPT_CHAR:
+            if (strlen(value) != 1) {
+                fprintf(stderr, "ERROR: argument for --%s must be a single character (got %s)\n", option->option_name, value);
+                return 0;
+            }
+            if (option->cb_char) {
+                if (!option->cb_char(value[0])) {
+                    return 0;
+                }
+            }
+            option->value_char = value[0];
+            if (option->dest_char) {
+                *(option->dest_char) = option->value_char;
+            }
+            break;
+        case OPT_STR:
+            if (option->cb_str) {
+                if (!option->cb_str(value)) {
+                    return 0;
+                }
+            }
+            option->value_str = value;
+            if (option->dest_str) {
+                option_store_str(option, value);
+            }
+            break;
+        case OPT_BOOL:
+            if (value == NULL || strcasecmp(value, "true") == 0) {
+                value_long = 1;
+            } else if (strcasecmp(value, "false") == 0) {
+                value_long = 0;
+            } else {
+                fprintf(stderr, "ERROR: unknown value for --%s (%s). should be \"true\" or \"false\"\n", option->option_name, value);
+                return 0;
+            }
+            if (option->cb_int) {
+                if (!option->cb_int(value_long)) {
+                    return 0;
+                }
+            }
+            option->value_int = value_long;
+            if (option->dest_int) {
+                *(option->dest_int) = option->value_int;
+            }
+            break;
+        case OPT_INT:
+            value_long = strtol(value, &end, 10);
+            if (end == value || *end != '\0') {
+                fprintf(stderr, "ERROR: argument for --%s must be a number (got %s)\n", option->option_name, value);
+                return 0;
+            }
+            if (option->cb_int) {
+                if (!option->cb_int(value_long)) {
+                    return 0;
+                }
+            }
+            option->value_int = value_long;
+            if (option->dest_int) {
+                *(option->dest_int) = option->value_int;
+            }
+            break;
+    }
+    
+    return 1;
+}
+
 int option_sort(struct Option *a, struct Option *b)
 {
     return strcmp(a->option_name, b->option_name);
@@ -78,6 +195,17 @@ int option_parse_command_line(int argc, char **argv)
         option_define_bool("help", OPT_OPTIONAL, 0, NULL, help_cb, "list usage");
     }
     
+    if (!option_argv) {
+        option_argv = calloc(argc + 1, sizeof(char *));
+        for (i = 0; i < argc; i++) {
+            option_argv[i] = strdup(argv[i]);
+        }
+        if (strchr(argv[0], '/') && (value = realpath(argv[0], NULL))) {
+            free(option_argv[0]);
+            option_argv[0] = value;
+        }
+    }
+    
     option_process_name = basename(argv[0]);
     for (i = 1; i < argc; i++) {
         // fprintf(stdout, "DEBUG: option %d : %s\n", i, argv[i]);
@@ -112,64 +240,8 @@ int option_parse_command_line(int argc, char **argv)
         
         // TODO: strip quotes from value
         
-        switch (option->option_type) {
-            case OPT_CHAR:
-                if (strlen(value) != 1) {
-                    fprintf(stderr, "ERROR: argument for --%s must be a single character (got %s)\n", option_name, value);
-                    return 0;
-                }
-                option->value_char = value[0];
-                if (option->cb_char) {
-                    if (!option->cb_char(option->value_char)) {
-                        return 0;
-                    }
-                }
-                if (option->dest_char) {
-                    *(option->dest_char) = option->value_char;
-                }
-                break;
-            case OPT_STR:
-                option->value_str = value;
-                if (option->cb_str) {
-                    if (!option->cb_str(value)) {
-                        return 0;
-                    }
-                }
-                if (option->dest_str) {
-                    *(option->dest_str) = strdup(value);
-                }
-                break;
-            case OPT_BOOL:
-                if (value == NULL) {
-                    option->value_int = 1;
-                } else if (strcasecmp(value, "false") == 0) {
-                    option->value_int = 0;
-                } else if (strcasecmp(value, "true") == 0) {
-                    option->value_int = 1;
-                } else {
-                    fprintf(stderr, "ERROR: unknown value for --%s (%s). should be \"true\" or \"false\"\n", option->option_name, value);
-                    return 0;
-                }
-                if (option->cb_int) {
-                    if (!option->cb_int(option->value_int)) {
-                        return 0;
-                    };
-                }
-                if (option->dest_int) {
-                    *(option->dest_int) = option->value_int;
-                }
-                break;
-            case OPT_INT:
-                option->value_int = atoi(value);
-                if (option->cb_int) {
-                    if (!option->cb_int(option->value_int)) {
-                        return 0;
-                    }
-                }
-                if (option->dest_int) {
-                    *(option->dest_int) = option->value_int;
-                }
-                break;
+        if (!option_apply(option, value)) {
+            return 0;
         }
         option->found++;
     }
@@ -186,7 +258,7 @@ int option_parse_command_line(int argc, char **argv)
                 *(option->dest_int) = option->default_int;
             } else if (option->dest_str) {
                 if (option->default_str) {
-                    *(option->dest_str) = strdup(option->default_str);
+                    option_store_str(option, option->default_str);
                 }
             } else if (option->dest_char) {
                 *(option->dest_char) = option->default_char;
@@ -265,6 +337,150 @@ char option_get_char(const char *option_name)
     return option->default_char;
 }
 
+static struct Option *option_find(const char *option_name)
+{
+    struct Option *option;
+    char *tmp_option_name = strdup(option_name);
+    if (format_option_name(tmp_option_name)) {
+        free(tmp_option_name);
+        return NULL;
+    }
+    HASH_FIND_STR(option_list, tmp_option_name, option);
+    free(tmp_option_name);
+    return option;
+}
+
+/*
+store the value of an int or bool option in dest now and whenever it changes, so
+it is looked up once instead of on every use
+
+@returns -1 if option not found or not an int or bool
+*/
+int option_bind_int(const char *option_name, int *dest)
+{
+    struct Option *option = option_find(option_name);
+    if (!option || (option->option_type != OPT_INT && option->option_type != OPT_BOOL)) {
+        return -1;
+    }
+    option->dest_int = dest;
+    *dest = option->found ? option->value_int : option->default_int;
+    return 1;
+}
+
+/*
+like option_bind_int(), dest gets a copy of the value
+
+@returns -1 if option not found or not a str
+*/
+int option_bind_str(const char *option_name, char **dest)
+{
+    struct Option *option = option_find(option_name);
+    if (!option || option->option_type != OPT_STR) {
+        return -1;
+    }
+    option->dest_str = dest;
+    option->dest_str_value = NULL;
+    option_store_str(option, option->found ? option->value_str : option->default_str);
+    return 1;
+}
+
+int option_bind_char(const char *option_name, char *dest)
+{
+    struct Option *option = option_find(option_name);
+    if (!option || option->option_type != OPT_CHAR) {
+        return -1;
+    }
+    option->dest_char = dest;
+    *dest = option->found ? option->value_char : option->default_char;
+    return 1;
+}
+
+/*
+allow option_set() to change option_name. cb (if set) runs after every change
+
+@returns -1 if option not found
+*/
+int option_set_runtime(const char *option_name, void(*cb)(const char *option_name, void *arg), void *arg)
+{
+    struct Option *option = option_find(option_name);
+    if (!option) {
+        return -1;
+    }
+    option->runtime = 1;
+    option->cb_change = cb;
+    option->change_arg = arg;
+    return 1;
+}
+
+/*
+change a runtime option, value is checked like it is on the command line
+
+@returns 1 when changed. 0 when value is invalid. -1 if option not found or
+not changeable at runtime
+*/
+int option_set(const char *option_name, const char *value)
+{
+    struct Option *option = option_find(option_name);
+    char *copy;
+    
+    if (!option || !option->runtime) {
+        return -1;
+    }
+    // value_str points at this until the next change
+    copy = strdup(value);
+    if (!option_apply(option, copy)) {
+        free(copy);
+        return 0;
+    }
+    if (option->option_type == OPT_STR) {
+        option_retire(option->runtime_str);
+        option->runtime_str = copy;
+    } else {
+        free(copy);
+    }
+    option->found++;
+    if (option->cb_change) {
+        option->cb_change(option->option_name, option->change_arg);
+    }
+    return 1;
+}
+
+/*
+cb for every runtime option in alphabetical order with its current value as a
+string, is_str says whether it is a str or char rather than a number or bool
+*/
+void option_foreach_runtime(void(*cb)(const char *option_name, const char *value, int is_str, void *arg), void *arg)
+{
+    struct Option *option, *tmp_option;
+    char buffer[32];
+    const char *value;
+    
+    HASH_SORT(option_list, option_sort);
+    HASH_ITER(hh, option_list, option, tmp_option) {
+        if (!option->runtime) {
+            continue;
+        }
+        switch (option->option_type) {
+            case OPT_STR:
+                value = option->found ? option->value_str : option->default_str;
+                cb(option->option_name, value ? value : "", 1, arg);
+                break;
+            case OPT_CHAR:
+                sprintf(buffer, "%c", option->found ? option->value_char : option->default_char);
+                cb(option->option_name, buffer, 1, arg);
+                break;
+            case OPT_BOOL:
+                value = (option->found ? option->value_int : option->default_int) ? "true" : "false";
+                cb(option->option_name, value, 0, arg);
+                break;
+            case OPT_INT:
+                sprintf(buffer, "%d", option->found ? option->value_int : option->default_int);
+                cb(option->option_name, buffer, 0, arg);
+                break;
+        }
+    }
+}
+
 struct Option *new_option(const char *option_name, int required, const char *help)
 {
     struct Option *option;
@@ -296,6 +512,11 @@ struct Option *new_option(const char *option_name, int required, const char *hel
     option->cb_char = NULL;
     option->default_char = 0;
     option->dest_char = NULL;
+    option->dest_str_value = NULL;
+    option->runtime = 0;
+    option->cb_change = NULL;
+    option->change_arg = NULL;
+    option->runtime_str = NULL;
     option->help = NULL;
     if (help) {
         option->help = strdup(help);
@@ -426,16 +647,37 @@ void option_help()
     fprintf(stdout, "\n");
 }
 
+char **option_get_argv()
+{
+    return option_argv;
+}
+
 void free_options()
 {
     struct Option *option, *tmp_option;
+    struct option_retired *retired;
+    char **arg;
+    
     HASH_ITER(hh, option_list, option, tmp_option) {
         HASH_DELETE(hh, option_list, option);
         free(option->option_name);
         free(option->help);
         free(option->default_str);
+        free(option->runtime_str);
         free(option);
     }
+    while ((retired = option_retired)) {
+        option_retired = retired->next;
+        free(retired->value);
+        free(retired);
+    }
+    if (option_argv) {
+        for (arg = option_argv; *arg; arg++) {
+            free(*arg);
+        }
+        free(option_argv);
+        option_argv = NULL;
+    }
 }
 
 int format_option_name(char *option_name)
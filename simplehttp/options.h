@@ -16,6 +16,20 @@ void option_help();
 int option_get_int(const char *option_name);
 char *option_get_str(const char *option_name);
 char option_get_char(const char *option_name);
+/* resolve an option once into dest, kept up to date when option_set() changes it. for
+    options read on every request instead of option_get_*() */
+int option_bind_int(const char *option_name, int *dest);
+int option_bind_str(const char *option_name, char **dest);
+int option_bind_char(const char *option_name, char *dest);
+/* runtime configuration. option_set() changes an option marked with option_set_runtime(),
+    validating value like the command line does, and then runs its cb. strings it replaces
+    (from option_get_str() or a bound dest) stay valid until free_options() */
+int option_set_runtime(const char *option_name, void(*cb)(const char *option_name, void *arg), void *arg);
+int option_set(const char *option_name, const char *value);
+void option_foreach_runtime(void(*cb)(const char *option_name, const char *value, int is_str, void *arg), void *arg);
+/* the command line as it was given to option_parse_command_line(), NULL terminated and with
+    an absolute argv[0] where it had a path. for re-executing the process */
+char **option_get_argv();
 
 void free_options();
 
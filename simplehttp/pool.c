@@ -0,0 +1,250 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "queue.h"
+#include "simplehttp.h"
+#include "pool.h"
+
+#define POOL_CLASSES 9
+#define POOL_ALIGN 16
+
+// slab header, objects start right after it and stay 16 byte aligned
+struct pool_slab {
+    struct pool_slab *next;
+    size_t count;
+    uint64_t data[];
+};
+
+struct simplehttp_pool {
+    char *name;
+    size_t size;
+    size_t per_slab;
+    pthread_mutex_t lock;
+    void *free_list;
+    struct pool_slab *slabs;
+    uint64_t in_use;
+    uint64_t free_count;
+    uint64_t slab_bytes;
+    uint64_t gets;
+    TAILQ_ENTRY(simplehttp_pool) entries;
+};
+
+static TAILQ_HEAD(, simplehttp_pool) pools = TAILQ_HEAD_INITIALIZER(pools);
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t classes_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct simplehttp_pool *size_classes[POOL_CLASSES];
+static uint64_t large_allocs = 0;
+static uint64_t large_bytes = 0;
+
+static void *(*pool_alloc_fn)(size_t) = malloc;
+static void (*pool_release_fn)(void *) = free;
+
+void simplehttp_pool_set_allocator(void *(*alloc)(size_t), void (*release)(void *))
+{
+    pool_alloc_fn = alloc ? alloc : malloc;
+    pool_release_fn = release ? release : free;
+}
+
+static void pool_metric(struct simplehttp_pool *pool, const char *suffix, const char *help, uint64_t *value, int counter)
+{
+    char name[128];
+    
+    snprintf(name, sizeof(name), "simplehttp_pool_%s_%s", pool->name, suffix);
+    if (counter) {
+        simplehttp_metric_counter(name, help, value);
+    } else {
+        simplehttp_metric_gauge(name, help, value);
+    }
+}
+
+struct simplehttp_pool *simplehttp_pool_new(const char *name, size_t size)
+{
+    struct simplehttp_pool *pool;
+    
+    pool = calloc(1, sizeof(*pool));
+    pool->name = strdup(name);
+    // every free object holds the free list link
+    if (size < sizeof(void *)) {
+        size = sizeof(void *);
+    }
+    pool->size = (size + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+    pool->per_slab = (SIMPLEHTTP_POOL_SLAB - sizeof(struct pool_slab)) / pool->size;
+    if (pool->per_slab < 8) {
+        pool->per_slab = 8;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    
+    pool_metric(pool, "in_use", "objects handed out", &pool->in_use, 0);
+    pool_metric(pool, "free", "objects on the free list", &pool->free_count, 0);
+    pool_metric(pool, "slab_bytes", "bytes held in slabs", &pool->slab_bytes, 0);
+    pool_metric(pool, "gets", "objects handed out since startup", &pool->gets, 1);
+    
+    pthread_mutex_lock(&pools_lock);
+    TAILQ_INSERT_TAIL(&pools, pool, entries);
+    pthread_mutex_unlock(&pools_lock);
+    
+    return pool;
+}
+
+// carve a new slab onto the free list, called with the pool locked
+static int pool_grow(struct simplehttp_pool *pool)
+{
+    struct pool_slab *slab;
+    size_t bytes = sizeof(struct pool_slab) + pool->size * pool->per_slab;
+    char *obj;
+    size_t i;
+    
+    if (!(slab = pool_alloc_fn(bytes))) {
+        return 0;
+    }
+    slab->count = pool->per_slab;
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+    pool->slab_bytes += bytes;
+    
+    // threaded back to front so objects are handed out in address order
+    obj = (char *)slab->data + pool->size * (pool->per_slab - 1);
+    for (i = 0; i < pool->per_slab; i++, obj -= pool->size) {
+        *(void **)obj = pool->free_list;
+        pool->free_list = obj;
+    }
+    pool->free_count += pool->per_slab;
+    
+    return 1;
+}
+
+void *simplehttp_pool_get(struct simplehttp_pool *pool)
+{
+    void *obj = NULL;
+    
+    pthread_mutex_lock(&pool->lock);
+    if (pool->free_list || pool_grow(pool)) {
+        obj = pool->free_list;
+        pool->free_list = *(void **)obj;
+        pool->free_count--;
+        pool->in_use++;
+        pool->gets++;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    
+    return obj;
+}
+
+void *simplehttp_pool_calloc(struct simplehttp_pool *pool)
+{
+    void *obj = simplehttp_pool_get(pool);
+    
+    if (obj) {
+        memset(obj, 0, pool->size);
+    }
+    
+    return obj;
+}
+
+void simplehttp_pool_put(struct simplehttp_pool *pool, void *ptr)
+{
+    if (!ptr) {
+        return;
+    }
+    
+    pthread_mutex_lock(&pool->lock);
+    *(void **)ptr = pool->free_list;
+    pool->free_list = ptr;
+    pool->free_count++;
+    pool->in_use--;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void pool_destroy(struct simplehttp_pool *pool)
+{
+    struct pool_slab *slab;
+    
+    TAILQ_REMOVE(&pools, pool, entries);
+    while ((slab = pool->slabs)) {
+        pool->slabs = slab->next;
+        pool_release_fn(slab);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->name);
+    free(pool);
+}
+
+static void size_classes_init()
+{
+    char name[32];
+    size_t size;
+    int i;
+    
+    // callers wait here until every class exists
+    pthread_mutex_lock(&classes_lock);
+    if (!size_classes[POOL_CLASSES - 1]) {
+        for (i = 0, size = SIMPLEHTTP_POOL_MIN_CLASS; i < POOL_CLASSES; i++, size <<= 1) {
+            snprintf(name, sizeof(name), "size_%lu", (unsigned long)size);
+            size_classes[i] = simplehttp_pool_new(name, size);
+        }
+        simplehttp_metric_counter("simplehttp_pool_large_allocs", "allocations over the largest size class", &large_allocs);
+        simplehttp_metric_gauge("simplehttp_pool_large_bytes", "bytes in allocations over the largest size class", &large_bytes);
+    }
+    pthread_mutex_unlock(&classes_lock);
+}
+
+// the smallest class holding size bytes, -1 when it is too big for any
+static int size_class(size_t size)
+{
+    int i = 0;
+    size_t class_size = SIMPLEHTTP_POOL_MIN_CLASS;
+    
+    while (class_size < size) {
+        if (++i == POOL_CLASSES) {
+            return -1;
+        }
+        class_size <<= 1;
+    }
+    
+    return i;
+}
+
+void *simplehttp_slab_alloc(size_t size)
+{
+    void *ptr;
+    int i;
+    
+    if ((i = size_class(size)) < 0) {
+        if ((ptr = pool_alloc_fn(size))) {
+            __sync_fetch_and_add(&large_allocs, 1);
+            __sync_fetch_and_add(&large_bytes, size);
+        }
+        return ptr;
+    }
+    if (!size_classes[i]) {
+        size_classes_init();
+    }
+    
+    return simplehttp_pool_get(size_classes[i]);
+}
+
+void simplehttp_slab_free(void *ptr, size_t size)
+{
+    int i;
+    
+    if (!ptr) {
+        return;
+    }
+    if ((i = size_class(size)) < 0) {
+        __sync_fetch_and_sub(&large_bytes, size);
+        pool_release_fn(ptr);
+        return;
+    }
+    simplehttp_pool_put(size_classes[i], ptr);
+}
+
+void simplehttp_pools_free()
+{
+    struct simplehttp_pool *pool;
+    
+    while ((pool = TAILQ_FIRST(&pools))) {
+        pool_destroy(pool);
+    }
+    memset(size_classes, 0, sizeof(size_classes));
+}
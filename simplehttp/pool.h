@@ -0,0 +1,40 @@
+#ifndef _SIMPLEHTTP_POOL_H
+#define _SIMPLEHTTP_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * fixed size object pools carved out of slabs. freed objects go on the pool's
+ * free list and are handed out again, slabs are kept for the life of the
+ * process and only released by simplehttp_pools_free() at exit (after
+ * simplehttp_free(), /metrics reads the pool counters in place).
+ *
+ * simplehttp_slab_alloc() / simplehttp_slab_free() serve variable sized allocations from
+ * power of two size class pools, anything over SIMPLEHTTP_POOL_MAX_CLASS goes
+ * straight to the backing allocator. the caller passes the size back on free.
+ *
+ * every pool is registered in /metrics as simplehttp_pool_<name>_*, so names
+ * should be plain [a-z0-9_]. pools are safe to use from any worker thread.
+ */
+
+#define SIMPLEHTTP_POOL_SLAB (64 * 1024)
+#define SIMPLEHTTP_POOL_MIN_CLASS 32
+#define SIMPLEHTTP_POOL_MAX_CLASS 8192
+
+struct simplehttp_pool;
+
+struct simplehttp_pool *simplehttp_pool_new(const char *name, size_t size);
+void *simplehttp_pool_get(struct simplehttp_pool *pool);
+void *simplehttp_pool_calloc(struct simplehttp_pool *pool);
+void simplehttp_pool_put(struct simplehttp_pool *pool, void *ptr);
+
+void *simplehttp_slab_alloc(size_t size);
+void simplehttp_slab_free(void *ptr, size_t size);
+
+/* memory for slabs and oversized allocations, malloc() and free() by default.
+    must be set before the first pool is used */
+void simplehttp_pool_set_allocator(void *(*alloc)(size_t), void (*release)(void *));
+void simplehttp_pools_free();
+
+#endif
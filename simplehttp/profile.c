@@ -0,0 +1,400 @@
+#define _GNU_SOURCE // for memrchr()
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <execinfo.h>
+#include <sys/time.h>
+#include "simplehttp.h"
+#include "uthash.h"
+#include "worker.h"
+#include "profile.h"
+
+/*
+ * /debug/profile?seconds=N (with --enable-profiling) samples the process for
+ * N seconds and replies with what it was doing. with mode=stacks (the
+ * default) a SIGPROF timer records a backtrace hz times per cpu second and
+ * the reply is folded stacks, one "outer;...;inner count" line per distinct
+ * stack, ready for flamegraph.pl. with mode=routes it is the thread cpu time
+ * spent in each route's callback instead (work done later by async requests
+ * is not included). functions in the binary are only named when it is linked
+ * with -rdynamic, otherwise frames show as binary+0xoffset for addr2line.
+ *
+ * when no profile is running the cost is a flag check per request. the
+ * reply is sent from a timer on the worker's own event base, the request is
+ * not made async so this works with --workers too.
+ */
+
+#define PROFILE_DEFAULT_SECONDS 10
+#define PROFILE_MAX_SECONDS 60
+#define PROFILE_DEFAULT_HZ 99
+#define PROFILE_MAX_HZ 1000
+#define PROFILE_DEPTH 48
+// the signal handler and the frame it interrupted through
+#define PROFILE_SKIP_FRAMES 2
+
+#define PROFILE_MODE_STACKS 0
+#define PROFILE_MODE_ROUTES 1
+
+struct profile_sample {
+    int depth;
+    void *pc[PROFILE_DEPTH];
+};
+
+// distinct stacks, keyed by their pcs
+struct profile_stack {
+    void **pc;
+    int depth;
+    uint64_t count;
+    UT_hash_handle hh;
+};
+
+// distinct folded lines, stacks that only differ in where a function was interrupted
+struct profile_line {
+    char *line;
+    size_t len;
+    uint64_t count;
+    UT_hash_handle hh;
+};
+
+struct profile_route {
+    const char *route;
+    uint64_t calls;
+    uint64_t usec;
+};
+
+volatile int simplehttp_profiling = 0;
+extern int callback_count;
+
+static int profile_running = 0;
+static int profile_mode;
+static int profile_seconds;
+static struct evhttp_request *profile_req = NULL;
+static struct event profile_ev;
+
+// reused by later profiles, a handler may still be writing one as a profile ends
+static struct profile_sample *samples = NULL;
+static int sample_alloc = 0;
+static int sample_max = 0;
+static volatile int sample_count = 0;
+static int signal_installed = 0;
+
+// sized to the routes there were at the first profile, kept for the life of the process
+static struct profile_route *routes = NULL;
+static int route_max = 0;
+
+uint64_t simplehttp_thread_cpu_usec()
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void simplehttp_profile_record(int index, const char *route, uint64_t usec)
+{
+    if (index < 0 || index >= route_max) {
+        return;
+    }
+    routes[index].route = route;
+    __sync_fetch_and_add(&routes[index].calls, 1);
+    __sync_fetch_and_add(&routes[index].usec, usec);
+}
+
+static void profile_signal(int sig)
+{
+    int saved_errno = errno;
+    int i;
+    
+    if (simplehttp_profiling && profile_mode == PROFILE_MODE_STACKS) {
+        i = __sync_fetch_and_add(&sample_count, 1);
+        if (i < sample_max) {
+            samples[i].depth = backtrace(samples[i].pc, PROFILE_DEPTH);
+        }
+    }
+    errno = saved_errno;
+}
+
+static int profile_timer(int hz)
+{
+    struct itimerval timer;
+    
+    memset(&timer, 0, sizeof(timer));
+    if (hz > 0) {
+        timer.it_interval.tv_usec = 1000000 / hz;
+        timer.it_value = timer.it_interval;
+    }
+    
+    return setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+static int profile_start_stacks(int hz)
+{
+    struct sigaction sa;
+    void *warm[4];
+    
+    // ITIMER_PROF counts the whole process's cpu time, each busy worker adds hz samples a second
+    sample_max = profile_seconds * hz * simplehttp_worker_count;
+    if (sample_max > sample_alloc) {
+        free(samples);
+        if (!(samples = malloc(sample_max * sizeof(struct profile_sample)))) {
+            sample_alloc = sample_max = 0;
+            return 0;
+        }
+        sample_alloc = sample_max;
+    }
+    memset(samples, 0, sample_max * sizeof(struct profile_sample));
+    sample_count = 0;
+    
+    // the first backtrace() loads libgcc, which must not happen in the handler
+    backtrace(warm, 4);
+    
+    // left installed, a SIGPROF still pending after the timer stops is ignored
+    if (!signal_installed) {
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = profile_signal;
+        sa.sa_flags = SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        if (sigaction(SIGPROF, &sa, NULL) != 0) {
+            return 0;
+        }
+        signal_installed = 1;
+    }
+    
+    return profile_timer(hz) == 0;
+}
+
+// one backtrace_symbols() line, "binary(function+0x1f) [0x...]", as function or binary+0xoffset
+static void profile_add_frame(struct evbuffer *evb, const char *symbol)
+{
+    const char *open = strchr(symbol, '('), *plus, *close;
+    const char *name;
+    
+    if (!open || !(close = strchr(open, ')'))) {
+        evbuffer_add(evb, symbol, strcspn(symbol, " "));
+        return;
+    }
+    if (open[1] != '+' && open[1] != ')') {
+        plus = memchr(open, '+', close - open);
+        evbuffer_add(evb, open + 1, (plus ? plus : close) - open - 1);
+        return;
+    }
+    name = memrchr(symbol, '/', open - symbol);
+    name = name ? name + 1 : symbol;
+    evbuffer_add(evb, name, open - name);
+    evbuffer_add(evb, open + 1, close - open - 1);
+}
+
+static int line_order(struct profile_line *a, struct profile_line *b)
+{
+    return a->count < b->count ? 1 : (a->count > b->count ? -1 : 0);
+}
+
+// "outer;...;inner" for stack on buf
+static void profile_fold_stack(struct evbuffer *buf, struct profile_stack *stack)
+{
+    void *pc[PROFILE_DEPTH];
+    char **symbols;
+    int j;
+    
+    // all but the interrupted frame are return addresses, back up into the
+    // call so they resolve to the caller
+    for (j = 0; j < stack->depth; j++) {
+        pc[j] = j ? (char *)stack->pc[j] - 1 : stack->pc[j];
+    }
+    if (!(symbols = backtrace_symbols(pc, stack->depth))) {
+        return;
+    }
+    for (j = stack->depth - 1; j >= 0; j--) {
+        profile_add_frame(buf, symbols[j]);
+        if (j) {
+            evbuffer_add(buf, ";", 1);
+        }
+    }
+    free(symbols);
+}
+
+static void profile_add_stacks(struct evbuffer *evb)
+{
+    struct profile_stack *stacks = NULL, *stack, *tmp;
+    struct profile_line *lines = NULL, *line, *tmp_line;
+    struct profile_sample *sample;
+    struct evbuffer *buf;
+    int count = sample_count < sample_max ? sample_count : sample_max;
+    int i;
+    
+    // samples are counted by their pcs first, that way each distinct stack is
+    // only symbolized once
+    for (i = 0; i < count; i++) {
+        sample = &samples[i];
+        if (sample->depth <= PROFILE_SKIP_FRAMES) {
+            continue;
+        }
+        HASH_FIND(hh, stacks, sample->pc + PROFILE_SKIP_FRAMES,
+                  (sample->depth - PROFILE_SKIP_FRAMES) * sizeof(void *), stack);
+        if (!stack) {
+            stack = malloc(sizeof(*stack));
+            stack->pc = sample->pc + PROFILE_SKIP_FRAMES;
+            stack->depth = sample->depth - PROFILE_SKIP_FRAMES;
+            stack->count = 0;
+            HASH_ADD_KEYPTR(hh, stacks, stack->pc, stack->depth * sizeof(void *), stack);
+        }
+        stack->count++;
+    }
+    
+    buf = evbuffer_new();
+    HASH_ITER(hh, stacks, stack, tmp) {
+        evbuffer_drain(buf, EVBUFFER_LENGTH(buf));
+        profile_fold_stack(buf, stack);
+        HASH_FIND(hh, lines, EVBUFFER_DATA(buf), EVBUFFER_LENGTH(buf), line);
+        if (!line) {
+            line = malloc(sizeof(*line));
+            line->len = EVBUFFER_LENGTH(buf);
+            line->line = malloc(line->len);
+            memcpy(line->line, EVBUFFER_DATA(buf), line->len);
+            line->count = 0;
+            HASH_ADD_KEYPTR(hh, lines, line->line, line->len, line);
+        }
+        line->count += stack->count;
+        HASH_DEL(stacks, stack);
+        free(stack);
+    }
+    evbuffer_free(buf);
+    
+    HASH_SORT(lines, line_order);
+    HASH_ITER(hh, lines, line, tmp_line) {
+        evbuffer_add(evb, line->line, line->len);
+        evbuffer_add_printf(evb, " %llu\n", (unsigned long long)line->count);
+        HASH_DEL(lines, line);
+        free(line->line);
+        free(line);
+    }
+    
+    if (sample_count > sample_max) {
+        fprintf(stderr, "/debug/profile dropped %d samples\n", sample_count - sample_max);
+    }
+}
+
+static void profile_add_routes(struct evbuffer *evb, int format)
+{
+    int i, first = 1;
+    
+    if (format == json_format) {
+        evbuffer_add_printf(evb, "{\"seconds\": %d, \"routes\": [", profile_seconds);
+    }
+    for (i = 0; i < route_max; i++) {
+        if (!routes[i].calls) {
+            continue;
+        }
+        if (format == json_format) {
+            evbuffer_add_printf(evb, "%s{\"route\": \"%s\", \"calls\": %llu, \"cpu_usec\": %llu}",
+                                first ? "" : ", ", routes[i].route,
+                                (unsigned long long)routes[i].calls, (unsigned long long)routes[i].usec);
+        } else {
+            evbuffer_add_printf(evb, "%s %llu calls %llu cpu usec\n", routes[i].route,
+                                (unsigned long long)routes[i].calls, (unsigned long long)routes[i].usec);
+        }
+        first = 0;
+    }
+    if (format == json_format) {
+        evbuffer_add_printf(evb, "]}\n");
+    }
+}
+
+static void profile_close_cb(struct evhttp_connection *evcon, void *arg)
+{
+    profile_req = NULL;
+}
+
+static void profile_done(int fd, short what, void *arg)
+{
+    struct evbuffer *evb;
+    int format = (int)(long)arg;
+    
+    simplehttp_profiling = 0;
+    if (profile_mode == PROFILE_MODE_STACKS) {
+        profile_timer(0);
+    }
+    
+    if (profile_req) {
+        evhttp_connection_set_closecb(profile_req->evcon, NULL, NULL);
+        evb = evbuffer_new();
+        if (profile_mode == PROFILE_MODE_STACKS) {
+            profile_add_stacks(evb);
+        } else {
+            profile_add_routes(evb, format);
+        }
+        evhttp_send_reply(profile_req, HTTP_OK, "OK", evb);
+        evbuffer_free(evb);
+        profile_req = NULL;
+    }
+    
+    __sync_lock_release(&profile_running);
+}
+
+void simplehttp_profile_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
+{
+    struct simplehttp_args *args = simplehttp_args(req);
+    struct timeval tv = {0, 0};
+    const char *mode = simplehttp_arg(args, "mode");
+    int hz = simplehttp_arg_int(args, "hz", PROFILE_DEFAULT_HZ);
+    int format = simplehttp_arg_format(args);
+    
+    if (__sync_lock_test_and_set(&profile_running, 1)) {
+        evbuffer_add_printf(evb, "a profile is already running\n");
+        evhttp_send_reply(req, HTTP_SERVUNAVAIL, "Service Unavailable", evb);
+        return;
+    }
+    
+    profile_seconds = simplehttp_arg_int(args, "seconds", PROFILE_DEFAULT_SECONDS);
+    if (profile_seconds < 1 || profile_seconds > PROFILE_MAX_SECONDS || hz < 1 || hz > PROFILE_MAX_HZ
+            || (mode && strcmp(mode, "stacks") != 0 && strcmp(mode, "routes") != 0)) {
+        __sync_lock_release(&profile_running);
+        evbuffer_add_printf(evb, "seconds must be 1-%d, hz 1-%d and mode stacks or routes\n",
+                            PROFILE_MAX_SECONDS, PROFILE_MAX_HZ);
+        evhttp_send_reply(req, HTTP_BADREQUEST, "Bad Request", evb);
+        return;
+    }
+    profile_mode = mode && strcmp(mode, "routes") == 0 ? PROFILE_MODE_ROUTES : PROFILE_MODE_STACKS;
+    
+    if (profile_mode == PROFILE_MODE_ROUTES) {
+        if (!routes) {
+            route_max = callback_count;
+            routes = calloc(route_max, sizeof(struct profile_route));
+        } else {
+            memset(routes, 0, route_max * sizeof(struct profile_route));
+        }
+    } else if (!profile_start_stacks(hz)) {
+        __sync_lock_release(&profile_running);
+        evbuffer_add_printf(evb, "could not start the profiler\n");
+        evhttp_send_reply(req, HTTP_SERVUNAVAIL, "Service Unavailable", evb);
+        return;
+    }
+    
+    profile_req = req;
+    evhttp_connection_set_closecb(req->evcon, profile_close_cb, NULL);
+    simplehttp_profiling = 1;
+    
+    tv.tv_sec = profile_seconds;
+    evtimer_set(&profile_ev, profile_done, (void *)(long)format);
+    event_base_set(simplehttp_worker_self()->base, &profile_ev);
+    evtimer_add(&profile_ev, &tv);
+}
+
+void simplehttp_profile_free()
+{
+    if (profile_running) {
+        evtimer_del(&profile_ev);
+        profile_timer(0);
+        simplehttp_profiling = 0;
+    }
+    free(samples);
+    samples = NULL;
+    sample_alloc = 0;
+    free(routes);
+    routes = NULL;
+    route_max = 0;
+}
@@ -0,0 +1,14 @@
+#ifndef _PROFILE_H
+#define _PROFILE_H
+
+#include "simplehttp.h"
+
+// set while a /debug/profile is running, checked around every dispatch
+extern volatile int simplehttp_profiling;
+
+uint64_t simplehttp_thread_cpu_usec();
+void simplehttp_profile_record(int index, const char *route, uint64_t usec);
+void simplehttp_profile_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx);
+void simplehttp_profile_free();
+
+#endif
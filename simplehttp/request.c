@@ -2,13 +2,27 @@
 #include <stdio.h>
 #include <inttypes.h>
 #include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include "queue.h"
 #include "simplehttp.h"
+#include "http-internal.h"
 #include "async_simplehttp.h"
 #include "request.h"
 #include "stat.h"
+#include "worker.h"
 
 extern int simplehttp_logging;
+extern int simplehttp_slow_request_ms;
+
+__thread struct simplehttp_request *simplehttp_reqs = NULL;
+
+uint64_t simplehttp_slow_requests = 0;
+uint64_t simplehttp_request_timeouts = 0;
+uint64_t simplehttp_requests_in_flight = 0;
 
 struct simplehttp_request *simplehttp_request_new(struct evhttp_request *req, uint64_t id)
 {
@@ -19,10 +33,23 @@ struct simplehttp_request *simplehttp_request_new(struct evhttp_request *req, ui
     s_req = malloc(sizeof(struct simplehttp_request));
     s_req->req = req;
     s_req->start_ts = start_ts;
+    s_req->dispatch_ts = start_ts;
+    s_req->handler_ts = start_ts;
+    s_req->reply_ts = start_ts;
     s_req->id = id;
     s_req->async = 0;
     s_req->index = -1;
-    TAILQ_INSERT_TAIL(&simplehttp_reqs, s_req, entries);
+    s_req->route = NULL;
+    s_req->compress = 0;
+    s_req->timeout_ms = 0;
+    s_req->timeout_armed = 0;
+    s_req->timeout_cb = NULL;
+    s_req->timeout_arg = NULL;
+    s_req->args = NULL;
+    s_req->chunks = NULL;
+    s_req->arena_used = 0;
+    HASH_ADD_PTR(simplehttp_reqs, req, s_req);
+    __sync_fetch_and_add(&simplehttp_requests_in_flight, 1);
     
     AS_DEBUG("simplehttp_request_new (%p)\n", s_req);
     
@@ -33,13 +60,9 @@ struct simplehttp_request *simplehttp_request_get(struct evhttp_request *req)
 {
     struct simplehttp_request *entry;
     
-    TAILQ_FOREACH(entry, &simplehttp_reqs, entries) {
-        if (req == entry->req) {
-            return entry;
-        }
-    }
+    HASH_FIND_PTR(simplehttp_reqs, &req, entry);
     
-    return NULL;
+    return entry;
 }
 
 uint64_t simplehttp_request_id(struct evhttp_request *req)
@@ -63,39 +86,272 @@ struct simplehttp_request *simplehttp_async_check(struct evhttp_request *req)
     return NULL;
 }
 
-void simplehttp_async_enable(struct evhttp_request *req)
+int simplehttp_async_enable(struct evhttp_request *req)
+{
+    struct simplehttp_request *entry;
+    
+    if ((entry = simplehttp_request_get(req)) == NULL) {
+        return 0;
+    }
+    AS_DEBUG("simplehttp_async_enable (%p)\n", req);
+    // async completions run on the main event base, which only worker 0 runs. that is
+    // where every exclusive callback is, only SIMPLEHTTP_CB_THREAD_SAFE ones get here
+    if (simplehttp_worker_count > 1 && simplehttp_worker_self()->id != 0) {
+        return 0;
+    }
+    entry->async = 1;
+    return 1;
+}
+
+void simplehttp_async_set_timeout_cb(struct evhttp_request *req, void (*cb)(struct evhttp_request *, void *), void *arg)
 {
     struct simplehttp_request *entry;
     
     if ((entry = simplehttp_request_get(req)) != NULL) {
-        AS_DEBUG("simplehttp_async_enable (%p)\n", req);
-        entry->async = 1;
+        entry->timeout_cb = cb;
+        entry->timeout_arg = arg;
+        // without a cb the handler would reply to req after it is gone
+        if (!cb && entry->timeout_armed) {
+            evtimer_del(&entry->timeout_ev);
+            entry->timeout_armed = 0;
+        }
+        simplehttp_request_arm_timeout(entry);
     }
 }
 
-void simplehttp_request_finish(struct evhttp_request *req, struct simplehttp_request *s_req)
+static void request_timeout_cb(int fd, short what, void *arg)
+{
+    struct simplehttp_request *s_req = (struct simplehttp_request *)arg;
+    struct evhttp_request *req = s_req->req;
+    struct evbuffer *evb;
+    
+    AS_DEBUG("request_timeout_cb (%p)\n", req);
+    
+    s_req->timeout_armed = 0;
+    __sync_fetch_and_add(&simplehttp_request_timeouts, 1);
+    
+    // the handler lets go of req here, it is gone once the 503 is written
+    s_req->timeout_cb(req, s_req->timeout_arg);
+    
+    evb = evbuffer_new();
+    evbuffer_add_printf(evb, "request timed out after %dms\n", s_req->timeout_ms);
+    evhttp_send_reply(req, HTTP_SERVUNAVAIL, "Service Unavailable", evb);
+    evbuffer_free(evb);
+    
+    simplehttp_request_finish(req, s_req);
+}
+
+/*
+ * an async request still running timeout_ms after it arrived gets a 503. only
+ * handlers that set a timeout cb can let go of req, nothing else is cut off
+ */
+void simplehttp_request_arm_timeout(struct simplehttp_request *s_req)
+{
+    struct timeval tv;
+    simplehttp_ts now_ts;
+    uint64_t elapsed, timeout;
+    
+    if (!s_req->async || !s_req->timeout_cb || s_req->timeout_ms <= 0 || s_req->timeout_armed) {
+        return;
+    }
+    
+    simplehttp_ts_get(&now_ts);
+    elapsed = simplehttp_ts_diff(s_req->start_ts, now_ts);
+    timeout = (uint64_t)s_req->timeout_ms * 1000;
+    timeout = timeout > elapsed ? timeout - elapsed : 0;
+    tv.tv_sec = timeout / 1000000;
+    tv.tv_usec = timeout % 1000000;
+    
+    evtimer_set(&s_req->timeout_ev, request_timeout_cb, s_req);
+    event_base_set(simplehttp_worker_self()->base, &s_req->timeout_ev);
+    evtimer_add(&s_req->timeout_ev, &tv);
+    s_req->timeout_armed = 1;
+}
+
+// ms since the last data arrived on req's connection, returns 0 when that is not known
+int simplehttp_request_delay_ms(struct evhttp_request *req, uint64_t *delay_ms)
+{
+#ifdef TCP_INFO
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    
+    if (req->evcon && getsockopt(req->evcon->fd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0) {
+        *delay_ms = info.tcpi_last_data_recv;
+        return 1;
+    }
+#endif
+    return 0;
+}
+
+/*
+ * libevent does not read from a connection while its request is outstanding,
+ * so a parked async request never hears that its client hung up. peek at the
+ * socket instead: end of file or a reset means there is no one to reply to.
+ * anything else, including a connection that is not a socket, counts as there.
+ */
+int simplehttp_client_gone(struct evhttp_request *req)
+{
+    char c;
+    ssize_t n;
+    
+    if (req->evcon == NULL || req->evcon->fd == -1) {
+        return 1;
+    }
+    n = recv(req->evcon->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (n == 0) {
+        return 1;
+    }
+    return n < 0 && (errno == ECONNRESET || errno == EPIPE || errno == ENOTCONN || errno == ETIMEDOUT);
+}
+
+/*
+ * the phases of a request: parse from its last bytes arriving (as far as the
+ * kernel knows, to its clock tick, else from evhttp handing it over) until
+ * its callback runs, handler the callback itself, async until the reply was
+ * sent and write until evhttp flushed it
+ */
+static void request_slow_detail(struct simplehttp_request *s_req, struct evhttp_request *req, simplehttp_ts end_ts,
+                                char *buf, size_t len)
+{
+    const char *bytes;
+    uint64_t parse, delay_ms, since_dispatch;
+    
+    parse = simplehttp_ts_diff(s_req->start_ts, s_req->dispatch_ts);
+    since_dispatch = simplehttp_ts_diff(s_req->dispatch_ts, end_ts);
+    if (simplehttp_request_delay_ms(req, &delay_ms) && delay_ms * 1000 > since_dispatch + parse) {
+        parse = delay_ms * 1000 - since_dispatch;
+    }
+    
+    bytes = evhttp_find_header(req->output_headers, "Content-Length");
+    snprintf(buf, len, " slow route=%s parse=%.3fms handler=%.3fms async=%.3fms write=%.3fms bytes=%s",
+             s_req->route ? s_req->route : "-",
+             parse / 1000.0,
+             simplehttp_ts_diff(s_req->dispatch_ts, s_req->handler_ts) / 1000.0,
+             s_req->async ? simplehttp_ts_diff(s_req->handler_ts, s_req->reply_ts) / 1000.0 : 0.0,
+             simplehttp_ts_diff(s_req->reply_ts, end_ts) / 1000.0,
+             bytes ? bytes : "-");
+}
+
+// the request log line, and the slow request one, once the reply is out
+static void request_log(struct simplehttp_request *s_req, struct evhttp_request *req, simplehttp_ts end_ts)
 {
-    simplehttp_ts end_ts;
     uint64_t req_time;
     char id_buf[64];
+    char detail_buf[256];
+    int slow;
     
-    AS_DEBUG("simplehttp_request_finish (%p, %p)\n", req, s_req);
-    
-    simplehttp_ts_get(&end_ts);
     req_time = simplehttp_ts_diff(s_req->start_ts, end_ts);
     
-    if (s_req->index != -1) {
-        simplehttp_stats_store(s_req->index, req_time);
+    // slow requests are logged with their phase times even without --enable-logging
+    slow = simplehttp_slow_request_ms > 0 && req_time >= (uint64_t)simplehttp_slow_request_ms * 1000;
+    if (slow) {
+        __sync_fetch_and_add(&simplehttp_slow_requests, 1);
     }
     
-    if (simplehttp_logging) {
+    if (simplehttp_logging || slow) {
         sprintf(id_buf, "%"PRIu64, s_req->id);
-        simplehttp_log("", req, req_time, id_buf, 1);
+        if (slow) {
+            request_slow_detail(s_req, req, end_ts, detail_buf, sizeof(detail_buf));
+        }
+        simplehttp_log_detail("", req, req_time, id_buf, 1, slow ? detail_buf : NULL);
+    }
+}
+
+static void request_free(struct simplehttp_request *s_req)
+{
+    struct simplehttp_arena_chunk *chunk;
+    
+    while ((chunk = s_req->chunks)) {
+        s_req->chunks = chunk->next;
+        free(chunk);
+    }
+    free(s_req);
+}
+
+// evhttp flushed the reply, pass on to its own cb which lets go of the request
+static void request_written_cb(struct evhttp_connection *evcon, void *arg)
+{
+    struct simplehttp_request *s_req = (struct simplehttp_request *)arg;
+    void (*cb)(struct evhttp_connection *, void *) = s_req->written_cb;
+    void *cb_arg = s_req->written_cb_arg;
+    simplehttp_ts end_ts;
+    
+    simplehttp_ts_get(&end_ts);
+    evcon->cb = cb;
+    evcon->cb_arg = cb_arg;
+    evhttp_connection_set_closecb(evcon, NULL, NULL);
+    request_log(s_req, s_req->req, end_ts);
+    request_free(s_req);
+    
+    cb(evcon, cb_arg);
+}
+
+// the connection went away with the reply still unwritten
+static void request_closed_cb(struct evhttp_connection *evcon, void *arg)
+{
+    struct simplehttp_request *s_req = (struct simplehttp_request *)arg;
+    simplehttp_ts end_ts;
+    
+    simplehttp_ts_get(&end_ts);
+    request_log(s_req, s_req->req, end_ts);
+    request_free(s_req);
+}
+
+/*
+ * 1 if the rest of s_req is left to when its reply has been written. that is
+ * only known from the connection's write cb, taken over here, or its close cb
+ * if it goes away first. a connection someone else watches is left alone.
+ */
+static int request_defer_to_write(struct simplehttp_request *s_req)
+{
+    struct evhttp_connection *evcon = s_req->req->evcon;
+    
+    if (!evcon || !evcon->cb || evcon->closecb || !EVBUFFER_LENGTH(evcon->output_buffer)) {
+        return 0;
+    }
+    s_req->written_cb = evcon->cb;
+    s_req->written_cb_arg = evcon->cb_arg;
+    evcon->cb = request_written_cb;
+    evcon->cb_arg = s_req;
+    evhttp_connection_set_closecb(evcon, request_closed_cb, s_req);
+    return 1;
+}
+
+void simplehttp_request_finish(struct evhttp_request *req, struct simplehttp_request *s_req)
+{
+    uint64_t req_time;
+    
+    AS_DEBUG("simplehttp_request_finish (%p, %p)\n", req, s_req);
+    
+    simplehttp_ts_get(&s_req->reply_ts);
+    req_time = simplehttp_ts_diff(s_req->start_ts, s_req->reply_ts);
+    
+    if (s_req->timeout_armed) {
+        evtimer_del(&s_req->timeout_ev);
+    }
+    
+    if (s_req->index != -1) {
+        simplehttp_stats_store(s_req->index, req_time);
     }
     
     AS_DEBUG("\n");
     
-    TAILQ_REMOVE(&simplehttp_reqs, s_req, entries);
+    // the handler is done with req, lookups no longer find it
+    HASH_DEL(simplehttp_reqs, s_req);
+    __sync_fetch_and_sub(&simplehttp_requests_in_flight, 1);
+    
+    if ((simplehttp_logging || simplehttp_slow_request_ms > 0) && request_defer_to_write(s_req)) {
+        return;
+    }
+    request_log(s_req, req, s_req->reply_ts);
+    request_free(s_req);
+}
+
+// drops s_req without logging or counting it, the request is served by another worker
+void simplehttp_request_release(struct simplehttp_request *s_req)
+{
+    HASH_DEL(simplehttp_reqs, s_req);
+    __sync_fetch_and_sub(&simplehttp_requests_in_flight, 1);
     free(s_req);
 }
 
@@ -111,6 +367,189 @@ void simplehttp_async_finish(struct evhttp_request *req)
 }
 
 
+// bump allocation from the request's inline block, then from malloc'd chunks
+static void *arena_alloc(struct simplehttp_request *s_req, size_t size)
+{
+    struct simplehttp_arena_chunk *chunk;
+    size_t chunk_size;
+    void *p;
+    
+    size = (size + 7) & ~(size_t)7;
+    if (sizeof(s_req->arena) - s_req->arena_used >= size) {
+        p = (char *)s_req->arena + s_req->arena_used;
+        s_req->arena_used += size;
+        return p;
+    }
+    
+    chunk = s_req->chunks;
+    if (!chunk || chunk->size - chunk->used < size) {
+        chunk_size = size > SIMPLEHTTP_ARENA_CHUNK ? size : SIMPLEHTTP_ARENA_CHUNK;
+        chunk = malloc(sizeof(struct simplehttp_arena_chunk) + chunk_size);
+        chunk->size = chunk_size;
+        chunk->used = 0;
+        chunk->next = s_req->chunks;
+        s_req->chunks = chunk;
+    }
+    p = (char *)chunk->data + chunk->used;
+    chunk->used += size;
+    
+    return p;
+}
+
+void *simplehttp_request_alloc(struct evhttp_request *req, size_t size)
+{
+    struct simplehttp_request *s_req;
+    
+    if ((s_req = simplehttp_request_get(req)) == NULL) {
+        return NULL;
+    }
+    
+    return arena_alloc(s_req, size);
+}
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+/*
+ * a value decoded in place the way libevent 1.4's evhttp_decode_uri() does it
+ * for evhttp_parse_query(): %XX always, + only once a ? went by
+ */
+static void decode_arg(char *s)
+{
+    char *out = s;
+    int hi, lo, in_query = 0;
+    
+    for (; *s; s++) {
+        if (*s == '?') {
+            in_query = 1;
+            *out++ = *s;
+        } else if (*s == '+' && in_query) {
+            *out++ = ' ';
+        } else if (*s == '%' && (hi = hex_value(s[1])) != -1 && (lo = hex_value(s[2])) != -1) {
+            *out++ = (char)((hi << 4) | lo);
+            s += 2;
+        } else {
+            *out++ = *s;
+        }
+    }
+    *out = '\0';
+}
+
+/*
+ * the query string is copied into the arena once and split there, keys and
+ * values point into that copy. as with evhttp_parse_query() only values are
+ * decoded. a key without = has an empty value.
+ */
+struct simplehttp_args *simplehttp_args(struct evhttp_request *req)
+{
+    static struct simplehttp_args no_args = {0, NULL};
+    struct simplehttp_request *s_req;
+    struct simplehttp_args *args;
+    const char *query;
+    char *buf, *p, *next, *eq;
+    size_t len;
+    int n;
+    
+    if ((s_req = simplehttp_request_get(req)) == NULL) {
+        return &no_args;
+    }
+    if (s_req->args) {
+        return s_req->args;
+    }
+    
+    args = arena_alloc(s_req, sizeof(struct simplehttp_args));
+    args->count = 0;
+    args->list = NULL;
+    s_req->args = args;
+    
+    if (!req->uri || (query = strchr(req->uri, '?')) == NULL) {
+        return args;
+    }
+    query++;
+    len = strlen(query);
+    buf = arena_alloc(s_req, len + 1);
+    memcpy(buf, query, len + 1);
+    
+    for (n = 1, p = buf; (p = strchr(p, '&')); p++) {
+        n++;
+    }
+    args->list = arena_alloc(s_req, n * sizeof(struct simplehttp_arg));
+    
+    for (p = buf; p; p = next) {
+        if ((next = strchr(p, '&'))) {
+            *next++ = '\0';
+        }
+        if (*p == '\0') {
+            continue;
+        }
+        if ((eq = strchr(p, '='))) {
+            *eq++ = '\0';
+        } else {
+            eq = p + strlen(p);
+        }
+        decode_arg(eq);
+        args->list[args->count].key = p;
+        args->list[args->count].value = eq;
+        args->count++;
+    }
+    
+    return args;
+}
+
+const char *simplehttp_arg(struct simplehttp_args *args, const char *key)
+{
+    int i;
+    
+    for (i = 0; i < args->count; i++) {
+        if (strcmp(args->list[i].key, key) == 0) {
+            return args->list[i].value;
+        }
+    }
+    
+    return NULL;
+}
+
+int simplehttp_arg_format(struct simplehttp_args *args)
+{
+    const char *format = simplehttp_arg(args, "format");
+    
+    if (format && !strncmp(format, "txt", 3)) {
+        return txt_format;
+    }
+    return json_format;
+}
+
+int simplehttp_arg_int(struct simplehttp_args *args, const char *key, int default_value)
+{
+    const char *tmp;
+    
+    if (key && (tmp = simplehttp_arg(args, key))) {
+        return atoi(tmp);
+    }
+    return default_value;
+}
+
+double simplehttp_arg_double(struct simplehttp_args *args, const char *key, double default_value)
+{
+    const char *tmp;
+    
+    if (key && (tmp = simplehttp_arg(args, key))) {
+        return atof(tmp);
+    }
+    return default_value;
+}
+
 int get_argument_format(struct evkeyvalq *args)
 {
     int format_code = json_format;
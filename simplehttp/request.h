@@ -1,19 +1,55 @@
 #ifndef _REQUEST_H
 #define _REQUEST_H
 
+#include "uthash.h"
+
+#define SIMPLEHTTP_ARENA_INLINE 1024
+#define SIMPLEHTTP_ARENA_CHUNK 4096
+
+// overflow of a request's arena once the inline block is used up
+struct simplehttp_arena_chunk {
+    struct simplehttp_arena_chunk *next;
+    size_t size;
+    size_t used;
+    uint64_t data[];
+};
+
 struct simplehttp_request {
     struct evhttp_request *req;
     simplehttp_ts start_ts;
+    simplehttp_ts dispatch_ts;
+    simplehttp_ts handler_ts;
+    simplehttp_ts reply_ts;
     uint64_t id;
     int index;
     int async;
-    TAILQ_ENTRY(simplehttp_request) entries;
+    const char *route;
+    int compress;
+    int timeout_ms;
+    int timeout_armed;
+    struct event timeout_ev;
+    void (*timeout_cb)(struct evhttp_request *, void *);
+    void *timeout_arg;
+    void (*written_cb)(struct evhttp_connection *, void *);
+    void *written_cb_arg;
+    struct simplehttp_args *args;
+    struct simplehttp_arena_chunk *chunks;
+    size_t arena_used;
+    uint64_t arena[SIMPLEHTTP_ARENA_INLINE / sizeof(uint64_t)];
+    UT_hash_handle hh;
 };
-TAILQ_HEAD(, simplehttp_request) simplehttp_reqs;
+
+// live requests hashed by their evhttp_request pointer, one table per worker thread
+extern __thread struct simplehttp_request *simplehttp_reqs;
+// across all workers, from the request arriving until it is finished
+extern uint64_t simplehttp_requests_in_flight;
 
 struct simplehttp_request *simplehttp_request_new(struct evhttp_request *req, uint64_t id);
 struct simplehttp_request *simplehttp_request_get(struct evhttp_request *req);
 struct simplehttp_request *simplehttp_async_check(struct evhttp_request *req);
-void simplehttp_request_finish(struct evhttp_request *req, struct simplehttp_request *s_req);;
+void simplehttp_request_arm_timeout(struct simplehttp_request *s_req);
+int simplehttp_request_delay_ms(struct evhttp_request *req, uint64_t *delay_ms);
+void simplehttp_request_finish(struct evhttp_request *req, struct simplehttp_request *s_req);
+void simplehttp_request_release(struct simplehttp_request *s_req);
 
 #endif
@@ -0,0 +1,228 @@
+#include <stdlib.h>
+#include <string.h>
+#include <fnmatch.h>
+#include "queue.h"
+#include "route.h"
+
+struct route_node {
+    char *label;
+    size_t len;
+    int exact_index;
+    int prefix_index;
+    struct route_node *child;
+    struct route_node *sibling;
+};
+
+struct route_glob {
+    char *pattern;
+    int index;
+    TAILQ_ENTRY(route_glob) entries;
+};
+
+struct simplehttp_route_table {
+    struct route_node *root;
+    TAILQ_HEAD(, route_glob) globs;
+};
+
+static struct route_node *route_node_new(const char *label, size_t len)
+{
+    struct route_node *node;
+    
+    node = malloc(sizeof(*node));
+    node->label = malloc(len + 1);
+    memcpy(node->label, label, len);
+    node->label[len] = '\0';
+    node->len = len;
+    node->exact_index = -1;
+    node->prefix_index = -1;
+    node->child = NULL;
+    node->sibling = NULL;
+    
+    return node;
+}
+
+static void route_node_free(struct route_node *node)
+{
+    struct route_node *child, *next;
+    
+    for (child = node->child; child; child = next) {
+        next = child->sibling;
+        route_node_free(child);
+    }
+    free(node->label);
+    free(node);
+}
+
+static struct route_node *route_node_child(struct route_node *node, char c)
+{
+    struct route_node *child;
+    
+    for (child = node->child; child; child = child->sibling) {
+        if (child->label[0] == c) {
+            return child;
+        }
+    }
+    
+    return NULL;
+}
+
+/*
+ * split node so that its label is only the first len bytes, the remainder
+ * (and everything hanging off node) moves into a new child.
+ */
+static void route_node_split(struct route_node *node, size_t len)
+{
+    struct route_node *tail;
+    
+    tail = route_node_new(node->label + len, node->len - len);
+    tail->exact_index = node->exact_index;
+    tail->prefix_index = node->prefix_index;
+    tail->child = node->child;
+    
+    node->label[len] = '\0';
+    node->len = len;
+    node->exact_index = -1;
+    node->prefix_index = -1;
+    node->child = tail;
+}
+
+/*
+ * returns the length of the literal part of pattern and sets *is_prefix when
+ * the pattern is a literal followed only by '*'. returns -1 for real globs.
+ */
+static int route_literal_len(const char *pattern, int *is_prefix)
+{
+    int len, end;
+    
+    len = strcspn(pattern, "*?[");
+    if (pattern[len] == '\0') {
+        *is_prefix = 0;
+        return len;
+    }
+    
+    for (end = len; pattern[end] == '*'; end++);
+    if (pattern[end] != '\0') {
+        return -1;
+    }
+    
+    *is_prefix = 1;
+    return len;
+}
+
+struct simplehttp_route_table *simplehttp_route_table_new()
+{
+    struct simplehttp_route_table *rt;
+    
+    rt = malloc(sizeof(*rt));
+    rt->root = route_node_new("", 0);
+    TAILQ_INIT(&rt->globs);
+    
+    return rt;
+}
+
+void simplehttp_route_table_add(struct simplehttp_route_table *rt, const char *pattern, int index)
+{
+    struct route_node *node, *child, **link;
+    struct route_glob *glob, *entry;
+    int len, is_prefix;
+    size_t i;
+    
+    len = route_literal_len(pattern, &is_prefix);
+    if (len < 0) {
+        // keep globs sorted by index so the first fnmatch() hit is the winner
+        glob = malloc(sizeof(*glob));
+        glob->pattern = strdup(pattern);
+        glob->index = index;
+        TAILQ_FOREACH(entry, &rt->globs, entries) {
+            if (entry->index > index) {
+                break;
+            }
+        }
+        if (entry) {
+            TAILQ_INSERT_BEFORE(entry, glob, entries);
+        } else {
+            TAILQ_INSERT_TAIL(&rt->globs, glob, entries);
+        }
+        return;
+    }
+    
+    node = rt->root;
+    while (len > 0) {
+        if ((child = route_node_child(node, *pattern)) == NULL) {
+            // siblings stay in registration order, earlier routes are found first
+            child = route_node_new(pattern, len);
+            for (link = &node->child; *link; link = &(*link)->sibling);
+            *link = child;
+        }
+        for (i = 0; i < child->len && i < len && child->label[i] == pattern[i]; i++);
+        if (i < child->len) {
+            route_node_split(child, i);
+        }
+        pattern += i;
+        len -= i;
+        node = child;
+    }
+    
+    // a duplicate pattern never wins over the one registered first
+    if (is_prefix) {
+        if (node->prefix_index == -1 || index < node->prefix_index) {
+            node->prefix_index = index;
+        }
+    } else {
+        if (node->exact_index == -1 || index < node->exact_index) {
+            node->exact_index = index;
+        }
+    }
+}
+
+int simplehttp_route_table_match(struct simplehttp_route_table *rt, const char *uri)
+{
+    struct route_node *node;
+    struct route_glob *glob;
+    const char *p;
+    int best = -1;
+    
+    node = rt->root;
+    p = uri;
+    while (1) {
+        if (node->prefix_index != -1 && (best == -1 || node->prefix_index < best)) {
+            best = node->prefix_index;
+        }
+        if (*p == '\0') {
+            if (node->exact_index != -1 && (best == -1 || node->exact_index < best)) {
+                best = node->exact_index;
+            }
+            break;
+        }
+        if ((node = route_node_child(node, *p)) == NULL || strncmp(p, node->label, node->len) != 0) {
+            break;
+        }
+        p += node->len;
+    }
+    
+    TAILQ_FOREACH(glob, &rt->globs, entries) {
+        if (best != -1 && glob->index > best) {
+            break;
+        }
+        if (fnmatch(glob->pattern, uri, FNM_NOESCAPE) == 0) {
+            return glob->index;
+        }
+    }
+    
+    return best;
+}
+
+void simplehttp_route_table_free(struct simplehttp_route_table *rt)
+{
+    struct route_glob *glob;
+    
+    if (rt) {
+        while ((glob = TAILQ_FIRST(&rt->globs))) {
+            TAILQ_REMOVE(&rt->globs, glob, entries);
+            free(glob->pattern);
+            free(glob);
+        }
+        route_node_free(rt->root);
+        free(rt);
+    }
+}
@@ -0,0 +1,20 @@
+#ifndef _ROUTE_H
+#define _ROUTE_H
+
+/*
+ * compiled lookup table for callback paths.
+ *
+ * exact paths ("/stats") and prefix paths ("/get*") are stored in a byte trie,
+ * anything else is a real glob and falls back to fnmatch(). a match always
+ * returns the lowest registration index that fnmatch() would have matched,
+ * so dispatch order is identical to a linear scan of the callbacks.
+ */
+
+struct simplehttp_route_table;
+
+struct simplehttp_route_table *simplehttp_route_table_new();
+void simplehttp_route_table_add(struct simplehttp_route_table *rt, const char *pattern, int index);
+int simplehttp_route_table_match(struct simplehttp_route_table *rt, const char *uri);
+void simplehttp_route_table_free(struct simplehttp_route_table *rt);
+
+#endif
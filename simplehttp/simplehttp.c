@@ -1,6 +1,8 @@
+#define _GNU_SOURCE // for pthread_rwlockattr_setkind_np()
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -11,39 +13,150 @@
 #include <errno.h>
 #include <string.h>
 #include <stdio.h>
-#include <fnmatch.h>
 #include "queue.h"
 #include "simplehttp.h"
 #include "stat.h"
 #include "request.h"
+#include "route.h"
+#include "worker.h"
+#include "compress.h"
+#include "upgrade.h"
+#include "profile.h"
+#include "admission.h"
+#include "batch.h"
 #include "options.h"
 
 typedef struct cb_entry {
     char *path;
     void (*cb)(struct evhttp_request *, struct evbuffer *, void *);
     void *ctx;
+    int flags;
+    int timeout_ms;
+    int priority;
     TAILQ_ENTRY(cb_entry) entries;
 } cb_entry;
 TAILQ_HEAD(, cb_entry) callbacks;
 
+// --listen, given once per listener
+typedef struct listen_entry {
+    char *spec;
+    char *path;
+    TAILQ_ENTRY(listen_entry) entries;
+} listen_entry;
+TAILQ_HEAD(, listen_entry) listeners = TAILQ_HEAD_INITIALIZER(listeners);
+
+// with --workers callbacks not flagged SIMPLEHTTP_CB_THREAD_SAFE run exclusively.
+// writers are preferred, see simplehttp_init()
+static pthread_rwlock_t callback_lock;
+
+// built from callbacks by simplehttp_compile_routes() in simplehttp_listen(), fixed from then on
+static struct simplehttp_route_table *routes = NULL;
+static struct cb_entry **callback_index = NULL;
+
+// the Date header is formatted at most once a second per thread
+static __thread time_t date_sec = 0;
+static __thread char date_buf[32];
+
 int simplehttp_logging = 0;
+int simplehttp_slow_request_ms = 0;
+int simplehttp_request_timeout_ms = 0;
 int callback_count = 0;
-uint64_t request_count = 0;
 struct evhttp *httpd;
 struct event pipe_ev;
 extern struct event_base *current_base;
+extern uint64_t simplehttp_log_dropped;
+extern uint64_t simplehttp_slow_requests;
+extern uint64_t simplehttp_request_timeouts;
 
 int help_cb(int *value);
+void simplehttp_metrics_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx);
+void simplehttp_config_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx);
+void simplehttp_metrics_free();
+
+static int compress_level_cb(int value)
+{
+    if (value < 0 || value > 9) {
+        fprintf(stderr, "ERROR: --compress-level must be 0-9\n");
+        return 0;
+    }
+    return 1;
+}
 
 static void ignore_cb(int sig, short what, void *arg)
 {
 }
 
+static const char *simplehttp_date()
+{
+    time_t now;
+    struct tm tm_now;
+    
+    time(&now);
+    if (now != date_sec) {
+        gmtime_r(&now, &tm_now);
+        strftime(date_buf, sizeof(date_buf), "%a, %d %b %Y %H:%M:%S GMT", &tm_now);
+        date_sec = now;
+    }
+    
+    return date_buf;
+}
+
 void termination_handler(int signum)
 {
     event_loopbreak();
 }
 
+static int listen_option_cb(char *value)
+{
+    struct listen_entry *entry;
+    
+    entry = malloc(sizeof(*entry));
+    entry->spec = strdup(value);
+    entry->path = strncmp(value, "unix:", 5) == 0 ? entry->spec + 5 : NULL;
+    TAILQ_INSERT_TAIL(&listeners, entry, entries);
+    
+    return 1;
+}
+
+/*
+ * unix:PATH, [ADDRESS]:PORT, ADDRESS:PORT or just PORT on --address. address
+ * is returned in buf, path points into spec
+ */
+static int simplehttp_parse_listen(const char *spec, const char *default_address,
+                                   char *buf, size_t len, const char **address, int *port, const char **path)
+{
+    const char *colon;
+    
+    *address = NULL;
+    *path = NULL;
+    if (strncmp(spec, "unix:", 5) == 0) {
+        *path = spec + 5;
+        return **path != '\0';
+    }
+    
+    if (!(colon = strrchr(spec, ':'))) {
+        *address = default_address;
+        colon = spec - 1;
+    } else if (spec[0] == '[') {
+        if (colon < spec + 2 || colon[-1] != ']' || colon - spec - 2 >= len) {
+            return 0;
+        }
+        memcpy(buf, spec + 1, colon - spec - 2);
+        buf[colon - spec - 2] = '\0';
+        *address = buf;
+    } else {
+        if (colon == spec || colon - spec >= len || memchr(spec, ':', colon - spec)) {
+            return 0;
+        }
+        memcpy(buf, spec, colon - spec);
+        buf[colon - spec] = '\0';
+        *address = buf;
+    }
+    *port = atoi(colon + 1);
+    
+    return *port > 0 && *port < 65536;
+}
+
 int get_uid(char *user)
 {
     int retcode;
@@ -113,47 +226,317 @@ char **simplehttp_callback_names()
     return callback_names;
 }
 
-void generic_request_handler(struct evhttp_request *req, void *arg)
+static void simplehttp_free_routes()
+{
+    simplehttp_route_table_free(routes);
+    free(callback_index);
+    routes = NULL;
+    callback_index = NULL;
+}
+
+static void simplehttp_compile_routes()
 {
-    int found_cb = 0, i = 0;
     struct cb_entry *entry;
+    int i = 0;
+    
+    simplehttp_free_routes();
+    routes = simplehttp_route_table_new();
+    callback_index = malloc(callback_count * sizeof(*callback_index));
+    TAILQ_FOREACH(entry, &callbacks, entries) {
+        simplehttp_route_table_add(routes, entry->path, i);
+        callback_index[i++] = entry;
+    }
+}
+
+static void simplehttp_dispatch(struct simplehttp_worker *worker, struct cb_entry *entry,
+                                struct evhttp_request *req, struct evbuffer *evb)
+{
+    // /batch takes the lock for each of its sub-requests instead
+    if (simplehttp_worker_count == 1 || entry->cb == simplehttp_batch_cb) {
+        (*entry->cb)(req, evb, entry->ctx);
+    } else if (entry->flags & SIMPLEHTTP_CB_THREAD_SAFE) {
+        pthread_rwlock_rdlock(&callback_lock);
+        (*entry->cb)(req, evb, entry->ctx);
+        pthread_rwlock_unlock(&callback_lock);
+    } else {
+        // in worker 0, the lock keeps out thread safe callbacks running in the others
+        pthread_rwlock_wrlock(&callback_lock);
+        (*entry->cb)(req, evb, entry->ctx);
+        pthread_rwlock_unlock(&callback_lock);
+    }
+}
+
+// runs route i for req, returns req's simplehttp_request unless the callback already finished it
+static struct simplehttp_request *simplehttp_run_route(struct simplehttp_worker *worker, struct simplehttp_request *s_req,
+        int i, struct evhttp_request *req, struct evbuffer *evb)
+{
+    struct cb_entry *entry = callback_index[i];
+    uint64_t cpu;
+    int profiled;
+    
+    s_req->index = i;
+    s_req->route = entry->path;
+    s_req->timeout_ms = entry->timeout_ms ? entry->timeout_ms : simplehttp_request_timeout_ms;
+    if (entry->flags & SIMPLEHTTP_CB_COMPRESS) {
+        s_req->compress = simplehttp_compress_negotiate(req);
+        // compressed or not, so a cache never hands a plain reply to a gzip client or the other way round
+        evhttp_add_header(req->output_headers, "Vary", "Accept-Encoding");
+    }
+    simplehttp_ts_get(&s_req->dispatch_ts);
+    profiled = simplehttp_profiling;
+    cpu = profiled ? simplehttp_thread_cpu_usec() : 0;
+    simplehttp_dispatch(worker, entry, req, evb);
+    if (profiled) {
+        simplehttp_profile_record(i, entry->path, simplehttp_thread_cpu_usec() - cpu);
+    }
+    // the callback may already have finished (and freed) the request
+    if ((s_req = simplehttp_request_get(req))) {
+        simplehttp_ts_get(&s_req->handler_ts);
+        simplehttp_request_arm_timeout(s_req);
+    }
+    
+    return s_req;
+}
+
+// one reply buffer per worker, reused across requests. evhttp_send_reply()
+// moves the data out of it so nothing is left behind between requests
+static struct evbuffer *simplehttp_reply_evb(struct simplehttp_worker *worker)
+{
+    if (!worker->reply_evb) {
+        worker->reply_evb = evbuffer_new();
+    }
+    return worker->reply_evb;
+}
+
+static void simplehttp_request_done(struct simplehttp_worker *worker, struct simplehttp_request *s_req,
+                                    struct evhttp_request *req, struct evbuffer *evb, simplehttp_ts start_ts)
+{
+    simplehttp_ts end_ts;
+    
+    if (s_req && !s_req->async) {
+        simplehttp_request_finish(req, s_req);
+    }
+    
+    if (EVBUFFER_LENGTH(evb)) {
+        evbuffer_drain(evb, EVBUFFER_LENGTH(evb));
+    }
+    
+    // for the event loop utilization in simplehttp_stats_get()
+    simplehttp_ts_get(&end_ts);
+    worker->loop_busy_usec += simplehttp_ts_diff(start_ts, end_ts);
+}
+
+// an exclusive route's request another worker read, in worker 0
+static void simplehttp_handoff_cb(struct simplehttp_handoff *handoff)
+{
+    struct simplehttp_worker *worker = simplehttp_worker_self();
+    struct evhttp_request *req = handoff->req;
     struct simplehttp_request *s_req;
-    struct evbuffer *evb = evbuffer_new();
+    struct evbuffer *evb = simplehttp_reply_evb(worker);
+    simplehttp_ts start_ts;
+    
+    simplehttp_ts_get(&start_ts);
+    s_req = simplehttp_request_new(req, handoff->id);
+    s_req->start_ts = handoff->start_ts;
+    s_req = simplehttp_run_route(worker, s_req, handoff->route, req, evb);
+    simplehttp_request_done(worker, s_req, req, evb, start_ts);
+}
+
+void generic_request_handler(struct evhttp_request *req, void *arg)
+{
+    int i;
+    struct simplehttp_request *s_req;
+    struct simplehttp_worker *worker = simplehttp_worker_self();
+    struct evbuffer *evb;
+    simplehttp_ts start_ts;
+    uint64_t id;
     
     // fprintf(stderr, "request for %s from %s\n", req->uri, req->remote_host);
     
-    request_count++;
+    // ids are interleaved across workers so they stay unique per process
+    id = (worker->request_count++ * simplehttp_worker_count) + worker->id + 1;
     
-    s_req = simplehttp_request_new(req, request_count);
+    s_req = simplehttp_request_new(req, id);
+    start_ts = s_req->start_ts;
     
-    TAILQ_FOREACH(entry, &callbacks, entries) {
-        if (fnmatch(entry->path, req->uri, FNM_NOESCAPE) == 0) {
-            s_req->index = i;
-            (*entry->cb)(req, evb, entry->ctx);
-            found_cb = 1;
-            break;
-        }
-        i++;
+    evb = simplehttp_reply_evb(worker);
+    
+    // saves evhttp a gmtime()/strftime() per reply
+    evhttp_add_header(req->output_headers, "Date", simplehttp_date());
+    // the new process is accepting, send keep-alive clients there
+    if (simplehttp_draining) {
+        evhttp_add_header(req->output_headers, "Connection", "close");
     }
     
-    if (!found_cb) {
+    i = simplehttp_route_table_match(routes, req->uri);
+    if (i != -1 && !simplehttp_admit(req, callback_index[i]->priority, start_ts)) {
+        // queued too long already, a fast 503 beats a late reply
+        simplehttp_admission_reject(req, evb);
+    } else if (i != -1 && worker->id != 0 && !(callback_index[i]->flags & SIMPLEHTTP_CB_THREAD_SAFE)) {
+        // exclusive callbacks run in worker 0, see simplehttp_worker_handoff()
+        simplehttp_request_release(s_req);
+        s_req = NULL;
+        simplehttp_worker_handoff(worker, req, i, id, start_ts);
+    } else if (i != -1) {
+        s_req = simplehttp_run_route(worker, s_req, i, req, evb);
+    } else {
+        evhttp_send_reply(req, HTTP_NOTFOUND, "", evb);
+    }
+    
+    simplehttp_request_done(worker, s_req, req, evb, start_ts);
+}
+
+/*
+ * a /batch sub-request, routed and finished like one off the wire with its
+ * own id and stats. it is admitted at its own route's priority, on how long
+ * ago the /batch request arrived on batch_req's connection. /batch itself is
+ * not allowed as a sub-request.
+ */
+void simplehttp_dispatch_sub_request(struct evhttp_request *batch_req, struct evhttp_request *req, struct evbuffer *evb)
+{
+    int i;
+    struct simplehttp_request *s_req;
+    struct simplehttp_worker *worker = simplehttp_worker_self();
+    uint64_t id;
+    
+    id = (worker->request_count++ * simplehttp_worker_count) + worker->id + 1;
+    s_req = simplehttp_request_new(req, id);
+    
+    i = simplehttp_route_table_match(routes, req->uri);
+    if (i != -1 && callback_index[i]->cb == simplehttp_batch_cb) {
+        evbuffer_add_printf(evb, "/batch can not be nested\n");
+        evhttp_send_reply(req, HTTP_BADREQUEST, "Bad Request", evb);
+    } else if (i != -1 && !simplehttp_admit(batch_req, callback_index[i]->priority, s_req->start_ts)) {
+        simplehttp_admission_reject(req, evb);
+    } else if (i != -1) {
+        s_req = simplehttp_run_route(worker, s_req, i, req, evb);
+    } else {
         evhttp_send_reply(req, HTTP_NOTFOUND, "", evb);
     }
     
-    if (simplehttp_async_check(req) == NULL) {
+    if (s_req && !s_req->async) {
         simplehttp_request_finish(req, s_req);
     }
+}
+
+// the encoding for a len byte reply to req, if it is to be compressed at all
+static int simplehttp_reply_encoding(struct evhttp_request *req, size_t len)
+{
+    struct simplehttp_request *s_req;
     
-    evbuffer_free(evb);
+    if (len < (size_t)simplehttp_compress_min_bytes || !(s_req = simplehttp_request_get(req)) || !s_req->compress) {
+        return SIMPLEHTTP_ENCODING_NONE;
+    }
+    // the handler already encoded the body itself
+    if (evhttp_find_header(req->output_headers, "Content-Encoding") || EVBUFFER_LENGTH(req->output_buffer)) {
+        return SIMPLEHTTP_ENCODING_NONE;
+    }
+    
+    return s_req->compress;
+}
+
+// compress data into the request's output buffer and send it, 0 if it went out as is
+static int simplehttp_reply_compressed(struct evhttp_request *req, int code, const char *reason,
+                                       const void *data, size_t len, int encoding)
+{
+    struct simplehttp_deflate *d;
+    int ok;
+    
+    if (!(d = simplehttp_deflate_get(encoding))) {
+        return 0;
+    }
+    ok = simplehttp_deflate_add(d, data, len, req->output_buffer, Z_FINISH);
+    simplehttp_deflate_put(d);
+    if (!ok) {
+        evbuffer_drain(req->output_buffer, EVBUFFER_LENGTH(req->output_buffer));
+        return 0;
+    }
+    
+    simplehttp_compress_headers(req, encoding);
+    __sync_fetch_and_add(&simplehttp_compress_replies, 1);
+    evhttp_send_reply(req, code, reason, NULL);
+    
+    return 1;
+}
+
+/*
+ * evhttp_send_reply() that compresses the body on SIMPLEHTTP_CB_COMPRESS routes
+ * when the client accepts it and it is at least --compress-min-bytes long
+ */
+void simplehttp_send_reply(struct evhttp_request *req, int code, const char *reason, struct evbuffer *evb)
+{
+    int encoding;
+    
+    if (evb && (encoding = simplehttp_reply_encoding(req, EVBUFFER_LENGTH(evb)))) {
+        if (simplehttp_reply_compressed(req, code, reason, EVBUFFER_DATA(evb), EVBUFFER_LENGTH(evb), encoding)) {
+            evbuffer_drain(evb, EVBUFFER_LENGTH(evb));
+            return;
+        }
+    }
+    evhttp_send_reply(req, code, reason, evb);
+}
+
+/*
+ * send a reply of len bytes without formatting. the body goes straight into
+ * the request's output buffer instead of through the callback's evbuffer.
+ */
+void simplehttp_reply_bytes(struct evhttp_request *req, int code, const char *reason, const void *data, size_t len)
+{
+    int encoding;
+    
+    if ((encoding = simplehttp_reply_encoding(req, len))) {
+        if (simplehttp_reply_compressed(req, code, reason, data, len, encoding)) {
+            return;
+        }
+    }
+    if (len) {
+        evbuffer_add(req->output_buffer, data, len);
+    }
+    evhttp_send_reply(req, code, reason, NULL);
+}
+
+static void simplehttp_free_listeners()
+{
+    struct listen_entry *entry;
+    
+    while ((entry = TAILQ_FIRST(&listeners))) {
+        TAILQ_REMOVE(&listeners, entry, entries);
+        // a process we handed the socket to is still listening on it
+        if (entry->path && !simplehttp_draining) {
+            unlink(entry->path);
+        }
+        free(entry->spec);
+        free(entry);
+    }
+}
+
+void simplehttp_run_exclusive(void (*cb)(void *), void *arg)
+{
+    if (simplehttp_worker_count == 1) {
+        (*cb)(arg);
+    } else {
+        pthread_rwlock_wrlock(&callback_lock);
+        (*cb)(arg);
+        pthread_rwlock_unlock(&callback_lock);
+    }
 }
 
 void simplehttp_init()
 {
+    pthread_rwlockattr_t attr;
+    
     if (!current_base) {
         event_init();
     }
     TAILQ_INIT(&callbacks);
-    TAILQ_INIT(&simplehttp_reqs);
+    
+    // glibc's default lets steady thread safe traffic keep worker 0's exclusive callbacks waiting forever
+    pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+    pthread_rwlock_init(&callback_lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
 }
 
 void simplehttp_free()
@@ -165,18 +548,36 @@ void simplehttp_free()
         free(entry->path);
         free(entry);
     }
-    evhttp_free(httpd);
+    simplehttp_free_routes();
+    pthread_rwlock_destroy(&callback_lock);
+    simplehttp_metrics_free();
     simplehttp_stats_destruct();
+    simplehttp_workers_free();
+    simplehttp_log_close();
+    simplehttp_compress_free();
+    simplehttp_upgrade_free();
+    simplehttp_profile_free();
+    simplehttp_batch_free();
+    simplehttp_free_listeners();
 }
 
 void simplehttp_set_cb(const char *path, void (*cb)(struct evhttp_request *, struct evbuffer *, void *), void *ctx)
 {
     struct cb_entry *cbPtr;
     
+    // workers may be reading the route table
+    if (routes) {
+        fprintf(stderr, "ERROR: callback for path \"%s\" registered after simplehttp_listen()\n", path);
+        return;
+    }
+    
     cbPtr = (cb_entry *)malloc(sizeof(*cbPtr));
     cbPtr->path = strdup(path);
     cbPtr->cb = cb;
     cbPtr->ctx = ctx;
+    cbPtr->flags = 0;
+    cbPtr->timeout_ms = 0;
+    cbPtr->priority = SIMPLEHTTP_PRIORITY_NORMAL;
     TAILQ_INSERT_TAIL(&callbacks, cbPtr, entries);
     
     callback_count++;
@@ -184,32 +585,144 @@ void simplehttp_set_cb(const char *path, void (*cb)(struct evhttp_request *, str
     printf("registering callback for path \"%s\"\n", path);
 }
 
+void simplehttp_set_cb_flags(const char *path, int flags)
+{
+    struct cb_entry *entry;
+    
+    TAILQ_FOREACH(entry, &callbacks, entries) {
+        if (strcmp(entry->path, path) == 0) {
+            entry->flags |= flags;
+        }
+    }
+}
+
+void simplehttp_set_cb_timeout(const char *path, int timeout_ms)
+{
+    struct cb_entry *entry;
+    
+    TAILQ_FOREACH(entry, &callbacks, entries) {
+        if (strcmp(entry->path, path) == 0) {
+            entry->timeout_ms = timeout_ms;
+        }
+    }
+}
+
+void simplehttp_set_cb_priority(const char *path, int priority)
+{
+    struct cb_entry *entry;
+    
+    TAILQ_FOREACH(entry, &callbacks, entries) {
+        if (strcmp(entry->path, path) == 0) {
+            entry->priority = priority;
+        }
+    }
+}
+
 void define_simplehttp_options()
 {
     option_define_str("address", OPT_OPTIONAL, "0.0.0.0", NULL, NULL, "address to listen on");
     option_define_int("port", OPT_OPTIONAL, 8080, NULL, NULL, "port to listen on");
+    option_define_str("listen", OPT_OPTIONAL, NULL, NULL, listen_option_cb, "listen on unix:PATH, [ADDRESS]:PORT or ADDRESS:PORT instead of --address/--port (repeatable)");
     option_define_bool("enable_logging", OPT_OPTIONAL, 0, NULL, NULL, "request logging");
+    option_define_str("log_file", OPT_OPTIONAL, NULL, NULL, NULL, "append request logs to this file instead of stdout");
+    option_define_int("log_buffer_size", OPT_OPTIONAL, 1048576, NULL, NULL, "bytes of request log buffered for the log writer thread (0 to write synchronously)");
     option_define_bool("daemon", OPT_OPTIONAL, 0, NULL, NULL, "daemonize process");
     option_define_str("root", OPT_OPTIONAL, NULL, NULL, NULL, "chdir and run from this directory");
     option_define_str("user", OPT_OPTIONAL, NULL, NULL, NULL, "run as this user");
     option_define_str("group", OPT_OPTIONAL, NULL, NULL, NULL, "run as this group");
+    option_define_int("stats_window", OPT_OPTIONAL, 60, NULL, NULL, "seconds of request times reported by /stats");
+    option_define_int("slow_request_ms", OPT_OPTIONAL, 0, NULL, NULL, "log route, phase times and size of requests slower than this (0 to disable)");
+    option_define_int("request_timeout_ms", OPT_OPTIONAL, 0, NULL, NULL, "answer async requests still unfinished after this with a 503, on routes without their own timeout whose handler can be cut off (0 to disable)");
+    option_define_int("workers", OPT_OPTIONAL, 1, NULL, NULL, "number of event loop threads (uses SO_REUSEPORT)");
+    option_define_int("compress_level", OPT_OPTIONAL, 6, NULL, compress_level_cb, "gzip/deflate level for replies on routes that allow compression (0 to disable)");
+    option_define_int("compress_min_bytes", OPT_OPTIONAL, 1024, NULL, NULL, "smallest reply body worth compressing");
+    option_define_str("upgrade_socket", OPT_OPTIONAL, NULL, NULL, NULL, "unix socket to take listening sockets over from a running process, and hand them on (SIGUSR2 restarts)");
+    option_define_int("drain_timeout_ms", OPT_OPTIONAL, 30000, NULL, NULL, "after handing over, how long to wait for in-flight requests before exiting");
+    option_define_int("admission_target_ms", OPT_OPTIONAL, 0, NULL, NULL, "shed requests with a 503 once they have been queueing longer than this for --admission-interval-ms (0 to disable)");
+    option_define_int("admission_interval_ms", OPT_OPTIONAL, 100, NULL, NULL, "how long queueing delay has to stay above --admission-target-ms before shedding");
+    option_define_int("batch_max_requests", OPT_OPTIONAL, 100, NULL, NULL, "most sub-requests one /batch request may carry");
+    option_define_bool("enable_profiling", OPT_OPTIONAL, 0, NULL, NULL, "serve cpu profiles of the running process on /debug/profile");
+    option_define_bool("enable_config", OPT_OPTIONAL, 0, NULL, NULL, "list and change runtime options on /config (unauthenticated)");
+}
+
+/*
+ * a socket per worker for address:port (with SO_REUSEPORT), or one unix
+ * socket at path shared by all workers, added to fds
+ */
+static int simplehttp_bind_listener(const char *address, int port, const char *path, int *fds, int *fd_count)
+{
+    int i;
+    
+    if (*fd_count + simplehttp_worker_count > SIMPLEHTTP_UPGRADE_MAX_FDS) {
+        return 0;
+    }
+    if (path) {
+        if ((fds[*fd_count] = simplehttp_bind_unix(path)) == -1) {
+            return 0;
+        }
+        (*fd_count)++;
+        // every worker accepts on its own dup()
+        for (i = 1; i < simplehttp_worker_count; i++) {
+            if ((fds[*fd_count] = dup(fds[*fd_count - 1])) == -1) {
+                return 0;
+            }
+            (*fd_count)++;
+        }
+        return 1;
+    }
+    for (i = 0; i < simplehttp_worker_count; i++) {
+        if ((fds[*fd_count] = simplehttp_bind_socket(address, port, simplehttp_worker_count > 1)) == -1) {
+            return 0;
+        }
+        (*fd_count)++;
+    }
+    
+    return 1;
 }
 
 int simplehttp_listen()
 {
+    struct cb_entry *entry;
     uid_t uid = 0;
     gid_t gid = 0;
     pid_t pid, sid;
     int errno;
+    int fds[SIMPLEHTTP_UPGRADE_MAX_FDS];
+    int fd_count = 0;
+    struct listen_entry *listener;
+    char address_buf[256];
+    const char *listen_address, *listen_path;
+    int listen_port = 0;
     
     char *address = option_get_str("address");
     int port = option_get_int("port");
+    int workers = option_get_int("workers");
+    int stats_window = option_get_int("stats_window");
     
     int daemon = option_get_int("daemon");
     char *root = option_get_str("root");
     char *user = option_get_str("user");
     char *group = option_get_str("group");
     simplehttp_logging = option_get_int("enable_logging");
+    // read on every request, and changeable through /config
+    option_bind_int("slow_request_ms", &simplehttp_slow_request_ms);
+    option_bind_int("request_timeout_ms", &simplehttp_request_timeout_ms);
+    option_bind_int("compress_level", &simplehttp_compress_level);
+    option_bind_int("compress_min_bytes", &simplehttp_compress_min_bytes);
+    option_set_runtime("slow_request_ms", NULL, NULL);
+    option_set_runtime("request_timeout_ms", NULL, NULL);
+    option_set_runtime("compress_level", NULL, NULL);
+    option_set_runtime("compress_min_bytes", NULL, NULL);
+    option_bind_int("admission_target_ms", &simplehttp_admission_target_ms);
+    option_bind_int("admission_interval_ms", &simplehttp_admission_interval_ms);
+    option_set_runtime("admission_target_ms", NULL, NULL);
+    option_set_runtime("admission_interval_ms", NULL, NULL);
+    option_bind_int("batch_max_requests", &simplehttp_batch_max_requests);
+    option_set_runtime("batch_max_requests", NULL, NULL);
+    char *log_file = option_get_str("log_file");
+    int log_buffer_size = option_get_int("log_buffer_size");
+    char *upgrade_socket = option_get_str("upgrade_socket");
+    int drain_timeout_ms = option_get_int("drain_timeout_ms");
     
     if (daemon) {
         pid = fork();
@@ -247,6 +760,14 @@ int simplehttp_listen()
         }
     }
     
+    // after forking, the writer thread would not survive it
+    if (simplehttp_logging) {
+        if (!simplehttp_log_init(log_file, log_buffer_size > 0 ? log_buffer_size : 0)) {
+            err(1, "could not open log file %s", log_file);
+        }
+        simplehttp_metric_counter("simplehttp_log_dropped", "request log lines dropped with a full log buffer", &simplehttp_log_dropped);
+    }
+    
     if (root != NULL) {
         if (chroot(root) != 0) {
             err(1, strerror(errno));
@@ -281,23 +802,109 @@ int simplehttp_listen()
     signal_set(&pipe_ev, SIGPIPE, ignore_cb, NULL);
     signal_add(&pipe_ev, NULL);
     
-    simplehttp_stats_init();
+    simplehttp_metric_counter("simplehttp_slow_requests", "requests slower than --slow-request-ms", &simplehttp_slow_requests);
+    simplehttp_metric_counter("simplehttp_request_timeouts", "async requests answered with a 503 at their route's deadline", &simplehttp_request_timeouts);
+    simplehttp_metric_counter("simplehttp_compress_replies", "replies sent gzip or deflate encoded", &simplehttp_compress_replies);
+    simplehttp_metric_counter("simplehttp_compress_bytes_in", "reply bytes before compression", &simplehttp_compress_bytes_in);
+    simplehttp_metric_counter("simplehttp_compress_bytes_out", "reply bytes after compression", &simplehttp_compress_bytes_out);
+    simplehttp_metric_counter("simplehttp_compress_usec", "thread cpu time spent compressing replies", &simplehttp_compress_usec);
+    simplehttp_metric_counter("simplehttp_requests_shed", "requests answered with a 503 by --admission-target-ms", &simplehttp_requests_shed);
+    simplehttp_metric_gauge("simplehttp_requests_in_flight", "requests received and not yet finished", &simplehttp_requests_in_flight);
+    
+    if (option_get_int("enable_profiling")) {
+        simplehttp_set_cb("/debug/profile*", simplehttp_profile_cb, NULL);
+        simplehttp_set_cb_flags("/debug/profile*", SIMPLEHTTP_CB_THREAD_SAFE);
+        simplehttp_set_cb_priority("/debug/profile*", SIMPLEHTTP_PRIORITY_HIGH);
+    }
+    
+    // services can serve their own /metrics, /config and /batch, otherwise register the built-in ones.
+    // /config changes how the service runs, so it is only there when asked for
+    TAILQ_FOREACH(entry, &callbacks, entries) {
+        if (strncmp(entry->path, "/metrics", 8) == 0) {
+            break;
+        }
+    }
+    if (!entry) {
+        simplehttp_set_cb("/metrics*", simplehttp_metrics_cb, NULL);
+        simplehttp_set_cb_flags("/metrics*", SIMPLEHTTP_CB_THREAD_SAFE);
+        simplehttp_set_cb_priority("/metrics*", SIMPLEHTTP_PRIORITY_HIGH);
+    }
+    TAILQ_FOREACH(entry, &callbacks, entries) {
+        if (strncmp(entry->path, "/config", 7) == 0) {
+            break;
+        }
+    }
+    if (!entry && option_get_int("enable_config")) {
+        simplehttp_set_cb("/config*", simplehttp_config_cb, NULL);
+        simplehttp_set_cb_priority("/config*", SIMPLEHTTP_PRIORITY_HIGH);
+    }
+    TAILQ_FOREACH(entry, &callbacks, entries) {
+        if (strncmp(entry->path, "/batch", 6) == 0) {
+            break;
+        }
+    }
+    if (!entry) {
+        simplehttp_set_cb("/batch*", simplehttp_batch_cb, NULL);
+        simplehttp_set_cb_flags("/batch*", SIMPLEHTTP_CB_COMPRESS);
+        // each of its sub-requests is admitted at its own priority instead
+        simplehttp_set_cb_priority("/batch*", SIMPLEHTTP_PRIORITY_HIGH);
+    }
+    
+    simplehttp_workers_init(workers, current_base);
+    simplehttp_stats_init(stats_window);
+    simplehttp_compile_routes();
     
-    httpd = evhttp_start(address, port);
-    if (!httpd) {
-        printf("could not bind to %s:%d\n", address, port);
+    // a running process on --upgrade-socket hands us its sockets, otherwise bind our own
+    if (upgrade_socket) {
+        fd_count = simplehttp_upgrade_receive(upgrade_socket, fds, SIMPLEHTTP_UPGRADE_MAX_FDS);
+    }
+    if (fd_count > 0) {
+        printf("took over %d listening sockets from %s\n", fd_count, upgrade_socket);
+    } else if (TAILQ_EMPTY(&listeners)) {
+        fd_count = 0;
+        if (!simplehttp_bind_listener(address, port, NULL, fds, &fd_count)) {
+            printf("could not bind to %s:%d\n", address, port);
+            return 0;
+        }
+        printf("listening on %s:%d\n", address, port);
+    } else {
+        fd_count = 0;
+        TAILQ_FOREACH(listener, &listeners, entries) {
+            if (!simplehttp_parse_listen(listener->spec, address, address_buf, sizeof(address_buf),
+                                         &listen_address, &listen_port, &listen_path)) {
+                printf("invalid --listen %s\n", listener->spec);
+                return 0;
+            }
+            if (!simplehttp_bind_listener(listen_address, listen_port, listen_path, fds, &fd_count)) {
+                printf("could not listen on %s\n", listener->spec);
+                return 0;
+            }
+            printf("listening on %s\n", listener->spec);
+        }
+    }
+    if (!simplehttp_workers_listen(fds, fd_count, generic_request_handler, simplehttp_handoff_cb)) {
+        printf("could not serve %d listening sockets\n", fd_count);
+        return 0;
+    }
+    httpd = simplehttp_workers[0].httpd;
+    
+    if (upgrade_socket && !simplehttp_upgrade_listen(upgrade_socket, fds, fd_count, drain_timeout_ms)) {
+        printf("could not listen on %s\n", upgrade_socket);
         return 0;
     }
     
-    printf("listening on %s:%d\n", address, port);
+    if (simplehttp_worker_count > 1) {
+        printf("running %d workers\n", simplehttp_worker_count);
+    }
     
-    evhttp_set_gencb(httpd, generic_request_handler, NULL);
     return 1;
 }
 
 void simplehttp_run()
 {
+    simplehttp_workers_start();
     event_dispatch();
+    simplehttp_workers_stop();
 }
 
 int simplehttp_main()
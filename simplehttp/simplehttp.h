@@ -3,6 +3,7 @@
 
 #include "queue.h"
 #include "options.h"
+#include "pool.h"
 #include <event.h>
 #include <evhttp.h>
 
@@ -24,13 +25,29 @@ unsigned int simplehttp_ts_diff(struct timeval start, struct timeval end);
 
 #endif
 
+/* request times (usec) per callback over the last window_secs seconds,
+    stats_counts is the total number of requests since startup */
 struct simplehttp_stats {
     uint64_t requests;
     uint64_t *stats_counts;
     uint64_t *average_requests;
+    uint64_t *fifty_percents;
     uint64_t *ninety_five_percents;
+    uint64_t *ninety_nine_percents;
+    uint64_t *ninety_nine_nine_percents;
+    uint64_t *max_requests;
     char **stats_labels;
     int callback_count;
+    int window_secs;
+    /* event loops over the same window. utilization is the percentage of time spent in
+        request callbacks across all workers (and in the busiest one), cpu the loop
+        threads' cpu time as a percentage and lag how late (usec) a timer on each loop
+        fired, the time the loop went without looking at its events */
+    double loop_utilization;
+    double loop_utilization_max;
+    double loop_cpu;
+    uint64_t loop_lag_99;
+    uint64_t loop_lag_max;
 };
 
 void simplehttp_init();
@@ -38,13 +55,97 @@ int simplehttp_main();
 int simplehttp_listen();
 void simplehttp_run();
 void simplehttp_free();
+/* callbacks are registered before simplehttp_listen(), later ones are refused */
 void simplehttp_set_cb(const char *path, void (*cb)(struct evhttp_request *, struct evbuffer *, void *), void *ctx);
+/* runs cb(arg) while no callback runs in any worker, as an exclusive callback would. for
+    changing what SIMPLEHTTP_CB_THREAD_SAFE callbacks read from timers and signal events
+    on the main event base */
+void simplehttp_run_exclusive(void (*cb)(void *), void *arg);
+
+/* flags for simplehttp_set_cb_flags(), path must match the one passed to simplehttp_set_cb().
+    with --workers=N a SIMPLEHTTP_CB_THREAD_SAFE callback runs concurrently in any worker,
+    everything else runs exclusively in worker 0, alongside the main event base's timers
+    and async requests (other workers hand those requests over). replies on a SIMPLEHTTP_CB_COMPRESS route are gzip or deflate
+    encoded when the client's Accept-Encoding allows it (see simplehttp_send_reply()) */
+#define SIMPLEHTTP_CB_THREAD_SAFE 0x01
+#define SIMPLEHTTP_CB_COMPRESS 0x02
+void simplehttp_set_cb_flags(const char *path, int flags);
+
+/* priority of path's requests for load shedding with --admission-target-ms. while a
+    worker is overloaded, SIMPLEHTTP_PRIORITY_LOW requests that waited longer than the
+    target and SIMPLEHTTP_PRIORITY_NORMAL (the default) ones that waited twice that get a
+    503 with Retry-After instead of being dispatched. SIMPLEHTTP_PRIORITY_HIGH requests are
+    never turned away, use it for /stats and the like */
+#define SIMPLEHTTP_PRIORITY_HIGH 0
+#define SIMPLEHTTP_PRIORITY_NORMAL 1
+#define SIMPLEHTTP_PRIORITY_LOW 2
+void simplehttp_set_cb_priority(const char *path, int priority);
+
+/* evhttp_send_reply() that compresses bodies of --compress-min-bytes or more on
+    SIMPLEHTTP_CB_COMPRESS routes. replies sent with evhttp_send_reply() directly go out as is */
+void simplehttp_send_reply(struct evhttp_request *req, int code, const char *reason, struct evbuffer *evb);
+/* reply with len raw bytes, no printf formatting and no copy through the callback's evbuffer */
+void simplehttp_reply_bytes(struct evhttp_request *req, int code, const char *reason, const void *data, size_t len);
+
+/* deadline for async requests on path, counted from when the request arrived. only
+    requests whose handler set a timeout cb with simplehttp_async_set_timeout_cb() are cut
+    off: still unfinished after timeout_ms they are answered with a 503 and finished, the
+    cb runs first so the handler can drop pending work. req must not be used once the cb
+    returns. 0 (the default) falls back to --request-timeout-ms */
+void simplehttp_set_cb_timeout(const char *path, int timeout_ms);
+
+/* chunked streaming replies. produce_cb appends the next part of the reply to evb and
+    returns SIMPLEHTTP_STREAM_MORE, SIMPLEHTTP_STREAM_DONE or SIMPLEHTTP_STREAM_WAIT (call
+    simplehttp_stream_resume() when there is more). it runs while less than high_water
+    bytes are waiting to go to the client, for up to budget_usec per pass of the event
+    loop, and again once the backlog drains below low_water. without a produce_cb data is
+    pushed with simplehttp_stream_send(). done_cb runs once at the end, connected is 0 if
+    the client went away (or was kicked) first; the stream is freed after it returns.
+    on a SIMPLEHTTP_CB_COMPRESS route the whole stream is compressed, whatever its size */
+#define SIMPLEHTTP_STREAM_DONE 0
+#define SIMPLEHTTP_STREAM_MORE 1
+#define SIMPLEHTTP_STREAM_WAIT 2
+#define SIMPLEHTTP_STREAM_LOW_WATER (64 * 1024)
+#define SIMPLEHTTP_STREAM_HIGH_WATER (1024 * 1024)
+#define SIMPLEHTTP_STREAM_BUDGET_USEC 10000
+struct simplehttp_stream;
+struct simplehttp_stream *simplehttp_stream_start(struct evhttp_request *req, int code, const char *reason,
+        int (*produce_cb)(struct simplehttp_stream *, struct evbuffer *, void *),
+        void (*done_cb)(struct simplehttp_stream *, int, void *), void *arg);
+void simplehttp_stream_set_limits(struct simplehttp_stream *stream, size_t low_water, size_t high_water, int budget_usec);
+struct evhttp_request *simplehttp_stream_request(struct simplehttp_stream *stream);
+/* bytes waiting to be written to the client */
+size_t simplehttp_stream_pending(struct simplehttp_stream *stream);
+int simplehttp_stream_send(struct simplehttp_stream *stream, struct evbuffer *evb);
+void simplehttp_stream_resume(struct simplehttp_stream *stream);
+void simplehttp_stream_end(struct simplehttp_stream *stream);
+/* drop the backlog, write message (unframed) and close the connection once it is out */
+void simplehttp_stream_kick(struct simplehttp_stream *stream, const char *message);
 
 uint64_t simplehttp_request_id(struct evhttp_request *req);
-void simplehttp_async_enable(struct evhttp_request *req);
+/* 0 if req can not go async, in a SIMPLEHTTP_CB_THREAD_SAFE callback on a worker other
+    than 0. the callback must then reply before it returns */
+int simplehttp_async_enable(struct evhttp_request *req);
 void simplehttp_async_finish(struct evhttp_request *req);
+void simplehttp_async_set_timeout_cb(struct evhttp_request *req, void (*cb)(struct evhttp_request *, void *), void *arg);
+/* 1 once the client of a parked async request has closed its connection */
+int simplehttp_client_gone(struct evhttp_request *req);
 
 void simplehttp_log(const char *host, struct evhttp_request *req, uint64_t req_time, const char *id, int display_post);
+void simplehttp_log_detail(const char *host, struct evhttp_request *req, uint64_t req_time, const char *id, int display_post, const char *detail);
+int simplehttp_log_init(const char *path, size_t buffer_size);
+void simplehttp_log_close();
+
+/* metrics served by the built-in /metrics route (OpenMetrics text). counters and gauges
+    are read from *value on every scrape, counter names are given without the _total suffix.
+    per-route request times are included automatically. they can be registered from any
+    worker at any time, a pool created on the request path registers its own */
+struct simplehttp_histogram;
+void simplehttp_metric_counter(const char *name, const char *help, uint64_t *value);
+void simplehttp_metric_gauge(const char *name, const char *help, uint64_t *value);
+void simplehttp_metric_gauge_cb(const char *name, const char *help, uint64_t (*cb)(void *), void *ctx);
+struct simplehttp_histogram *simplehttp_metric_histogram(const char *name, const char *help);
+void simplehttp_histogram_record(struct simplehttp_histogram *h, uint64_t value);
 
 char *simplehttp_strnstr(const char *s, const char *find, size_t slen);
 uint64_t ninety_five_percent(int64_t *int_array, int length);
@@ -63,7 +164,8 @@ struct RequestHeader {
 };
 
 /* start a new callback_group. memory will be freed after a call to
-    release_callback_group or when all the callbacks have been run */
+    release_callback_group or when all the callbacks have been run. finished_cb
+    is passed a NULL request if req timed out (simplehttp_set_cb_timeout) first */
 struct AsyncCallbackGroup *new_async_callback_group(struct evhttp_request *req,
         void (*finished_cb)(struct evhttp_request *, void *), void *finished_cb_arg);
 /* create a new AsyncCallback. delegation of memory for this callback
@@ -77,8 +179,32 @@ struct AsyncCallback *new_async_request_with_body(int request_method, const char
 void free_async_callback_group(struct AsyncCallbackGroup *callback_group);
 void init_async_connection_pool(int enable_request_logging);
 void free_async_connection_pool();
+/* connections per host are opened on demand up to max, idle ones above min are
+    closed after a while. requests queue while a host has max in flight */
+void set_async_connection_pool_limits(int min, int max);
+void set_async_host_connection_limits(const char *address, int port, int min, int max);
 
 enum response_formats {json_format, txt_format};
+
+/* query arguments, decoded once per request into the request's arena and valid until
+    the request finishes. nothing needs freeing. outside of a simplehttp callback no
+    arguments are returned */
+struct simplehttp_arg {
+    const char *key;
+    const char *value;
+};
+struct simplehttp_args {
+    int count;
+    struct simplehttp_arg *list;
+};
+struct simplehttp_args *simplehttp_args(struct evhttp_request *req);
+const char *simplehttp_arg(struct simplehttp_args *args, const char *key);
+int simplehttp_arg_format(struct simplehttp_args *args);
+int simplehttp_arg_int(struct simplehttp_args *args, const char *key, int default_value);
+double simplehttp_arg_double(struct simplehttp_args *args, const char *key, double default_value);
+/* scratch memory freed along with the request */
+void *simplehttp_request_alloc(struct evhttp_request *req, size_t size);
+
 int get_argument_format(struct evkeyvalq *args);
 int get_int_argument(struct evkeyvalq *args, const char *key, int default_value);
 double get_double_argument(struct evkeyvalq *args, const char *key, double default_value);
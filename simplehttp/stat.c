@@ -3,48 +3,127 @@
 #include <inttypes.h>
 #include "stat.h"
 #include "simplehttp.h"
+#include "worker.h"
+#include "profile.h"
 
-static int64_t *stats = NULL;
-static int *stats_idx = NULL;
-static uint64_t *stats_counts = NULL;
+#define LOOP_TICK_MSECS 100
 
 extern int callback_count;
-extern uint64_t request_count;
 
+static int stats_slot_secs = 10;
+
+static void loop_tick_cb(int fd, short what, void *arg)
+{
+    struct simplehttp_worker *worker = (struct simplehttp_worker *)arg;
+    struct simplehttp_loop_window *window = worker->loop;
+    struct timeval tv = {0, LOOP_TICK_MSECS * 1000};
+    time_t epoch = time(NULL) / stats_slot_secs;
+    int slot = epoch % STAT_SLOTS;
+    uint64_t elapsed, cpu = simplehttp_thread_cpu_usec();
+    simplehttp_ts now;
+    
+    simplehttp_ts_get(&now);
+    // the first tick runs on the worker's own thread, start counting from there
+    if (worker->loop_ts.tv_sec) {
+        if (window->epoch[slot] != epoch) {
+            window->elapsed_usec[slot] = 0;
+            window->busy_usec[slot] = 0;
+            window->cpu_usec[slot] = 0;
+            simplehttp_histogram_reset(&window->lag[slot]);
+            window->epoch[slot] = epoch;
+        }
+        elapsed = simplehttp_ts_diff(worker->loop_ts, now);
+        window->elapsed_usec[slot] += elapsed;
+        window->busy_usec[slot] += worker->loop_busy_usec;
+        window->cpu_usec[slot] += cpu - worker->loop_cpu_usec;
+        simplehttp_histogram_record(&window->lag[slot], elapsed > LOOP_TICK_MSECS * 1000 ? elapsed - LOOP_TICK_MSECS * 1000 : 0);
+    }
+    worker->loop_ts = now;
+    worker->loop_cpu_usec = cpu;
+    worker->loop_busy_usec = 0;
+    
+    evtimer_add(&worker->loop_ev, &tv);
+}
+
+// each worker records into its own windows, simplehttp_stats_get() merges them
 void simplehttp_stats_store(int index, uint64_t val)
 {
-    stats[(index * STAT_WINDOW) + stats_idx[index]] = val;
-    stats_idx[index]++;
-    stats_counts[index]++;
+    struct simplehttp_worker *worker = simplehttp_worker_self();
+    struct simplehttp_stat_window *window = &worker->stats[index];
+    time_t epoch = time(NULL) / stats_slot_secs;
+    int slot = epoch % STAT_SLOTS;
     
-    if (stats_idx[index] >= STAT_WINDOW) {
-        stats_idx[index] = 0;
+    if (window->epoch[slot] != epoch) {
+        simplehttp_histogram_reset(&window->slots[slot]);
+        window->epoch[slot] = epoch;
     }
+    simplehttp_histogram_record(&window->slots[slot], val);
+    simplehttp_histogram_record(&worker->stats_totals[index], val);
+    worker->stats_counts[index]++;
 }
 
-void simplehttp_stats_init()
+void simplehttp_stats_init(int window_secs)
 {
-    int i;
-    stats = malloc(STAT_WINDOW * callback_count * sizeof(int64_t));
-    for (i = 0; i < (STAT_WINDOW * callback_count); i++) {
-        stats[i] = -1;
+    struct simplehttp_worker *worker;
+    struct timeval tv = {0, 0};
+    int w;
+    
+    if (window_secs <= 0) {
+        window_secs = 60;
+    }
+    stats_slot_secs = window_secs / STAT_SLOTS;
+    if (stats_slot_secs < 1) {
+        stats_slot_secs = 1;
+    }
+    
+    for (w = 0; w < simplehttp_worker_count; w++) {
+        worker = &simplehttp_workers[w];
+        worker->stats = calloc(callback_count, sizeof(struct simplehttp_stat_window));
+        worker->stats_totals = calloc(callback_count, sizeof(struct simplehttp_histogram));
+        worker->stats_counts = calloc(1, callback_count * sizeof(uint64_t));
+        
+        worker->loop = calloc(1, sizeof(struct simplehttp_loop_window));
+        memset(&worker->loop_ts, 0, sizeof(worker->loop_ts));
+        evtimer_set(&worker->loop_ev, loop_tick_cb, worker);
+        event_base_set(worker->base, &worker->loop_ev);
+        evtimer_add(&worker->loop_ev, &tv);
     }
-    stats_idx = calloc(1, callback_count * sizeof(int));
-    stats_counts = calloc(1, callback_count * sizeof(uint64_t));
 }
 
 void simplehttp_stats_destruct()
 {
-    free(stats);
-    free(stats_idx);
-    free(stats_counts);
+    struct simplehttp_worker *worker;
+    int w;
+    
+    for (w = 0; w < simplehttp_worker_count; w++) {
+        worker = &simplehttp_workers[w];
+        free(worker->stats);
+        free(worker->stats_totals);
+        free(worker->stats_counts);
+        if (worker->loop) {
+            evtimer_del(&worker->loop_ev);
+            free(worker->loop);
+            worker->loop = NULL;
+        }
+    }
+}
+
+// every request time recorded for callback index since startup, across all workers
+void simplehttp_stats_totals(int index, struct simplehttp_histogram *merged)
+{
+    int w;
+    
+    simplehttp_histogram_reset(merged);
+    for (w = 0; w < simplehttp_worker_count; w++) {
+        simplehttp_histogram_merge(merged, &simplehttp_workers[w].stats_totals[index]);
+    }
 }
 
 struct simplehttp_stats *simplehttp_stats_new()
 {
     struct simplehttp_stats *st;
     
-    st = malloc(sizeof(struct simplehttp_stats));
+    st = calloc(1, sizeof(struct simplehttp_stats));
     
     return st;
 }
@@ -66,6 +145,22 @@ void simplehttp_stats_free(struct simplehttp_stats *st)
             free(st->ninety_five_percents);
         }
         
+        if (st->fifty_percents) {
+            free(st->fifty_percents);
+        }
+        
+        if (st->ninety_nine_percents) {
+            free(st->ninety_nine_percents);
+        }
+        
+        if (st->ninety_nine_nine_percents) {
+            free(st->ninety_nine_nine_percents);
+        }
+        
+        if (st->max_requests) {
+            free(st->max_requests);
+        }
+        
         if (st->stats_labels) {
             for (i = 0; i < st->callback_count; i++) {
                 free(st->stats_labels[i]);
@@ -77,28 +172,92 @@ void simplehttp_stats_free(struct simplehttp_stats *st)
     }
 }
 
+// loop utilization and lag over the window, lag is merged into merged
+static void simplehttp_stats_loop(struct simplehttp_stats *st, struct simplehttp_histogram *merged, time_t epoch)
+{
+    struct simplehttp_loop_window *window;
+    uint64_t elapsed = 0, busy = 0, cpu = 0;
+    uint64_t worker_elapsed, worker_busy;
+    int w, slot;
+    
+    simplehttp_histogram_reset(merged);
+    for (w = 0; w < simplehttp_worker_count; w++) {
+        if (!(window = simplehttp_workers[w].loop)) {
+            continue;
+        }
+        worker_elapsed = worker_busy = 0;
+        for (slot = 0; slot < STAT_SLOTS; slot++) {
+            if (window->epoch[slot] > epoch - STAT_SLOTS) {
+                worker_elapsed += window->elapsed_usec[slot];
+                worker_busy += window->busy_usec[slot];
+                cpu += window->cpu_usec[slot];
+                simplehttp_histogram_merge(merged, &window->lag[slot]);
+            }
+        }
+        if (worker_elapsed && 100.0 * worker_busy / worker_elapsed > st->loop_utilization_max) {
+            st->loop_utilization_max = 100.0 * worker_busy / worker_elapsed;
+        }
+        elapsed += worker_elapsed;
+        busy += worker_busy;
+    }
+    if (elapsed) {
+        st->loop_utilization = 100.0 * busy / elapsed;
+        st->loop_cpu = 100.0 * cpu / elapsed;
+    }
+    if (merged->count) {
+        st->loop_lag_99 = simplehttp_histogram_percentile(merged, 99.0);
+        st->loop_lag_max = merged->max;
+    }
+}
+
 void simplehttp_stats_get(struct simplehttp_stats *st)
 {
-    uint64_t request_total;
-    int i, j, c, request_array_end;
+    struct simplehttp_worker *worker;
+    struct simplehttp_stat_window *window;
+    struct simplehttp_histogram *merged;
+    time_t epoch = time(NULL) / stats_slot_secs;
+    int i, w, slot;
     
-    st->requests = request_count;
+    st->requests = 0;
     st->callback_count = callback_count;
-    st->stats_counts = malloc(callback_count * sizeof(uint64_t));
-    memcpy(st->stats_counts, stats_counts, callback_count * sizeof(uint64_t));
+    st->window_secs = stats_slot_secs * STAT_SLOTS;
+    st->stats_counts = calloc(1, callback_count * sizeof(uint64_t));
     st->average_requests = calloc(1, callback_count * sizeof(uint64_t));
+    st->fifty_percents = calloc(1, callback_count * sizeof(uint64_t));
     st->ninety_five_percents = calloc(1, callback_count * sizeof(uint64_t));
+    st->ninety_nine_percents = calloc(1, callback_count * sizeof(uint64_t));
+    st->ninety_nine_nine_percents = calloc(1, callback_count * sizeof(uint64_t));
+    st->max_requests = calloc(1, callback_count * sizeof(uint64_t));
     st->stats_labels = simplehttp_callback_names();
+    merged = malloc(sizeof(*merged));
+    
+    for (w = 0; w < simplehttp_worker_count; w++) {
+        st->requests += simplehttp_workers[w].request_count;
+    }
     
     for (i = 0; i < callback_count; i++) {
-        request_total = 0;
-        for (j = (i * STAT_WINDOW), request_array_end = j + STAT_WINDOW, c = 0;
-                (j < request_array_end) && (stats[j] != -1); j++, c++) {
-            request_total += stats[j];
+        simplehttp_histogram_reset(merged);
+        for (w = 0; w < simplehttp_worker_count; w++) {
+            worker = &simplehttp_workers[w];
+            window = &worker->stats[i];
+            st->stats_counts[i] += worker->stats_counts[i];
+            for (slot = 0; slot < STAT_SLOTS; slot++) {
+                if (window->epoch[slot] > epoch - STAT_SLOTS) {
+                    simplehttp_histogram_merge(merged, &window->slots[slot]);
+                }
+            }
         }
-        if (c) {
-            st->average_requests[i] = request_total / c;
-            st->ninety_five_percents[i] = ninety_five_percent(stats + (i * STAT_WINDOW), c);
+        if (merged->count) {
+            st->average_requests[i] = merged->sum / merged->count;
+            st->fifty_percents[i] = simplehttp_histogram_percentile(merged, 50.0);
+            st->ninety_five_percents[i] = simplehttp_histogram_percentile(merged, 95.0);
+            st->ninety_nine_percents[i] = simplehttp_histogram_percentile(merged, 99.0);
+            st->ninety_nine_nine_percents[i] = simplehttp_histogram_percentile(merged, 99.9);
+            st->max_requests[i] = merged->max;
         }
     }
+    
+    simplehttp_stats_loop(st, merged, epoch);
+    
+    free(merged);
 }
@@ -1,10 +1,34 @@
 #ifndef _STAT_H
 #define _STAT_H
 
-#define STAT_WINDOW 1000
+#include <time.h>
+#include "histogram.h"
+
+// request times are kept for the last --stats-window seconds in this many rotating slots
+#define STAT_SLOTS 6
+
+struct simplehttp_stat_window {
+    time_t epoch[STAT_SLOTS];
+    struct simplehttp_histogram slots[STAT_SLOTS];
+};
+
+/*
+ * event loop time per slot, from a LOOP_TICK_MSECS timer on each worker's
+ * loop. busy is time spent in request callbacks, cpu the loop thread's cpu
+ * time and lag how late the timer fired, i.e. how long the loop went without
+ * getting back to its events
+ */
+struct simplehttp_loop_window {
+    time_t epoch[STAT_SLOTS];
+    uint64_t elapsed_usec[STAT_SLOTS];
+    uint64_t busy_usec[STAT_SLOTS];
+    uint64_t cpu_usec[STAT_SLOTS];
+    struct simplehttp_histogram lag[STAT_SLOTS];
+};
 
 void simplehttp_stats_store(int index, uint64_t val);
-void simplehttp_stats_init();
+void simplehttp_stats_init(int window_secs);
 void simplehttp_stats_destruct();
+void simplehttp_stats_totals(int index, struct simplehttp_histogram *merged);
 
 #endif
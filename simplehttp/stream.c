@@ -0,0 +1,278 @@
+#include <stdlib.h>
+#include <string.h>
+#include "simplehttp.h"
+#include "worker.h"
+#include "request.h"
+#include "compress.h"
+#include "http-internal.h"
+
+/*
+ * chunked replies fed at the speed the client reads them. a producer is run
+ * while the connection has less than high_water bytes pending, for at most
+ * budget_usec per event loop pass, and is woken again once the pending output
+ * drains below low_water. push style streams (no producer) write with
+ * simplehttp_stream_send() and check simplehttp_stream_pending() themselves.
+ * compressed streams run every chunk through one deflate state, flushed
+ * whenever the producer yields so the client can decode what it has.
+ */
+
+enum stream_state {
+    STREAM_RUNNING,
+    STREAM_WAITING,
+    STREAM_KICKED,
+};
+
+struct simplehttp_stream {
+    struct evhttp_request *req;
+    struct evhttp_connection *evcon;
+    int (*produce_cb)(struct simplehttp_stream *, struct evbuffer *, void *);
+    void (*done_cb)(struct simplehttp_stream *, int, void *);
+    void *arg;
+    struct evbuffer *evb;
+    struct simplehttp_deflate *deflate;
+    struct evbuffer *zevb;
+    struct event ev;
+    int scheduled;
+    enum stream_state state;
+    size_t low_water;
+    size_t high_water;
+    int budget_usec;
+};
+
+// the connection's pending output, only reachable through libevent's private http-internal.h
+static struct evbuffer *stream_output(struct simplehttp_stream *stream)
+{
+    return stream->evcon->output_buffer;
+}
+
+static void stream_schedule(struct simplehttp_stream *stream)
+{
+    struct timeval tv = {0, 0};
+    
+    if (!stream->scheduled) {
+        evtimer_add(&stream->ev, &tv);
+        stream->scheduled = 1;
+    }
+}
+
+static void stream_free(struct simplehttp_stream *stream)
+{
+    if (stream->scheduled) {
+        evtimer_del(&stream->ev);
+    }
+    if (stream->deflate) {
+        simplehttp_deflate_put(stream->deflate);
+        evbuffer_free(stream->zevb);
+    }
+    evbuffer_free(stream->evb);
+    free(stream);
+}
+
+// send evb as the next chunk, through the compressor if there is one
+static void stream_write(struct simplehttp_stream *stream, struct evbuffer *evb, int flush)
+{
+    if (!stream->deflate) {
+        if (EVBUFFER_LENGTH(evb)) {
+            evhttp_send_reply_chunk(stream->req, evb);
+        }
+        return;
+    }
+    simplehttp_deflate_add(stream->deflate, EVBUFFER_DATA(evb), EVBUFFER_LENGTH(evb), stream->zevb, flush);
+    evbuffer_drain(evb, EVBUFFER_LENGTH(evb));
+    if (EVBUFFER_LENGTH(stream->zevb)) {
+        evhttp_send_reply_chunk(stream->req, stream->zevb);
+    }
+}
+
+// the connection went away, or was closed by simplehttp_stream_kick()
+static void stream_close_cb(struct evhttp_connection *evcon, void *arg)
+{
+    struct simplehttp_stream *stream = (struct simplehttp_stream *)arg;
+    
+    evbuffer_setcb(stream_output(stream), NULL, NULL);
+    if (stream->done_cb) {
+        stream->done_cb(stream, 0, stream->arg);
+    }
+    stream_free(stream);
+}
+
+static void stream_output_cb(struct evbuffer *buffer, size_t old_len, size_t new_len, void *arg)
+{
+    struct simplehttp_stream *stream = (struct simplehttp_stream *)arg;
+    
+    if (new_len >= old_len) {
+        return;
+    }
+    if ((stream->state == STREAM_RUNNING && stream->produce_cb && new_len < stream->low_water)
+            || (stream->state == STREAM_KICKED && new_len == 0)) {
+        // not from in here, evhttp is still in the middle of writing
+        stream_schedule(stream);
+    }
+}
+
+static void stream_run(int fd, short what, void *arg)
+{
+    struct simplehttp_stream *stream = (struct simplehttp_stream *)arg;
+    simplehttp_ts start_ts, now_ts;
+    int rc;
+    
+    stream->scheduled = 0;
+    
+    if (stream->state == STREAM_KICKED) {
+        // the last of the output (the kick message) is out
+        if (EVBUFFER_LENGTH(stream_output(stream)) == 0) {
+            evhttp_connection_free(stream->evcon);
+        }
+        return;
+    }
+    if (stream->state != STREAM_RUNNING || !stream->produce_cb) {
+        return;
+    }
+    
+    simplehttp_ts_get(&start_ts);
+    while (EVBUFFER_LENGTH(stream_output(stream)) < stream->high_water) {
+        rc = stream->produce_cb(stream, stream->evb, stream->arg);
+        if (rc == SIMPLEHTTP_STREAM_DONE) {
+            // simplehttp_stream_end() finishes the compressed data
+            stream_write(stream, stream->evb, Z_NO_FLUSH);
+            simplehttp_stream_end(stream);
+            return;
+        }
+        if (rc == SIMPLEHTTP_STREAM_WAIT) {
+            stream_write(stream, stream->evb, Z_SYNC_FLUSH);
+            stream->state = STREAM_WAITING;
+            return;
+        }
+        stream_write(stream, stream->evb, Z_NO_FLUSH);
+        
+        // out of time for this pass, let other requests run
+        simplehttp_ts_get(&now_ts);
+        if (simplehttp_ts_diff(start_ts, now_ts) >= stream->budget_usec) {
+            stream_write(stream, stream->evb, Z_SYNC_FLUSH);
+            stream_schedule(stream);
+            return;
+        }
+    }
+    // over high_water, stream_output_cb() wakes us up again
+    stream_write(stream, stream->evb, Z_SYNC_FLUSH);
+}
+
+struct simplehttp_stream *simplehttp_stream_start(struct evhttp_request *req, int code, const char *reason,
+        int (*produce_cb)(struct simplehttp_stream *, struct evbuffer *, void *),
+        void (*done_cb)(struct simplehttp_stream *, int, void *), void *arg)
+{
+    struct simplehttp_stream *stream;
+    struct simplehttp_worker *worker = simplehttp_worker_self();
+    struct simplehttp_request *s_req = simplehttp_request_get(req);
+    
+    stream = calloc(1, sizeof(*stream));
+    stream->req = req;
+    stream->evcon = req->evcon;
+    stream->produce_cb = produce_cb;
+    stream->done_cb = done_cb;
+    stream->arg = arg;
+    stream->evb = evbuffer_new();
+    stream->state = STREAM_RUNNING;
+    stream->low_water = SIMPLEHTTP_STREAM_LOW_WATER;
+    stream->high_water = SIMPLEHTTP_STREAM_HIGH_WATER;
+    stream->budget_usec = SIMPLEHTTP_STREAM_BUDGET_USEC;
+    
+    evtimer_set(&stream->ev, stream_run, stream);
+    if (worker) {
+        event_base_set(worker->base, &stream->ev);
+    }
+    
+    if (s_req && s_req->compress && !evhttp_find_header(req->output_headers, "Content-Encoding")
+            && (stream->deflate = simplehttp_deflate_get(s_req->compress))) {
+        stream->zevb = evbuffer_new();
+        simplehttp_compress_headers(req, s_req->compress);
+        __sync_fetch_and_add(&simplehttp_compress_replies, 1);
+    }
+    
+    evhttp_send_reply_start(req, code, reason);
+    evhttp_connection_set_closecb(stream->evcon, stream_close_cb, stream);
+    evbuffer_setcb(stream_output(stream), stream_output_cb, stream);
+    
+    if (produce_cb) {
+        stream_schedule(stream);
+    }
+    
+    return stream;
+}
+
+void simplehttp_stream_set_limits(struct simplehttp_stream *stream, size_t low_water, size_t high_water, int budget_usec)
+{
+    stream->low_water = low_water;
+    stream->high_water = high_water > low_water ? high_water : low_water + 1;
+    stream->budget_usec = budget_usec;
+}
+
+struct evhttp_request *simplehttp_stream_request(struct simplehttp_stream *stream)
+{
+    return stream->req;
+}
+
+size_t simplehttp_stream_pending(struct simplehttp_stream *stream)
+{
+    return EVBUFFER_LENGTH(stream_output(stream));
+}
+
+int simplehttp_stream_send(struct simplehttp_stream *stream, struct evbuffer *evb)
+{
+    if (stream->state == STREAM_KICKED) {
+        evbuffer_drain(evb, EVBUFFER_LENGTH(evb));
+        return 0;
+    }
+    stream_write(stream, evb, Z_SYNC_FLUSH);
+    
+    return 1;
+}
+
+void simplehttp_stream_resume(struct simplehttp_stream *stream)
+{
+    if (stream->state == STREAM_WAITING) {
+        stream->state = STREAM_RUNNING;
+        stream_schedule(stream);
+    }
+}
+
+void simplehttp_stream_end(struct simplehttp_stream *stream)
+{
+    struct evhttp_request *req = stream->req;
+    
+    if (stream->deflate) {
+        stream_write(stream, stream->evb, Z_FINISH);
+    }
+    
+    // the connection may be kept alive for another request, let go of it first
+    evbuffer_setcb(stream_output(stream), NULL, NULL);
+    evhttp_connection_set_closecb(stream->evcon, NULL, NULL);
+    
+    if (stream->done_cb) {
+        stream->done_cb(stream, 1, stream->arg);
+    }
+    stream_free(stream);
+    
+    evhttp_send_reply_end(req);
+}
+
+void simplehttp_stream_kick(struct simplehttp_stream *stream, const char *message)
+{
+    struct evbuffer *output = stream_output(stream);
+    
+    if (stream->state == STREAM_KICKED) {
+        return;
+    }
+    stream->state = STREAM_KICKED;
+    
+    // whatever is still queued is dropped, the message goes out unframed. a
+    // compressed stream is cut short without it, the client could not decode it
+    evbuffer_drain(output, EVBUFFER_LENGTH(output));
+    if (message && !stream->deflate) {
+        evbuffer_add(stream->evb, message, strlen(message));
+        stream->req->chunked = 0;
+        evhttp_send_reply_chunk(stream->req, stream->evb);
+    } else {
+        stream_schedule(stream);
+    }
+}
@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <pthread.h>
+#include "simplehttp.h"
+#include "test_util.h"
+
+/*
+ * a burst of slow requests builds a standing queue, --admission-target-ms
+ * sheds part of it with 503s while high priority /stats is always served,
+ * and once the queue has drained requests are admitted again. /batch requests
+ * in the burst are always answered, their sub-requests are admitted one by one
+ * at their own priority.
+ *
+ *   ./test_admission [port]
+ */
+
+#define BURST 40
+#define BATCHES 10
+
+static int shed = 0;
+static int served = 0;
+static int batch_shed = 0;
+static pthread_mutex_t counts_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void slow_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
+{
+    usleep(20000);
+    evhttp_send_reply(req, HTTP_OK, "OK", evb);
+}
+
+static void stats_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
+{
+    evhttp_send_reply(req, HTTP_OK, "OK", evb);
+}
+
+static void *slow_client(void *arg)
+{
+    char buf[1024];
+    
+    test_read_reply(test_send_request("/slow"), buf, sizeof(buf));
+    pthread_mutex_lock(&counts_lock);
+    if (strstr(buf, " 503 ")) {
+        assert(strstr(buf, "Retry-After: 1\r\n"));
+        shed++;
+    } else {
+        assert(strstr(buf, " 200 "));
+        served++;
+    }
+    pthread_mutex_unlock(&counts_lock);
+    
+    return NULL;
+}
+
+static void *batch_client(void *arg)
+{
+    char buf[1024];
+    
+    test_read_reply(test_send_request("/batch?uri=/stats&uri=/slow&format=txt"), buf, sizeof(buf));
+    assert(strstr(buf, " 200 "));
+    assert(strstr(buf, "\r\n200 0 /stats\n"));
+    if (strstr(buf, "\n503 0 /slow\n")) {
+        pthread_mutex_lock(&counts_lock);
+        batch_shed++;
+        pthread_mutex_unlock(&counts_lock);
+    } else {
+        assert(strstr(buf, "\n200 0 /slow\n"));
+    }
+    
+    return NULL;
+}
+
+static void *stats_client(void *arg)
+{
+    char buf[1024];
+    
+    usleep(300000);
+    // queued behind the slow ones, but never shed
+    test_read_reply(test_send_request("/stats"), buf, sizeof(buf));
+    assert(strstr(buf, " 200 "));
+    
+    return NULL;
+}
+
+static void *client(void *arg)
+{
+    pthread_t threads[BURST + 1];
+    char buf[1024];
+    int i;
+    
+    for (i = 0; i < BURST; i++) {
+        pthread_create(&threads[i], NULL, i % 4 == 3 && i / 4 < BATCHES ? batch_client : slow_client, NULL);
+    }
+    pthread_create(&threads[BURST], NULL, stats_client, NULL);
+    for (i = 0; i <= BURST; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    assert(shed > 0 && served > 0 && shed + served == BURST - BATCHES);
+    assert(batch_shed > 0);
+    
+    // idle for a while, the next request is served
+    usleep(300000);
+    test_read_reply(test_send_request("/slow"), buf, sizeof(buf));
+    assert(strstr(buf, " 200 "));
+    
+    fprintf(stdout, "ok\n");
+    fflush(stdout);
+    
+    // there is no reply to /exit
+    close(test_send_request("/exit"));
+    
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    pthread_t thread;
+    char port_arg[32];
+    char target_arg[] = "--admission-target-ms=5";
+    // the option parser rewrites its arguments in place
+    char *args[] = {argv[0], port_arg, target_arg, NULL};
+    
+    test_port = 18101;
+    if (argc > 1) {
+        test_port = atoi(argv[1]);
+    }
+    sprintf(port_arg, "--port=%d", test_port);
+    
+    define_simplehttp_options();
+    assert(option_parse_command_line(3, args));
+    
+    simplehttp_init();
+    simplehttp_set_cb("/slow*", slow_cb, NULL);
+    simplehttp_set_cb("/stats*", stats_cb, NULL);
+    simplehttp_set_cb_priority("/stats*", SIMPLEHTTP_PRIORITY_HIGH);
+    simplehttp_set_cb("/exit*", test_exit_cb, NULL);
+    assert(simplehttp_listen());
+    
+    pthread_create(&thread, NULL, client, NULL);
+    simplehttp_run();
+    pthread_join(thread, NULL);
+    
+    simplehttp_free();
+    free_options();
+    
+    return 0;
+}
@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <inttypes.h>
+#include "simplehttp.h"
+#include "request.h"
+
+/*
+ * checks simplehttp_args() decoding against evhttp_parse_query() of
+ * libevent 1.4, which leaves keys and a + alone, and compares the cost of the
+ * two per request.
+ *
+ *   ./test_args [iterations]
+ */
+
+static const char *uris[] = {
+    "/get?key=abc",
+    "/mget?k=a&k=b%20c&k=d+e&format=txt",
+    "/put?data=%7B%22a%22%3A1%7D&separator=%0A",
+    "/stats",
+    "/x?&&a=1&&b=&c",
+    "/x?a%20b=c+d&e=f?g+h",
+    NULL
+};
+
+static void check_matches_evhttp(const char *uri)
+{
+    struct evhttp_request *req;
+    struct simplehttp_args *args;
+    struct evkeyvalq headers;
+    struct evkeyval *pair;
+    int i = 0;
+    
+    req = evhttp_request_new(NULL, NULL);
+    req->uri = strdup(uri);
+    simplehttp_request_new(req, 1);
+    
+    args = simplehttp_args(req);
+    assert(args == simplehttp_args(req));
+    
+    evhttp_parse_query(uri, &headers);
+    TAILQ_FOREACH(pair, &headers, next) {
+        assert(i < args->count);
+        assert(strcmp(pair->key, args->list[i].key) == 0);
+        assert(strcmp(pair->value, args->list[i].value) == 0);
+        i++;
+    }
+    evhttp_clear_headers(&headers);
+    
+    simplehttp_request_finish(req, simplehttp_request_get(req));
+    evhttp_request_free(req);
+}
+
+static void check_values()
+{
+    struct evhttp_request *req;
+    struct simplehttp_args *args;
+    char *big;
+    int i;
+    
+    req = evhttp_request_new(NULL, NULL);
+    req->uri = strdup("/mget?k=a&k=b%20c&k=d+e&format=txt&n=42&f=1.5&flag&%6b=x");
+    simplehttp_request_new(req, 1);
+    
+    args = simplehttp_args(req);
+    assert(args->count == 8);
+    assert(strcmp(args->list[1].value, "b c") == 0);
+    assert(strcmp(args->list[2].value, "d+e") == 0);
+    assert(strcmp(args->list[7].key, "%6b") == 0);
+    assert(strcmp(simplehttp_arg(args, "k"), "a") == 0);
+    assert(strcmp(simplehttp_arg(args, "flag"), "") == 0);
+    assert(simplehttp_arg(args, "missing") == NULL);
+    assert(simplehttp_arg_format(args) == txt_format);
+    assert(simplehttp_arg_int(args, "n", 0) == 42);
+    assert(simplehttp_arg_int(args, "missing", 7) == 7);
+    assert(simplehttp_arg_double(args, "f", 0) == 1.5);
+    
+    // past the inline block the arena continues in malloc'd chunks
+    for (i = 0; i < 100; i++) {
+        big = simplehttp_request_alloc(req, 500);
+        memset(big, 'x', 500);
+    }
+    assert(strcmp(simplehttp_arg(args, "k"), "a") == 0);
+    
+    simplehttp_request_finish(req, simplehttp_request_get(req));
+    
+    // not a simplehttp request (any more)
+    args = simplehttp_args(req);
+    assert(args->count == 0);
+    assert(simplehttp_request_alloc(req, 8) == NULL);
+    
+    evhttp_request_free(req);
+}
+
+static void bench(const char *uri, int iterations)
+{
+    struct evhttp_request *req;
+    struct simplehttp_args *args;
+    struct evkeyvalq headers;
+    simplehttp_ts start_ts, end_ts;
+    uint64_t evhttp_usec, args_usec;
+    volatile int found = 0;
+    int i;
+    
+    req = evhttp_request_new(NULL, NULL);
+    req->uri = strdup(uri);
+    
+    simplehttp_ts_get(&start_ts);
+    for (i = 0; i < iterations; i++) {
+        evhttp_parse_query(uri, &headers);
+        found += evhttp_find_header(&headers, "format") != NULL;
+        evhttp_clear_headers(&headers);
+    }
+    simplehttp_ts_get(&end_ts);
+    evhttp_usec = simplehttp_ts_diff(start_ts, end_ts);
+    
+    simplehttp_ts_get(&start_ts);
+    for (i = 0; i < iterations; i++) {
+        simplehttp_request_new(req, i);
+        args = simplehttp_args(req);
+        found += simplehttp_arg(args, "format") != NULL;
+        simplehttp_request_finish(req, simplehttp_request_get(req));
+    }
+    simplehttp_ts_get(&end_ts);
+    args_usec = simplehttp_ts_diff(start_ts, end_ts);
+    
+    fprintf(stdout, "%s\n  evhttp_parse_query %.1fns  simplehttp_args (incl. request setup) %.1fns\n", uri,
+            evhttp_usec * 1000.0 / iterations, args_usec * 1000.0 / iterations);
+    
+    evhttp_request_free(req);
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = 200000;
+    int i;
+    
+    if (argc > 1) {
+        iterations = atoi(argv[1]);
+    }
+    
+    for (i = 0; uris[i]; i++) {
+        check_matches_evhttp(uris[i]);
+    }
+    check_values();
+    
+    bench(uris[1], iterations);
+    bench(uris[2], iterations);
+    
+    fprintf(stdout, "ok\n");
+    
+    return 0;
+}
@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <assert.h>
+#include <pthread.h>
+#include "simplehttp.h"
+#include "test_util.h"
+
+/*
+ * /batch runs sync and async sub-requests in order, in json and txt, and
+ * counts them against their own routes. bad lists are refused.
+ *
+ *   ./test_batch [port]
+ */
+
+
+static void get_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
+{
+    const char *key = simplehttp_arg(simplehttp_args(req), "key");
+    
+    evbuffer_add_printf(evb, "value-%s", key ? key : "");
+    evhttp_send_reply(req, HTTP_OK, "OK", evb);
+}
+
+static void async_reply(int fd, short what, void *arg)
+{
+    struct evhttp_request *req = (struct evhttp_request *)arg;
+    const char *key = simplehttp_arg(simplehttp_args(req), "key");
+    struct evbuffer *evb = evbuffer_new();
+    
+    evbuffer_add_printf(evb, "later-%s", key ? key : "");
+    evhttp_send_reply(req, HTTP_OK, "OK", evb);
+    evbuffer_free(evb);
+    simplehttp_async_finish(req);
+}
+
+static void async_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
+{
+    struct timeval tv = {0, 10000};
+    
+    simplehttp_async_enable(req);
+    event_once(-1, EV_TIMEOUT, async_reply, req, &tv);
+}
+
+// how many requests /get has had
+static void count_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
+{
+    struct simplehttp_stats *st = simplehttp_stats_new();
+    int i;
+    
+    simplehttp_stats_get(st);
+    for (i = 0; i < st->callback_count; i++) {
+        if (strcmp(st->stats_labels[i], "get") == 0) {
+            evbuffer_add_printf(evb, "%"PRIu64, st->stats_counts[i]);
+        }
+    }
+    simplehttp_stats_free(st);
+    evhttp_send_reply(req, HTTP_OK, "OK", evb);
+}
+
+static void *client(void *arg)
+{
+    char buf[4096];
+    char *body;
+    
+    body = test_read_reply(test_send_request_with("/batch", NULL, "/get?key=a\n\n/async?key=b\r\n/nope\n/get?key=c\n"), buf, sizeof(buf));
+    assert(strstr(buf, " 200 "));
+    assert(strcmp(body, "{\"responses\": ["
+                  "{\"uri\": \"/get?key=a\", \"status\": 200, \"body\": \"value-a\"}, "
+                  "{\"uri\": \"/async?key=b\", \"status\": 200, \"body\": \"later-b\"}, "
+                  "{\"uri\": \"/nope\", \"status\": 404, \"body\": \"\"}, "
+                  "{\"uri\": \"/get?key=c\", \"status\": 200, \"body\": \"value-c\"}]}\n") == 0);
+    
+    body = test_read_reply(test_send_request_with("/batch?format=txt", NULL, "[\"/get?key=\\u0078\", \"/async?key=y\"]"), buf, sizeof(buf));
+    assert(strcmp(body, "200 7 /get?key=x\nvalue-x\n200 7 /async?key=y\nlater-y\n") == 0);
+    
+    body = test_read_reply(test_send_request_with("/batch?format=txt&uri=/get%3Fkey%3Dz&uri=/batch", NULL, NULL), buf, sizeof(buf));
+    assert(strncmp(body, "200 7 /get?key=z\nvalue-z\n400 ", 28) == 0);
+    
+    // --batch-max-requests=4
+    body = test_read_reply(test_send_request_with("/batch", NULL, "/get\n/get\n/get\n/get\n/get\n"), buf, sizeof(buf));
+    assert(strstr(buf, " 400 ") && strstr(body, "more than 4"));
+    body = test_read_reply(test_send_request_with("/batch", NULL, "[\"/get\", /get]"), buf, sizeof(buf));
+    assert(strstr(buf, " 400 "));
+    body = test_read_reply(test_send_request_with("/batch", NULL, "get"), buf, sizeof(buf));
+    assert(strstr(buf, " 400 "));
+    body = test_read_reply(test_send_request_with("/batch", NULL, NULL), buf, sizeof(buf));
+    assert(strstr(buf, " 400 "));
+    
+    // the sub-requests went through /get's stats
+    body = test_read_reply(test_send_request_with("/count", NULL, NULL), buf, sizeof(buf));
+    assert(strcmp(body, "4") == 0);
+    
+    fprintf(stdout, "ok\n");
+    fflush(stdout);
+    
+    // there is no reply to /exit
+    close(test_send_request("/exit"));
+    
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    pthread_t thread;
+    char port_arg[32];
+    char max_arg[] = "--batch-max-requests=4";
+    // the option parser rewrites its arguments in place
+    char *args[] = {argv[0], port_arg, max_arg, NULL};
+    
+    test_port = 18102;
+    if (argc > 1) {
+        test_port = atoi(argv[1]);
+    }
+    sprintf(port_arg, "--port=%d", test_port);
+    
+    define_simplehttp_options();
+    assert(option_parse_command_line(3, args));
+    
+    simplehttp_init();
+    simplehttp_set_cb("/get*", get_cb, NULL);
+    simplehttp_set_cb("/async*", async_cb, NULL);
+    simplehttp_set_cb("/count*", count_cb, NULL);
+    simplehttp_set_cb("/exit*", test_exit_cb, NULL);
+    assert(simplehttp_listen());
+    
+    pthread_create(&thread, NULL, client, NULL);
+    simplehttp_run();
+    pthread_join(thread, NULL);
+    
+    simplehttp_free();
+    free_options();
+    
+    return 0;
+}
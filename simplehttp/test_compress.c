@@ -0,0 +1,212 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <pthread.h>
+#include <zlib.h>
+#include "simplehttp.h"
+#include "test_util.h"
+
+/*
+ * replies on a compressed route are gzip or deflate encoded as the client's
+ * Accept-Encoding allows, small replies and other routes are left alone, every
+ * reply of a compressed route carries Vary: Accept-Encoding and a compressed
+ * stream decodes back to every line.
+ *
+ *   ./test_compress [port]
+ */
+
+#define LINES 50000
+
+extern uint64_t simplehttp_compress_replies;
+extern uint64_t simplehttp_compress_bytes_in;
+extern uint64_t simplehttp_compress_bytes_out;
+
+
+static void big_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
+{
+    int i;
+    
+    for (i = 0; i < 1000; i++) {
+        evbuffer_add_printf(evb, "line %d of a fairly repetitive reply\n", i);
+    }
+    simplehttp_send_reply(req, HTTP_OK, "OK", evb);
+}
+
+static void small_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
+{
+    simplehttp_reply_bytes(req, HTTP_OK, "OK", "small\n", 6);
+}
+
+static int count_produce(struct simplehttp_stream *stream, struct evbuffer *evb, void *arg)
+{
+    int *next = (int *)arg;
+    int i;
+    
+    for (i = 0; i < 100 && *next < LINES; i++) {
+        evbuffer_add_printf(evb, "%d\n", (*next)++);
+    }
+    
+    return *next < LINES ? SIMPLEHTTP_STREAM_MORE : SIMPLEHTTP_STREAM_DONE;
+}
+
+static void count_done(struct simplehttp_stream *stream, int connected, void *arg)
+{
+    free(arg);
+}
+
+static void stream_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
+{
+    simplehttp_stream_start(req, HTTP_OK, "OK", count_produce, count_done, calloc(1, sizeof(int)));
+}
+
+// the whole response sent with accept as its Accept-Encoding, body points past the headers
+static char *request(const char *path, const char *accept, char **body, size_t *body_len)
+{
+    char headers[128];
+    size_t len;
+    char *buf;
+    
+    snprintf(headers, sizeof(headers), "Accept-Encoding: %s\r\n", accept);
+    buf = test_read_all(test_send_request_with(path, headers, NULL), &len);
+    *body = strstr(buf, "\r\n\r\n") + 4;
+    *body_len = len - (*body - buf);
+    
+    return buf;
+}
+
+// gzip or zlib wrapped data, decoded into a new string
+static char *inflate_all(const char *data, size_t len, size_t *out_len)
+{
+    z_stream zs;
+    size_t size = len * 20 + 1024;
+    char *out = malloc(size);
+    
+    memset(&zs, 0, sizeof(zs));
+    // 32 more window bits detects gzip or zlib headers
+    assert(inflateInit2(&zs, 15 + 32) == Z_OK);
+    zs.next_in = (unsigned char *)data;
+    zs.avail_in = len;
+    zs.next_out = (unsigned char *)out;
+    zs.avail_out = size - 1;
+    assert(inflate(&zs, Z_FINISH) == Z_STREAM_END);
+    *out_len = zs.total_out;
+    out[*out_len] = '\0';
+    inflateEnd(&zs);
+    
+    return out;
+}
+
+static void *client(void *arg)
+{
+    char *buf, *body, *plain, *line;
+    size_t len, plain_len;
+    int i;
+    
+    // gzip preferred, the body decodes to the original
+    buf = request("/big", "deflate, gzip", &body, &len);
+    assert(strstr(buf, "Content-Encoding: gzip"));
+    assert(strstr(buf, "Vary: Accept-Encoding"));
+    assert(!strstr(strstr(buf, "Vary: ") + 1, "Vary: "));
+    plain = inflate_all(body, len, &plain_len);
+    assert(len < plain_len / 4);
+    assert(strncmp(plain, "line 0 of a fairly repetitive reply\n", 36) == 0);
+    assert(strstr(plain, "line 999 of a fairly repetitive reply\n"));
+    free(plain);
+    free(buf);
+    
+    // refused with q=0, deflate it is
+    buf = request("/big", "gzip;q=0, deflate", &body, &len);
+    assert(strstr(buf, "Content-Encoding: deflate"));
+    plain = inflate_all(body, len, &plain_len);
+    assert(strstr(plain, "line 999 of a fairly repetitive reply\n"));
+    free(plain);
+    free(buf);
+    
+    // nothing acceptable, no Accept-Encoding at all, too small, or not a compressed route.
+    // plain replies of a compressed route vary on Accept-Encoding all the same
+    buf = request("/big", "br", &body, &len);
+    assert(!strstr(buf, "Content-Encoding"));
+    assert(strstr(buf, "Vary: Accept-Encoding"));
+    assert(strncmp(body, "line 0 ", 7) == 0);
+    free(buf);
+    buf = test_read_all(test_send_request("/big"), &len);
+    assert(!strstr(buf, "Content-Encoding"));
+    assert(strstr(buf, "Vary: Accept-Encoding"));
+    free(buf);
+    buf = request("/small", "gzip", &body, &len);
+    assert(!strstr(buf, "Content-Encoding"));
+    assert(strstr(buf, "Vary: Accept-Encoding"));
+    assert(strcmp(body, "small\n") == 0);
+    free(buf);
+    buf = request("/plain", "gzip", &body, &len);
+    assert(!strstr(buf, "Content-Encoding"));
+    assert(!strstr(buf, "Vary"));
+    free(buf);
+    
+    // a compressed stream, chunked on the outside
+    buf = request("/stream", "gzip", &body, &len);
+    assert(strstr(buf, "Content-Encoding: gzip"));
+    assert(strstr(buf, "Vary: Accept-Encoding"));
+    assert(strstr(buf, "Transfer-Encoding: chunked"));
+    len = test_dechunk(body);
+    plain = inflate_all(body, len, &plain_len);
+    line = plain;
+    for (i = 0; i < LINES; i++) {
+        assert(atoi(line) == i);
+        line = strchr(line, '\n') + 1;
+    }
+    assert(*line == '\0');
+    free(plain);
+    free(buf);
+    
+    assert(simplehttp_compress_replies == 3);
+    assert(simplehttp_compress_bytes_out < simplehttp_compress_bytes_in);
+    
+    fprintf(stdout, "ok\n");
+    fflush(stdout);
+    
+    // there is no reply to /exit
+    close(test_send_request("/exit"));
+    
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    pthread_t thread;
+    char name_arg[] = "test_compress";
+    char port_arg[32];
+    // the option parser rewrites its arguments in place
+    char *args[] = {name_arg, port_arg, NULL};
+    
+    test_port = 18097;
+    if (argc > 1) {
+        test_port = atoi(argv[1]);
+    }
+    sprintf(port_arg, "--port=%d", test_port);
+    
+    define_simplehttp_options();
+    assert(option_parse_command_line(2, args));
+    
+    simplehttp_init();
+    simplehttp_set_cb("/big*", big_cb, NULL);
+    simplehttp_set_cb("/small*", small_cb, NULL);
+    simplehttp_set_cb("/stream*", stream_cb, NULL);
+    simplehttp_set_cb("/plain*", big_cb, NULL);
+    simplehttp_set_cb("/exit*", test_exit_cb, NULL);
+    simplehttp_set_cb_flags("/big*", SIMPLEHTTP_CB_COMPRESS);
+    simplehttp_set_cb_flags("/small*", SIMPLEHTTP_CB_COMPRESS);
+    simplehttp_set_cb_flags("/stream*", SIMPLEHTTP_CB_COMPRESS);
+    assert(simplehttp_listen());
+    
+    pthread_create(&thread, NULL, client, NULL);
+    simplehttp_run();
+    pthread_join(thread, NULL);
+    
+    simplehttp_free();
+    free_options();
+    
+    return 0;
+}
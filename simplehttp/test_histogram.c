@@ -0,0 +1,51 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <inttypes.h>
+#include "histogram.h"
+
+int main(int argc, char **argv)
+{
+    struct simplehttp_histogram a, b;
+    uint64_t i;
+    
+    simplehttp_histogram_reset(&a);
+    simplehttp_histogram_reset(&b);
+    
+    for (i = 0; i < 20000; i++) {
+        simplehttp_histogram_record(i < 10000 ? &a : &b, i);
+    }
+    simplehttp_histogram_merge(&a, &b);
+    
+    assert(a.count == 20000);
+    assert(a.max == 19999);
+    assert(a.sum / a.count == 9999);
+    assert(simplehttp_histogram_percentile(&a, 50.0) == 10239);
+    assert(simplehttp_histogram_percentile(&a, 95.0) == 19455);
+    assert(simplehttp_histogram_percentile(&a, 99.0) == 19999);
+    assert(simplehttp_histogram_percentile(&a, 100.0) == 19999);
+    
+    // every value is reported within one sub bucket (1/16th) of itself
+    for (i = 0; i < (1 << 24); i += 97) {
+        simplehttp_histogram_reset(&b);
+        simplehttp_histogram_record(&b, i);
+        simplehttp_histogram_record(&b, i + (1 << 30));
+        assert(simplehttp_histogram_percentile(&b, 50.0) >= i);
+        assert(simplehttp_histogram_percentile(&b, 50.0) <= i + (i / 16) + 1);
+    }
+    
+    // a bound moved up to its sub bucket top counts every value at or below the bound
+    for (i = 0; i < (1 << 24); i += 97) {
+        simplehttp_histogram_reset(&b);
+        simplehttp_histogram_record(&b, i);
+        simplehttp_histogram_record(&b, simplehttp_histogram_bucket_top(i) + 1);
+        assert(simplehttp_histogram_bucket_top(i) >= i);
+        assert(simplehttp_histogram_bucket_top(i) <= i + (i / 16) + 1);
+        assert(simplehttp_histogram_count_below(&b, simplehttp_histogram_bucket_top(i)) == 1);
+    }
+    assert(simplehttp_histogram_bucket_top(100) == 103);
+    
+    fprintf(stdout, "ok\n");
+    
+    return 0;
+}
@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <assert.h>
+#include <pthread.h>
+#include "simplehttp.h"
+#include "test_util.h"
+
+/*
+ * a callback that blocks the event loop shows up as loop utilization and as
+ * lag on the loop's timer in simplehttp_stats_get()
+ *
+ *   ./test_loop [port]
+ */
+
+
+static void block_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
+{
+    usleep(250000);
+    evhttp_send_reply(req, HTTP_OK, "OK", evb);
+}
+
+static void loop_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
+{
+    struct simplehttp_stats *st = simplehttp_stats_new();
+    
+    simplehttp_stats_get(st);
+    evbuffer_add_printf(evb, "%.1f %.1f %.1f %"PRIu64" %"PRIu64, st->loop_utilization,
+                        st->loop_utilization_max, st->loop_cpu, st->loop_lag_99, st->loop_lag_max);
+    simplehttp_stats_free(st);
+    evhttp_send_reply(req, HTTP_OK, "OK", evb);
+}
+
+static void *client(void *arg)
+{
+    char buf[1024];
+    double utilization, utilization_max, cpu;
+    uint64_t lag_99, lag_max;
+    
+    // let the loop's timer get going
+    usleep(300000);
+    assert(sscanf(test_read_reply(test_send_request("/loop"), buf, sizeof(buf)), "%lf %lf %lf %"SCNu64" %"SCNu64,
+                  &utilization, &utilization_max, &cpu, &lag_99, &lag_max) == 5);
+    // an idle loop
+    assert(utilization < 10.0 && lag_max < 50000);
+    
+    test_read_reply(test_send_request("/block"), buf, sizeof(buf));
+    test_read_reply(test_send_request("/block"), buf, sizeof(buf));
+    usleep(300000);
+    
+    assert(sscanf(test_read_reply(test_send_request("/loop"), buf, sizeof(buf)), "%lf %lf %lf %"SCNu64" %"SCNu64,
+                  &utilization, &utilization_max, &cpu, &lag_99, &lag_max) == 5);
+    // 500ms blocked out of a bit over a second, the timer was held up by each
+    assert(utilization > 25.0 && utilization <= 100.0);
+    assert(utilization_max == utilization);
+    // sleeping, not using cpu
+    assert(cpu < utilization);
+    assert(lag_max >= 140000 && lag_max < 400000);
+    assert(lag_99 >= 140000);
+    
+    fprintf(stdout, "ok\n");
+    fflush(stdout);
+    
+    // there is no reply to /exit
+    close(test_send_request("/exit"));
+    
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    pthread_t thread;
+    char port_arg[32];
+    // the option parser rewrites its arguments in place
+    char *args[] = {argv[0], port_arg, NULL};
+    
+    test_port = 18100;
+    if (argc > 1) {
+        test_port = atoi(argv[1]);
+    }
+    sprintf(port_arg, "--port=%d", test_port);
+    
+    define_simplehttp_options();
+    assert(option_parse_command_line(2, args));
+    
+    simplehttp_init();
+    simplehttp_set_cb("/block*", block_cb, NULL);
+    simplehttp_set_cb("/loop*", loop_cb, NULL);
+    simplehttp_set_cb("/exit*", test_exit_cb, NULL);
+    assert(simplehttp_listen());
+    
+    pthread_create(&thread, NULL, client, NULL);
+    simplehttp_run();
+    pthread_join(thread, NULL);
+    
+    simplehttp_free();
+    free_options();
+    
+    return 0;
+}
@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "options.h"
+
+/*
+ * bound options track the command line and later option_set() changes,
+ * which only runtime options allow and which are validated like the command line
+ */
+
+static int changes = 0;
+static char listed[256];
+
+static void changed_cb(const char *option_name, void *arg)
+{
+    assert(strcmp(option_name, "limit") == 0);
+    assert(arg == &changes);
+    changes++;
+}
+
+static void list_cb(const char *option_name, const char *value, int is_str, void *arg)
+{
+    sprintf(listed + strlen(listed), "%s=%s%s;", option_name, value, is_str ? "(s)" : "");
+}
+
+static int positive_cb(int value)
+{
+    return value > 0;
+}
+
+int main(int argc, char **argv)
+{
+    int limit = 0, verbose = -1, port = 0;
+    char *name = NULL, *held, *bound;
+    char sep = '\0';
+    char arg0[] = "test_options";
+    char arg1[] = "--limit=10";
+    char arg2[] = "--name=first";
+    char *args[] = {arg0, arg1, arg2, NULL};
+    
+    option_define_int("limit", OPT_OPTIONAL, 5, NULL, positive_cb, NULL);
+    option_define_bool("verbose", OPT_OPTIONAL, 1, NULL, NULL, NULL);
+    option_define_str("name", OPT_OPTIONAL, NULL, NULL, NULL, NULL);
+    option_define_char("sep", OPT_OPTIONAL, ',', NULL, NULL, NULL);
+    option_define_int("port", OPT_OPTIONAL, 8080, NULL, NULL, NULL);
+    assert(option_parse_command_line(3, args));
+    
+    // resolved from the command line, or the default
+    assert(option_bind_int("limit", &limit) == 1 && limit == 10);
+    assert(option_bind_int("verbose", &verbose) == 1 && verbose == 1);
+    assert(option_bind_str("name", &name) == 1 && strcmp(name, "first") == 0);
+    assert(option_bind_char("sep", &sep) == 1 && sep == ',');
+    assert(option_bind_int("port", &port) == 1 && port == 8080);
+    assert(option_bind_int("name", &limit) == -1);
+    assert(option_bind_int("missing", &limit) == -1);
+    
+    // only runtime options change
+    assert(option_set("port", "9090") == -1 && port == 8080);
+    assert(option_set_runtime("limit", changed_cb, &changes) == 1);
+    assert(option_set_runtime("verbose", NULL, NULL) == 1);
+    assert(option_set_runtime("name", NULL, NULL) == 1);
+    assert(option_set_runtime("sep", NULL, NULL) == 1);
+    
+    assert(option_set("limit", "20") == 1 && limit == 20 && changes == 1);
+    assert(option_get_int("limit") == 20);
+    // rejected by the option's cb, or not a number, nothing changes
+    assert(option_set("limit", "-1") == 0 && limit == 20);
+    assert(option_set("limit", "2x") == 0 && limit == 20 && changes == 1);
+    assert(option_set("verbose", "false") == 1 && verbose == 0);
+    assert(option_set("verbose", "maybe") == 0 && verbose == 0);
+    assert(option_set("name", "second") == 1 && strcmp(name, "second") == 0);
+    assert(strcmp(option_get_str("name"), "second") == 0);
+    // strings handed out before a change stay valid
+    held = option_get_str("name");
+    bound = name;
+    assert(option_set("name", "third") == 1 && strcmp(name, "third") == 0);
+    assert(strcmp(held, "second") == 0 && strcmp(bound, "second") == 0);
+    assert(option_set("name", "second") == 1);
+    assert(option_set("sep", "|") == 1 && sep == '|');
+    assert(option_set("sep", "||") == 0 && sep == '|');
+    
+    option_foreach_runtime(list_cb, NULL);
+    assert(strcmp(listed, "limit=20;name=second(s);sep=|(s);verbose=false;") == 0);
+    
+    free(name);
+    free_options();
+    fprintf(stdout, "ok\n");
+    
+    return 0;
+}
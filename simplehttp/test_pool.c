@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "simplehttp.h"
+
+#define THREADS 4
+#define OBJECTS 10000
+
+static int slab_allocs = 0;
+static int slab_frees = 0;
+
+static void *count_alloc(size_t size)
+{
+    __sync_fetch_and_add(&slab_allocs, 1);
+    return malloc(size);
+}
+
+static void count_release(void *ptr)
+{
+    __sync_fetch_and_add(&slab_frees, 1);
+    free(ptr);
+}
+
+struct thing {
+    uint64_t id;
+    char name[40];
+};
+
+static struct simplehttp_pool *things;
+
+// each thread fills and checks its own objects while sharing the pool
+static void *hammer(void *arg)
+{
+    struct thing **held = malloc(OBJECTS * sizeof(*held));
+    uint64_t base = (uintptr_t)arg * OBJECTS;
+    int round, i;
+    
+    for (round = 0; round < 10; round++) {
+        for (i = 0; i < OBJECTS; i++) {
+            held[i] = simplehttp_pool_get(things);
+            held[i]->id = base + i;
+        }
+        for (i = 0; i < OBJECTS; i++) {
+            assert(held[i]->id == base + i);
+            simplehttp_pool_put(things, held[i]);
+        }
+    }
+    free(held);
+    
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    pthread_t threads[THREADS];
+    struct thing *a, *b, *c;
+    char *small, *big;
+    int i, allocs;
+    
+    simplehttp_pool_set_allocator(count_alloc, count_release);
+    things = simplehttp_pool_new("thing", sizeof(struct thing));
+    
+    // freed objects are handed out again before the pool grows
+    a = simplehttp_pool_get(things);
+    b = simplehttp_pool_calloc(things);
+    assert(a && b && a != b);
+    assert(((uintptr_t)a % 16) == 0 && ((uintptr_t)b % 16) == 0);
+    assert(b->id == 0 && b->name[0] == '\0');
+    assert(slab_allocs == 1);
+    simplehttp_pool_put(things, a);
+    c = simplehttp_pool_get(things);
+    assert(c == a);
+    simplehttp_pool_put(things, b);
+    simplehttp_pool_put(things, c);
+    
+    // one slab per SIMPLEHTTP_POOL_SLAB bytes of objects
+    allocs = slab_allocs;
+    for (i = 0; i < THREADS; i++) {
+        pthread_create(&threads[i], NULL, hammer, (void *)(uintptr_t)i);
+    }
+    for (i = 0; i < THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    assert(slab_allocs - allocs <= (THREADS * OBJECTS * 48) / (SIMPLEHTTP_POOL_SLAB - 16) + THREADS);
+    
+    // size classes reuse by class, big allocations pass through
+    allocs = slab_allocs;
+    small = simplehttp_slab_alloc(100);
+    memset(small, 'x', 100);
+    simplehttp_slab_free(small, 100);
+    assert(simplehttp_slab_alloc(128) == small);
+    simplehttp_slab_free(small, 128);
+    assert(slab_allocs == allocs + 1);
+    big = simplehttp_slab_alloc(SIMPLEHTTP_POOL_MAX_CLASS + 1);
+    assert(slab_allocs == allocs + 2);
+    simplehttp_slab_free(big, SIMPLEHTTP_POOL_MAX_CLASS + 1);
+    assert(slab_frees == 1);
+    
+    simplehttp_pools_free();
+    assert(slab_frees == slab_allocs);
+    
+    fprintf(stdout, "ok\n");
+    return 0;
+}
@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <pthread.h>
+#include "simplehttp.h"
+#include "test_util.h"
+
+/*
+ * /debug/profile samples a busy route and names it, in both modes.
+ * link with -rdynamic so burn_cpu() shows up by name.
+ *
+ *   ./test_profile [port]
+ */
+
+static volatile int spinning = 1;
+volatile unsigned long burn_result = 0;
+
+// not static, so it is in the dynamic symbol table
+void burn_cpu(int usec)
+{
+    struct timeval start, now;
+    unsigned long x = 0;
+    
+    gettimeofday(&start, NULL);
+    do {
+        for (x = 0; x < 10000; x++) {
+            burn_result += x;
+        }
+        gettimeofday(&now, NULL);
+    } while ((now.tv_sec - start.tv_sec) * 1000000 + (now.tv_usec - start.tv_usec) < usec);
+}
+
+static void spin_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
+{
+    burn_cpu(5000);
+    evhttp_send_reply(req, HTTP_OK, "OK", evb);
+}
+
+// keeps /spin busy while a profile runs
+static void *spinner(void *arg)
+{
+    char buf[1024];
+    
+    while (spinning) {
+        test_read_reply(test_send_request("/spin"), buf, sizeof(buf));
+    }
+    
+    return NULL;
+}
+
+static void *client(void *arg)
+{
+    static char buf[1024 * 1024];
+    pthread_t thread;
+    int profile_fd;
+    char *body;
+    
+    pthread_create(&thread, NULL, spinner, NULL);
+    
+    profile_fd = test_send_request("/debug/profile?seconds=1&hz=500");
+    usleep(100000);
+    // one at a time
+    body = test_read_reply(test_send_request("/debug/profile?seconds=1"), buf, sizeof(buf));
+    assert(strstr(buf, " 503 "));
+    body = test_read_reply(profile_fd, buf, sizeof(buf));
+    assert(strstr(body, ";generic_request_handler;"));
+    assert(strstr(body, ";burn_cpu "));
+    
+    body = test_read_reply(test_send_request("/debug/profile?seconds=1&mode=routes&format=txt"), buf, sizeof(buf));
+    assert(strncmp(strstr(body, "/spin*"), "/spin* ", 7) == 0);
+    
+    body = test_read_reply(test_send_request("/debug/profile?seconds=0"), buf, sizeof(buf));
+    assert(strstr(buf, " 400 "));
+    
+    spinning = 0;
+    pthread_join(thread, NULL);
+    
+    fprintf(stdout, "ok\n");
+    fflush(stdout);
+    
+    // there is no reply to /exit
+    close(test_send_request("/exit"));
+    
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    pthread_t thread;
+    char port_arg[32];
+    char profiling_arg[] = "--enable-profiling";
+    // the option parser rewrites its arguments in place
+    char *args[] = {argv[0], port_arg, profiling_arg, NULL};
+    
+    test_port = 18099;
+    if (argc > 1) {
+        test_port = atoi(argv[1]);
+    }
+    sprintf(port_arg, "--port=%d", test_port);
+    
+    define_simplehttp_options();
+    assert(option_parse_command_line(3, args));
+    
+    simplehttp_init();
+    simplehttp_set_cb("/spin*", spin_cb, NULL);
+    simplehttp_set_cb("/exit*", test_exit_cb, NULL);
+    assert(simplehttp_listen());
+    
+    pthread_create(&thread, NULL, client, NULL);
+    simplehttp_run();
+    pthread_join(thread, NULL);
+    
+    simplehttp_free();
+    free_options();
+    
+    return 0;
+}
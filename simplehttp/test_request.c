@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <inttypes.h>
+#include "simplehttp.h"
+#include "request.h"
+
+/*
+ * stress the per-request bookkeeping with a large number of open async
+ * requests; lookups must stay constant time however many are live.
+ *
+ *   ./test_request [requests]
+ */
+
+#define LOOKUP_ROUNDS 20
+
+int main(int argc, char **argv)
+{
+    struct evhttp_request **reqs;
+    simplehttp_ts start_ts, end_ts;
+    uint64_t lookups = 0;
+    int n = 50000;
+    int i, round;
+    
+    if (argc > 1) {
+        n = atoi(argv[1]);
+    }
+    
+    reqs = malloc(n * sizeof(*reqs));
+    for (i = 0; i < n; i++) {
+        reqs[i] = evhttp_request_new(NULL, NULL);
+        simplehttp_request_new(reqs[i], i + 1);
+        simplehttp_async_enable(reqs[i]);
+    }
+    assert(HASH_COUNT(simplehttp_reqs) == n);
+    
+    simplehttp_ts_get(&start_ts);
+    for (round = 0; round < LOOKUP_ROUNDS; round++) {
+        for (i = 0; i < n; i++) {
+            assert(simplehttp_request_id(reqs[i]) == i + 1);
+            assert(simplehttp_async_check(reqs[i]) != NULL);
+            lookups += 2;
+        }
+    }
+    simplehttp_ts_get(&end_ts);
+    
+    fprintf(stdout, "%d open async requests, %"PRIu64" lookups, %.1fns/lookup\n",
+            n, lookups, simplehttp_ts_diff(start_ts, end_ts) * 1000.0 / lookups);
+    
+    // finish from both ends so removal isn't only ever from the head
+    for (i = 0; i < n / 2; i++) {
+        simplehttp_async_finish(reqs[i]);
+        simplehttp_async_finish(reqs[n - i - 1]);
+    }
+    if (n % 2) {
+        simplehttp_async_finish(reqs[n / 2]);
+    }
+    assert(HASH_COUNT(simplehttp_reqs) == 0);
+    assert(simplehttp_request_id(reqs[0]) == 0);
+    
+    for (i = 0; i < n; i++) {
+        evhttp_request_free(reqs[i]);
+    }
+    free(reqs);
+    
+    fprintf(stdout, "ok\n");
+    
+    return 0;
+}
@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <pthread.h>
+#include "simplehttp.h"
+#include "test_util.h"
+
+/*
+ * streams a large chunked reply through a producer and checks every line
+ * arrives, that a client hanging up mid stream reaches done_cb, and that a
+ * kicked push stream gets its message before being closed.
+ *
+ *   ./test_stream [port]
+ */
+
+#define LINES 200000
+
+static volatile int done_connected = -1;
+static volatile int produce_calls = 0;
+
+struct counter {
+    int next;
+    int end;
+};
+
+static int count_produce(struct simplehttp_stream *stream, struct evbuffer *evb, void *arg)
+{
+    struct counter *counter = (struct counter *)arg;
+    int i;
+    
+    produce_calls++;
+    for (i = 0; i < 100 && counter->next < counter->end; i++) {
+        evbuffer_add_printf(evb, "%d\n", counter->next++);
+    }
+    
+    return counter->next < counter->end ? SIMPLEHTTP_STREAM_MORE : SIMPLEHTTP_STREAM_DONE;
+}
+
+static void count_done(struct simplehttp_stream *stream, int connected, void *arg)
+{
+    free(arg);
+    done_connected = connected;
+}
+
+static void count_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
+{
+    struct counter *counter = calloc(1, sizeof(*counter));
+    
+    counter->end = simplehttp_arg_int(simplehttp_args(req), "n", LINES);
+    simplehttp_stream_start(req, HTTP_OK, "OK", count_produce, count_done, counter);
+}
+
+static void push_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
+{
+    struct simplehttp_stream *stream;
+    
+    stream = simplehttp_stream_start(req, HTTP_OK, "OK", NULL, count_done, NULL);
+    evbuffer_add_printf(evb, "hello\n");
+    assert(simplehttp_stream_send(stream, evb));
+    simplehttp_stream_kick(stream, "KICKED\n");
+    assert(!simplehttp_stream_send(stream, evb));
+}
+
+static void wait_for_done()
+{
+    int i;
+    
+    for (i = 0; i < 500 && done_connected == -1; i++) {
+        usleep(10000);
+    }
+}
+
+static void *client(void *arg)
+{
+    char *buf, *body, *line;
+    char path[64];
+    size_t len;
+    int fd, i;
+    
+    // every line, in order, through many producer calls
+    fd = test_send_request("/count");
+    buf = test_read_all(fd, &len);
+    assert(strstr(buf, "Transfer-Encoding: chunked"));
+    body = strstr(buf, "\r\n\r\n") + 4;
+    test_dechunk(body);
+    line = body;
+    for (i = 0; i < LINES; i++) {
+        assert(atoi(line) == i);
+        line = strchr(line, '\n') + 1;
+    }
+    assert(*line == '\0');
+    free(buf);
+    wait_for_done();
+    assert(done_connected == 1);
+    assert(produce_calls >= LINES / 100);
+    
+    // hang up early, the producer must stop and done_cb see the disconnect
+    done_connected = -1;
+    sprintf(path, "/count?n=%d", LINES * 100);
+    fd = test_send_request(path);
+    assert(read(fd, path, sizeof(path)) > 0);
+    close(fd);
+    wait_for_done();
+    assert(done_connected == 0);
+    
+    // unsent output is dropped for the kick message, then the connection closes
+    done_connected = -1;
+    fd = test_send_request("/push");
+    buf = test_read_all(fd, &len);
+    assert(!strstr(buf, "hello\n"));
+    assert(len >= 7 && strcmp(buf + len - 7, "KICKED\n") == 0);
+    free(buf);
+    wait_for_done();
+    assert(done_connected == 0);
+    
+    fprintf(stdout, "ok\n");
+    fflush(stdout);
+    
+    // there is no reply to /exit
+    close(test_send_request("/exit"));
+    
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    pthread_t thread;
+    char name_arg[] = "test_stream";
+    char port_arg[32];
+    // the option parser rewrites its arguments in place
+    char *args[] = {name_arg, port_arg, NULL};
+    
+    test_port = 18096;
+    if (argc > 1) {
+        test_port = atoi(argv[1]);
+    }
+    sprintf(port_arg, "--port=%d", test_port);
+    
+    define_simplehttp_options();
+    assert(option_parse_command_line(2, args));
+    
+    simplehttp_init();
+    simplehttp_set_cb("/count*", count_cb, NULL);
+    simplehttp_set_cb("/push*", push_cb, NULL);
+    simplehttp_set_cb("/exit*", test_exit_cb, NULL);
+    assert(simplehttp_listen());
+    
+    pthread_create(&thread, NULL, client, NULL);
+    simplehttp_run();
+    pthread_join(thread, NULL);
+    
+    simplehttp_free();
+    free_options();
+    
+    return 0;
+}
@@ -0,0 +1,155 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <pthread.h>
+#include "simplehttp.h"
+#include "test_util.h"
+
+/*
+ * async requests past their route deadline get a 503 and their timeout cb,
+ * ones finishing in time or without a timeout cb are untouched, routes
+ * without a deadline fall back to --request-timeout-ms and slow requests are
+ * counted.
+ *
+ *   ./test_timeout [port]
+ */
+
+extern uint64_t simplehttp_slow_requests;
+extern uint64_t simplehttp_request_timeouts;
+
+static int timeout_cb_runs = 0;
+static struct event late_ev;
+static struct event nocb_ev;
+
+static void hang_timeout_cb(struct evhttp_request *req, void *arg)
+{
+    timeout_cb_runs++;
+}
+
+static void hang_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
+{
+    simplehttp_async_enable(req);
+    simplehttp_async_set_timeout_cb(req, hang_timeout_cb, NULL);
+}
+
+static void late_reply(int fd, short what, void *arg)
+{
+    struct evhttp_request *req = (struct evhttp_request *)arg;
+    
+    simplehttp_reply_bytes(req, HTTP_OK, "OK", "late\n", 5);
+    simplehttp_async_finish(req);
+}
+
+static void late_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
+{
+    struct timeval tv = {0, 10000};
+    
+    simplehttp_async_enable(req);
+    evtimer_set(&late_ev, late_reply, req);
+    evtimer_add(&late_ev, &tv);
+}
+
+// past its deadline, but nothing told simplehttp how to let go of req
+static void nocb_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
+{
+    struct timeval tv = {0, 80000};
+    
+    simplehttp_async_enable(req);
+    evtimer_set(&nocb_ev, late_reply, req);
+    evtimer_add(&nocb_ev, &tv);
+}
+
+static void slow_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
+{
+    usleep(20000);
+    evhttp_send_reply(req, HTTP_OK, "OK", evb);
+}
+
+// the response code of path's reply, the reply is left in buf
+static int request(const char *path, char *buf, size_t size)
+{
+    test_read_reply(test_send_request(path), buf, size);
+    return atoi(buf + 9);
+}
+
+static void *client(void *arg)
+{
+    char buf[4096];
+    uint64_t slow;
+    
+    assert(request("/hang", buf, sizeof(buf)) == 503);
+    assert(strstr(buf, "request timed out after 50ms"));
+    assert(timeout_cb_runs == 1);
+    assert(simplehttp_request_timeouts == 1);
+    
+    assert(request("/late", buf, sizeof(buf)) == 200);
+    assert(strstr(buf, "\r\n\r\nlate\n"));
+    assert(timeout_cb_runs == 1);
+    assert(simplehttp_request_timeouts == 1);
+    
+    assert(request("/nocb", buf, sizeof(buf)) == 200);
+    assert(strstr(buf, "\r\n\r\nlate\n"));
+    assert(simplehttp_request_timeouts == 1);
+    
+    assert(request("/default", buf, sizeof(buf)) == 503);
+    assert(strstr(buf, "request timed out after 30ms"));
+    assert(timeout_cb_runs == 2);
+    assert(simplehttp_request_timeouts == 2);
+    
+    // the timed out request was a slow one too
+    slow = simplehttp_slow_requests;
+    assert(slow >= 1);
+    assert(request("/slow", buf, sizeof(buf)) == 200);
+    assert(simplehttp_slow_requests == slow + 1);
+    
+    fprintf(stdout, "ok\n");
+    fflush(stdout);
+    
+    // there is no reply to /exit
+    close(test_send_request("/exit"));
+    
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    pthread_t thread;
+    char name_arg[] = "test_timeout";
+    char port_arg[32];
+    char slow_arg[] = "--slow-request-ms=15";
+    char timeout_arg[] = "--request-timeout-ms=30";
+    // the option parser rewrites its arguments in place
+    char *args[] = {name_arg, port_arg, slow_arg, timeout_arg, NULL};
+    
+    test_port = 18095;
+    if (argc > 1) {
+        test_port = atoi(argv[1]);
+    }
+    sprintf(port_arg, "--port=%d", test_port);
+    
+    define_simplehttp_options();
+    assert(option_parse_command_line(4, args));
+    
+    simplehttp_init();
+    simplehttp_set_cb("/hang*", hang_cb, NULL);
+    simplehttp_set_cb_timeout("/hang*", 50);
+    simplehttp_set_cb("/late*", late_cb, NULL);
+    simplehttp_set_cb_timeout("/late*", 50);
+    simplehttp_set_cb("/nocb*", nocb_cb, NULL);
+    simplehttp_set_cb_timeout("/nocb*", 50);
+    simplehttp_set_cb("/default*", hang_cb, NULL);
+    simplehttp_set_cb("/slow*", slow_cb, NULL);
+    simplehttp_set_cb("/exit*", test_exit_cb, NULL);
+    assert(simplehttp_listen());
+    
+    pthread_create(&thread, NULL, client, NULL);
+    simplehttp_run();
+    pthread_join(thread, NULL);
+    
+    simplehttp_free();
+    free_options();
+    
+    return 0;
+}
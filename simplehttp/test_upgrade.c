@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <assert.h>
+#include <pthread.h>
+#include "simplehttp.h"
+#include "test_util.h"
+
+/*
+ * SIGUSR2 re-executes the process, the new one takes over the listening socket
+ * and the old one finishes its in-flight request before exiting. a new
+ * process that exits before taking over leaves the old one serving, ready to
+ * restart again.
+ *
+ *   ./test_upgrade [port]
+ */
+
+static struct event slow_ev;
+
+static void pid_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
+{
+    evbuffer_add_printf(evb, "%d", (int)getpid());
+    evhttp_send_reply(req, HTTP_OK, "OK", evb);
+}
+
+static void slow_reply(int fd, short what, void *arg)
+{
+    struct evhttp_request *req = (struct evhttp_request *)arg;
+    
+    simplehttp_reply_bytes(req, HTTP_OK, "OK", "slow\n", 5);
+    simplehttp_async_finish(req);
+}
+
+// outlives the handoff, the old process has to wait for it
+static void slow_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
+{
+    struct timeval tv = {1, 0};
+    
+    simplehttp_async_enable(req);
+    evtimer_set(&slow_ev, slow_reply, req);
+    evtimer_add(&slow_ev, &tv);
+}
+
+static void *client(void *arg)
+{
+    char buf[1024];
+    int slow_fd, pid, tries;
+    
+    assert(atoi(test_read_reply(test_send_request("/pid"), buf, sizeof(buf))) == getpid());
+    
+    setenv("TEST_UPGRADE_FAIL", "1", 1);
+    kill(getpid(), SIGUSR2);
+    usleep(300000);
+    unsetenv("TEST_UPGRADE_FAIL");
+    assert(atoi(test_read_reply(test_send_request("/pid"), buf, sizeof(buf))) == getpid());
+    
+    slow_fd = test_send_request("/slow");
+    
+    setenv("TEST_UPGRADE_CHILD", "1", 1);
+    kill(getpid(), SIGUSR2);
+    
+    // the new process answers once the old one has stopped accepting
+    for (tries = 0; tries < 500; tries++) {
+        pid = atoi(test_read_reply(test_send_request("/pid"), buf, sizeof(buf)));
+        if (pid != getpid()) {
+            break;
+        }
+        usleep(10000);
+    }
+    assert(pid != getpid());
+    
+    // handed over while in flight, still answered by us
+    assert(strcmp(test_read_reply(slow_fd, buf, sizeof(buf)), "slow\n") == 0);
+    
+    fprintf(stdout, "ok\n");
+    fflush(stdout);
+    
+    // there is no reply to /exit
+    close(test_send_request("/exit"));
+    
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    pthread_t thread;
+    int child = getenv("TEST_UPGRADE_CHILD") != NULL;
+    char port_arg[32];
+    char socket_arg[] = "--upgrade-socket=/tmp/test_upgrade.sock";
+    char drain_arg[] = "--drain-timeout-ms=5000";
+    // the option parser rewrites its arguments in place
+    char *args[] = {NULL, port_arg, socket_arg, drain_arg, NULL};
+    
+    if (getenv("TEST_UPGRADE_FAIL")) {
+        return 3;
+    }
+    test_port = 18098;
+    if (argc > 1 && strncmp(argv[1], "--", 2) != 0) {
+        test_port = atoi(argv[1]);
+    }
+    sprintf(port_arg, "--port=%d", test_port);
+    // re-executed as argv[0] with the arguments we parse below
+    args[0] = argv[0];
+    
+    define_simplehttp_options();
+    assert(option_parse_command_line(4, args));
+    
+    simplehttp_init();
+    simplehttp_set_cb("/pid*", pid_cb, NULL);
+    simplehttp_set_cb("/slow*", slow_cb, NULL);
+    simplehttp_set_cb("/exit*", test_exit_cb, NULL);
+    assert(simplehttp_listen());
+    
+    if (!child) {
+        pthread_create(&thread, NULL, client, NULL);
+    }
+    simplehttp_run();
+    if (!child) {
+        pthread_join(thread, NULL);
+    }
+    
+    simplehttp_free();
+    free_options();
+    
+    return 0;
+}
@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "test_util.h"
+
+int test_port = 0;
+
+int test_send_request_with(const char *path, const char *headers, const char *body)
+{
+    struct sockaddr_in sin;
+    char line[1024];
+    int fd, len;
+    
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(test_port);
+    sin.sin_addr.s_addr = inet_addr("127.0.0.1");
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    assert(connect(fd, (struct sockaddr *)&sin, sizeof(sin)) == 0);
+    
+    if (body) {
+        len = snprintf(line, sizeof(line), "POST %s HTTP/1.1\r\nHost: localhost\r\n%sConnection: close\r\n"
+                       "Content-Length: %d\r\n\r\n%s", path, headers ? headers : "", (int)strlen(body), body);
+    } else {
+        len = snprintf(line, sizeof(line), "GET %s HTTP/1.1\r\nHost: localhost\r\n%sConnection: close\r\n\r\n",
+                       path, headers ? headers : "");
+    }
+    assert(len < sizeof(line));
+    assert(write(fd, line, len) == len);
+    
+    return fd;
+}
+
+int test_send_request(const char *path)
+{
+    return test_send_request_with(path, NULL, NULL);
+}
+
+char *test_read_reply(int fd, char *buf, size_t len)
+{
+    size_t have = 0;
+    ssize_t n;
+    
+    while ((n = read(fd, buf + have, len - have - 1)) > 0) {
+        have += n;
+    }
+    close(fd);
+    buf[have] = '\0';
+    assert(strstr(buf, "\r\n\r\n"));
+    
+    return strstr(buf, "\r\n\r\n") + 4;
+}
+
+char *test_read_all(int fd, size_t *len)
+{
+    size_t size = 65536, have = 0;
+    char *buf = malloc(size);
+    ssize_t n;
+    
+    while ((n = read(fd, buf + have, size - have - 1)) > 0) {
+        have += n;
+        if (size - have < 4096) {
+            size *= 2;
+            buf = realloc(buf, size);
+        }
+    }
+    close(fd);
+    buf[have] = '\0';
+    *len = have;
+    
+    return buf;
+}
+
+size_t test_dechunk(char *body)
+{
+    char *in = body, *out = body, *end;
+    size_t chunk;
+    
+    while ((chunk = strtoul(in, &end, 16)) > 0) {
+        in = strstr(end, "\r\n") + 2;
+        memmove(out, in, chunk);
+        out += chunk;
+        in += chunk + 2;
+    }
+    *out = '\0';
+    
+    return out - body;
+}
+
+void test_exit_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
+{
+    event_loopbreak();
+}
@@ -0,0 +1,27 @@
+#ifndef _TEST_UTIL_H
+#define _TEST_UTIL_H
+
+#include <stddef.h>
+#include "simplehttp.h"
+
+/*
+ * for the tests that start a server in their main thread and talk to it over
+ * 127.0.0.1:test_port from a client thread. every request is sent with
+ * Connection: close, so a reply is read by reading until the server closes.
+ */
+
+extern int test_port;
+
+int test_send_request(const char *path);
+/* headers are whole "Name: value\r\n" lines or NULL, a body makes it a POST */
+int test_send_request_with(const char *path, const char *headers, const char *body);
+/* reads the reply on fd into buf and closes fd, returns the body */
+char *test_read_reply(int fd, char *buf, size_t len);
+/* reads the reply on fd, however large, into a malloc'd string and closes fd */
+char *test_read_all(int fd, size_t *len);
+/* strips the chunk framing of a chunked body in place, returns its length */
+size_t test_dechunk(char *body);
+/* /exit, stops the server. there is no reply to it */
+void test_exit_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx);
+
+#endif
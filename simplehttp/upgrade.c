@@ -0,0 +1,373 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "simplehttp.h"
+#include "request.h"
+#include "worker.h"
+#include "upgrade.h"
+
+/*
+ * zero downtime restarts. with --upgrade-socket the process listens on a unix
+ * socket, and a new process started with the same --upgrade-socket (or
+ * re-executed by sending this one SIGUSR2) connects to it at startup. the old
+ * process passes its listening sockets over with SCM_RIGHTS and the new one
+ * serves from them instead of binding its own, so connections keep queuing on
+ * the same sockets throughout. once the new process acknowledges that it is
+ * listening the old one stops accepting, closes keep-alive connections as
+ * their requests finish and exits when no requests are left in flight or
+ * --drain-timeout-ms runs out, whichever comes first.
+ */
+
+#define UPGRADE_ACK_TIMEOUT_SECS 60
+#define DRAIN_CHECK_MSECS 100
+
+volatile int simplehttp_draining = 0;
+
+static char *upgrade_path = NULL;
+static int upgrade_fd = -1;
+static struct event upgrade_ev;
+static struct event upgrade_signal_ev;
+// the binary SIGUSR2 runs, argv[0] if it was a path or else where we were run from
+static char upgrade_exe[PATH_MAX];
+// the process SIGUSR2 started, until it exits or takes over
+static pid_t upgrade_child = -1;
+static struct event upgrade_child_ev;
+// the process taking over, while we wait for it to acknowledge
+static int upgrade_client_fd = -1;
+static struct event upgrade_client_ev;
+// the process we took over from, acknowledged by simplehttp_upgrade_listen()
+static int upgrade_from_fd = -1;
+
+static int listen_fds[SIMPLEHTTP_UPGRADE_MAX_FDS];
+static int listen_fd_count = 0;
+static int drain_timeout_ms = 0;
+static struct timeval drain_start;
+static struct event drain_ev;
+
+static void set_unix_addr(struct sockaddr_un *addr, const char *path)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strncpy(addr->sun_path, path, sizeof(addr->sun_path) - 1);
+}
+
+/*
+ * connect to a running process on path and take its listening sockets. returns
+ * the number of sockets received, 0 when nothing is listening on path
+ */
+int simplehttp_upgrade_receive(const char *path, int *fds, int max)
+{
+    struct sockaddr_un addr;
+    struct timeval tv = {10, 0};
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(SIMPLEHTTP_UPGRADE_MAX_FDS * sizeof(int))];
+    } control;
+    int count = 0;
+    int fd, n;
+    
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+        return -1;
+    }
+    set_unix_addr(&addr, path);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(fd);
+        return 0;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &count;
+    iov.iov_len = sizeof(count);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    
+    if (recvmsg(fd, &msg, 0) != sizeof(count) || !(cmsg = CMSG_FIRSTHDR(&msg))
+            || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        fprintf(stderr, "no listening sockets received from %s\n", path);
+        close(fd);
+        return -1;
+    }
+    n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    if (n != count || n > max) {
+        fprintf(stderr, "expected %d listening sockets from %s, got %d\n", count, path, n);
+        close(fd);
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), n * sizeof(int));
+    
+    // the old process keeps serving until it hears back from simplehttp_upgrade_listen()
+    upgrade_from_fd = fd;
+    
+    return n;
+}
+
+static void drain_check_cb(int fd, short what, void *arg)
+{
+    struct timeval now, tv = {0, DRAIN_CHECK_MSECS * 1000};
+    uint64_t in_flight = simplehttp_requests_in_flight;
+    long elapsed_ms;
+    
+    gettimeofday(&now, NULL);
+    elapsed_ms = (now.tv_sec - drain_start.tv_sec) * 1000 + (now.tv_usec - drain_start.tv_usec) / 1000;
+    
+    if (in_flight == 0) {
+        fprintf(stdout, "drained in %ldms, exiting\n", elapsed_ms);
+    } else if (elapsed_ms >= drain_timeout_ms) {
+        fprintf(stdout, "drain timed out with %llu requests in flight, exiting\n", (unsigned long long)in_flight);
+    } else {
+        evtimer_add(&drain_ev, &tv);
+        return;
+    }
+    event_loopbreak();
+}
+
+static void upgrade_close_listener()
+{
+    if (upgrade_fd != -1) {
+        event_del(&upgrade_ev);
+        close(upgrade_fd);
+        upgrade_fd = -1;
+    }
+}
+
+static void simplehttp_drain()
+{
+    struct timeval tv = {0, 0};
+    int i;
+    
+    simplehttp_draining = 1;
+    // the new process owns the socket path now
+    upgrade_close_listener();
+    
+    simplehttp_worker_stop_accepting(&simplehttp_workers[0]);
+    for (i = 1; i < simplehttp_worker_count; i++) {
+        simplehttp_worker_wake(&simplehttp_workers[i]);
+    }
+    
+    fprintf(stdout, "handed over %d listening sockets, draining %llu requests\n",
+            listen_fd_count, (unsigned long long)simplehttp_requests_in_flight);
+    gettimeofday(&drain_start, NULL);
+    evtimer_set(&drain_ev, drain_check_cb, NULL);
+    evtimer_add(&drain_ev, &tv);
+}
+
+static void upgrade_client_close()
+{
+    event_del(&upgrade_client_ev);
+    close(upgrade_client_fd);
+    upgrade_client_fd = -1;
+}
+
+static void upgrade_ack_cb(int fd, short what, void *arg)
+{
+    char ack;
+    
+    if ((what & EV_READ) && read(fd, &ack, 1) == 1) {
+        upgrade_client_close();
+        simplehttp_drain();
+        return;
+    }
+    fprintf(stderr, "new process did not take over, still serving\n");
+    upgrade_client_close();
+}
+
+static void upgrade_accept_cb(int fd, short what, void *arg)
+{
+    struct timeval tv = {UPGRADE_ACK_TIMEOUT_SECS, 0};
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(SIMPLEHTTP_UPGRADE_MAX_FDS * sizeof(int))];
+    } control;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    int client_fd;
+    
+    if ((client_fd = accept(fd, NULL, NULL)) == -1) {
+        return;
+    }
+    // one handoff at a time
+    if (upgrade_client_fd != -1 || simplehttp_draining) {
+        close(client_fd);
+        return;
+    }
+    
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &listen_fd_count;
+    iov.iov_len = sizeof(listen_fd_count);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(listen_fd_count * sizeof(int));
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(listen_fd_count * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), listen_fds, listen_fd_count * sizeof(int));
+    
+    if (sendmsg(client_fd, &msg, 0) != sizeof(listen_fd_count)) {
+        fprintf(stderr, "could not hand over listening sockets (%s)\n", strerror(errno));
+        close(client_fd);
+        return;
+    }
+    
+    upgrade_client_fd = client_fd;
+    event_set(&upgrade_client_ev, client_fd, EV_READ, upgrade_ack_cb, NULL);
+    event_add(&upgrade_client_ev, &tv);
+}
+
+// SIGUSR2, re-execute the binary with the same command line to take over from us
+static void upgrade_signal_cb(int sig, short what, void *arg)
+{
+    char **argv = option_get_argv();
+    long max_fd = sysconf(_SC_OPEN_MAX);
+    pid_t pid;
+    long fd;
+    
+    if (!argv || upgrade_child != -1 || upgrade_client_fd != -1 || simplehttp_draining) {
+        fprintf(stderr, "not restarting, %s\n", argv ? "a restart is in progress" : "no command line to run");
+        return;
+    }
+    
+    if ((pid = fork()) == -1) {
+        fprintf(stderr, "fork() failed (%s)\n", strerror(errno));
+        return;
+    }
+    if (pid == 0) {
+        for (fd = 3; fd < max_fd; fd++) {
+            close(fd);
+        }
+        // without a path to it, argv[0] is looked up on PATH
+        if (upgrade_exe[0]) {
+            execv(upgrade_exe, argv);
+        } else {
+            execvp(argv[0], argv);
+        }
+        fprintf(stderr, "could not run %s (%s)\n", upgrade_exe[0] ? upgrade_exe : argv[0], strerror(errno));
+        _exit(127);
+    }
+    upgrade_child = pid;
+    fprintf(stdout, "started %s (pid %d), waiting for it to take over\n", upgrade_exe[0] ? upgrade_exe : argv[0], (int)pid);
+}
+
+// SIGCHLD, a new process that exits before taking over leaves us serving
+static void upgrade_child_cb(int sig, short what, void *arg)
+{
+    int status;
+    
+    if (upgrade_child == -1 || waitpid(upgrade_child, &status, WNOHANG) != upgrade_child) {
+        return;
+    }
+    if (!simplehttp_draining) {
+        if (WIFEXITED(status)) {
+            fprintf(stderr, "restart failed, pid %d exited with status %d before taking over, still serving\n",
+                    (int)upgrade_child, WEXITSTATUS(status));
+        } else {
+            fprintf(stderr, "restart failed, pid %d was killed by signal %d before taking over, still serving\n",
+                    (int)upgrade_child, WTERMSIG(status));
+        }
+    }
+    upgrade_child = -1;
+}
+
+/*
+ * offer fds to the next process on path. if we took them over from an old
+ * process, tell it we are listening now so it can drain
+ */
+int simplehttp_upgrade_listen(const char *path, const int *fds, int count, int timeout_ms)
+{
+    char **argv = option_get_argv();
+    struct sockaddr_un addr;
+    struct stat st;
+    ssize_t len;
+    int old_umask;
+    
+    if (count > SIMPLEHTTP_UPGRADE_MAX_FDS) {
+        return 0;
+    }
+    memcpy(listen_fds, fds, count * sizeof(int));
+    listen_fd_count = count;
+    drain_timeout_ms = timeout_ms;
+    upgrade_path = strdup(path);
+    
+    // replaces the old process' socket, it only needed it until now
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+    if ((upgrade_fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+        return 0;
+    }
+    set_unix_addr(&addr, path);
+    old_umask = umask(0077);
+    if (bind(upgrade_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(upgrade_fd, 4) == -1) {
+        umask(old_umask);
+        close(upgrade_fd);
+        upgrade_fd = -1;
+        return 0;
+    }
+    umask(old_umask);
+    fcntl(upgrade_fd, F_SETFL, O_NONBLOCK);
+    event_set(&upgrade_ev, upgrade_fd, EV_READ | EV_PERSIST, upgrade_accept_cb, NULL);
+    event_add(&upgrade_ev, NULL);
+    
+    signal_set(&upgrade_signal_ev, SIGUSR2, upgrade_signal_cb, NULL);
+    signal_add(&upgrade_signal_ev, NULL);
+    signal_set(&upgrade_child_ev, SIGCHLD, upgrade_child_cb, NULL);
+    signal_add(&upgrade_child_ev, NULL);
+    // run from PATH, /proc/self/exe is read now as by SIGUSR2 it may name a deleted binary
+    if (argv && strchr(argv[0], '/')) {
+        snprintf(upgrade_exe, sizeof(upgrade_exe), "%s", argv[0]);
+    } else if ((len = readlink("/proc/self/exe", upgrade_exe, sizeof(upgrade_exe) - 1)) > 0) {
+        upgrade_exe[len] = '\0';
+    } else {
+        upgrade_exe[0] = '\0';
+    }
+    
+    if (upgrade_from_fd != -1) {
+        if (write(upgrade_from_fd, "", 1) != 1) {
+            fprintf(stderr, "old process went away during the handoff\n");
+        }
+        close(upgrade_from_fd);
+        upgrade_from_fd = -1;
+    }
+    
+    return 1;
+}
+
+void simplehttp_upgrade_free()
+{
+    if (upgrade_path) {
+        signal_del(&upgrade_signal_ev);
+        signal_del(&upgrade_child_ev);
+        // still ours unless a new process took over
+        if (upgrade_fd != -1) {
+            unlink(upgrade_path);
+        }
+        free(upgrade_path);
+        upgrade_path = NULL;
+    }
+    upgrade_close_listener();
+    if (upgrade_client_fd != -1) {
+        upgrade_client_close();
+    }
+    if (simplehttp_draining) {
+        event_del(&drain_ev);
+    }
+}
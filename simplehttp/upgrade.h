@@ -0,0 +1,15 @@
+#ifndef _UPGRADE_H
+#define _UPGRADE_H
+
+#include "simplehttp.h"
+
+#define SIMPLEHTTP_UPGRADE_MAX_FDS 64
+
+// set once the listening sockets have been handed to a new process
+extern volatile int simplehttp_draining;
+
+int simplehttp_upgrade_receive(const char *path, int *fds, int max);
+int simplehttp_upgrade_listen(const char *path, const int *fds, int count, int timeout_ms);
+void simplehttp_upgrade_free();
+
+#endif
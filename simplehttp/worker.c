@@ -0,0 +1,438 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include "queue.h"
+#include "simplehttp.h"
+#include "http-internal.h"
+#include "worker.h"
+#include "compress.h"
+#include "upgrade.h"
+
+struct simplehttp_worker *simplehttp_workers = NULL;
+int simplehttp_worker_count = 1;
+
+static __thread struct simplehttp_worker *current_worker = NULL;
+static void (*handoff_cb)(struct simplehttp_handoff *) = NULL;
+
+struct simplehttp_worker *simplehttp_worker_self()
+{
+    return current_worker ? current_worker : simplehttp_workers;
+}
+
+void simplehttp_workers_init(int count, struct event_base *main_base)
+{
+    int i;
+    
+    if (count < 1) {
+        count = 1;
+    }
+    simplehttp_worker_count = count;
+    simplehttp_workers = calloc(count, sizeof(struct simplehttp_worker));
+    for (i = 0; i < count; i++) {
+        simplehttp_workers[i].id = i;
+        simplehttp_workers[i].wake_fds[0] = -1;
+        simplehttp_workers[i].wake_fds[1] = -1;
+    }
+    pthread_mutex_init(&simplehttp_workers[0].handoff_lock, NULL);
+    simplehttp_workers[0].handoffs_tail = &simplehttp_workers[0].handoffs;
+    // created up front, the stats timers go on them before anything listens
+    simplehttp_workers[0].base = main_base;
+    for (i = 1; i < count; i++) {
+        simplehttp_workers[i].base = event_base_new();
+    }
+}
+
+// a non-blocking listening socket, with SO_REUSEPORT so each worker can bind its own
+int simplehttp_bind_socket(const char *address, int port, int reuseport)
+{
+    struct addrinfo hints, *res, *ai;
+    char port_buf[16];
+    int fd = -1, on = 1;
+    
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    sprintf(port_buf, "%d", port);
+    
+    if (getaddrinfo(address, port_buf, &hints, &res) != 0) {
+        return -1;
+    }
+    
+    for (ai = res; ai; ai = ai->ai_next) {
+        if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) == -1) {
+            continue;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        // [::] and 0.0.0.0 can then both be listened on
+        if (ai->ai_family == AF_INET6) {
+            setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on));
+        }
+#ifdef SO_REUSEPORT
+        if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0) {
+            close(fd);
+            fd = -1;
+            continue;
+        }
+#else
+        if (reuseport) {
+            close(fd);
+            fd = -1;
+            continue;
+        }
+#endif
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0
+                && listen(fd, 1024) == 0
+                && fcntl(fd, F_SETFL, O_NONBLOCK) == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    
+    return fd;
+}
+
+int simplehttp_bind_unix(const char *path)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    int fd;
+    
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    
+    // clean up a socket file left behind by a previous run
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0
+            || listen(fd, 1024) != 0
+            || fcntl(fd, F_SETFL, O_NONBLOCK) != 0) {
+        close(fd);
+        return -1;
+    }
+    
+    return fd;
+}
+
+static void unix_accept_cb(int fd, short what, void *arg)
+{
+    struct simplehttp_unix_accept *accept_ev = (struct simplehttp_unix_accept *)arg;
+    struct sockaddr_in sin;
+    int nfd;
+    
+    if ((nfd = accept(fd, NULL, NULL)) == -1) {
+        return;
+    }
+    if (fcntl(nfd, F_SETFL, O_NONBLOCK) != 0) {
+        close(nfd);
+        return;
+    }
+    // unix peers have no address, they are logged as coming from loopback
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    evhttp_get_request(accept_ev->httpd, nfd, (struct sockaddr *)&sin, sizeof(sin));
+}
+
+/*
+ * evhttp would getnameinfo() the peer of an accepted unix socket, whose path
+ * is left uninitialized, so unix listeners are accepted here instead
+ */
+static int simplehttp_worker_accept_unix(struct simplehttp_worker *worker, int fd)
+{
+    struct simplehttp_unix_accept *accept_ev;
+    
+    accept_ev = malloc(sizeof(*accept_ev));
+    accept_ev->fd = fd;
+    accept_ev->httpd = worker->httpd;
+    event_set(&accept_ev->ev, fd, EV_READ | EV_PERSIST, unix_accept_cb, accept_ev);
+    event_base_set(worker->base, &accept_ev->ev);
+    event_add(&accept_ev->ev, NULL);
+    accept_ev->next = worker->unix_accepts;
+    worker->unix_accepts = accept_ev;
+    
+    return 0;
+}
+
+static int simplehttp_worker_accept(struct simplehttp_worker *worker, int fd)
+{
+    struct sockaddr_storage ss;
+    socklen_t len = sizeof(ss);
+    
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    if (getsockname(fd, (struct sockaddr *)&ss, &len) == 0 && ss.ss_family == AF_UNIX) {
+        return simplehttp_worker_accept_unix(worker, fd);
+    }
+    
+    return evhttp_accept_socket(worker->httpd, fd);
+}
+
+// stops taking new connections, the sockets stay open for the process they were handed to
+void simplehttp_worker_stop_accepting(struct simplehttp_worker *worker)
+{
+    struct evhttp_bound_socket *bound;
+    struct simplehttp_unix_accept *accept_ev;
+    
+    TAILQ_FOREACH(bound, &worker->httpd->sockets, next) {
+        event_del(&bound->bind_ev);
+    }
+    for (accept_ev = worker->unix_accepts; accept_ev; accept_ev = accept_ev->next) {
+        event_del(&accept_ev->ev);
+    }
+}
+
+/*
+ * callbacks not marked SIMPLEHTTP_CB_THREAD_SAFE only run in worker 0, the
+ * thread that also runs the main event base with the service's timers and
+ * async requests. another worker that reads such a request hands its
+ * connection over: it leaves the worker's evhttp here and worker 0 adopts it
+ * into its own once woken. every event the connection owns is taken off this
+ * worker's base here and put back on worker 0's, timeout included, so the
+ * reply and any later requests on it are served from worker 0's loop.
+ */
+void simplehttp_worker_handoff(struct simplehttp_worker *worker, struct evhttp_request *req, int route,
+                               uint64_t id, simplehttp_ts start_ts)
+{
+    struct simplehttp_worker *main_worker = &simplehttp_workers[0];
+    struct evhttp_connection *evcon = req->evcon;
+    struct simplehttp_handoff *handoff;
+    
+    handoff = malloc(sizeof(*handoff));
+    handoff->req = req;
+    handoff->route = route;
+    handoff->id = id;
+    handoff->start_ts = start_ts;
+    handoff->ev_pending = event_pending(&evcon->ev, EV_READ | EV_WRITE | EV_TIMEOUT, NULL);
+    handoff->close_pending = event_pending(&evcon->close_ev, EV_READ, NULL);
+    handoff->next = NULL;
+    
+    event_del(&evcon->ev);
+    event_del(&evcon->close_ev);
+    TAILQ_REMOVE(&worker->httpd->connections, evcon, next);
+    evcon->http_server = NULL;
+    
+    pthread_mutex_lock(&main_worker->handoff_lock);
+    *main_worker->handoffs_tail = handoff;
+    main_worker->handoffs_tail = &handoff->next;
+    pthread_mutex_unlock(&main_worker->handoff_lock);
+    simplehttp_worker_wake(main_worker);
+}
+
+static struct simplehttp_handoff *worker_take_handoffs(struct simplehttp_worker *worker)
+{
+    struct simplehttp_handoff *handoffs;
+    
+    pthread_mutex_lock(&worker->handoff_lock);
+    handoffs = worker->handoffs;
+    worker->handoffs = NULL;
+    worker->handoffs_tail = &worker->handoffs;
+    pthread_mutex_unlock(&worker->handoff_lock);
+    
+    return handoffs;
+}
+
+// puts back an event the connection had pending, with evhttp's timeout for it
+static void worker_readd_event(struct simplehttp_worker *worker, struct event *ev, int timeout)
+{
+    struct timeval tv;
+    
+    event_base_set(worker->base, ev);
+    if (timeout != 0) {
+        tv.tv_sec = timeout != -1 ? timeout : HTTP_READ_TIMEOUT;
+        tv.tv_usec = 0;
+        event_add(ev, &tv);
+    } else {
+        event_add(ev, NULL);
+    }
+}
+
+static void worker_adopt_handoffs(struct simplehttp_worker *worker)
+{
+    struct simplehttp_handoff *handoff, *next;
+    struct evhttp_connection *evcon;
+    
+    for (handoff = worker_take_handoffs(worker); handoff; handoff = next) {
+        next = handoff->next;
+        evcon = handoff->req->evcon;
+        evcon->base = worker->base;
+        evcon->http_server = worker->httpd;
+        TAILQ_INSERT_TAIL(&worker->httpd->connections, evcon, next);
+        // evhttp sets the base again before it next adds either, these were already added
+        if (handoff->ev_pending) {
+            worker_readd_event(worker, &evcon->ev, evcon->timeout);
+        }
+        if (handoff->close_pending) {
+            worker_readd_event(worker, &evcon->close_ev, 0);
+        }
+        handoff_cb(handoff);
+        free(handoff);
+    }
+}
+
+static void wake_cb(int fd, short what, void *arg)
+{
+    struct simplehttp_worker *worker = (struct simplehttp_worker *)arg;
+    char buf[64];
+    
+    while (read(fd, buf, sizeof(buf)) > 0);
+    
+    if (simplehttp_draining) {
+        simplehttp_worker_stop_accepting(worker);
+    }
+    if (worker->id == 0) {
+        worker_adopt_handoffs(worker);
+    }
+    if (worker->id != 0 && worker->stopping) {
+        event_base_loopbreak(worker->base);
+    }
+}
+
+/*
+ * serve the listening sockets in fds, each worker takes every count'th one and
+ * workers left over share a dup() of one
+ */
+int simplehttp_workers_listen(const int *fds, int count, void (*cb)(struct evhttp_request *, void *),
+                              void (*handoff)(struct simplehttp_handoff *))
+{
+    struct simplehttp_worker *worker;
+    int i, j, fd;
+    
+    handoff_cb = handoff;
+    for (i = 0; i < simplehttp_worker_count; i++) {
+        worker = &simplehttp_workers[i];
+        worker->httpd = evhttp_new(worker->base);
+        evhttp_set_gencb(worker->httpd, cb, NULL);
+        for (j = i; j < count; j += simplehttp_worker_count) {
+            if (simplehttp_worker_accept(worker, fds[j]) != 0) {
+                return 0;
+            }
+        }
+        if (i >= count) {
+            if ((fd = dup(fds[i % count])) == -1 || simplehttp_worker_accept(worker, fd) != 0) {
+                return 0;
+            }
+        }
+        
+        if (simplehttp_worker_count == 1) {
+            break;
+        }
+        if (pipe(worker->wake_fds) != 0) {
+            return 0;
+        }
+        fcntl(worker->wake_fds[0], F_SETFL, O_NONBLOCK);
+        fcntl(worker->wake_fds[1], F_SETFL, O_NONBLOCK);
+        event_set(&worker->wake_ev, worker->wake_fds[0], EV_READ | EV_PERSIST, wake_cb, worker);
+        event_base_set(worker->base, &worker->wake_ev);
+        event_add(&worker->wake_ev, NULL);
+    }
+    
+    return 1;
+}
+
+static void *worker_thread(void *arg)
+{
+    current_worker = (struct simplehttp_worker *)arg;
+    event_base_dispatch(current_worker->base);
+    simplehttp_compress_free();
+    return NULL;
+}
+
+void simplehttp_workers_start()
+{
+    sigset_t all, old;
+    int i;
+    
+    // signals are only ever handled by the main thread, except the SIGPROF
+    // samples of /debug/profile which land on whichever thread is running
+    sigfillset(&all);
+    sigdelset(&all, SIGPROF);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    for (i = 1; i < simplehttp_worker_count; i++) {
+        pthread_create(&simplehttp_workers[i].thread, NULL, worker_thread, &simplehttp_workers[i]);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+void simplehttp_worker_wake(struct simplehttp_worker *worker)
+{
+    if (worker->wake_fds[1] != -1) {
+        if (write(worker->wake_fds[1], "", 1) < 0) {
+            // the pipe is full, a wakeup is already pending
+        }
+    }
+}
+
+void simplehttp_workers_stop()
+{
+    int i;
+    
+    for (i = 1; i < simplehttp_worker_count; i++) {
+        simplehttp_workers[i].stopping = 1;
+        simplehttp_worker_wake(&simplehttp_workers[i]);
+    }
+    for (i = 1; i < simplehttp_worker_count; i++) {
+        pthread_join(simplehttp_workers[i].thread, NULL);
+    }
+}
+
+void simplehttp_workers_free()
+{
+    struct simplehttp_worker *worker;
+    struct simplehttp_unix_accept *accept_ev;
+    struct simplehttp_handoff *handoff, *next;
+    int i;
+    
+    // handed over after worker 0's loop had already stopped
+    for (handoff = worker_take_handoffs(&simplehttp_workers[0]); handoff; handoff = next) {
+        next = handoff->next;
+        evhttp_connection_free(handoff->req->evcon);
+        free(handoff);
+    }
+    pthread_mutex_destroy(&simplehttp_workers[0].handoff_lock);
+    
+    for (i = 0; i < simplehttp_worker_count; i++) {
+        worker = &simplehttp_workers[i];
+        while ((accept_ev = worker->unix_accepts)) {
+            worker->unix_accepts = accept_ev->next;
+            event_del(&accept_ev->ev);
+            close(accept_ev->fd);
+            free(accept_ev);
+        }
+        if (worker->wake_fds[0] != -1) {
+            event_del(&worker->wake_ev);
+            close(worker->wake_fds[0]);
+            close(worker->wake_fds[1]);
+        }
+        if (worker->httpd) {
+            evhttp_free(worker->httpd);
+        }
+        if (worker->reply_evb) {
+            evbuffer_free(worker->reply_evb);
+        }
+        if (i != 0 && worker->base) {
+            event_base_free(worker->base);
+        }
+    }
+    free(simplehttp_workers);
+    simplehttp_workers = NULL;
+    simplehttp_worker_count = 1;
+}
@@ -0,0 +1,76 @@
+#ifndef _WORKER_H
+#define _WORKER_H
+
+#include <pthread.h>
+#include "simplehttp.h"
+#include "stat.h"
+
+// a unix socket listener, accepted by us rather than evhttp
+struct simplehttp_unix_accept {
+    int fd;
+    struct event ev;
+    struct evhttp *httpd;
+    struct simplehttp_unix_accept *next;
+};
+
+// a request another worker passed to worker 0, see simplehttp_worker_handoff()
+struct simplehttp_handoff {
+    struct evhttp_request *req;
+    int route;
+    uint64_t id;
+    simplehttp_ts start_ts;
+    // which of the connection's events were pending, re-added on worker 0's base
+    int ev_pending;
+    int close_pending;
+    struct simplehttp_handoff *next;
+};
+
+/*
+ * with --workers=N each worker owns an event base and an evhttp bound to the
+ * same address with SO_REUSEPORT. worker 0 is the main thread and the
+ * process-wide event base, the rest run in their own threads.
+ */
+struct simplehttp_worker {
+    int id;
+    struct event_base *base;
+    struct evhttp *httpd;
+    pthread_t thread;
+    int wake_fds[2];
+    struct event wake_ev;
+    uint64_t request_count;
+    struct simplehttp_stat_window *stats;
+    struct simplehttp_histogram *stats_totals;
+    uint64_t *stats_counts;
+    struct simplehttp_loop_window *loop;
+    struct event loop_ev;
+    simplehttp_ts loop_ts;
+    uint64_t loop_cpu_usec;
+    // time in request callbacks since the last loop tick
+    uint64_t loop_busy_usec;
+    struct evbuffer *reply_evb;
+    struct simplehttp_unix_accept *unix_accepts;
+    int stopping;
+    // worker 0 only, requests waiting to be adopted
+    pthread_mutex_t handoff_lock;
+    struct simplehttp_handoff *handoffs;
+    struct simplehttp_handoff **handoffs_tail;
+};
+
+extern struct simplehttp_worker *simplehttp_workers;
+extern int simplehttp_worker_count;
+
+struct simplehttp_worker *simplehttp_worker_self();
+void simplehttp_workers_init(int count, struct event_base *main_base);
+int simplehttp_bind_socket(const char *address, int port, int reuseport);
+int simplehttp_bind_unix(const char *path);
+int simplehttp_workers_listen(const int *fds, int count, void (*cb)(struct evhttp_request *, void *),
+                              void (*handoff_cb)(struct simplehttp_handoff *));
+void simplehttp_workers_start();
+void simplehttp_workers_stop();
+void simplehttp_worker_wake(struct simplehttp_worker *worker);
+void simplehttp_worker_handoff(struct simplehttp_worker *worker, struct evhttp_request *req, int route,
+                               uint64_t id, simplehttp_ts start_ts);
+void simplehttp_worker_stop_accepting(struct simplehttp_worker *worker);
+void simplehttp_workers_free();
+
+#endif
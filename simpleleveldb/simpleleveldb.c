@@ -12,17 +12,13 @@
 #include <json/json.h>
 #include <leveldb/c.h>
 #include <sys/socket.h>
-#include "http-internal.h"
 #include "str_list_set.h"
 
 // defined values
 #define NAME            "simpleleveldb"
 #define VERSION         "0.9.2"
 
-#define DUMP_CSV_ITERS_CHECK       10
-#define DUMP_CSV_MSECS_WORK        10
-#define DUMP_CSV_MSECS_SLEEP      100
-#define DUMP_CSV_MAX_BUFFER        (8*1024*1024)
+#define DUMP_CSV_ROWS             100
 
 const char default_sep = ',';
 
@@ -59,9 +55,8 @@ void set_add_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx);
 void set_remove_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx);
 void set_pop_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx);
 void dump_csv_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx);
-void do_dump_csv(int fd, short what, void *ctx);
-void set_dump_csv_timer(struct evhttp_request *req);
-void cleanup_dump_csv_cb(struct evhttp_connection *evcon, void *arg);
+int dump_csv_produce(struct simplehttp_stream *stream, struct evbuffer *evb, void *ctx);
+void dump_csv_done(struct simplehttp_stream *stream, int connected, void *ctx);
 void hup_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx);
 
 // global variables
@@ -73,10 +68,12 @@ leveldb_cache_t *ldb_cache;
 const leveldb_snapshot_t *dump_snapshot;
 leveldb_readoptions_t *dump_read_options;
 leveldb_iterator_t *dump_iter;
-struct event dump_ev;
 int is_currently_dumping = 0;
 char *dump_fwmatch_key;
 
+// --verify-checksums, read on every request and changeable through /config
+int verify_checksums = 1;
+
 void finalize_request(int response_code, char *error, struct evhttp_request *req, struct evbuffer *evb, struct evkeyvalq *args, struct json_object *jsobj)
 {
     const char *json, *jsonp;
@@ -124,7 +121,7 @@ void finalize_request(int response_code, char *error, struct evhttp_request *req
     
     // don't send the request if it was already sent
     if (!req->response_code) {
-        evhttp_send_reply(req, response_code, (response_code == HTTP_OK) ? "OK" : "ERROR", evb);
+        simplehttp_send_reply(req, response_code, (response_code == HTTP_OK) ? "OK" : "ERROR", evb);
     } else {
         fprintf(stderr, "ERROR: request already sent\n");
     }
@@ -334,7 +331,7 @@ void get_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
     }
     
     read_options = leveldb_readoptions_create();
-    leveldb_readoptions_set_verify_checksums(read_options, option_get_int("verify_checksums"));
+    leveldb_readoptions_set_verify_checksums(read_options, verify_checksums);
     value = leveldb_get(ldb, read_options, key, strlen(key), &vallen, &error);
     leveldb_readoptions_destroy(read_options);
     
@@ -388,7 +385,7 @@ void mget_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
     }
     
     read_options = leveldb_readoptions_create();
-    leveldb_readoptions_set_verify_checksums(read_options, option_get_int("verify_checksums"));
+    leveldb_readoptions_set_verify_checksums(read_options, verify_checksums);
     
     TAILQ_FOREACH(pair, &args, next) {
         if (pair->key[0] != 'k') {
@@ -640,7 +637,7 @@ void list_add_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
     evbuffer_add_printf(new_value, "%s", ""); // null terminate
     
     read_options = leveldb_readoptions_create();
-    leveldb_readoptions_set_verify_checksums(read_options, option_get_int("verify_checksums"));
+    leveldb_readoptions_set_verify_checksums(read_options, verify_checksums);
     orig_value = leveldb_get(ldb, read_options, key, strlen(key), &orig_valuelen, &error);
     leveldb_readoptions_destroy(read_options);
     
@@ -762,7 +759,7 @@ void list_remove_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
     evbuffer_add_printf(new_value, "%s", ""); // null terminate
     
     read_options = leveldb_readoptions_create();
-    leveldb_readoptions_set_verify_checksums(read_options, option_get_int("verify_checksums"));
+    leveldb_readoptions_set_verify_checksums(read_options, verify_checksums);
     orig_value = leveldb_get(ldb, read_options, key, strlen(key), &orig_valuelen, &error);
     leveldb_readoptions_destroy(read_options);
     
@@ -872,7 +869,7 @@ void list_pop_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
     }
     
     read_options = leveldb_readoptions_create();
-    leveldb_readoptions_set_verify_checksums(read_options, option_get_int("verify_checksums"));
+    leveldb_readoptions_set_verify_checksums(read_options, verify_checksums);
     orig_value = leveldb_get(ldb, read_options, key, strlen(key), &orig_valuelen, &error);
     leveldb_readoptions_destroy(read_options);
     
@@ -1004,7 +1001,7 @@ void set_add_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
     }
     
     read_options = leveldb_readoptions_create();
-    leveldb_readoptions_set_verify_checksums(read_options, option_get_int("verify_checksums"));
+    leveldb_readoptions_set_verify_checksums(read_options, verify_checksums);
     orig_value = leveldb_get(ldb, read_options, key, strlen(key), &orig_valuelen, &error);
     leveldb_readoptions_destroy(read_options);
     
@@ -1108,7 +1105,7 @@ void set_remove_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
     }
     
     read_options = leveldb_readoptions_create();
-    leveldb_readoptions_set_verify_checksums(read_options, option_get_int("verify_checksums"));
+    leveldb_readoptions_set_verify_checksums(read_options, verify_checksums);
     orig_value = leveldb_get(ldb, read_options, key, strlen(key), &orig_valuelen, &error);
     leveldb_readoptions_destroy(read_options);
     
@@ -1213,7 +1210,7 @@ void set_pop_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
     }
     
     read_options = leveldb_readoptions_create();
-    leveldb_readoptions_set_verify_checksums(read_options, option_get_int("verify_checksums"));
+    leveldb_readoptions_set_verify_checksums(read_options, verify_checksums);
     orig_value = leveldb_get(ldb, read_options, key, strlen(key), &orig_valuelen, &error);
     leveldb_readoptions_destroy(read_options);
     
@@ -1293,42 +1290,24 @@ void dump_csv_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
     }
     
     evhttp_clear_headers(&args);
-    evhttp_send_reply_start(req, 200, "OK");
-    evhttp_connection_set_closecb(req->evcon, cleanup_dump_csv_cb, NULL);
     
-    /* run the first dump loop */
-    do_dump_csv(0, 0, req);
+    /* rows are produced as fast as the client reads them */
+    simplehttp_stream_start(req, 200, "OK", dump_csv_produce, dump_csv_done, NULL);
 }
 
-void do_dump_csv(int fd, short what, void *ctx)
+int dump_csv_produce(struct simplehttp_stream *stream, struct evbuffer *evb, void *ctx)
 {
-    struct evhttp_request *req = (struct evhttp_request *)ctx;
-    struct evbuffer *evb;
-    int c = 0, set_timer = 0, send_reply = 0;
+    int c;
     const char *key, *value;
     size_t key_len, value_len;
-    struct timeval time_start, time_now;
-    struct evhttp_connection *evcon;
-    unsigned long output_buffer_length;
-    
-    gettimeofday(&time_start, NULL);
-    evb = req->output_buffer;
-    
-    // if backed up, continue later
-    evcon = (struct evhttp_connection *)req->evcon;
-    output_buffer_length = evcon->output_buffer ? (unsigned long)EVBUFFER_LENGTH(evcon->output_buffer) : 0;
-    if (output_buffer_length > DUMP_CSV_MAX_BUFFER) {
-        set_dump_csv_timer(req);
-        return;
-    }
     
-    while (leveldb_iter_valid(dump_iter)) {
+    for (c = 0; c < DUMP_CSV_ROWS && leveldb_iter_valid(dump_iter); c++) {
         key = leveldb_iter_key(dump_iter, &key_len);
         if (dump_fwmatch_key) {
             // this is the case where we are only dumping keys of this prefix
             // so we need to break out of the loop at the last key
             if (strlen(dump_fwmatch_key) > key_len || strncmp(key, dump_fwmatch_key, strlen(dump_fwmatch_key)) != 0 ) {
-                break;
+                return SIMPLEHTTP_STREAM_DONE;
             }
         }
         value = leveldb_iter_value(dump_iter, &value_len);
@@ -1337,50 +1316,16 @@ void do_dump_csv(int fd, short what, void *ctx)
         evbuffer_add(evb, value, value_len);
         evbuffer_add(evb, "\n", 1);
         leveldb_iter_next(dump_iter);
-        
-        send_reply = 1;
-        c++;
-        if (c == DUMP_CSV_ITERS_CHECK) {
-            int64_t usecs;
-            gettimeofday(&time_now, NULL);
-            usecs = 0 + ((int64_t)time_now  .tv_sec * 1000000 + time_now  .tv_usec)
-                    -   ((int64_t)time_start.tv_sec * 1000000 + time_start.tv_usec);
-            if (usecs > DUMP_CSV_MSECS_WORK * 1000) {
-                set_timer = 1;
-                break;
-            }
-            c = 0;
-        }
     }
     
     // leveldb_iter_get_error(dump_iter, &err);
     
-    if (send_reply) {
-        evhttp_send_reply_chunk(req, evb);
-    }
-    
-    if (set_timer) {
-        set_dump_csv_timer(req);
-    } else {
-        evhttp_send_reply_end(req);
-        // we're finished this request, but connection might be reused
-        evhttp_connection_set_closecb(req->evcon, NULL, NULL);
-        cleanup_dump_csv_cb(NULL, NULL);
-    }
-}
-
-void set_dump_csv_timer(struct evhttp_request *req)
-{
-    struct timeval tv = {0, DUMP_CSV_MSECS_SLEEP * 1000};
-    
-    evtimer_del(&dump_ev);
-    evtimer_set(&dump_ev, do_dump_csv, req);
-    evtimer_add(&dump_ev, &tv);
+    return leveldb_iter_valid(dump_iter) ? SIMPLEHTTP_STREAM_MORE : SIMPLEHTTP_STREAM_DONE;
 }
 
-void cleanup_dump_csv_cb(struct evhttp_connection *evcon, void *arg)
+// runs when the dump is complete or the client went away
+void dump_csv_done(struct simplehttp_stream *stream, int connected, void *ctx)
 {
-    evtimer_del(&dump_ev);
     leveldb_iter_destroy(dump_iter);
     leveldb_readoptions_destroy(dump_read_options);
     leveldb_release_snapshot(ldb, dump_snapshot);
@@ -1406,16 +1351,34 @@ void stats_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
     if ((format != NULL) && (strcmp(format, "json") == 0)) {
         evbuffer_add_printf(evb, "{");
         for (i = 0; i < st->callback_count; i++) {
+            evbuffer_add_printf(evb, "\"%s_50\": %"PRIu64",", st->stats_labels[i], st->fifty_percents[i]);
             evbuffer_add_printf(evb, "\"%s_95\": %"PRIu64",", st->stats_labels[i], st->ninety_five_percents[i]);
+            evbuffer_add_printf(evb, "\"%s_99\": %"PRIu64",", st->stats_labels[i], st->ninety_nine_percents[i]);
+            evbuffer_add_printf(evb, "\"%s_999\": %"PRIu64",", st->stats_labels[i], st->ninety_nine_nine_percents[i]);
+            evbuffer_add_printf(evb, "\"%s_max\": %"PRIu64",", st->stats_labels[i], st->max_requests[i]);
             evbuffer_add_printf(evb, "\"%s_average_request\": %"PRIu64",", st->stats_labels[i], st->average_requests[i]);
             evbuffer_add_printf(evb, "\"%s_requests\": %"PRIu64",", st->stats_labels[i], st->stats_counts[i]);
         }
+        evbuffer_add_printf(evb, "\"loop_utilization\": %.1f,", st->loop_utilization);
+        evbuffer_add_printf(evb, "\"loop_utilization_max\": %.1f,", st->loop_utilization_max);
+        evbuffer_add_printf(evb, "\"loop_cpu\": %.1f,", st->loop_cpu);
+        evbuffer_add_printf(evb, "\"loop_lag_99\": %"PRIu64",", st->loop_lag_99);
+        evbuffer_add_printf(evb, "\"loop_lag_max\": %"PRIu64",", st->loop_lag_max);
         evbuffer_add_printf(evb, "\"total_requests\": %"PRIu64, st->requests);
         evbuffer_add_printf(evb, "}\n");
     } else {
+        evbuffer_add_printf(evb, "loop utilization: %.1f%%\n", st->loop_utilization);
+        evbuffer_add_printf(evb, "busiest loop utilization: %.1f%%\n", st->loop_utilization_max);
+        evbuffer_add_printf(evb, "loop cpu: %.1f%%\n", st->loop_cpu);
+        evbuffer_add_printf(evb, "loop lag 99%% (usec): %"PRIu64"\n", st->loop_lag_99);
+        evbuffer_add_printf(evb, "loop lag max (usec): %"PRIu64"\n", st->loop_lag_max);
         evbuffer_add_printf(evb, "total requests: %"PRIu64"\n", st->requests);
         for (i = 0; i < st->callback_count; i++) {
+            evbuffer_add_printf(evb, "/%s 50%%: %"PRIu64"\n", st->stats_labels[i], st->fifty_percents[i]);
             evbuffer_add_printf(evb, "/%s 95%%: %"PRIu64"\n", st->stats_labels[i], st->ninety_five_percents[i]);
+            evbuffer_add_printf(evb, "/%s 99%%: %"PRIu64"\n", st->stats_labels[i], st->ninety_nine_percents[i]);
+            evbuffer_add_printf(evb, "/%s 99.9%%: %"PRIu64"\n", st->stats_labels[i], st->ninety_nine_nine_percents[i]);
+            evbuffer_add_printf(evb, "/%s max (usec): %"PRIu64"\n", st->stats_labels[i], st->max_requests[i]);
             evbuffer_add_printf(evb, "/%s average request (usec): %"PRIu64"\n", st->stats_labels[i], st->average_requests[i]);
             evbuffer_add_printf(evb, "/%s requests: %"PRIu64"\n", st->stats_labels[i], st->stats_counts[i]);
         }
@@ -1491,12 +1454,13 @@ int main(int argc, char **argv)
     option_define_int("cache_size", OPT_OPTIONAL, 4 << 20, NULL, NULL, "cache size (frequently used blocks)");
     option_define_int("block_size", OPT_OPTIONAL, 4096, NULL, NULL, "block size");
     option_define_bool("compression", OPT_OPTIONAL, 1, NULL, NULL, "snappy compression");
-    option_define_bool("verify_checksums", OPT_OPTIONAL, 1, NULL, NULL, "verify checksums at read time");
+    option_define_bool("verify_checksums", OPT_OPTIONAL, 1, &verify_checksums, NULL, "verify checksums at read time");
     option_define_int("leveldb_max_open_files", OPT_OPTIONAL, 4096, NULL, NULL, "leveldb max open files");
     
     if (!option_parse_command_line(argc, argv)) {
         return 1;
     }
+    option_set_runtime("verify_checksums", NULL, NULL);
     
     info();
     
@@ -1523,6 +1487,15 @@ int main(int argc, char **argv)
     simplehttp_set_cb("/exit*", exit_cb, NULL);
     simplehttp_set_cb("/dump_csv*", dump_csv_cb, NULL);
     simplehttp_set_cb("/hup*", hup_cb, NULL);
+    // the bulk reads, compressed for clients that ask for it
+    simplehttp_set_cb_flags("/mget*", SIMPLEHTTP_CB_COMPRESS);
+    simplehttp_set_cb_flags("/fwmatch*", SIMPLEHTTP_CB_COMPRESS);
+    simplehttp_set_cb_flags("/range_match*", SIMPLEHTTP_CB_COMPRESS);
+    simplehttp_set_cb_flags("/dump_csv*", SIMPLEHTTP_CB_COMPRESS);
+    // under --admission-target-ms bulk transfers are shed first, /stats never
+    simplehttp_set_cb_priority("/stats*", SIMPLEHTTP_PRIORITY_HIGH);
+    simplehttp_set_cb_priority("/dump_csv*", SIMPLEHTTP_PRIORITY_LOW);
+    simplehttp_set_cb_priority("/mput*", SIMPLEHTTP_PRIORITY_LOW);
     
     simplehttp_main();
     
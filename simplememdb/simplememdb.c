@@ -20,8 +20,10 @@
 #define VERSION                 "1.5"
 #define BUFFER_SZ               1048576
 #define SM_BUFFER_SZ            4096
+#define DUMP_ROWS               500
 
-void set_dump_timer();
+int dump_produce(struct simplehttp_stream *stream, struct evbuffer *evb, void *ctx);
+void dump_done(struct simplehttp_stream *stream, int connected, void *ctx);
 void fwmatch_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx);
 void fwmatch_int_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx);
 void del_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx);
@@ -36,7 +38,7 @@ void info();
 
 static TCADB *adb;
 static int is_currently_dumping = 0;
-static struct event ev;
+static int dump_string_mode = 0;
 static pcre *dump_regex;
 
 void finalize_request(struct evhttp_request *req, struct evbuffer *evb, struct evkeyvalq *args, struct json_object *jsobj)
@@ -655,16 +657,34 @@ void stats_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
     if (format == json_format) {
         evbuffer_add_printf(evb, "{");
         for (i = 0; i < st->callback_count; i++) {
+            evbuffer_add_printf(evb, "\"%s_50\": %"PRIu64",", st->stats_labels[i], st->fifty_percents[i]);
             evbuffer_add_printf(evb, "\"%s_95\": %"PRIu64",", st->stats_labels[i], st->ninety_five_percents[i]);
+            evbuffer_add_printf(evb, "\"%s_99\": %"PRIu64",", st->stats_labels[i], st->ninety_nine_percents[i]);
+            evbuffer_add_printf(evb, "\"%s_999\": %"PRIu64",", st->stats_labels[i], st->ninety_nine_nine_percents[i]);
+            evbuffer_add_printf(evb, "\"%s_max\": %"PRIu64",", st->stats_labels[i], st->max_requests[i]);
             evbuffer_add_printf(evb, "\"%s_average_request\": %"PRIu64",", st->stats_labels[i], st->average_requests[i]);
             evbuffer_add_printf(evb, "\"%s_requests\": %"PRIu64",", st->stats_labels[i], st->stats_counts[i]);
         }
+        evbuffer_add_printf(evb, "\"loop_utilization\": %.1f,", st->loop_utilization);
+        evbuffer_add_printf(evb, "\"loop_utilization_max\": %.1f,", st->loop_utilization_max);
+        evbuffer_add_printf(evb, "\"loop_cpu\": %.1f,", st->loop_cpu);
+        evbuffer_add_printf(evb, "\"loop_lag_99\": %"PRIu64",", st->loop_lag_99);
+        evbuffer_add_printf(evb, "\"loop_lag_max\": %"PRIu64",", st->loop_lag_max);
         evbuffer_add_printf(evb, "\"total_requests\": %"PRIu64, st->requests);
         evbuffer_add_printf(evb, "}\n");
     } else {
+        evbuffer_add_printf(evb, "loop utilization: %.1f%%\n", st->loop_utilization);
+        evbuffer_add_printf(evb, "busiest loop utilization: %.1f%%\n", st->loop_utilization_max);
+        evbuffer_add_printf(evb, "loop cpu: %.1f%%\n", st->loop_cpu);
+        evbuffer_add_printf(evb, "loop lag 99%% (usec): %"PRIu64"\n", st->loop_lag_99);
+        evbuffer_add_printf(evb, "loop lag max (usec): %"PRIu64"\n", st->loop_lag_max);
         evbuffer_add_printf(evb, "total requests: %"PRIu64"\n", st->requests);
         for (i = 0; i < st->callback_count; i++) {
+            evbuffer_add_printf(evb, "/%s 50%%: %"PRIu64"\n", st->stats_labels[i], st->fifty_percents[i]);
             evbuffer_add_printf(evb, "/%s 95%%: %"PRIu64"\n", st->stats_labels[i], st->ninety_five_percents[i]);
+            evbuffer_add_printf(evb, "/%s 99%%: %"PRIu64"\n", st->stats_labels[i], st->ninety_nine_percents[i]);
+            evbuffer_add_printf(evb, "/%s 99.9%%: %"PRIu64"\n", st->stats_labels[i], st->ninety_nine_nine_percents[i]);
+            evbuffer_add_printf(evb, "/%s max (usec): %"PRIu64"\n", st->stats_labels[i], st->max_requests[i]);
             evbuffer_add_printf(evb, "/%s average request (usec): %"PRIu64"\n", st->stats_labels[i], st->average_requests[i]);
             evbuffer_add_printf(evb, "/%s requests: %"PRIu64"\n", st->stats_labels[i], st->stats_counts[i]);
         }
@@ -688,30 +708,18 @@ void info()
     fprintf(stdout, "Version: %s, https://github.com/bitly/simplehttp/tree/master/simplememdb\n", VERSION);
 }
 
-void do_dump(int fd, short what, void *ctx)
+int dump_produce(struct simplehttp_stream *stream, struct evbuffer *evb, void *ctx)
 {
-    struct evhttp_request *req;
-    struct evbuffer *evb;
-    struct evkeyvalq args;
-    int n, c = 0, set_timer = 0, send_reply = 0;
-    int limit = 500; // dump 500 at a time
+    int n, c;
     char *key;
     void *value;
-    const char *string;
-    int string_mode = 0;
     int ovector[30], rc;
     
-    req = (struct evhttp_request *)ctx;
-    evb = req->output_buffer;
-    
-    evhttp_parse_query(req->uri, &args);
-    string = (char *)evhttp_find_header(&args, "string");
-    if (string) {
-        string_mode = atoi(string);
-    }
-    evhttp_clear_headers(&args);
-    
-    while ((key = tcadbiternext2(adb)) != NULL) {
+    for (c = 0; c < DUMP_ROWS; c++) {
+        if ((key = tcadbiternext2(adb)) == NULL) {
+            return SIMPLEHTTP_STREAM_DONE;
+        }
+        
         if (dump_regex) {
             rc = pcre_exec(
                      dump_regex,           /* the compiled pattern */
@@ -727,52 +735,34 @@ void do_dump(int fd, short what, void *ctx)
         if ((dump_regex && (rc > 0)) || !dump_regex) {
             value = tcadbget(adb, key, strlen(key), &n);
             if (value) {
-                if (string_mode) {
+                if (dump_string_mode) {
                     evbuffer_add_printf(evb, "%s,%s\n", key, (char *)value);
                 } else {
                     evbuffer_add_printf(evb, "%s,%d\n", key, *(int *)value);
                 }
                 free(value);
             }
-            send_reply = 1;
         }
         
         free(key);
-        
-        c++;
-        if (c == limit) {
-            set_timer = 1;
-            break;
-        }
     }
     
-    if (send_reply) {
-        evhttp_send_reply_chunk(req, evb);
-    }
-    
-    if (set_timer) {
-        set_dump_timer(req);
-    } else {
-        evhttp_send_reply_end(req);
-        if (dump_regex) {
-            pcre_free(dump_regex);
-        }
-        is_currently_dumping = 0;
-    }
+    return SIMPLEHTTP_STREAM_MORE;
 }
 
-void set_dump_timer(struct evhttp_request *req)
+// runs when the dump is complete or the client went away
+void dump_done(struct simplehttp_stream *stream, int connected, void *ctx)
 {
-    struct timeval tv = {0, 500000}; // loop every 0.5 seconds
-    
-    evtimer_del(&ev);
-    evtimer_set(&ev, do_dump, req);
-    evtimer_add(&ev, &tv);
+    if (dump_regex) {
+        pcre_free(dump_regex);
+        dump_regex = NULL;
+    }
+    is_currently_dumping = 0;
 }
 
 /**
  * initiate a non-blocking asynchronous dump of key,value pairs
- * this is accomplished by writing x # of rows (default 500) to the output buffer via evtimers
+ * rows are produced DUMP_ROWS at a time as the client reads them,
  * giving libevent opportunity to handle other requests
  */
 void dump_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
@@ -801,11 +791,11 @@ void dump_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
     } else {
         dump_regex = NULL;
     }
+    dump_string_mode = get_int_argument(&args, "string", 0);
     evhttp_clear_headers(&args);
     
     tcadbiterinit(adb);
-    evhttp_send_reply_start(req, 200, "OK");
-    set_dump_timer(req);
+    simplehttp_stream_start(req, 200, "OK", dump_produce, dump_done, NULL);
 }
 
 int version_cb(int value)
@@ -851,6 +841,8 @@ int main(int argc, char **argv)
     simplehttp_set_cb("/dump*", dump_cb, NULL);
     simplehttp_set_cb("/stats*", stats_cb, NULL);
     simplehttp_set_cb("/exit", exit_cb, NULL);
+    simplehttp_set_cb_priority("/stats*", SIMPLEHTTP_PRIORITY_HIGH);
+    simplehttp_set_cb_priority("/dump*", SIMPLEHTTP_PRIORITY_LOW);
     simplehttp_main();
     
     tcadbclose(adb);
@@ -0,0 +1,155 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "simplehttp/queue.h"
+#include "simplehttp/simplehttp.h"
+#include "ring.h"
+
+/*
+ * memory per message and put/get cost at depth for the ring's packed chunks
+ * against the old layout, one slab allocation per message on a TAILQ. each
+ * runs in its own process so their resident memory is measured separately.
+ *
+ *   ./bench_ring [messages] [message bytes]
+ */
+
+struct list_entry {
+    TAILQ_ENTRY(list_entry) entries;
+    size_t bytes;
+    char data[1];
+};
+TAILQ_HEAD(, list_entry) list;
+
+static struct ring ring;
+
+static void list_push(const char *data, size_t len)
+{
+    struct list_entry *entry = simplehttp_slab_alloc(sizeof(*entry) + len + 1);
+    
+    memcpy(entry->data, data, len);
+    entry->data[len] = '\0';
+    entry->bytes = len;
+    TAILQ_INSERT_TAIL(&list, entry, entries);
+}
+
+static size_t list_pop()
+{
+    struct list_entry *entry = TAILQ_FIRST(&list);
+    size_t len = entry->bytes;
+    
+    TAILQ_REMOVE(&list, entry, entries);
+    simplehttp_slab_free(entry, sizeof(*entry) + entry->bytes + 1);
+    return len;
+}
+
+static void ring_push_msg(const char *data, size_t len)
+{
+    ring_push(&ring, data, len);
+}
+
+static size_t ring_pop_msg()
+{
+    const char *data;
+    size_t len;
+    
+    ring_pop(&ring, &data, &len);
+    return len;
+}
+
+// resident set size in bytes, 0 where /proc is not available
+static size_t current_rss()
+{
+    unsigned long pages, resident;
+    FILE *fp;
+    
+    if ((fp = fopen("/proc/self/statm", "r")) == NULL) {
+        return 0;
+    }
+    if (fscanf(fp, "%lu %lu", &pages, &resident) != 2) {
+        resident = 0;
+    }
+    fclose(fp);
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+static void bench(const char *name, void (*push)(const char *, size_t), size_t (*pop)(), int messages, int size)
+{
+    simplehttp_ts start_ts, end_ts;
+    char *msg = malloc(size);
+    volatile size_t taken = 0;
+    size_t rss_start, rss_full, rss_drained;
+    double fill_ns, steady_ns, drain_ns;
+    int i;
+    
+    memset(msg, 'x', size);
+    rss_start = current_rss();
+    
+    simplehttp_ts_get(&start_ts);
+    for (i = 0; i < messages; i++) {
+        push(msg, size);
+    }
+    simplehttp_ts_get(&end_ts);
+    fill_ns = simplehttp_ts_diff(start_ts, end_ts) * 1000.0 / messages;
+    rss_full = current_rss();
+    
+    // a put and a get each, the depth stays at messages
+    simplehttp_ts_get(&start_ts);
+    for (i = 0; i < messages; i++) {
+        push(msg, size);
+        taken += pop();
+    }
+    simplehttp_ts_get(&end_ts);
+    steady_ns = simplehttp_ts_diff(start_ts, end_ts) * 1000.0 / messages;
+    
+    simplehttp_ts_get(&start_ts);
+    for (i = 0; i < messages; i++) {
+        taken += pop();
+    }
+    simplehttp_ts_get(&end_ts);
+    drain_ns = simplehttp_ts_diff(start_ts, end_ts) * 1000.0 / messages;
+    rss_drained = current_rss();
+    
+    fprintf(stdout, "%-6s %14.1f %10.1f %12.1f %10.1f %14.1f\n", name,
+            (double)(rss_full - rss_start) / messages, fill_ns, steady_ns, drain_ns,
+            (double)(rss_drained - rss_start) / (1024 * 1024));
+    fflush(stdout);
+    free(msg);
+}
+
+int main(int argc, char **argv)
+{
+    int messages = 1000000;
+    int size = 64;
+    pid_t pid;
+    
+    if (argc > 1) {
+        messages = atoi(argv[1]);
+    }
+    if (argc > 2) {
+        size = atoi(argv[2]);
+    }
+    
+    fprintf(stdout, "%d messages of %d bytes\n", messages, size);
+    fprintf(stdout, "%-6s %14s %10s %12s %10s %14s\n", "layout", "rss bytes/msg", "put ns",
+            "put+get ns", "get ns", "drained rss MB");
+    fflush(stdout);
+    
+    if ((pid = fork()) == 0) {
+        TAILQ_INIT(&list);
+        bench("list", list_push, list_pop, messages, size);
+        exit(0);
+    }
+    waitpid(pid, NULL, 0);
+    
+    if ((pid = fork()) == 0) {
+        ring_init(&ring);
+        bench("ring", ring_push_msg, ring_pop_msg, messages, size);
+        ring_free(&ring);
+        exit(0);
+    }
+    waitpid(pid, NULL, 0);
+    
+    return 0;
+}
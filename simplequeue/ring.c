@@ -0,0 +1,135 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "ring.h"
+
+/*
+ * the queue's records are packed back to back into RING_CHUNK_SIZE chunks,
+ * each a 4 byte length and the data. puts append to the last chunk and gets
+ * take from the head of the first, a chunk is released once everything in it
+ * has been taken. a deep backlog is a few large allocations rather than one
+ * per record, and its memory goes back to the system as it drains. one empty
+ * chunk is kept as a spare so a queue that hovers around a chunk boundary
+ * does not allocate on every crossing.
+ *
+ * a record larger than a chunk gets a chunk of its own.
+ */
+
+static struct ring_chunk *ring_chunk_new(struct ring *ring, size_t size)
+{
+    struct ring_chunk *chunk;
+    
+    if (ring->spare && ring->spare->size >= size) {
+        chunk = ring->spare;
+        ring->spare = NULL;
+    } else {
+        chunk = malloc(sizeof(*chunk) + size);
+        chunk->size = size;
+        ring->allocated += sizeof(*chunk) + size;
+    }
+    chunk->head = 0;
+    chunk->used = 0;
+    TAILQ_INSERT_TAIL(&ring->chunks, chunk, entries);
+    return chunk;
+}
+
+static void ring_chunk_release(struct ring *ring, struct ring_chunk *chunk)
+{
+    TAILQ_REMOVE(&ring->chunks, chunk, entries);
+    if (!ring->spare && chunk->size == RING_CHUNK_SIZE) {
+        ring->spare = chunk;
+    } else {
+        ring->allocated -= sizeof(*chunk) + chunk->size;
+        free(chunk);
+    }
+}
+
+/*
+ * the record returned by the last ring_pop() stays in place until the next
+ * push or pop, only then can its chunk go
+ */
+static void ring_release_taken(struct ring *ring)
+{
+    struct ring_chunk *chunk;
+    
+    while ((chunk = TAILQ_FIRST(&ring->chunks)) != NULL && chunk->head == chunk->used) {
+        if (chunk == TAILQ_LAST(&ring->chunks, ring_chunks)) {
+            // empty, start over at the beginning of it
+            chunk->head = 0;
+            chunk->used = 0;
+            break;
+        }
+        ring_chunk_release(ring, chunk);
+    }
+}
+
+void ring_init(struct ring *ring)
+{
+    memset(ring, 0, sizeof(*ring));
+    TAILQ_INIT(&ring->chunks);
+}
+
+void ring_push(struct ring *ring, const char *data, size_t len)
+{
+    struct ring_chunk *chunk;
+    size_t record_size = RING_HEADER_BYTES + len;
+    uint32_t header = len;
+    
+    ring_release_taken(ring);
+    chunk = TAILQ_LAST(&ring->chunks, ring_chunks);
+    if (chunk == NULL || chunk->size - chunk->used < record_size) {
+        chunk = ring_chunk_new(ring, record_size > RING_CHUNK_SIZE ? record_size : RING_CHUNK_SIZE);
+    }
+    memcpy(chunk->data + chunk->used, &header, RING_HEADER_BYTES);
+    memcpy(chunk->data + chunk->used + RING_HEADER_BYTES, data, len);
+    chunk->used += record_size;
+    ring->bytes += record_size;
+    ring->count++;
+}
+
+// the oldest record, *data is valid until the next push or pop
+int ring_pop(struct ring *ring, const char **data, size_t *len)
+{
+    struct ring_chunk *chunk;
+    uint32_t header;
+    
+    ring_release_taken(ring);
+    chunk = TAILQ_FIRST(&ring->chunks);
+    if (chunk == NULL || chunk->head == chunk->used) {
+        return 0;
+    }
+    memcpy(&header, chunk->data + chunk->head, RING_HEADER_BYTES);
+    *data = chunk->data + chunk->head + RING_HEADER_BYTES;
+    *len = header;
+    chunk->head += RING_HEADER_BYTES + header;
+    ring->bytes -= RING_HEADER_BYTES + header;
+    ring->count--;
+    return 1;
+}
+
+// oldest first, without taking them
+void ring_foreach(struct ring *ring, void (*cb)(const char *data, size_t len, void *arg), void *arg)
+{
+    struct ring_chunk *chunk;
+    size_t offset;
+    uint32_t header;
+    
+    TAILQ_FOREACH(chunk, &ring->chunks, entries) {
+        for (offset = chunk->head; offset < chunk->used; offset += RING_HEADER_BYTES + header) {
+            memcpy(&header, chunk->data + offset, RING_HEADER_BYTES);
+            cb(chunk->data + offset + RING_HEADER_BYTES, header, arg);
+        }
+    }
+}
+
+void ring_free(struct ring *ring)
+{
+    struct ring_chunk *chunk;
+    
+    while ((chunk = TAILQ_FIRST(&ring->chunks)) != NULL) {
+        TAILQ_REMOVE(&ring->chunks, chunk, entries);
+        free(chunk);
+    }
+    free(ring->spare);
+    ring_init(ring);
+}
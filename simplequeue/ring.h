@@ -0,0 +1,37 @@
+#ifndef _RING_H
+#define _RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "simplehttp/queue.h"
+
+/*
+ * fifo storage for the queue, records packed into chunks, see ring.c
+ */
+
+#define RING_CHUNK_SIZE (1024 * 1024)
+#define RING_HEADER_BYTES 4
+
+struct ring_chunk {
+    TAILQ_ENTRY(ring_chunk) entries;
+    size_t size;
+    size_t head;        // offset of the oldest record left in the chunk
+    size_t used;
+    char data[1];
+};
+
+struct ring {
+    TAILQ_HEAD(ring_chunks, ring_chunk) chunks;
+    struct ring_chunk *spare;
+    uint64_t count;
+    size_t bytes;       // records with their length headers
+    size_t allocated;   // chunks, the spare included
+};
+
+void ring_init(struct ring *ring);
+void ring_push(struct ring *ring, const char *data, size_t len);
+int ring_pop(struct ring *ring, const char **data, size_t *len);
+void ring_foreach(struct ring *ring, void (*cb)(const char *data, size_t len, void *arg), void *arg);
+void ring_free(struct ring *ring);
+
+#endif
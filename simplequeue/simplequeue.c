@@ -3,143 +3,623 @@
 #include <string.h>
 #include <signal.h>
 #include <inttypes.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
 #include "simplehttp/queue.h"
 #include "simplehttp/simplehttp.h"
+#include "simplehttp/uthash.h"
+#include "ring.h"
+#include "wal.h"
 
 #define VERSION "1.3.1"
+#define MAX_QUEUE_NAME 64
 
 void exit_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx);
 
+// an item taken off the queue, data is only valid until the next put or get
 struct queue_entry {
-    TAILQ_ENTRY(queue_entry) entries;
+    const char *data;
     size_t bytes;
-    char data[1];
 };
-TAILQ_HEAD(, queue_entry) queues;
+struct queue;
+
+/*
+ * a /get or /mget?wait=ms that found its queue empty, parked until a put or
+ * until the wait is up. puts hand items to waiters oldest first. one for a
+ * queue that does not exist yet waits on its name instead, and moves onto
+ * the queue when a put creates it.
+ */
+struct waiter {
+    struct evhttp_request *req;
+    struct queue *q;
+    struct pending_queue *pending;  // instead of q, before the queue exists
+    int num_items;      // 0 for a /get
+    const char *separator;
+    struct event timeout_ev;
+    TAILQ_ENTRY(waiter) entries;
+};
+
+/*
+ * a named queue, ?queue=clicks, created by its first put. the default queue
+ * is the one without a name. each has its own items, limits, stats, overflow
+ * log (--overflow-log with .<name> appended) and write-ahead log (a directory
+ * under <--wal-dir>/queues).
+ */
+struct queue {
+    char *name;
+    struct ring ring;
+    int limits_set;     // set through /limits, --max-depth and --max-bytes no longer apply
+    uint64_t max_depth;
+    size_t   max_bytes;
+    char *overflow_log;
+    FILE *overflow_log_fp;
+    struct wal *wal;
+    uint64_t depth;
+    uint64_t depth_high_water;
+    uint64_t n_puts;
+    uint64_t n_gets;
+    uint64_t n_overflow;
+    size_t   n_bytes;
+    uint64_t n_waiters;
+    TAILQ_HEAD(, waiter) waiters;
+    UT_hash_handle hh;
+};
+
+// a name waited on before a put created its queue, at most --max-queues of them
+struct pending_queue {
+    char *name;
+    TAILQ_HEAD(, waiter) waiters;
+    UT_hash_handle hh;
+};
 
 char *progname = "simplequeue";
 char *overflow_log = NULL;
-FILE *overflow_log_fp = NULL;
 uint64_t max_depth = 0;
 size_t   max_bytes = 0;
 int max_mget = 0;
+int max_queues = 100;
+int max_wait_ms = 60000;
 char *mget_item_sep = "\n";
 char *mput_item_sep = "\n";
+char *wal_dir = NULL;
+struct queue *queues = NULL;
+struct queue *default_queue = NULL;
+int n_queues = 0;
+struct pending_queue *pending_queues = NULL;
+int n_pending_queues = 0;
+
+// totals over all queues, for /metrics
 uint64_t depth = 0;
 uint64_t depth_high_water = 0;
 uint64_t n_puts = 0;
 uint64_t n_gets = 0;
 uint64_t n_overflow = 0;
 size_t   n_bytes = 0;
+uint64_t n_waiters = 0;
+
+struct event hup_ev;
 
-void hup_handler(int signum)
+void open_overflow_log(struct queue *q)
 {
-    signal(SIGHUP, hup_handler);
-    if (overflow_log_fp) {
-        fclose(overflow_log_fp);
+    q->overflow_log_fp = fopen(q->overflow_log, "a");
+    if (!q->overflow_log_fp) {
+        perror("fopen failed: ");
+        exit(1);
     }
-    if (overflow_log) {
-        overflow_log_fp = fopen(overflow_log, "a");
-        if (!overflow_log_fp) {
-            perror("fopen failed: ");
-            exit(1);
+    fprintf(stdout, "opened overflow_log: %s\n", q->overflow_log);
+}
+
+// reopens the overflow logs, run from the event loop so no put is halfway through a queue
+void hup_cb(int sig, short what, void *arg)
+{
+    struct queue *q, *tmp;
+    
+    HASH_ITER(hh, queues, q, tmp) {
+        if (q->overflow_log_fp) {
+            fclose(q->overflow_log_fp);
+            open_overflow_log(q);
         }
-        fprintf(stdout, "opened overflow_log: %s\n", overflow_log);
     }
 }
 
-void overflow_one()
+int get_queue_entry(struct queue *q, struct queue_entry *entry)
 {
-    struct queue_entry *entry;
+    if (!ring_pop(&q->ring, &entry->data, &entry->bytes)) {
+        return 0;
+    }
+    q->depth--;
+    q->n_bytes -= entry->bytes;
+    depth--;
+    n_bytes -= entry->bytes;
+    if (q->wal) {
+        wal_consume(q->wal, entry->bytes);
+    }
+    return 1;
+}
+
+void overflow_one(struct queue *q)
+{
+    struct queue_entry entry;
     
-    entry = TAILQ_FIRST(&queues);
-    if (entry != NULL) {
-        TAILQ_REMOVE(&queues, entry, entries);
-        fwrite(entry->data, entry->bytes, 1, overflow_log_fp);
-        fwrite("\n", 1, 1, overflow_log_fp);
-        n_bytes -= entry->bytes;
-        depth--;
+    if (get_queue_entry(q, &entry)) {
+        if (q->overflow_log_fp) {
+            fwrite(entry.data, entry.bytes, 1, q->overflow_log_fp);
+            fwrite("\n", 1, 1, q->overflow_log_fp);
+        }
+        q->n_overflow++;
         n_overflow++;
-        free(entry);
     }
 }
 
+void append_queue_entry(struct queue *q, const char *data, size_t record_size)
+{
+    uint64_t limit_depth = q->limits_set ? q->max_depth : max_depth;
+    size_t limit_bytes = q->limits_set ? q->max_bytes : max_bytes;
+    
+    // copy the record into the queue, overflow if needed
+    ring_push(&q->ring, data, record_size);
+    q->n_bytes += record_size;
+    q->depth++;
+    if (q->depth > q->depth_high_water) {
+        q->depth_high_water = q->depth;
+    }
+    n_bytes += record_size;
+    depth++;
+    if (depth > depth_high_water) {
+        depth_high_water = depth;
+    }
+    while ((limit_depth > 0 && q->depth > limit_depth)
+            || (limit_bytes > 0 && q->ring.bytes > limit_bytes)) {
+        overflow_one(q);
+    }
+}
+
+// --wal-dir records from the last run, already logged
+void replay_queue_entry(const char *data, size_t len, void *arg)
+{
+    append_queue_entry((struct queue *)arg, data, len);
+}
+
+// names end up in file names
+int valid_queue_name(const char *name)
+{
+    const char *p;
+    
+    if (name[0] == '.' || strlen(name) > MAX_QUEUE_NAME) {
+        return 0;
+    }
+    for (p = name; *p; p++) {
+        if (!((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') || (*p >= '0' && *p <= '9')
+                || *p == '_' || *p == '-' || *p == '.')) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void free_pending_queue(struct pending_queue *pending)
+{
+    HASH_DEL(pending_queues, pending);
+    n_pending_queues--;
+    free(pending->name);
+    free(pending);
+}
+
+struct queue *new_queue(const char *name)
+{
+    struct queue *q;
+    char path[1024];
+    
+    struct pending_queue *pending;
+    struct waiter *w;
+    
+    q = calloc(1, sizeof(*q));
+    q->name = strdup(name);
+    ring_init(&q->ring);
+    TAILQ_INIT(&q->waiters);
+    HASH_ADD_KEYPTR(hh, queues, q->name, strlen(q->name), q);
+    n_queues++;
+    
+    // gets that were already waiting for it, the put that made it wakes them
+    HASH_FIND_STR(pending_queues, name, pending);
+    if (pending) {
+        while ((w = TAILQ_FIRST(&pending->waiters)) != NULL) {
+            TAILQ_REMOVE(&pending->waiters, w, entries);
+            w->pending = NULL;
+            w->q = q;
+            TAILQ_INSERT_TAIL(&q->waiters, w, entries);
+            q->n_waiters++;
+        }
+        free_pending_queue(pending);
+    }
+    
+    if (overflow_log) {
+        if (name[0]) {
+            snprintf(path, sizeof(path), "%s.%s", overflow_log, name);
+            q->overflow_log = strdup(path);
+        } else {
+            q->overflow_log = strdup(overflow_log);
+        }
+        open_overflow_log(q);
+    }
+    if (wal_dir) {
+        if (name[0]) {
+            snprintf(path, sizeof(path), "%s/queues/%s", wal_dir, name);
+        } else {
+            snprintf(path, sizeof(path), "%s", wal_dir);
+        }
+        q->wal = wal_open(path, option_get_int("wal_fsync_ms"), option_get_int("wal_segment_bytes"));
+        wal_replay(q->wal, replay_queue_entry, q);
+        fprintf(stdout, "replayed %"PRIu64" entries from %s\n", q->depth, path);
+    }
+    return q;
+}
+
+void free_queue(struct queue *q)
+{
+    HASH_DEL(queues, q);
+    n_queues--;
+    if (q->wal) {
+        // what is left stays in the log for the next start
+        wal_close(q->wal);
+    } else {
+        while (q->overflow_log_fp && q->depth) {
+            overflow_one(q);
+        }
+    }
+    if (q->overflow_log_fp) {
+        fclose(q->overflow_log_fp);
+    }
+    ring_free(&q->ring);
+    free(q->overflow_log);
+    free(q->name);
+    free(q);
+}
+
+/*
+ * the queue named by the queue argument, the default queue without one. a
+ * queue that does not exist yet is created when create is set and NULL
+ * returned otherwise. a bad name, or a new queue past --max-queues, is
+ * answered here with a 400 and *error set.
+ */
+struct queue *request_queue(struct evhttp_request *req, struct evbuffer *evb, int create, int *error)
+{
+    const char *name;
+    struct queue *q;
+    
+    *error = 0;
+    name = simplehttp_arg(simplehttp_args(req), "queue");
+    if (name == NULL || name[0] == '\0') {
+        return default_queue;
+    }
+    HASH_FIND_STR(queues, name, q);
+    if (q || !create) {
+        return q;
+    }
+    
+    if (!valid_queue_name(name)) {
+        evbuffer_add_printf(evb, "%s\n", "invalid queue name");
+    } else if (max_queues > 0 && n_queues >= max_queues) {
+        evbuffer_add_printf(evb, "%s\n", "too many queues");
+    } else {
+        return new_queue(name);
+    }
+    evhttp_send_reply(req, HTTP_BADREQUEST, "ERROR", evb);
+    *error = 1;
+    return NULL;
+}
+
 void stats(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
 {
-    struct evkeyvalq args;
+    struct simplehttp_args *args;
+    struct simplehttp_stats *st;
+    struct queue *q, empty;
     const char *reset;
     const char *format;
+    int error;
+    
+    // a queue that was never put to is empty
+    if ((q = request_queue(req, evb, 0, &error)) == NULL) {
+        if (error) {
+            return;
+        }
+        memset(&empty, 0, sizeof(empty));
+        q = &empty;
+    }
     
-    evhttp_parse_query(req->uri, &args);
-    reset = evhttp_find_header(&args, "reset");
+    args = simplehttp_args(req);
+    reset = simplehttp_arg(args, "reset");
     if (reset != NULL && strcmp(reset, "1") == 0) {
-        depth_high_water = 0;
-        n_puts = 0;
-        n_gets = 0;
+        q->depth_high_water = 0;
+        q->n_puts = 0;
+        q->n_gets = 0;
     } else {
-        format = evhttp_find_header(&args, "format");
+        format = simplehttp_arg(args, "format");
+        // event loop saturation, the signal to shard or move to --workers
+        st = simplehttp_stats_new();
+        simplehttp_stats_get(st);
         
         if ((format != NULL) && (strcmp(format, "json") == 0)) {
             evbuffer_add_printf(evb, "{");
-            evbuffer_add_printf(evb, "\"puts\": %"PRIu64",", n_puts);
-            evbuffer_add_printf(evb, "\"gets\": %"PRIu64",", n_gets);
-            evbuffer_add_printf(evb, "\"depth\": %"PRIu64",", depth);
-            evbuffer_add_printf(evb, "\"depth_high_water\": %"PRIu64",", depth_high_water);
-            evbuffer_add_printf(evb, "\"bytes\": %ld,", n_bytes);
-            evbuffer_add_printf(evb, "\"overflow\": %"PRIu64"", n_overflow);
+            evbuffer_add_printf(evb, "\"puts\": %"PRIu64",", q->n_puts);
+            evbuffer_add_printf(evb, "\"gets\": %"PRIu64",", q->n_gets);
+            evbuffer_add_printf(evb, "\"depth\": %"PRIu64",", q->depth);
+            evbuffer_add_printf(evb, "\"depth_high_water\": %"PRIu64",", q->depth_high_water);
+            evbuffer_add_printf(evb, "\"bytes\": %ld,", q->n_bytes);
+            evbuffer_add_printf(evb, "\"overflow\": %"PRIu64",", q->n_overflow);
+            evbuffer_add_printf(evb, "\"memory\": %ld,", q->ring.allocated);
+            evbuffer_add_printf(evb, "\"waiters\": %"PRIu64",", q->n_waiters);
+            evbuffer_add_printf(evb, "\"loop_utilization\": %.1f,", st->loop_utilization);
+            evbuffer_add_printf(evb, "\"loop_lag_99\": %"PRIu64",", st->loop_lag_99);
+            evbuffer_add_printf(evb, "\"loop_lag_max\": %"PRIu64"", st->loop_lag_max);
             evbuffer_add_printf(evb, "}\n");
         } else {
-            evbuffer_add_printf(evb, "puts:%"PRIu64"\n", n_puts);
-            evbuffer_add_printf(evb, "gets:%"PRIu64"\n", n_gets);
-            evbuffer_add_printf(evb, "depth:%"PRIu64"\n", depth);
-            evbuffer_add_printf(evb, "depth_high_water:%"PRIu64"\n", depth_high_water);
-            evbuffer_add_printf(evb, "bytes:%ld\n", n_bytes);
-            evbuffer_add_printf(evb, "overflow:%"PRIu64"\n", n_overflow);
+            evbuffer_add_printf(evb, "puts:%"PRIu64"\n", q->n_puts);
+            evbuffer_add_printf(evb, "gets:%"PRIu64"\n", q->n_gets);
+            evbuffer_add_printf(evb, "depth:%"PRIu64"\n", q->depth);
+            evbuffer_add_printf(evb, "depth_high_water:%"PRIu64"\n", q->depth_high_water);
+            evbuffer_add_printf(evb, "bytes:%ld\n", q->n_bytes);
+            evbuffer_add_printf(evb, "overflow:%"PRIu64"\n", q->n_overflow);
+            evbuffer_add_printf(evb, "memory:%ld\n", q->ring.allocated);
+            evbuffer_add_printf(evb, "waiters:%"PRIu64"\n", q->n_waiters);
+            evbuffer_add_printf(evb, "loop_utilization:%.1f\n", st->loop_utilization);
+            evbuffer_add_printf(evb, "loop_lag_99:%"PRIu64"\n", st->loop_lag_99);
+            evbuffer_add_printf(evb, "loop_lag_max:%"PRIu64"\n", st->loop_lag_max);
         }
+        simplehttp_stats_free(st);
     }
     
     evhttp_send_reply(req, HTTP_OK, "OK", evb);
-    evhttp_clear_headers(&args);
 }
 
-struct queue_entry *get_queue_entry()
+// the reply to a /get, num_items 0, or an /mget of up to num_items
+void send_items(struct queue *q, struct evhttp_request *req, struct evbuffer *evb, int num_items, const char *separator)
 {
-    struct queue_entry *entry;
-    entry = TAILQ_FIRST(&queues);
-    if (entry != NULL) {
-        TAILQ_REMOVE(&queues, entry, entries);
-        depth--;
+    struct queue_entry entry;
+    size_t separator_len = strlen(separator);
+    int i = 0;
+    
+    if (num_items == 0) {
+        q->n_gets++;
+        n_gets++;
+        if (get_queue_entry(q, &entry)) {
+            simplehttp_reply_bytes(req, HTTP_OK, "OK", entry.data, entry.bytes);
+        } else {
+            simplehttp_reply_bytes(req, HTTP_OK, "OK", NULL, 0);
+        }
+        return;
+    }
+    
+    // get n number of items from the queue to return
+    for (i = 0; i < num_items && get_queue_entry(q, &entry); q->n_gets++, n_gets++, i++) {
+        evbuffer_add(evb, entry.data, entry.bytes);
+        if (i < (num_items - 1)) {
+            evbuffer_add(evb, separator, separator_len);
+        }
     }
-    return entry;
+    
+    evhttp_send_reply(req, HTTP_OK, "OK", evb);
 }
 
-void get(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
+void free_waiter(struct waiter *w)
 {
-    struct queue_entry *entry;
-    n_gets++;
+    if (w->pending) {
+        TAILQ_REMOVE(&w->pending->waiters, w, entries);
+        if (TAILQ_EMPTY(&w->pending->waiters)) {
+            free_pending_queue(w->pending);
+        }
+    } else {
+        TAILQ_REMOVE(&w->q->waiters, w, entries);
+        w->q->n_waiters--;
+    }
+    n_waiters--;
+    evtimer_del(&w->timeout_ev);
+    evhttp_connection_set_closecb(w->req->evcon, NULL, NULL);
+    free(w);
+}
+
+// answer a parked request with whatever the queue has for it, maybe nothing
+void wake_waiter(struct waiter *w)
+{
+    struct evhttp_request *req = w->req;
+    struct queue *q = w->q;
+    int num_items = w->num_items;
+    const char *separator = w->separator;
+    struct evbuffer *evb;
     
-    entry = get_queue_entry();
-    if (entry != NULL) {
-        n_bytes -= entry->bytes;
-        evbuffer_add_printf(evb, "%s", entry->data);
-        free(entry);
+    free_waiter(w);
+    evb = evbuffer_new();
+    if (q) {
+        send_items(q, req, evb, num_items, separator);
+    } else {
+        // its queue was never made
+        evhttp_send_reply(req, HTTP_OK, "OK", evb);
     }
+    evbuffer_free(evb);
+    simplehttp_async_finish(req);
+}
+
+// its client hung up without libevent noticing, the items stay for the next one
+void drop_waiter(struct waiter *w)
+{
+    struct evhttp_request *req = w->req;
     
-    evhttp_send_reply(req, HTTP_OK, "OK", evb);
+    free_waiter(w);
+    simplehttp_reply_bytes(req, HTTP_OK, "OK", NULL, 0);
+    simplehttp_async_finish(req);
+}
+
+void wake_waiters(struct queue *q)
+{
+    struct waiter *w;
+    
+    while (q->depth > 0 && (w = TAILQ_FIRST(&q->waiters)) != NULL) {
+        if (simplehttp_client_gone(w->req)) {
+            drop_waiter(w);
+        } else {
+            wake_waiter(w);
+        }
+    }
+}
+
+void waiter_timeout_cb(int fd, short what, void *arg)
+{
+    wake_waiter((struct waiter *)arg);
+}
+
+// the client went away
+void waiter_close_cb(struct evhttp_connection *evcon, void *arg)
+{
+    struct waiter *w = (struct waiter *)arg;
+    struct evhttp_request *req = w->req;
+    
+    free_waiter(w);
+    simplehttp_async_finish(req);
+}
+
+// a simplehttp_set_cb_timeout() deadline, simplehttp answers it
+void waiter_deadline_cb(struct evhttp_request *req, void *arg)
+{
+    free_waiter((struct waiter *)arg);
+}
+
+void park_waiter(struct waiter *w, int wait_ms)
+{
+    struct evhttp_request *req = w->req;
+    struct timeval tv;
+    
+    if (wait_ms > max_wait_ms) {
+        wait_ms = max_wait_ms;
+    }
+    n_waiters++;
+    
+    simplehttp_async_set_timeout_cb(req, waiter_deadline_cb, w);
+    evhttp_connection_set_closecb(req->evcon, waiter_close_cb, w);
+    tv.tv_sec = wait_ms / 1000;
+    tv.tv_usec = (wait_ms % 1000) * 1000;
+    evtimer_set(&w->timeout_ev, waiter_timeout_cb, w);
+    evtimer_add(&w->timeout_ev, &tv);
+}
+
+struct waiter *new_waiter(struct evhttp_request *req, int num_items, const char *separator)
+{
+    struct waiter *w;
+    
+    w = calloc(1, sizeof(*w));
+    w->req = req;
+    w->num_items = num_items;
+    w->separator = separator;
+    return w;
+}
+
+// 1 if req was parked to wait for the queue's next items
+int wait_for_items(struct queue *q, struct evhttp_request *req, int wait_ms, int num_items, const char *separator)
+{
+    struct waiter *w;
+    
+    if (wait_ms <= 0 || q->depth > 0 || !simplehttp_async_enable(req)) {
+        return 0;
+    }
+    
+    w = new_waiter(req, num_items, separator);
+    w->q = q;
+    TAILQ_INSERT_TAIL(&q->waiters, w, entries);
+    q->n_waiters++;
+    park_waiter(w, wait_ms);
+    return 1;
+}
+
+/*
+ * 1 if req was parked to wait for a queue named by its queue argument that
+ * does not exist yet. the names waited on are not queues, only up to
+ * --max-queues of them are kept.
+ */
+int wait_for_queue(struct evhttp_request *req, int wait_ms, int num_items, const char *separator)
+{
+    struct pending_queue *pending;
+    const char *name;
+    struct waiter *w;
+    
+    name = simplehttp_arg(simplehttp_args(req), "queue");
+    if (wait_ms <= 0 || name == NULL || !valid_queue_name(name)) {
+        return 0;
+    }
+    HASH_FIND_STR(pending_queues, name, pending);
+    if (!pending && max_queues > 0 && n_pending_queues >= max_queues) {
+        return 0;
+    }
+    if (!simplehttp_async_enable(req)) {
+        return 0;
+    }
+    if (!pending) {
+        pending = calloc(1, sizeof(*pending));
+        pending->name = strdup(name);
+        TAILQ_INIT(&pending->waiters);
+        HASH_ADD_KEYPTR(hh, pending_queues, pending->name, strlen(pending->name), pending);
+        n_pending_queues++;
+    }
+    
+    w = new_waiter(req, num_items, separator);
+    w->pending = pending;
+    TAILQ_INSERT_TAIL(&pending->waiters, w, entries);
+    park_waiter(w, wait_ms);
+    return 1;
+}
+
+// parked requests go with their connections when the http server is freed
+void release_waiters()
+{
+    struct queue *q, *tmp;
+    struct evhttp_request *req;
+    
+    // the last waiter on a name frees it
+    while (pending_queues) {
+        req = TAILQ_FIRST(&pending_queues->waiters)->req;
+        free_waiter(TAILQ_FIRST(&pending_queues->waiters));
+        simplehttp_async_finish(req);
+    }
+    
+    HASH_ITER(hh, queues, q, tmp) {
+        while (!TAILQ_EMPTY(&q->waiters)) {
+            req = TAILQ_FIRST(&q->waiters)->req;
+            free_waiter(TAILQ_FIRST(&q->waiters));
+            simplehttp_async_finish(req);
+        }
+    }
+}
+
+void get(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
+{
+    struct queue *q;
+    int wait_ms = simplehttp_arg_int(simplehttp_args(req), "wait", 0);
+    int error;
+    
+    // gets never make a queue, they wait for the put that does
+    if ((q = request_queue(req, evb, 0, &error)) == NULL) {
+        if (!error && !wait_for_queue(req, wait_ms, 0, mget_item_sep)) {
+            simplehttp_reply_bytes(req, HTTP_OK, "OK", NULL, 0);
+        }
+        return;
+    }
+    if (!wait_for_items(q, req, wait_ms, 0, mget_item_sep)) {
+        send_items(q, req, evb, 0, mget_item_sep);
+    }
 }
 
 void mget(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
 {
-    struct evkeyvalq args;
+    struct simplehttp_args *args;
     const char *items_arg;
     const char *separator;
-    struct queue_entry *entry;
+    struct queue *q;
     int num_items = 1;
-    int i = 0;
+    int wait_ms;
+    int error;
     
     // parse the number of items to return, defaults to 1
-    evhttp_parse_query(req->uri, &args);
-    items_arg = evhttp_find_header(&args, "items");
+    args = simplehttp_args(req);
+    items_arg = simplehttp_arg(args, "items");
     
     // if arg, must be > 0, it is constrained to max
     if (items_arg != NULL) {
@@ -147,7 +627,6 @@ void mget(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
         if (num_items <= 0) {
             evbuffer_add_printf(evb, "%s\n", "number of items must be > 0");
             evhttp_send_reply(req, HTTP_BADREQUEST, "ERROR", evb);
-            evhttp_clear_headers(&args);
             return;
         }
     }
@@ -156,62 +635,56 @@ void mget(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
     }
     
     // allow dynamically setting separator for items, defaults to newline
-    separator = evhttp_find_header(&args, "separator");
+    separator = simplehttp_arg(args, "separator");
     if (separator == NULL) {
         separator = mget_item_sep;
     }
     
-    // get n number of items from the queue to return
-    for (i = 0; i < num_items && (entry = get_queue_entry()); n_gets++, i++) {
-        n_bytes -= entry->bytes;
-        evbuffer_add_printf(evb, "%s", entry->data);
-        if (i < (num_items - 1)) {
-            evbuffer_add_printf(evb, "%s", separator);
+    wait_ms = simplehttp_arg_int(args, "wait", 0);
+    if ((q = request_queue(req, evb, 0, &error)) == NULL) {
+        if (!error && !wait_for_queue(req, wait_ms, num_items, separator)) {
+            evhttp_send_reply(req, HTTP_OK, "OK", evb);
         }
-        free(entry);
+        return;
+    }
+    if (!wait_for_items(q, req, wait_ms, num_items, separator)) {
+        send_items(q, req, evb, num_items, separator);
     }
-    
-    evhttp_send_reply(req, HTTP_OK, "OK", evb);
-    evhttp_clear_headers(&args);
 }
 
-void put_queue_entry(const char *data, size_t record_size)
+void put_queue_entry(struct queue *q, const char *data, size_t record_size)
 {
-    struct queue_entry *entry;
-    
     // don't put empty records on the queue
     if (record_size > 0) {
-        // copy the record
-        entry = malloc(sizeof(*entry) + record_size + 1);
-        strncpy(entry->data, data, record_size);
-        entry->data[record_size] = '\0';
-        entry->bytes = record_size;
-        
-        // insert it into the queue, overflow if needed
-        TAILQ_INSERT_TAIL(&queues, entry, entries);
-        n_bytes += entry->bytes;
-        depth++;
-        if (depth > depth_high_water) {
-            depth_high_water = depth;
-        }
-        while ((max_depth > 0 && depth > max_depth)
-                || (max_bytes > 0 && n_bytes > max_bytes)) {
-            overflow_one();
+        // logged first, an overflow takes it straight back off
+        if (q->wal) {
+            wal_append(q->wal, data, record_size);
         }
+        append_queue_entry(q, data, record_size);
+        q->n_puts++;
+        n_puts++;
+    }
+}
+
+// with --wal-fsync-ms=0 a put is answered once it is on disk
+void put_reply(struct queue *q, struct evhttp_request *req, struct evbuffer *evb)
+{
+    if (!q->wal || !wal_wait(q->wal, req)) {
+        evhttp_send_reply(req, HTTP_OK, "OK", evb);
     }
 }
 
 void put(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
 {
-    struct evkeyvalq args;
+    struct simplehttp_args *args;
     const char *data;
     size_t data_size = 0;
-    
-    n_puts++;
+    struct queue *q;
+    int error;
     
     // try to get the data from get first, then from post
-    evhttp_parse_query(req->uri, &args);
-    if ((data = evhttp_find_header(&args, "data")) != NULL) {
+    args = simplehttp_args(req);
+    if ((data = simplehttp_arg(args, "data")) != NULL) {
         data_size = strlen(data);
     } else if ((data_size = EVBUFFER_LENGTH(req->input_buffer)) > 0) {
         data = (char *)EVBUFFER_DATA(req->input_buffer);
@@ -219,19 +692,21 @@ void put(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
     
     // no data, ignore the call
     if (data) {
-        put_queue_entry(data, data_size);
-        evhttp_send_reply(req, HTTP_OK, "OK", evb);
+        if ((q = request_queue(req, evb, 1, &error)) == NULL) {
+            return;
+        }
+        put_queue_entry(q, data, data_size);
+        wake_waiters(q);
+        put_reply(q, req, evb);
     } else {
         evbuffer_add_printf(evb, "%s\n", "missing data");
         evhttp_send_reply(req, HTTP_BADREQUEST, "ERROR", evb);
     }
-    
-    evhttp_clear_headers(&args);
 }
 
 void mput(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
 {
-    struct evkeyvalq args;
+    struct simplehttp_args *args;
     const char *data = NULL;
     size_t data_size = 0;
     const char *sep = NULL;
@@ -240,10 +715,12 @@ void mput(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
     char *sep_start = NULL;
     const char *record_start;
     size_t record_size = 0;
+    struct queue *q;
+    int error;
     
     // try to get the data from get first, then from post
-    evhttp_parse_query(req->uri, &args);
-    if ((data = evhttp_find_header(&args, "data")) != NULL) {
+    args = simplehttp_args(req);
+    if ((data = simplehttp_arg(args, "data")) != NULL) {
         data_size = strlen(data);
     } else if ((data_size = EVBUFFER_LENGTH(req->input_buffer)) > 0) {
         data = (char *)EVBUFFER_DATA(req->input_buffer);
@@ -251,8 +728,11 @@ void mput(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
     
     // no data, ignore the call
     if (data) {
+        if ((q = request_queue(req, evb, 1, &error)) == NULL) {
+            return;
+        }
         // allow dynamically setting separator for items, defaults to newline
-        sep = evhttp_find_header(&args, "separator");
+        sep = simplehttp_arg(args, "separator");
         if (sep == NULL) {
             sep = mput_item_sep;
         }
@@ -270,26 +750,23 @@ void mput(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
                 if (record_size > data_left) {
                     record_size = data_left;
                 }
-                put_queue_entry(record_start, record_size);
+                put_queue_entry(q, record_start, record_size);
                 record_start = sep_start + sep_size;
                 data_left -= (record_size + sep_size);
-                n_puts++;
             }
         }
         
         // any ending record
         if (data_left > 0) {
-            put_queue_entry(record_start, data_left);
-            n_puts++;
+            put_queue_entry(q, record_start, data_left);
         }
         
-        evhttp_send_reply(req, HTTP_OK, "OK", evb);
+        wake_waiters(q);
+        put_reply(q, req, evb);
     } else {
         evbuffer_add_printf(evb, "%s\n", "missing data");
         evhttp_send_reply(req, HTTP_BADREQUEST, "ERROR", evb);
     }
-    
-    evhttp_clear_headers(&args);
 }
 
 void exit_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
@@ -298,17 +775,131 @@ void exit_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
     event_loopbreak();
 }
 
+void dump_entry(const char *data, size_t len, void *arg)
+{
+    struct evbuffer *evb = (struct evbuffer *)arg;
+    
+    evbuffer_add(evb, data, len);
+    evbuffer_add(evb, "\n", 1);
+}
+
 void dump(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
 {
-    struct queue_entry *entry;
+    struct queue *q;
+    int error;
     
-    TAILQ_FOREACH(entry, &queues, entries) {
-        evbuffer_add_printf(evb, "%s\n", entry->data);
+    if ((q = request_queue(req, evb, 0, &error)) == NULL && error) {
+        return;
+    }
+    if (q) {
+        ring_foreach(&q->ring, dump_entry, evb);
     }
+    simplehttp_send_reply(req, HTTP_OK, "OK", evb);
+}
+
+// the queues there are, the default one as ""
+void list_queues(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
+{
+    struct queue *q, *tmp;
+    int format = simplehttp_arg_format(simplehttp_args(req));
     
+    if (format == json_format) {
+        evbuffer_add_printf(evb, "{\"queues\": [");
+    }
+    HASH_ITER(hh, queues, q, tmp) {
+        if (format == json_format) {
+            evbuffer_add_printf(evb, "%s{\"name\": \"%s\", \"depth\": %"PRIu64"}",
+                                q == queues ? "" : ", ", q->name, q->depth);
+        } else {
+            evbuffer_add_printf(evb, "%s %"PRIu64"\n", q->name, q->depth);
+        }
+    }
+    if (format == json_format) {
+        evbuffer_add_printf(evb, "]}\n");
+    }
     evhttp_send_reply(req, HTTP_OK, "OK", evb);
 }
 
+/*
+ * /limits?queue=clicks&max_depth=1000&max_bytes=0 gives one queue its own
+ * limits in place of --max-depth and --max-bytes, until the next restart.
+ * without arguments it shows them. max_bytes counts the items as the ring
+ * does, not the chunks holding them: overflowing an item frees no memory
+ * until its whole chunk is taken, so a limit on those could not be kept.
+ */
+void limits(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
+{
+    struct simplehttp_args *args = simplehttp_args(req);
+    const char *depth_arg = simplehttp_arg(args, "max_depth");
+    const char *bytes_arg = simplehttp_arg(args, "max_bytes");
+    struct queue *q;
+    int error;
+    
+    if ((q = request_queue(req, evb, 1, &error)) == NULL) {
+        return;
+    }
+    if ((depth_arg && atoll(depth_arg) < 0) || (bytes_arg && atoll(bytes_arg) < 0)) {
+        evbuffer_add_printf(evb, "%s\n", "limits must be >= 0");
+        evhttp_send_reply(req, HTTP_BADREQUEST, "ERROR", evb);
+        return;
+    }
+    if (depth_arg || bytes_arg) {
+        if (!q->limits_set) {
+            q->limits_set = 1;
+            q->max_depth = max_depth;
+            q->max_bytes = max_bytes;
+        }
+        if (depth_arg) {
+            q->max_depth = (uint64_t)atoll(depth_arg);
+        }
+        if (bytes_arg) {
+            q->max_bytes = (size_t)atoll(bytes_arg);
+        }
+        while ((q->max_depth > 0 && q->depth > q->max_depth)
+                || (q->max_bytes > 0 && q->ring.bytes > q->max_bytes)) {
+            overflow_one(q);
+        }
+    }
+    
+    if (simplehttp_arg_format(args) == json_format) {
+        evbuffer_add_printf(evb, "{\"max_depth\": %"PRIu64", \"max_bytes\": %ld}\n",
+                            q->limits_set ? q->max_depth : max_depth, q->limits_set ? q->max_bytes : max_bytes);
+    } else {
+        evbuffer_add_printf(evb, "max_depth:%"PRIu64"\nmax_bytes:%ld\n",
+                            q->limits_set ? q->max_depth : max_depth, q->limits_set ? q->max_bytes : max_bytes);
+    }
+    evhttp_send_reply(req, HTTP_OK, "OK", evb);
+}
+
+// queues with a write-ahead log from the last run come back at startup
+void open_logged_queues()
+{
+    char path[1024];
+    struct dirent *dent;
+    struct queue *q;
+    DIR *d;
+    
+    snprintf(path, sizeof(path), "%s/queues", wal_dir);
+    if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+        perror("mkdir failed: ");
+        exit(1);
+    }
+    if ((d = opendir(path)) == NULL) {
+        perror("opendir failed: ");
+        exit(1);
+    }
+    while ((dent = readdir(d)) != NULL) {
+        if (dent->d_name[0] == '.' || !valid_queue_name(dent->d_name)) {
+            continue;
+        }
+        HASH_FIND_STR(queues, dent->d_name, q);
+        if (q == NULL) {
+            new_queue(dent->d_name);
+        }
+    }
+    closedir(d);
+}
+
 void usage()
 {
     fprintf(stderr, "%s: A simple http buffer queue.\n", progname);
@@ -317,6 +908,34 @@ void usage()
     exit(1);
 }
 
+uint64_t queue_bytes(void *ctx)
+{
+    return n_bytes;
+}
+
+uint64_t queue_memory(void *ctx)
+{
+    struct queue *q, *tmp;
+    uint64_t allocated = 0;
+    
+    HASH_ITER(hh, queues, q, tmp) {
+        allocated += q->ring.allocated;
+    }
+    return allocated;
+}
+
+uint64_t queue_count(void *ctx)
+{
+    return n_queues;
+}
+
+// --max-bytes and --max-depth at startup and after each change through /config
+void limits_changed(const char *option_name, void *arg)
+{
+    max_bytes = (size_t)option_get_int("max_bytes");
+    max_depth = (uint64_t)option_get_int("max_depth");
+}
+
 int version_cb(int value)
 {
     fprintf(stdout, "Version: %s\n", VERSION);
@@ -325,53 +944,76 @@ int version_cb(int value)
 
 int main(int argc, char **argv)
 {
-    TAILQ_INIT(&queues);
-    
     define_simplehttp_options();
-    option_define_str("overflow_log", OPT_OPTIONAL, NULL, &overflow_log, NULL, "file to write data beyond --max-depth or --max-bytes");
+    option_define_str("overflow_log", OPT_OPTIONAL, NULL, &overflow_log, NULL, "file to write data beyond --max-depth or --max-bytes (.<name> appended for named queues)");
     option_define_str("mget_item_sep", OPT_OPTIONAL, "\n", &mget_item_sep, NULL, "separator between items in mget, defaults to newline");
     option_define_str("mput_item_sep", OPT_OPTIONAL, "\n", &mput_item_sep, NULL, "separator between items in mput, defaults to newline");
-    option_define_int("max_bytes", OPT_OPTIONAL, 0, NULL, NULL, "memory limit");
+    option_define_int("max_bytes", OPT_OPTIONAL, 0, NULL, NULL, "limit on queued items, each counted as its data and a 4 byte length. the 1MB chunks they are packed into (memory in /stats) take up to 3MB more, and more with items of hundreds of KB");
     option_define_int("max_depth", OPT_OPTIONAL, 0, NULL, NULL, "maximum items in queue");
+    option_define_int("max_queues", OPT_OPTIONAL, 100, &max_queues, NULL, "maximum named queues, created by their first put (0 for no limit)");
+    option_define_int("max_wait_ms", OPT_OPTIONAL, 60000, &max_wait_ms, NULL, "longest a /get or /mget?wait=ms waits for an item");
     option_define_bool("version", OPT_OPTIONAL, 0, NULL, version_cb, VERSION);
-    option_define_int("max_mget", OPT_OPTIONAL, 0, NULL, NULL, "maximum items to return in a single mget");
+    option_define_int("max_mget", OPT_OPTIONAL, 0, &max_mget, NULL, "maximum items to return in a single mget");
+    option_define_str("wal_dir", OPT_OPTIONAL, NULL, &wal_dir, NULL, "directory for a write-ahead log of the queue, replayed on startup");
+    option_define_int("wal_fsync_ms", OPT_OPTIONAL, 1000, NULL, NULL, "fsync the write-ahead log every N ms, 0 to fsync before answering each put, -1 to leave it to the OS");
+    option_define_int("wal_segment_bytes", OPT_OPTIONAL, 64 * 1024 * 1024, NULL, NULL, "start a new write-ahead log file after this many bytes");
     
     if (!option_parse_command_line(argc, argv)) {
         return 1;
     }
-    max_bytes = (size_t)option_get_int("max_bytes");
-    max_depth = (uint64_t)option_get_int("max_depth");
-    max_mget = (int)option_get_int("max_mget");
-    
-    if (overflow_log) {
-        overflow_log_fp = fopen(overflow_log, "a");
-        if (!overflow_log_fp) {
-            perror("fopen failed: ");
-            exit(1);
-        }
-        fprintf(stdout, "opened --overflow-log: %s\n", overflow_log);
-    }
+    limits_changed(NULL, NULL);
+    option_set_runtime("max_bytes", limits_changed, NULL);
+    option_set_runtime("max_depth", limits_changed, NULL);
+    option_set_runtime("max_mget", NULL, NULL);
+    option_set_runtime("max_queues", NULL, NULL);
+    option_set_runtime("max_wait_ms", NULL, NULL);
     
     fprintf(stderr, "Version: %s, http://code.google.com/p/simplehttp/\n", VERSION);
     fprintf(stderr, "use --help for options\n");
     simplehttp_init();
-    signal(SIGHUP, hup_handler);
+    signal_set(&hup_ev, SIGHUP, hup_cb, NULL);
+    signal_add(&hup_ev, NULL);
+    default_queue = new_queue("");
+    if (wal_dir) {
+        open_logged_queues();
+        simplehttp_metric_counter("simplequeue_wal_commits", "write-ahead log writes, each a batch of puts", &wal_commits);
+        simplehttp_metric_counter("simplequeue_wal_syncs", "write-ahead log fsyncs", &wal_syncs);
+        simplehttp_metric_counter("simplequeue_wal_bytes", "bytes written to the write-ahead log", &wal_bytes);
+    }
     simplehttp_set_cb("/put*", put, NULL);
     simplehttp_set_cb("/get*", get, NULL);
     simplehttp_set_cb("/mget*", mget, NULL);
     simplehttp_set_cb("/mput*", mput, NULL);
     simplehttp_set_cb("/dump*", dump, NULL);
     simplehttp_set_cb("/stats*", stats, NULL);
+    simplehttp_set_cb("/queues*", list_queues, NULL);
+    simplehttp_set_cb("/limits*", limits, NULL);
     simplehttp_set_cb("/exit*", exit_cb, NULL);
-    simplehttp_main();
+    simplehttp_set_cb_flags("/dump*", SIMPLEHTTP_CB_COMPRESS);
+    // under --admission-target-ms bulk transfers are shed first, /stats never
+    simplehttp_set_cb_priority("/stats*", SIMPLEHTTP_PRIORITY_HIGH);
+    simplehttp_set_cb_priority("/dump*", SIMPLEHTTP_PRIORITY_LOW);
+    simplehttp_set_cb_priority("/mput*", SIMPLEHTTP_PRIORITY_LOW);
+    simplehttp_metric_counter("simplequeue_puts", "items put, all queues", &n_puts);
+    simplehttp_metric_counter("simplequeue_gets", "items taken, all queues", &n_gets);
+    simplehttp_metric_counter("simplequeue_overflow", "items dropped past --max-depth or --max-bytes, all queues", &n_overflow);
+    simplehttp_metric_gauge("simplequeue_depth", "items in all queues", &depth);
+    simplehttp_metric_gauge("simplequeue_depth_high_water", "highest depth of all queues together", &depth_high_water);
+    simplehttp_metric_gauge_cb("simplequeue_bytes", "bytes in all queues", queue_bytes, NULL);
+    simplehttp_metric_gauge_cb("simplequeue_memory_bytes", "memory allocated for queued items", queue_memory, NULL);
+    simplehttp_metric_gauge("simplequeue_waiters", "gets waiting on an empty queue, all queues", &n_waiters);
+    simplehttp_metric_gauge_cb("simplequeue_queues", "queues, the default one included", queue_count, NULL);
+    if (simplehttp_listen()) {
+        simplehttp_run();
+        release_waiters();
+        simplehttp_free();
+    }
     free_options();
     
-    if (overflow_log_fp) {
-        while (depth) {
-            overflow_one();
-        }
-        fclose(overflow_log_fp);
+    while (queues) {
+        free_queue(queues);
     }
+    simplehttp_pools_free();
     return 0;
 }
 
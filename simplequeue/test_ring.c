@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "ring.h"
+
+/*
+ * records come out of the ring in order and intact across chunk boundaries,
+ * records larger than a chunk get one of their own, ring_foreach() sees what
+ * ring_pop() would and the memory accounting follows chunks as they come and
+ * go, the spare included.
+ *
+ *   ./test_ring
+ */
+
+#define CHUNK_BYTES (sizeof(struct ring_chunk) + RING_CHUNK_SIZE)
+
+static char *buf;
+static size_t record_lens[4096];
+static int pushed, popped, seen;
+
+// record i is its length's worth of bytes counting up from i
+static void fill(int i, size_t len)
+{
+    size_t j;
+    
+    for (j = 0; j < len; j++) {
+        buf[j] = (char)(i + j);
+    }
+}
+
+static int check(int i, const char *data, size_t len)
+{
+    size_t j;
+    
+    if (len != record_lens[i]) {
+        return 0;
+    }
+    for (j = 0; j < len; j++) {
+        if (data[j] != (char)(i + j)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void push(struct ring *ring, size_t len)
+{
+    fill(pushed, len);
+    record_lens[pushed] = len;
+    ring_push(ring, buf, len);
+    pushed++;
+}
+
+static void pop(struct ring *ring)
+{
+    const char *data;
+    size_t len;
+    
+    assert(ring_pop(ring, &data, &len));
+    assert(check(popped, data, len));
+    popped++;
+}
+
+static void foreach_cb(const char *data, size_t len, void *arg)
+{
+    assert(check(popped + seen, data, len));
+    seen++;
+}
+
+static size_t queued_bytes()
+{
+    size_t bytes = 0;
+    int i;
+    
+    for (i = popped; i < pushed; i++) {
+        bytes += RING_HEADER_BYTES + record_lens[i];
+    }
+    return bytes;
+}
+
+static void check_foreach(struct ring *ring)
+{
+    seen = 0;
+    ring_foreach(ring, foreach_cb, NULL);
+    assert(seen == pushed - popped);
+    assert(ring->count == (uint64_t)(pushed - popped));
+    assert(ring->bytes == queued_bytes());
+}
+
+int main(int argc, char **argv)
+{
+    struct ring ring;
+    const char *data;
+    size_t len;
+    int i;
+    
+    buf = malloc(3 * RING_CHUNK_SIZE);
+    ring_init(&ring);
+    assert(!ring_pop(&ring, &data, &len));
+    assert(ring.allocated == 0);
+    
+    // 1000 byte records, the 1045th no longer fits the first chunk
+    for (i = 0; i < 2500; i++) {
+        push(&ring, 1000);
+    }
+    assert(ring.allocated == 3 * CHUNK_BYTES);
+    check_foreach(&ring);
+    
+    // an empty record and one that exactly fills what is left of the last chunk
+    push(&ring, 0);
+    push(&ring, RING_CHUNK_SIZE - (2500 - 2 * 1044) * (RING_HEADER_BYTES + 1000) - 2 * RING_HEADER_BYTES);
+    assert(ring.allocated == 3 * CHUNK_BYTES);
+    check_foreach(&ring);
+    
+    // taking the first chunk's records keeps it as the spare, the next chunk is that one
+    for (i = 0; i < 1044; i++) {
+        pop(&ring);
+    }
+    push(&ring, 10);
+    assert(ring.allocated == 3 * CHUNK_BYTES);
+    check_foreach(&ring);
+    
+    // larger than a chunk, it gets one of its own and the next record a new one
+    push(&ring, 2 * RING_CHUNK_SIZE);
+    assert(ring.allocated == 3 * CHUNK_BYTES + sizeof(struct ring_chunk) + 2 * RING_CHUNK_SIZE + RING_HEADER_BYTES);
+    push(&ring, 10);
+    assert(ring.allocated == 4 * CHUNK_BYTES + sizeof(struct ring_chunk) + 2 * RING_CHUNK_SIZE + RING_HEADER_BYTES);
+    check_foreach(&ring);
+    
+    // drained, the oversized chunk is freed and one spare is kept
+    while (popped < pushed) {
+        pop(&ring);
+        if (popped % 100 == 0 || pushed - popped < 4) {
+            check_foreach(&ring);
+        }
+    }
+    assert(!ring_pop(&ring, &data, &len));
+    assert(ring.count == 0 && ring.bytes == 0);
+    assert(ring.allocated == 2 * CHUNK_BYTES);
+    
+    // and it starts over at the beginning of the last chunk
+    push(&ring, 1000);
+    assert(ring.allocated == 2 * CHUNK_BYTES);
+    pop(&ring);
+    
+    ring_free(&ring);
+    assert(ring.allocated == 0 && ring.count == 0);
+    free(buf);
+    
+    fprintf(stdout, "ok\n");
+    
+    return 0;
+}
@@ -1,5 +1,7 @@
 import os
 import sys
+import threading
+import time
 sys.path.append(os.path.join(os.path.dirname(__file__), "../shared_tests"))
 
 import simplejson as json
@@ -55,6 +57,59 @@ class SimplequeueTest(SubprocessTest):
         data = http_fetch('/get')
         assert data == 'test3'
 
+    def test_named_queues(self):
+        # each queue keeps its own items and stats
+        http_fetch('/put', dict(queue='clicks', data='c1'))
+        http_fetch('/mput', dict(queue='views', data='v1\nv2'))
+        data = json.loads(http_fetch('/stats', dict(queue='views', format='json')))
+        assert data['depth'] == 2
+        assert http_fetch('/get', dict(queue='clicks')) == 'c1'
+        assert http_fetch('/get', dict(queue='clicks')) == ''
+        assert http_fetch('/get', dict(queue='nosuch')) == ''
+        assert http_fetch('/get') == ''
+
+        # limits of their own
+        http_fetch('/limits', dict(queue='views', max_depth=1))
+        assert http_fetch('/dump', dict(queue='views')) == 'v2\n'
+        assert http_fetch('/mget', dict(queue='views', items=5)) == 'v2\n'
+
+        http_fetch('/put', dict(queue='../x', data='x'), 400)
+
+    def test_long_poll(self):
+        # an empty queue answers empty once the wait is up
+        start = time.time()
+        assert http_fetch('/get', dict(wait=200)) == ''
+        assert time.time() - start >= 0.2
+
+        # gets never make a queue, waiting on a missing one waits all the same
+        start = time.time()
+        assert http_fetch('/get', dict(queue='nosuch', wait=200)) == ''
+        assert http_fetch('/mget', dict(queue='nosuch', wait=200)) == ''
+        assert time.time() - start >= 0.4
+        assert 'nosuch' not in http_fetch('/queues')
+
+        # and the put that makes the queue wakes it
+        result = []
+        t = threading.Thread(target=lambda: result.append(http_fetch('/get', dict(queue='later', wait=5000))))
+        t.start()
+        time.sleep(0.2)
+        assert 'later' not in http_fetch('/queues')
+        http_fetch('/put', dict(queue='later', data='l1'))
+        t.join()
+        assert result == ['l1']
+
+        # a put wakes a parked get
+        http_fetch('/put', dict(queue='jobs', data='j0'))
+        assert http_fetch('/get', dict(queue='jobs')) == 'j0'
+        result = []
+        t = threading.Thread(target=lambda: result.append(http_fetch('/get', dict(queue='jobs', wait=5000))))
+        t.start()
+        time.sleep(0.2)
+        http_fetch('/put', dict(queue='jobs', data='j1'))
+        t.join()
+        assert result == ['j1']
+        assert http_fetch('/get', dict(queue='jobs')) == ''
+
 
 if __name__ == "__main__":
     print "usage: py.test"
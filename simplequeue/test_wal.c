@@ -0,0 +1,202 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include "wal.h"
+
+/*
+ * the write-ahead log across restarts: records come back in order from the
+ * cursor on, a torn or corrupt tail is cut off and appends carry on after it,
+ * a lost cursor replays everything still on disk and segments wholly behind
+ * the cursor are deleted. with fsync 0 only new records are worth an fsync.
+ *
+ *   ./test_wal [dir]
+ */
+
+// 4 records of 8 + 9 bytes fill a segment
+#define SEGMENT_BYTES 64
+#define RECORD_BYTES 9
+
+static char dir[1024];
+static char replayed[32][RECORD_BYTES + 1];
+static int replayed_count;
+
+static void replay_cb(const char *data, size_t len, void *arg)
+{
+    assert(len == RECORD_BYTES);
+    memcpy(replayed[replayed_count], data, len);
+    replayed[replayed_count][len] = '\0';
+    replayed_count++;
+}
+
+static struct wal *open_wal()
+{
+    struct wal *wal;
+    
+    replayed_count = 0;
+    wal = wal_open(dir, 0, SEGMENT_BYTES);
+    wal_replay(wal, replay_cb, NULL);
+    return wal;
+}
+
+// the commit runs at the end of a pass of the event loop
+static void commit()
+{
+    event_loop(EVLOOP_NONBLOCK);
+}
+
+static void append(struct wal *wal, int i)
+{
+    char record[RECORD_BYTES + 1];
+    
+    sprintf(record, "record-%02d", i);
+    wal_append(wal, record, RECORD_BYTES);
+    commit();
+}
+
+static void consume(struct wal *wal, int n)
+{
+    while (n--) {
+        wal_consume(wal, RECORD_BYTES);
+    }
+    commit();
+}
+
+// replayed are records first to last
+static void check_replayed(int first, int last)
+{
+    char record[RECORD_BYTES + 1];
+    int i;
+    
+    assert(replayed_count == last - first + 1);
+    for (i = first; i <= last; i++) {
+        sprintf(record, "record-%02d", i);
+        assert(strcmp(replayed[i - first], record) == 0);
+    }
+}
+
+static int segment_count()
+{
+    struct dirent *dent;
+    DIR *d;
+    int n = 0;
+    
+    assert((d = opendir(dir)) != NULL);
+    while ((dent = readdir(d)) != NULL) {
+        n += strlen(dent->d_name) == 20 && strcmp(dent->d_name + 16, ".log") == 0;
+    }
+    closedir(d);
+    return n;
+}
+
+static void last_segment(struct wal *wal, char *path, size_t len)
+{
+    snprintf(path, len, "%s/%016"PRIx64".log", dir, TAILQ_LAST(&wal->segments, wal_segments)->base);
+}
+
+static off_t file_size(const char *path)
+{
+    struct stat st;
+    
+    assert(stat(path, &st) == 0);
+    return st.st_size;
+}
+
+static void write_at(const char *path, off_t offset, const void *data, size_t len)
+{
+    int fd;
+    
+    assert((fd = open(path, O_WRONLY)) != -1);
+    assert(pwrite(fd, data, len, offset) == (ssize_t)len);
+    close(fd);
+}
+
+int main(int argc, char **argv)
+{
+    struct wal *wal;
+    char path[PATH_MAX];
+    uint32_t torn[3] = {100, 0, 0};
+    uint64_t syncs;
+    off_t size;
+    int i;
+    
+    if (argc > 1) {
+        snprintf(dir, sizeof(dir), "%s", argv[1]);
+    } else {
+        snprintf(dir, sizeof(dir), "/tmp/test_wal.XXXXXX");
+        assert(mkdtemp(dir) != NULL);
+    }
+    event_init();
+    
+    // a new log, rotating every 4 records
+    wal = open_wal();
+    assert(replayed_count == 0);
+    for (i = 0; i < 10; i++) {
+        syncs = wal_syncs;
+        append(wal, i);
+        assert(wal_syncs == syncs + 1);
+    }
+    assert(segment_count() == 3);
+    
+    // taking 5 leaves the first segment wholly behind the cursor
+    syncs = wal_syncs;
+    consume(wal, 5);
+    assert(wal_syncs == syncs);
+    assert(segment_count() == 2);
+    wal_close(wal);
+    
+    wal = open_wal();
+    check_replayed(5, 9);
+    last_segment(wal, path, sizeof(path));
+    size = file_size(path);
+    wal_close(wal);
+    
+    // a crash halfway through writing a record
+    write_at(path, size, torn, sizeof(torn));
+    wal = open_wal();
+    check_replayed(5, 9);
+    assert(file_size(path) == size);
+    append(wal, 10);
+    wal_close(wal);
+    
+    wal = open_wal();
+    check_replayed(5, 10);
+    wal_close(wal);
+    
+    // a record whose data does not match its crc
+    write_at(path, file_size(path) - 1, "X", 1);
+    wal = open_wal();
+    check_replayed(5, 9);
+    assert(file_size(path) == size);
+    wal_close(wal);
+    
+    // without a cursor everything still on disk comes back
+    snprintf(path, sizeof(path), "%s/cursor", dir);
+    write_at(path, 0, "garbage garbage!", 16);
+    wal = open_wal();
+    check_replayed(4, 9);
+    
+    // all taken, only the segment being appended to is left
+    consume(wal, 6);
+    assert(segment_count() == 1);
+    wal_close(wal);
+    
+    wal = open_wal();
+    assert(replayed_count == 0);
+    append(wal, 11);
+    wal_close(wal);
+    
+    wal = open_wal();
+    check_replayed(11, 11);
+    wal_close(wal);
+    
+    fprintf(stdout, "ok\n");
+    
+    return 0;
+}
@@ -0,0 +1,468 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <err.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "wal.h"
+
+/*
+ * write-ahead log for --wal-dir. puts are appended to a buffer that is written
+ * out once per pass of the event loop (a group commit), so a burst of puts
+ * costs one write() and, with --wal-fsync-ms=0, one fsync(). records are their
+ * length, a crc32 of the data and the data, in host byte order, in segment
+ * files named after the log offset they start at.
+ *
+ * the read cursor is the log offset of the oldest record not yet taken. it
+ * moves as entries leave the queue and is rewritten to the cursor file with
+ * each commit. segments wholly behind the written cursor are deleted. takes are
+ * answered before the cursor is on disk, and with --wal-fsync-ms=0 it is only
+ * synced along with new records, so after a crash some entries can come out
+ * again. puts are never lost once acknowledged with --wal-fsync-ms=0: their
+ * segment is synced, and so is the directory once the segment is created.
+ *
+ * on startup the records from the cursor on are replayed into the queue. a
+ * torn record at the end of the last segment, a crash mid-write, is cut off.
+ */
+
+#define WAL_WRITE_BATCH (1024 * 1024)
+
+uint64_t wal_commits = 0;
+uint64_t wal_syncs = 0;
+uint64_t wal_bytes = 0;
+
+struct wal_cursor {
+    uint64_t offset;
+    uint32_t crc;
+    uint32_t unused;
+};
+
+static void wal_segment_path(struct wal *wal, uint64_t base, char *path, size_t len)
+{
+    snprintf(path, len, "%s/%016"PRIx64".log", wal->dir, base);
+}
+
+// segments are kept in log order
+static struct wal_segment *wal_add_segment(struct wal *wal, uint64_t base, uint64_t bytes)
+{
+    struct wal_segment *seg, *next;
+    
+    seg = calloc(1, sizeof(*seg));
+    seg->base = base;
+    seg->bytes = bytes;
+    TAILQ_FOREACH(next, &wal->segments, entries) {
+        if (next->base > base) {
+            TAILQ_INSERT_BEFORE(next, seg, entries);
+            return seg;
+        }
+    }
+    TAILQ_INSERT_TAIL(&wal->segments, seg, entries);
+    return seg;
+}
+
+// files created in or unlinked from the log's directory stay that way after a crash
+static void wal_sync_dir(struct wal *wal)
+{
+    int fd;
+    
+    if (wal->fsync_ms == -1) {
+        return;
+    }
+    if ((fd = open(wal->dir, O_RDONLY)) == -1 || fsync(fd) == -1) {
+        err(1, "wal fsync of %s failed", wal->dir);
+    }
+    close(fd);
+}
+
+static void wal_open_last(struct wal *wal)
+{
+    struct wal_segment *seg = TAILQ_LAST(&wal->segments, wal_segments);
+    char path[PATH_MAX];
+    
+    wal_segment_path(wal, seg->base, path, sizeof(path));
+    wal->fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (wal->fd == -1) {
+        err(1, "wal open %s failed", path);
+    }
+    wal_sync_dir(wal);
+}
+
+static void wal_sync(struct wal *wal)
+{
+    if ((wal->dirty && fsync(wal->fd) == -1) || (wal->cursor_dirty && fsync(wal->cursor_fd) == -1)) {
+        err(1, "wal fsync in %s failed", wal->dir);
+    }
+    wal->dirty = 0;
+    wal->cursor_dirty = 0;
+    wal_syncs++;
+}
+
+static void wal_write_cursor(struct wal *wal)
+{
+    struct wal_cursor cursor;
+    
+    memset(&cursor, 0, sizeof(cursor));
+    cursor.offset = wal->cursor;
+    cursor.crc = crc32(0, (const Bytef *)&cursor.offset, sizeof(cursor.offset));
+    if (pwrite(wal->cursor_fd, &cursor, sizeof(cursor), 0) != sizeof(cursor)) {
+        err(1, "wal write to %s/cursor failed", wal->dir);
+    }
+    wal->cursor_written = wal->cursor;
+    wal->cursor_dirty = 1;
+}
+
+static uint64_t wal_read_cursor(struct wal *wal)
+{
+    struct wal_cursor cursor;
+    
+    if (pread(wal->cursor_fd, &cursor, sizeof(cursor), 0) != sizeof(cursor)
+            || cursor.crc != crc32(0, (const Bytef *)&cursor.offset, sizeof(cursor.offset))) {
+        return 0;
+    }
+    return cursor.offset;
+}
+
+// whole segments behind the written cursor, never the one being appended to
+static void wal_compact(struct wal *wal)
+{
+    struct wal_segment *seg;
+    char path[PATH_MAX];
+    int unlinked = 0;
+    
+    while ((seg = TAILQ_FIRST(&wal->segments)) != TAILQ_LAST(&wal->segments, wal_segments)
+            && seg->base + seg->bytes <= wal->cursor_written) {
+        wal_segment_path(wal, seg->base, path, sizeof(path));
+        if (unlink(path) == -1) {
+            warn("wal unlink %s failed", path);
+        } else {
+            unlinked = 1;
+        }
+        TAILQ_REMOVE(&wal->segments, seg, entries);
+        free(seg);
+    }
+    if (unlinked) {
+        wal_sync_dir(wal);
+    }
+}
+
+static void wal_rotate(struct wal *wal)
+{
+    struct wal_segment *seg = TAILQ_LAST(&wal->segments, wal_segments);
+    
+    if (wal->fsync_ms != -1 && fsync(wal->fd) == -1) {
+        err(1, "wal fsync in %s failed", wal->dir);
+    }
+    close(wal->fd);
+    wal_add_segment(wal, seg->base + seg->bytes, 0);
+    wal_open_last(wal);
+}
+
+// puts waiting on the fsync of their commit
+static void wal_ack(struct wal *wal)
+{
+    int i;
+    
+    for (i = 0; i < wal->waiting_count; i++) {
+        evhttp_send_reply(wal->waiting[i], HTTP_OK, "OK", NULL);
+        simplehttp_async_finish(wal->waiting[i]);
+    }
+    wal->waiting_count = 0;
+}
+
+static void wal_commit(struct wal *wal)
+{
+    struct wal_segment *seg = TAILQ_LAST(&wal->segments, wal_segments);
+    size_t len = EVBUFFER_LENGTH(wal->buf);
+    size_t written = 0;
+    ssize_t n;
+    
+    while (written < len) {
+        n = write(wal->fd, EVBUFFER_DATA(wal->buf) + written, len - written);
+        if (n == -1 && errno != EINTR) {
+            err(1, "wal write in %s failed", wal->dir);
+        }
+        if (n > 0) {
+            written += n;
+        }
+    }
+    if (len > 0) {
+        evbuffer_drain(wal->buf, len);
+        seg->bytes += len;
+        wal_bytes += len;
+        wal_commits++;
+        wal->dirty = 1;
+    }
+    if (wal->cursor != wal->cursor_written) {
+        wal_write_cursor(wal);
+    }
+    
+    // a commit that only moved the cursor is not worth an fsync of its own
+    if (wal->fsync_ms == 0) {
+        if (wal->dirty) {
+            wal_sync(wal);
+        }
+        wal_ack(wal);
+    }
+    if (seg->bytes >= wal->segment_bytes) {
+        wal_rotate(wal);
+    }
+    wal_compact(wal);
+}
+
+static void wal_commit_cb(int fd, short what, void *arg)
+{
+    struct wal *wal = (struct wal *)arg;
+    
+    wal->commit_pending = 0;
+    wal_commit(wal);
+}
+
+// at the end of this pass of the event loop
+static void wal_schedule(struct wal *wal)
+{
+    struct timeval tv = {0, 0};
+    
+    if (!wal->commit_pending) {
+        wal->commit_pending = 1;
+        evtimer_add(&wal->commit_ev, &tv);
+    }
+}
+
+static void wal_sync_cb(int fd, short what, void *arg)
+{
+    struct wal *wal = (struct wal *)arg;
+    struct timeval tv;
+    
+    if (wal->dirty || wal->cursor_dirty) {
+        wal_sync(wal);
+    }
+    tv.tv_sec = wal->fsync_ms / 1000;
+    tv.tv_usec = (wal->fsync_ms % 1000) * 1000;
+    evtimer_add(&wal->sync_ev, &tv);
+}
+
+/*
+ * open the log in dir, creating it if needed. fsync_ms 0 syncs every commit
+ * and holds the puts in it (see wal_wait()), N syncs at most every N ms and
+ * -1 leaves it to the OS. call wal_replay() next.
+ */
+struct wal *wal_open(const char *dir, int fsync_ms, uint64_t segment_bytes)
+{
+    struct wal *wal;
+    struct wal_segment *seg, *prev = NULL;
+    struct dirent *dent;
+    struct stat st;
+    char path[PATH_MAX];
+    uint64_t base;
+    DIR *d;
+    
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+        err(1, "wal mkdir %s failed", dir);
+    }
+    
+    wal = calloc(1, sizeof(*wal));
+    wal->dir = strdup(dir);
+    wal->fsync_ms = fsync_ms;
+    wal->segment_bytes = segment_bytes;
+    wal->buf = evbuffer_new();
+    TAILQ_INIT(&wal->segments);
+    
+    if ((d = opendir(dir)) == NULL) {
+        err(1, "wal opendir %s failed", dir);
+    }
+    while ((dent = readdir(d)) != NULL) {
+        if (strlen(dent->d_name) != 20 || strcmp(dent->d_name + 16, ".log") != 0
+                || sscanf(dent->d_name, "%16"SCNx64, &base) != 1) {
+            continue;
+        }
+        wal_segment_path(wal, base, path, sizeof(path));
+        if (stat(path, &st) == -1) {
+            err(1, "wal stat %s failed", path);
+        }
+        wal_add_segment(wal, base, st.st_size);
+    }
+    closedir(d);
+    
+    snprintf(path, sizeof(path), "%s/cursor", dir);
+    wal->cursor_fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (wal->cursor_fd == -1) {
+        err(1, "wal open %s failed", path);
+    }
+    wal_sync_dir(wal);
+    wal->cursor = wal_read_cursor(wal);
+    
+    TAILQ_FOREACH(seg, &wal->segments, entries) {
+        if (prev && prev->base + prev->bytes != seg->base) {
+            errx(1, "wal segments in %s are not contiguous at %016"PRIx64, dir, seg->base);
+        }
+        prev = seg;
+    }
+    // a new log, or one that was all taken and compacted, carries on at the cursor
+    if (TAILQ_EMPTY(&wal->segments)) {
+        wal_add_segment(wal, wal->cursor, 0);
+    }
+    wal_open_last(wal);
+    
+    evtimer_set(&wal->commit_ev, wal_commit_cb, wal);
+    evtimer_set(&wal->sync_ev, wal_sync_cb, wal);
+    if (fsync_ms > 0) {
+        wal_sync_cb(-1, EV_TIMEOUT, wal);
+    }
+    
+    return wal;
+}
+
+static void wal_replay_segment(struct wal *wal, struct wal_segment *seg, uint64_t from, int last,
+                               void (*cb)(const char *data, size_t len, void *arg), void *arg)
+{
+    char path[PATH_MAX];
+    uint32_t header[2];
+    char *data = NULL;
+    size_t data_size = 0;
+    uint64_t offset = 0;
+    FILE *fp;
+    
+    wal_segment_path(wal, seg->base, path, sizeof(path));
+    if ((fp = fopen(path, "r")) == NULL) {
+        err(1, "wal open %s failed", path);
+    }
+    // the cursor is always on a record boundary
+    if (from > seg->base) {
+        offset = from - seg->base;
+        if (fseeko(fp, offset, SEEK_SET) == -1) {
+            err(1, "wal seek in %s failed", path);
+        }
+    }
+    
+    while (offset < seg->bytes) {
+        if (fread(header, sizeof(header), 1, fp) != 1) {
+            break;
+        }
+        if (header[0] == 0 || offset + WAL_HEADER_BYTES + header[0] > seg->bytes) {
+            break;
+        }
+        if (header[0] > data_size) {
+            data_size = header[0];
+            data = realloc(data, data_size);
+        }
+        if (fread(data, header[0], 1, fp) != 1 || crc32(0, (const Bytef *)data, header[0]) != header[1]) {
+            break;
+        }
+        cb(data, header[0], arg);
+        offset += WAL_HEADER_BYTES + header[0];
+    }
+    fclose(fp);
+    free(data);
+    
+    if (offset < seg->bytes) {
+        if (!last) {
+            errx(1, "wal segment %s is corrupt at offset %"PRIu64, path, offset);
+        }
+        fprintf(stderr, "wal: cutting off %"PRIu64" bytes of a torn write at the end of %s\n",
+                seg->bytes - offset, path);
+        if (ftruncate(wal->fd, offset) == -1) {
+            err(1, "wal truncate %s failed", path);
+        }
+        seg->bytes = offset;
+        wal->dirty = 1;
+    }
+}
+
+/*
+ * cb gets each record from the cursor on, in order. records it takes off the
+ * queue again (an overflow) are passed to wal_consume() as usual.
+ */
+void wal_replay(struct wal *wal, void (*cb)(const char *data, size_t len, void *arg), void *arg)
+{
+    struct wal_segment *seg, *last = TAILQ_LAST(&wal->segments, wal_segments);
+    uint64_t from = wal->cursor;
+    
+    // a lost or damaged cursor file replays everything still on disk
+    if (from < TAILQ_FIRST(&wal->segments)->base) {
+        from = TAILQ_FIRST(&wal->segments)->base;
+    }
+    wal->cursor = from;
+    TAILQ_FOREACH(seg, &wal->segments, entries) {
+        if (seg->base + seg->bytes > from) {
+            wal_replay_segment(wal, seg, from, seg == last, cb, arg);
+        }
+    }
+    // the log can lose an unsynced tail the cursor already passed
+    if (wal->cursor > last->base + last->bytes) {
+        wal->cursor = last->base + last->bytes;
+    }
+    
+    // on disk before anything is appended past it
+    wal_write_cursor(wal);
+    wal_sync(wal);
+    wal_compact(wal);
+}
+
+void wal_append(struct wal *wal, const char *data, size_t len)
+{
+    uint32_t header[2];
+    
+    header[0] = len;
+    header[1] = crc32(0, (const Bytef *)data, len);
+    evbuffer_add(wal->buf, header, sizeof(header));
+    evbuffer_add(wal->buf, data, len);
+    if (EVBUFFER_LENGTH(wal->buf) >= WAL_WRITE_BATCH) {
+        wal_commit(wal);
+    } else {
+        wal_schedule(wal);
+    }
+}
+
+// the oldest record, len bytes of data, left the queue
+void wal_consume(struct wal *wal, size_t len)
+{
+    wal->cursor += WAL_HEADER_BYTES + len;
+    wal_schedule(wal);
+}
+
+/*
+ * with --wal-fsync-ms=0 req, a put, is answered once its commit is synced and
+ * this returns 1. otherwise the caller replies as usual.
+ */
+int wal_wait(struct wal *wal, struct evhttp_request *req)
+{
+    if (wal->fsync_ms != 0 || !simplehttp_async_enable(req)) {
+        return 0;
+    }
+    if (wal->waiting_count == wal->waiting_size) {
+        wal->waiting_size = wal->waiting_size ? wal->waiting_size * 2 : 64;
+        wal->waiting = realloc(wal->waiting, wal->waiting_size * sizeof(*wal->waiting));
+    }
+    wal->waiting[wal->waiting_count++] = req;
+    wal_schedule(wal);
+    return 1;
+}
+
+void wal_close(struct wal *wal)
+{
+    struct wal_segment *seg;
+    
+    event_del(&wal->commit_ev);
+    event_del(&wal->sync_ev);
+    // their connections went with the http server
+    wal->waiting_count = 0;
+    wal_commit(wal);
+    wal_sync(wal);
+    
+    close(wal->fd);
+    close(wal->cursor_fd);
+    while ((seg = TAILQ_FIRST(&wal->segments)) != NULL) {
+        TAILQ_REMOVE(&wal->segments, seg, entries);
+        free(seg);
+    }
+    evbuffer_free(wal->buf);
+    free(wal->waiting);
+    free(wal->dir);
+    free(wal);
+}
@@ -0,0 +1,52 @@
+#ifndef _WAL_H
+#define _WAL_H
+
+#include <stdint.h>
+#include "simplehttp/queue.h"
+#include "simplehttp/simplehttp.h"
+
+/*
+ * append-only log of the queue under --wal-dir, see wal.c
+ */
+
+#define WAL_HEADER_BYTES 8
+
+struct wal_segment {
+    uint64_t base;      // log offset of the first record in the segment
+    uint64_t bytes;
+    TAILQ_ENTRY(wal_segment) entries;
+};
+
+struct wal {
+    char *dir;
+    int fsync_ms;
+    uint64_t segment_bytes;
+    TAILQ_HEAD(wal_segments, wal_segment) segments;
+    int fd;
+    int cursor_fd;
+    uint64_t cursor;
+    uint64_t cursor_written;
+    struct evbuffer *buf;
+    struct event commit_ev;
+    int commit_pending;
+    struct event sync_ev;
+    int dirty;          // records written since the last fsync
+    int cursor_dirty;
+    struct evhttp_request **waiting;
+    int waiting_count;
+    int waiting_size;
+};
+
+// totals over every open log
+extern uint64_t wal_commits;
+extern uint64_t wal_syncs;
+extern uint64_t wal_bytes;
+
+struct wal *wal_open(const char *dir, int fsync_ms, uint64_t segment_bytes);
+void wal_replay(struct wal *wal, void (*cb)(const char *data, size_t len, void *arg), void *arg);
+void wal_append(struct wal *wal, const char *data, size_t len);
+void wal_consume(struct wal *wal, size_t len);
+int wal_wait(struct wal *wal, struct evhttp_request *req);
+void wal_close(struct wal *wal);
+
+#endif
@@ -970,16 +970,34 @@ void stats_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
     if ((format != NULL) && (strcmp(format, "json") == 0)) {
         evbuffer_add_printf(evb, "{");
         for (i = 0; i < st->callback_count; i++) {
+            evbuffer_add_printf(evb, "\"%s_50\": %"PRIu64",", st->stats_labels[i], st->fifty_percents[i]);
             evbuffer_add_printf(evb, "\"%s_95\": %"PRIu64",", st->stats_labels[i], st->ninety_five_percents[i]);
+            evbuffer_add_printf(evb, "\"%s_99\": %"PRIu64",", st->stats_labels[i], st->ninety_nine_percents[i]);
+            evbuffer_add_printf(evb, "\"%s_999\": %"PRIu64",", st->stats_labels[i], st->ninety_nine_nine_percents[i]);
+            evbuffer_add_printf(evb, "\"%s_max\": %"PRIu64",", st->stats_labels[i], st->max_requests[i]);
             evbuffer_add_printf(evb, "\"%s_average_request\": %"PRIu64",", st->stats_labels[i], st->average_requests[i]);
             evbuffer_add_printf(evb, "\"%s_requests\": %"PRIu64",", st->stats_labels[i], st->stats_counts[i]);
         }
+        evbuffer_add_printf(evb, "\"loop_utilization\": %.1f,", st->loop_utilization);
+        evbuffer_add_printf(evb, "\"loop_utilization_max\": %.1f,", st->loop_utilization_max);
+        evbuffer_add_printf(evb, "\"loop_cpu\": %.1f,", st->loop_cpu);
+        evbuffer_add_printf(evb, "\"loop_lag_99\": %"PRIu64",", st->loop_lag_99);
+        evbuffer_add_printf(evb, "\"loop_lag_max\": %"PRIu64",", st->loop_lag_max);
         evbuffer_add_printf(evb, "\"total_requests\": %"PRIu64, st->requests);
         evbuffer_add_printf(evb, "}\n");
     } else {
+        evbuffer_add_printf(evb, "loop utilization: %.1f%%\n", st->loop_utilization);
+        evbuffer_add_printf(evb, "busiest loop utilization: %.1f%%\n", st->loop_utilization_max);
+        evbuffer_add_printf(evb, "loop cpu: %.1f%%\n", st->loop_cpu);
+        evbuffer_add_printf(evb, "loop lag 99%% (usec): %"PRIu64"\n", st->loop_lag_99);
+        evbuffer_add_printf(evb, "loop lag max (usec): %"PRIu64"\n", st->loop_lag_max);
         evbuffer_add_printf(evb, "total requests: %"PRIu64"\n", st->requests);
         for (i = 0; i < st->callback_count; i++) {
+            evbuffer_add_printf(evb, "/%s 50%%: %"PRIu64"\n", st->stats_labels[i], st->fifty_percents[i]);
             evbuffer_add_printf(evb, "/%s 95%%: %"PRIu64"\n", st->stats_labels[i], st->ninety_five_percents[i]);
+            evbuffer_add_printf(evb, "/%s 99%%: %"PRIu64"\n", st->stats_labels[i], st->ninety_nine_percents[i]);
+            evbuffer_add_printf(evb, "/%s 99.9%%: %"PRIu64"\n", st->stats_labels[i], st->ninety_nine_nine_percents[i]);
+            evbuffer_add_printf(evb, "/%s max (usec): %"PRIu64"\n", st->stats_labels[i], st->max_requests[i]);
             evbuffer_add_printf(evb, "/%s average request (usec): %"PRIu64"\n", st->stats_labels[i], st->average_requests[i]);
             evbuffer_add_printf(evb, "/%s requests: %"PRIu64"\n", st->stats_labels[i], st->stats_counts[i]);
         }
@@ -1039,6 +1057,8 @@ int main(int argc, char **argv)
     simplehttp_set_cb("/incr*", incr_cb, NULL);
     simplehttp_set_cb("/stats*", stats_cb, NULL);
     simplehttp_set_cb("/exit", exit_cb, NULL);
+    simplehttp_set_cb_priority("/stats*", SIMPLEHTTP_PRIORITY_HIGH);
+    simplehttp_metric_counter("simpletokyo_db_opened", "ttserver connections opened", &db_opened);
     simplehttp_main();
     
     db_close();
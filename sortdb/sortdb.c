@@ -21,18 +21,20 @@ void get_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx);
 void reload_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx);
 void exit_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx);
 char *prev_line(char *pos);
-char *map_search(char *key, size_t keylen, char *lower, char *upper, int *seeks, int allow_prefix);
+char *map_search(const char *key, size_t keylen, char *lower, char *upper, int *seeks, int allow_prefix);
 void info();
 int main(int argc, char **argv);
 void close_dbfile();
 void open_dbfile();
-void hup_handler(int signum);
+void reload_dbfile(void *arg);
+void hup_cb(int sig, short what, void *arg);
 
 static void *map_base = NULL;
 static char *db_filename;
 static struct stat st;
 static char deliminator = '\t';
 static int fd = 0;
+static struct event hup_ev;
 
 enum prefix_options { disable_prefix, enable_prefix };
 
@@ -53,7 +55,7 @@ char *prev_line(char *pos)
     return pos;
 }
 
-char *map_search(char *key, size_t keylen, char *lower, char *upper, int *seeks, int allow_prefix)
+char *map_search(const char *key, size_t keylen, char *lower, char *upper, int *seeks, int allow_prefix)
 {
     ptrdiff_t distance;
     char *current;
@@ -66,7 +68,7 @@ char *map_search(char *key, size_t keylen, char *lower, char *upper, int *seeks,
     }
     
     *seeks += 1;
-    total_seeks++;
+    __sync_fetch_and_add(&total_seeks, 1);
     current = lower + (distance / 2);
     line = prev_line(current);
     if (!line) {
@@ -94,12 +96,13 @@ char *map_search(char *key, size_t keylen, char *lower, char *upper, int *seeks,
 
 void fwmatch_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
 {
-    struct evkeyvalq args;
-    char *key, *line, *prev, *start, *end, *newline, buf[32];
+    struct simplehttp_args *args;
+    const char *key;
+    char *line, *prev, *start, *end, *newline, buf[32];
     int keylen, seeks = 0;
     
-    evhttp_parse_query(req->uri, &args);
-    key = (char *)evhttp_find_header(&args, "key");
+    args = simplehttp_args(req);
+    key = simplehttp_arg(args, "key");
     keylen = key ? strlen(key) : 0;
     
     if (DEBUG) {
@@ -140,30 +143,29 @@ void fwmatch_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
             } else {
                 evbuffer_add_printf(evb, "%s\n", line);
             }
-            fwmatch_hits++;
+            __sync_fetch_and_add(&fwmatch_hits, 1);
             sprintf(buf, "%d", seeks);
             evhttp_add_header(req->output_headers, "x-sortdb-seeks", buf);
         } else {
-            fwmatch_misses++;
+            __sync_fetch_and_add(&fwmatch_misses, 1);
         }
         
-        evhttp_send_reply(req, HTTP_OK, "OK", evb);
+        simplehttp_send_reply(req, HTTP_OK, "OK", evb);
     } else {
         evbuffer_add_printf(evb, "missing argument: key\n");
         evhttp_send_reply(req, HTTP_BADREQUEST, "MISSING_ARG_KEY", evb);
     }
-    
-    evhttp_clear_headers(&args);
 }
 
 void get_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
 {
-    struct evkeyvalq args;
-    char *key, *line, *newline, *delim, buf[32];
+    struct simplehttp_args *args;
+    const char *key;
+    char *line, *newline, *delim, buf[32];
     int seeks = 0;
     
-    evhttp_parse_query(req->uri, &args);
-    key = (char *)evhttp_find_header(&args, "key");
+    args = simplehttp_args(req);
+    key = simplehttp_arg(args, "key");
     
     if (DEBUG) {
         fprintf(stderr, "/get %s\n", key);
@@ -180,35 +182,33 @@ void get_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
             line = delim + 1;
         }
         newline = strchr(line, '\n');
+        __sync_fetch_and_add(&get_hits, 1);
         if (newline) {
-            evbuffer_add(evb, line, (newline - line) + 1);
+            simplehttp_reply_bytes(req, HTTP_OK, "OK", line, (newline - line) + 1);
         } else {
             evbuffer_add_printf(evb, "%s\n", line);
+            evhttp_send_reply(req, HTTP_OK, "OK", evb);
         }
-        get_hits++;
-        evhttp_send_reply(req, HTTP_OK, "OK", evb);
     } else {
-        get_misses++;
+        __sync_fetch_and_add(&get_misses, 1);
         evhttp_send_reply(req, HTTP_NOTFOUND, "OK", evb);
     }
-    
-    evhttp_clear_headers(&args);
 }
 
 void mget_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
 {
-    struct evkeyvalq args;
-    struct evkeyval *pair;
-    char *key, *line, *newline, buf[32];
-    int seeks = 0, nkeys = 0;
+    struct simplehttp_args *args;
+    const char *key;
+    char *line, *newline, buf[32];
+    int seeks = 0, nkeys = 0, i;
     
-    evhttp_parse_query(req->uri, &args);
+    args = simplehttp_args(req);
     
-    TAILQ_FOREACH(pair, &args, next) {
-        if (pair->key[0] != 'k') {
+    for (i = 0; i < args->count; i++) {
+        if (args->list[i].key[0] != 'k') {
             continue;
         }
-        key = (char *)pair->value;
+        key = args->list[i].value;
         nkeys++;
         
         if (DEBUG) {
@@ -224,28 +224,26 @@ void mget_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
             } else {
                 evbuffer_add_printf(evb, "%s\n", line);
             }
-            get_hits++;
+            __sync_fetch_and_add(&get_hits, 1);
         } else {
-            get_misses++;
+            __sync_fetch_and_add(&get_misses, 1);
         }
     }
     
     if (nkeys) {
         sprintf(buf, "%d", seeks);
         evhttp_add_header(req->output_headers, "x-sortdb-seeks", buf);
-        evhttp_send_reply(req, HTTP_OK, "OK", evb);
+        simplehttp_send_reply(req, HTTP_OK, "OK", evb);
     } else {
         evbuffer_add_printf(evb, "missing argument: key\n");
         evhttp_send_reply(req, HTTP_BADREQUEST, "MISSING_ARG_KEY", evb);
     }
-    
-    evhttp_clear_headers(&args);
 }
 
 void stats_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
 {
     int i;
-    struct evkeyvalq args;
+    struct simplehttp_args *args;
     const char *format;
     
     struct simplehttp_stats *st;
@@ -253,13 +251,17 @@ void stats_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
     st = simplehttp_stats_new();
     simplehttp_stats_get(st);
     
-    evhttp_parse_query(req->uri, &args);
-    format = (char *)evhttp_find_header(&args, "format");
+    args = simplehttp_args(req);
+    format = simplehttp_arg(args, "format");
     
     if ((format != NULL) && (strcmp(format, "json") == 0)) {
         evbuffer_add_printf(evb, "{");
         for (i = 0; i < st->callback_count; i++) {
+            evbuffer_add_printf(evb, "\"%s_50\": %"PRIu64",", st->stats_labels[i], st->fifty_percents[i]);
             evbuffer_add_printf(evb, "\"%s_95\": %"PRIu64",", st->stats_labels[i], st->ninety_five_percents[i]);
+            evbuffer_add_printf(evb, "\"%s_99\": %"PRIu64",", st->stats_labels[i], st->ninety_nine_percents[i]);
+            evbuffer_add_printf(evb, "\"%s_999\": %"PRIu64",", st->stats_labels[i], st->ninety_nine_nine_percents[i]);
+            evbuffer_add_printf(evb, "\"%s_max\": %"PRIu64",", st->stats_labels[i], st->max_requests[i]);
             evbuffer_add_printf(evb, "\"%s_average_request\": %"PRIu64",", st->stats_labels[i], st->average_requests[i]);
             evbuffer_add_printf(evb, "\"%s_requests\": %"PRIu64",", st->stats_labels[i], st->stats_counts[i]);
         }
@@ -268,35 +270,43 @@ void stats_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
         evbuffer_add_printf(evb, "\"fwmatch_hits\": %"PRIu64",", fwmatch_hits);
         evbuffer_add_printf(evb, "\"fwmatch_misses\": %"PRIu64",", fwmatch_misses);
         evbuffer_add_printf(evb, "\"total_seeks\": %"PRIu64",", total_seeks);
+        evbuffer_add_printf(evb, "\"loop_utilization\": %.1f,", st->loop_utilization);
+        evbuffer_add_printf(evb, "\"loop_utilization_max\": %.1f,", st->loop_utilization_max);
+        evbuffer_add_printf(evb, "\"loop_cpu\": %.1f,", st->loop_cpu);
+        evbuffer_add_printf(evb, "\"loop_lag_99\": %"PRIu64",", st->loop_lag_99);
+        evbuffer_add_printf(evb, "\"loop_lag_max\": %"PRIu64",", st->loop_lag_max);
         evbuffer_add_printf(evb, "\"total_requests\": %"PRIu64, st->requests);
         evbuffer_add_printf(evb, "}\n");
     } else {
         for (i = 0; i < st->callback_count; i++) {
+            evbuffer_add_printf(evb, "/%s 50%%: %"PRIu64"\n", st->stats_labels[i], st->fifty_percents[i]);
             evbuffer_add_printf(evb, "/%s 95%%: %"PRIu64"\n", st->stats_labels[i], st->ninety_five_percents[i]);
+            evbuffer_add_printf(evb, "/%s 99%%: %"PRIu64"\n", st->stats_labels[i], st->ninety_nine_percents[i]);
+            evbuffer_add_printf(evb, "/%s 99.9%%: %"PRIu64"\n", st->stats_labels[i], st->ninety_nine_nine_percents[i]);
+            evbuffer_add_printf(evb, "/%s max (usec): %"PRIu64"\n", st->stats_labels[i], st->max_requests[i]);
             evbuffer_add_printf(evb, "/%s average request (usec): %"PRIu64"\n", st->stats_labels[i], st->average_requests[i]);
             evbuffer_add_printf(evb, "/%s requests: %"PRIu64"\n", st->stats_labels[i], st->stats_counts[i]);
         }
         evbuffer_add_printf(evb, "/get hits: %"PRIu64"\n", get_hits);
         evbuffer_add_printf(evb, "/get misses: %"PRIu64"\n", get_misses);
         evbuffer_add_printf(evb, "total seeks: %"PRIu64"\n", total_seeks);
+        evbuffer_add_printf(evb, "loop utilization: %.1f%%\n", st->loop_utilization);
+        evbuffer_add_printf(evb, "busiest loop utilization: %.1f%%\n", st->loop_utilization_max);
+        evbuffer_add_printf(evb, "loop cpu: %.1f%%\n", st->loop_cpu);
+        evbuffer_add_printf(evb, "loop lag 99%% (usec): %"PRIu64"\n", st->loop_lag_99);
+        evbuffer_add_printf(evb, "loop lag max (usec): %"PRIu64"\n", st->loop_lag_max);
         evbuffer_add_printf(evb, "total requests: %"PRIu64"\n", st->requests);
     }
     
     simplehttp_stats_free(st);
     
     evhttp_send_reply(req, HTTP_OK, "OK", evb);
-    evhttp_clear_headers(&args);
 }
 
 void reload_cb(struct evhttp_request *req, struct evbuffer *evb, void *ctx)
 {
     fprintf(stdout, "/reload request recieved\n");
-    close_dbfile();
-    open_dbfile();
-    if (map_base == NULL) {
-        fprintf(stderr, "no mmaped file; exiting\n");
-        exit(1);
-    }
+    reload_dbfile(NULL);
     evbuffer_add_printf(evb, "db reloaded\n");
     evhttp_send_reply(req, HTTP_OK, "OK", evb);
 }
@@ -313,10 +323,8 @@ void info()
     fprintf(stdout, "Version: %s, https://github.com/bitly/simplehttp/tree/master/sortdb\n", VERSION);
 }
 
-void hup_handler(int signum)
+void reload_dbfile(void *arg)
 {
-    signal(SIGHUP, hup_handler);
-    fprintf(stdout, "HUP recieved\n");
     close_dbfile();
     open_dbfile();
     if (map_base == NULL) {
@@ -325,6 +333,13 @@ void hup_handler(int signum)
     }
 }
 
+// from the event loop, the lookups in other workers must not see the file unmapped
+void hup_cb(int sig, short what, void *arg)
+{
+    fprintf(stdout, "HUP recieved\n");
+    simplehttp_run_exclusive(reload_dbfile, NULL);
+}
+
 void close_dbfile()
 {
     fprintf(stdout, "closing %s\n", db_filename);
@@ -394,13 +409,27 @@ int main(int argc, char **argv)
     }
     
     simplehttp_init();
-    signal(SIGHUP, hup_handler);
+    signal_set(&hup_ev, SIGHUP, hup_cb, NULL);
+    signal_add(&hup_ev, NULL);
     simplehttp_set_cb("/get?*", get_cb, NULL);
     simplehttp_set_cb("/mget?*", mget_cb, NULL);
     simplehttp_set_cb("/fwmatch?*", fwmatch_cb, NULL);
     simplehttp_set_cb("/stats*", stats_cb, NULL);
     simplehttp_set_cb("/reload", reload_cb, NULL);
     simplehttp_set_cb("/exit", exit_cb, NULL);
+    // lookups only read the mmaped file, /reload and /exit still run exclusively
+    simplehttp_set_cb_flags("/get?*", SIMPLEHTTP_CB_THREAD_SAFE);
+    simplehttp_set_cb_flags("/mget?*", SIMPLEHTTP_CB_THREAD_SAFE);
+    simplehttp_set_cb_flags("/fwmatch?*", SIMPLEHTTP_CB_THREAD_SAFE);
+    simplehttp_set_cb_flags("/stats*", SIMPLEHTTP_CB_THREAD_SAFE);
+    simplehttp_set_cb_flags("/mget?*", SIMPLEHTTP_CB_COMPRESS);
+    simplehttp_set_cb_flags("/fwmatch?*", SIMPLEHTTP_CB_COMPRESS);
+    simplehttp_set_cb_priority("/stats*", SIMPLEHTTP_PRIORITY_HIGH);
+    simplehttp_metric_counter("sortdb_get_hits", "keys found by /get and /mget", &get_hits);
+    simplehttp_metric_counter("sortdb_get_misses", "keys missed by /get and /mget", &get_misses);
+    simplehttp_metric_counter("sortdb_fwmatch_hits", "prefixes found by /fwmatch", &fwmatch_hits);
+    simplehttp_metric_counter("sortdb_fwmatch_misses", "prefixes missed by /fwmatch", &fwmatch_misses);
+    simplehttp_metric_counter("sortdb_seeks", "binary search seeks", &total_seeks);
     simplehttp_main();
     free_options();
     